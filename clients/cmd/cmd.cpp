@@ -39,10 +39,16 @@ namespace Aseba
 	using namespace Dashel;
 	using namespace std;
 	
+	//! Whether whex and wusb read pages back and skip the ones already holding the right content
+	static bool skipUnchangedPages(false);
+	//! How many pages wusb writes before waiting for an acknowledgement, whex only supports 1
+	static unsigned pagesInFlight(1);
+	
 	//! Show list of known commands
 	void dumpCommandList(ostream &stream)
 	{
 		stream << "* presence : broadcast presence message\n";
+		stream << "* description : request the full description of a node [dest]\n";
 		stream << "* usermsg: user message [type] [word0] ... [wordN]\n";
 		stream << "* rdpage : bootloader read page [dest] [page number]\n";
 		stream << "* rdpageusb : bootloader read page usb [dest] [page number]\n";
@@ -58,11 +64,14 @@ namespace Aseba
 	void dumpHelp(ostream &stream, const char *programName)
 	{
 		stream << "Aseba cmd, send message over the aseba network, usage:\n";
-		stream << programName << " [-t target] [cmd destId (args)] ... [cmd destId (args)]\n";
+		stream << programName << " [-t target] [-s] [-p pages] [cmd destId (args)] ... [cmd destId (args)]\n";
 		stream << "where cmd is one af the following:\n";
 		dumpCommandList(stream);
 		stream << std::endl;
 		stream << "Other options:\n";
+		stream << "    -s, --skip-unchanged    : whex and wusb read pages back and only write the changed ones\n";
+		stream << "    -p, --pages-in-flight N : wusb writes up to N pages before waiting for an acknowledgement,\n";
+		stream << "                              the bootloader must process commands in order; whex refuses N > 1\n";
 		stream << "    -h, --help      : shows this help\n";
 		stream << "    -V, --version   : shows the version number\n";
 		stream << "Report bugs to: aseba-dev@gna.org" << std::endl;
@@ -134,31 +143,32 @@ namespace Aseba
 	public:
 		CmdBootloaderInterface(Stream* stream, int dest):
 			BootloaderInterface(stream, dest)
-		{}
+		{
+			setSkipUnchangedPages(Aseba::skipUnchangedPages);
+			setPagesInFlight(Aseba::pagesInFlight);
+		}
 	
 	protected:
 		// reporting function
 		virtual void writePageStart(unsigned pageNumber, const uint8* data, bool simple)
 		{
-			cout << "Writing page " << pageNumber << "... ";
-			cout.flush();
+			cout << "Writing page " << pageNumber << "..." << endl;
 			//cout << "First data: " << hex << (int) data[0] << "," << hex << (int) data[1] << "," << hex << (int) data[2] << endl;
 		}
 		
-		virtual void writePageWaitAck()
+		virtual void writePageSuccess(unsigned pageNumber, unsigned milliseconds)
 		{
-			cout << "Waiting ack ... ";
-			cout.flush();
+			cout << "Page " << pageNumber << " written in " << milliseconds << " ms" << endl;
 		}
 		
-		virtual void writePageSuccess()
+		virtual void writePageFailure(unsigned pageNumber)
 		{
-			cout << "Success" << endl;
+			cout << "Failure writing page " << pageNumber << endl;
 		}
 		
-		virtual void writePageFailure()
+		virtual void writePageSkipped(unsigned pageNumber)
 		{
-			cout << "Failure" << endl;
+			cout << "Page " << pageNumber << " unchanged, skipped" << endl;
 		}
 		
 		virtual void writeHexStart(const string &fileName, bool reset, bool simple)
@@ -204,6 +214,16 @@ namespace Aseba
 			message.serialize(stream);
 			stream->flush();
 		}
+		else if (strcmp(cmd, "description") == 0)
+		{
+			if (argc < 2)
+				errorMissingArgument(argv[0]);
+			argEaten = 1;
+			
+			GetNodeDescription message(atoi(argv[1]));
+			message.serialize(stream);
+			stream->flush();
+		}
 		else if (strcmp(cmd, "usermsg") == 0)
 		{
 			// first arg is type, second is length
@@ -416,6 +436,17 @@ int main(int argc, char *argv[])
 			else
 				Aseba::errorMissingArgument(argv[0]);
 		}
+		else if ((strcmp(arg, "-s") == 0) || (strcmp(arg, "--skip-unchanged") == 0))
+		{
+			Aseba::skipUnchangedPages = true;
+		}
+		else if ((strcmp(arg, "-p") == 0) || (strcmp(arg, "--pages-in-flight") == 0))
+		{
+			if (++argCounter < argc)
+				Aseba::pagesInFlight = atoi(argv[argCounter]);
+			else
+				Aseba::errorMissingArgument(argv[0]);
+		}
 		else if ((strcmp(arg, "-h") == 0) || (strcmp(arg, "--help") == 0))
 		{
 			Aseba::dumpHelp(std::cout, argv[0]);
@@ -5,8 +5,11 @@
 #include <cmath>
 #include <QtGui>
 #include <cassert>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <algorithm>
 
 #ifdef _MSC_VER
 #define QWT_DLL
@@ -65,7 +68,12 @@ class EventLogger : public Hub, public QwtPlot
 {
 protected:
 	Stream* stream;
-	int eventId;
+	int eventId; //!< event to plot, -1 when plotting variables
+	int nodeId; //!< node whose variables to plot, -1 when plotting an event
+	unsigned variablesStart; //!< address of the first variable to plot
+	vector<sint16> currentValues; //!< values of the variables, as they are received
+	bool pollVariables; //!< whether the node had no room to send the variables by itself, so that they are polled
+	unsigned ticksSincePoll; //!< timer ticks since the variables were last polled
 	vector<vector<sint16> > values;
 	vector<double> timeStamps;
 	QTime startingTime;
@@ -75,7 +83,49 @@ public:
 	EventLogger(const char* target, int eventId, int eventVariablesCount, const char* filename) :
 		QwtPlot(QwtText(QString(tr("Plot for event %0")).arg(eventId))),
 		eventId(eventId),
+		nodeId(-1),
+		variablesStart(0),
+		pollVariables(false),
+		ticksSincePoll(0),
 		values(eventVariablesCount)
+	{
+		init(target, filename);
+	}
+	
+	EventLogger(const char* target, int nodeId, unsigned variablesStart, unsigned variablesCount, const char* filename) :
+		QwtPlot(QwtText(QString(tr("Plot for variables %0 to %1 of node %2")).arg(variablesStart).arg(variablesStart + variablesCount - 1).arg(nodeId))),
+		eventId(-1),
+		nodeId(nodeId),
+		variablesStart(variablesStart),
+		currentValues(variablesCount),
+		pollVariables(false),
+		ticksSincePoll(0),
+		values(variablesCount)
+	{
+		init(target, filename);
+		
+		// let the node send the variables whenever they change, instead of polling them
+		SubscribeVariables(nodeId, variablesStart, variablesCount, 0, true).serialize(stream);
+		stream->flush();
+	}
+	
+	virtual ~EventLogger()
+	{
+		if (nodeId < 0 || !stream)
+			return;
+		try
+		{
+			UnsubscribeVariables(nodeId, variablesStart, values.size()).serialize(stream);
+			stream->flush();
+		}
+		catch(Dashel::DashelException e)
+		{
+			std::cerr << e.what() << std::endl;
+		}
+	}
+
+protected:
+	void init(const char* target, const char* filename)
 	{
 		stream = Hub::connect(target);
 		cout << "Connected to " << stream->getTargetName() << endl;
@@ -109,12 +159,17 @@ public:
 		
 		startTimer(10);
 	}
-
-protected:
+	
 	virtual void timerEvent ( QTimerEvent * event )
 	{
 		if (!step(0))
 			close();
+		if (pollVariables && stream && ++ticksSincePoll >= 10)
+		{
+			GetVariables(nodeId, variablesStart, currentValues.size()).serialize(stream);
+			stream->flush();
+			ticksSincePoll = 0;
+		}
 	}
 	
 	void incomingData(Stream *stream)
@@ -124,36 +179,74 @@ protected:
 		if (userMessage)
 		{
 			if (userMessage->type == eventId)
+				addSample(userMessage->data);
+		}
+		Variables *variables = dynamic_cast<Variables *>(message);
+		if (variables && variables->source == nodeId)
+		{
+			// large ranges are sent in several messages, add a sample once the last one is received
+			if (variables->start >= variablesStart && variables->start + variables->variables.size() <= variablesStart + currentValues.size())
+			{
+				copy(variables->variables.begin(), variables->variables.end(), currentValues.begin() + (variables->start - variablesStart));
+				if (variables->start + variables->variables.size() == variablesStart + currentValues.size())
+					addSample(currentValues);
+			}
+		}
+		VariablesDelta *variablesDelta = dynamic_cast<VariablesDelta *>(message);
+		if (variablesDelta && variablesDelta->source == nodeId)
+		{
+			// after the first values, the node only sends those that changed
+			variablesDelta->apply(variablesStart, currentValues);
+			if (variablesDelta->start >= variablesStart && variablesDelta->start + variablesDelta->length == variablesStart + currentValues.size())
+				addSample(currentValues);
+		}
+		VariablesUnsubscribed *unsubscribed = dynamic_cast<VariablesUnsubscribed *>(message);
+		if (unsubscribed && unsubscribed->source == nodeId && unsubscribed->start == variablesStart && unsubscribed->length == currentValues.size())
+		{
+			// renew the subscription, unless the node has no room for it, in which case poll the variables every 100 ms
+			if (unsubscribed->reason == ASEBA_UNSUBSCRIBED_NO_ROOM)
+			{
+				cerr << "Node " << nodeId << " has no room to send the variables by itself, polling them" << endl;
+				pollVariables = true;
+			}
+			else
+			{
+				SubscribeVariables(nodeId, variablesStart, currentValues.size(), 0, true).serialize(stream);
+				stream->flush();
+			}
+		}
+		delete message;
+	}
+	
+	void addSample(const vector<sint16>& data)
+	{
+		double elapsedTime = (double)startingTime.msecsTo(QTime::currentTime()) / 1000.;
+		if (outputFile.is_open())
+			outputFile << elapsedTime;
+		timeStamps.push_back(elapsedTime);
+		for (size_t i = 0; i < values.size(); i++)
+		{
+			if (i < data.size())
 			{
-				double elapsedTime = (double)startingTime.msecsTo(QTime::currentTime()) / 1000.;
 				if (outputFile.is_open())
-					outputFile << elapsedTime;
-				timeStamps.push_back(elapsedTime);
-				for (size_t i = 0; i < values.size(); i++)
-				{
-					if (i < userMessage->data.size())
-					{
-						if (outputFile.is_open())
-							outputFile << " " << userMessage->data[i];
-						values[i].push_back(userMessage->data[i]);
-					}
-					else
-					{
-						if (outputFile.is_open())
-							outputFile << " " << 0;
-						values[i].push_back(0);
-					}
-				}
+					outputFile << " " << data[i];
+				values[i].push_back(data[i]);
+			}
+			else
+			{
 				if (outputFile.is_open())
-					outputFile << endl;
-				replot();
+					outputFile << " " << 0;
+				values[i].push_back(0);
 			}
 		}
-		delete message;
+		if (outputFile.is_open())
+			outputFile << endl;
+		replot();
 	}
 	
 	void connectionClosed(Stream *stream, bool abnormal)
 	{
+		this->stream = 0;
 		dumpTime(cerr);
 		cout << "Connection closed to " << stream->getTargetName();
 		if (abnormal)
@@ -166,9 +259,11 @@ protected:
 int main(int argc, char *argv[])
 {
 	Dashel::initPlugins();
-	if (argc < 4)
+	const bool plotVariables(argc > 2 && strcmp(argv[2], "--variables") == 0);
+	if (argc < 4 || (plotVariables && argc < 6))
 	{
 		cerr << "Usage " << argv[0] << " target event_id event_variables_count [output file]" << endl;
+		cerr << "      " << argv[0] << " target --variables node_id start count [output file]" << endl;
 		return 1;
 	}
 	
@@ -177,8 +272,12 @@ int main(int argc, char *argv[])
 	int res;
 	try
 	{
-		EventLogger logger(argv[1], atoi(argv[2]), atoi(argv[3]), (argc > 4 ? argv[4] : 0));
-		logger.show();
+		auto_ptr<EventLogger> logger;
+		if (plotVariables)
+			logger.reset(new EventLogger(argv[1], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), (argc > 6 ? argv[6] : 0)));
+		else
+			logger.reset(new EventLogger(argv[1], atoi(argv[2]), atoi(argv[3]), (argc > 4 ? argv[4] : 0)));
+		logger->show();
 		res = app.exec();
 	}
 	catch(Dashel::DashelException e)
@@ -25,13 +25,14 @@
 #include "../../common/consts.h"
 #include "../../common/msg/msg.h"
 #include "../../common/msg/descriptions-manager.h"
+#include "../../common/msg/bytecode-uploader.h"
 #include "../../common/utils/utils.h"
+#include "../../compiler/batch/BatchCompiler.h"
 #include "../../transport/dashel_plugins/dashel-plugins.h"
 #include <QCoreApplication>
+#include <QFile>
 #include <QString>
 #include <QStringList>
-#include <QFile>
-#include <QDomDocument>
 
 namespace Aseba 
 {
@@ -41,11 +42,13 @@ namespace Aseba
 	class MassLoader: public Hub, public DescriptionsManager
 	{
 	protected:
-		QString fileName;
+		const AeslProject project;
+		BatchCompiler compiler;
+		BytecodeUploader bytecodeUploader;
 		Stream* stream;
 		
 	public:
-		MassLoader(const QString& fileName):fileName(fileName),stream(0) {}
+		MassLoader(const AeslProject& project, const QString& cacheDirectory);
 		void loadToTarget(const std::string& target);
 		
 	protected:
@@ -55,9 +58,20 @@ namespace Aseba
 		virtual void connectionClosed(Stream *stream, bool abnormal);
 	
 		// from DescriptionsManager
+		virtual void requestNodeDescription(unsigned nodeId);
 		virtual void nodeDescriptionReceived(unsigned nodeId);
 	};
 	
+	MassLoader::MassLoader(const AeslProject& project, const QString& cacheDirectory):
+		project(project),
+		stream(0)
+	{
+		compiler.setDiskCache(cacheDirectory);
+		// the directory now exists, it also keeps the descriptions of the nodes, so that reloads do not wait for them
+		if (!cacheDirectory.isEmpty())
+			setDiskCache(QFile::encodeName(cacheDirectory).constData());
+	}
+	
 	void MassLoader::loadToTarget(const std::string& target)
 	{
 		while (true)
@@ -106,6 +120,7 @@ namespace Aseba
 			message->dump(wcerr);
 			wcerr << endl;*/
 			// process it
+			bytecodeUploader.processMessage(message.get());
 			processMessage(message.get());
 		}
 		catch (DashelException e)
@@ -121,6 +136,14 @@ namespace Aseba
 		this->stream = 0;
 		stop();
 		reset();
+		bytecodeUploader.reset();
+	}
+	
+	void MassLoader::requestNodeDescription(unsigned nodeId)
+	{
+		assert(stream);
+		GetNodeDescription(nodeId).serialize(stream);
+		stream->flush();
 	}
 	
 	void MassLoader::nodeDescriptionReceived(unsigned nodeId)
@@ -128,85 +151,40 @@ namespace Aseba
 		//cerr << "Description received" << endl;
 		assert(stream);
 		
-		// we have a new node description, load file to see if there is code for it
-		CommonDefinitions commonDefinitions;
-		
-		// open file
-		QFile file(fileName);
-		if (!file.open(QFile::ReadOnly))
-		{
-			wcerr << QString("Cannot open file %0").arg(fileName).toStdWString() << endl;
-			return;
-		}
-		// load document
-		QDomDocument document("aesl-source");
-		QString errorMsg;
-		int errorLine;
-		int errorColumn;
-		if (!document.setContent(&file, false, &errorMsg, &errorLine, &errorColumn))
+		// we have a new node description, compile the programs of the project that are for this node
+		BatchCompiler::JobsVector jobs;
+		vector<const AeslNodeProgram*> programs;
+		for (size_t i = 0; i < project.programs.size(); ++i)
 		{
-			wcerr << QString("Error in XML source file: %0 at line %1, column %2").arg(errorMsg).arg(errorLine).arg(errorColumn).toStdWString() << endl;
-			return;
+			const AeslNodeProgram& program(project.programs[i]);
+			bool ok;
+			const unsigned programNodeId(getNodeId(program.name, program.nodeId, &ok));
+			if (ok && programNodeId == nodeId)
+			{
+				jobs.push_back(BatchCompiler::Job(getDescription(nodeId), program.source));
+				programs.push_back(&program);
+			}
 		}
+		const BatchCompiler::CompiledProgramsVector results(compiler.compile(jobs, project.commonDefinitions));
 		
-		// FIXME: this code depends on event and contants being before any code
-		QDomNode domNode = document.documentElement().firstChild();
-		while (!domNode.isNull())
+		// load them
+		for (size_t i = 0; i < results.size(); ++i)
 		{
-			if (domNode.isElement())
+			const CompiledProgram& result(results[i]);
+			if (result.success)
 			{
-				QDomElement element = domNode.toElement();
-				if (element.tagName() == "node")
-				{
-					bool ok;
-					const unsigned nodeId(getNodeId(element.attribute("name").toStdWString(), element.attribute("nodeId", 0).toUInt(), &ok));
-					if (ok)
-					{
-						std::wistringstream is(element.firstChild().toText().data().toStdWString());
-						Error error;
-						BytecodeVector bytecode;
-						unsigned allocatedVariablesCount;
-						
-						Compiler compiler;
-						compiler.setTargetDescription(getDescription(nodeId));
-						compiler.setCommonDefinitions(&commonDefinitions);
-						bool result = compiler.compile(is, bytecode, allocatedVariablesCount, error);
-						
-						if (result)
-						{
-							sendBytecode(stream, nodeId, std::vector<uint16>(bytecode.begin(), bytecode.end()));
-							Run(nodeId).serialize(stream);
-							stream->flush();
-							wcerr << QString("! %1 bytecodes loaded to target %0, you can disconnect target !").arg(element.attribute("name")).arg(bytecode.size()).toStdWString() << endl;
-						}
-						else
-						{
-							wcerr << L"Compilation error: " << error.toWString() << endl;
-							break;
-						}
-					}
-				}
-				else if (element.tagName() == "event")
-				{
-					const QString eventName(element.attribute("name"));
-					const unsigned eventSize(element.attribute("size").toUInt());
-					if (eventSize > ASEBA_MAX_EVENT_ARG_SIZE)
-					{
-						wcerr << QString("Event %1 has a length %2 larger than maximum %3").arg(eventName).arg(eventSize).arg(ASEBA_MAX_EVENT_ARG_SIZE).toStdWString() << endl;
-						break;
-					}
-					else
-					{
-						commonDefinitions.events.push_back(NamedValue(eventName.toStdWString(), eventSize));
-					}
-				}
-				else if (element.tagName() == "constant")
-				{
-					commonDefinitions.constants.push_back(NamedValue(element.attribute("name").toStdWString(), element.attribute("value").toUInt()));
-				}
+				bytecodeUploader.sendBytecode(stream, nodeId, std::vector<uint16>(result.bytecode.begin(), result.bytecode.end()));
+				Run(nodeId).serialize(stream);
+				stream->flush();
+				wcerr << QString("! %1 bytecodes loaded to target %0, you can disconnect target !").arg(QString::fromStdWString(programs[i]->name)).arg(result.bytecode.size()).toStdWString() << endl;
+			}
+			else
+			{
+				wcerr << L"Compilation error: " << result.error.toWString() << endl;
+				break;
 			}
-			domNode = domNode.nextSibling();
 		}
+		wcerr << QString("Compilation cache: %0 hits, %1 disk hits, %2 misses").arg(compiler.getCacheHitsCount()).arg(compiler.getDiskCacheHitsCount()).arg(compiler.getCacheMissesCount()).toStdWString() << endl;
 	}
 }
 
@@ -216,17 +194,37 @@ int main(int argc, char *argv[])
 	Dashel::initPlugins();
 	
 	QString target(ASEBA_DEFAULT_TARGET);
+	QStringList arguments(app.arguments());
+	
+	// compilations and nodes descriptions are kept in this directory across runs, if given
+	QString cacheDirectory;
+	const int cacheIndex(arguments.indexOf("--cache"));
+	if (cacheIndex > 0 && cacheIndex + 1 < arguments.size())
+	{
+		cacheDirectory = arguments.at(cacheIndex + 1);
+		arguments.removeAt(cacheIndex + 1);
+		arguments.removeAt(cacheIndex);
+	}
 	
-	if (app.arguments().size() < 2)
+	if (arguments.size() < 2)
 	{
-		std::wcerr << L"Usage: " << app.arguments().first().toStdWString() << L" filename [target]" << std::endl;
+		std::wcerr << L"Usage: " << arguments.first().toStdWString() << L" [--cache directory] filename [target]" << std::endl;
 		return 1;
 	}
 	
-	if (app.arguments().size() >= 3)
-		target = app.arguments().at(2);
+	if (arguments.size() >= 3)
+		target = arguments.at(2);
+	
+	// parse the project once, the programs are compiled when the nodes describe themselves
+	Aseba::AeslProject project;
+	QString errorMessage;
+	if (!project.load(arguments.at(1), errorMessage))
+	{
+		std::wcerr << errorMessage.toStdWString() << std::endl;
+		return 1;
+	}
 	
-	Aseba::MassLoader massLoader(app.arguments().at(1));
+	Aseba::MassLoader massLoader(project, cacheDirectory);
 	massLoader.loadToTarget(target.toStdString());
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,716 @@
+/*
+	Aseba - an event-based framework for distributed robot control
+	Copyright (C) 2007--2012:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+		and other contributors, see authors.txt for details
+	
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+	
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "FlashOrchestrator.h"
+#include "../../common/msg/msg.h"
+#include "../../common/utils/HexFile.h"
+#include "../../common/utils/FormatableString.h"
+#include "../../common/utils/BootloaderInterface.h"
+#include <dashel/dashel.h>
+#include <deque>
+#include <memory>
+#include <sys/time.h>
+#include <errno.h>
+
+namespace Aseba
+{
+	using namespace Dashel;
+	using namespace std;
+	
+	//! Absolute time in milliseconds from now, for pthread_cond_timedwait()
+	static timespec deadlineIn(unsigned milliseconds)
+	{
+		timeval now;
+		gettimeofday(&now, 0);
+		const unsigned long long nanoseconds((now.tv_usec + (milliseconds % 1000) * 1000ULL) * 1000ULL);
+		timespec deadline;
+		deadline.tv_sec = now.tv_sec + milliseconds / 1000 + nanoseconds / 1000000000ULL;
+		deadline.tv_nsec = nanoseconds % 1000000000ULL;
+		return deadline;
+	}
+	
+	//! A connection shared by the sessions of all nodes reached through a target
+	class FlashOrchestrator::Connection: public Hub
+	{
+	public:
+		Connection(const string& target);
+		virtual ~Connection();
+		
+		//! Start the thread dispatching incoming messages to the nodes
+		void start();
+		//! Receive the messages from node dest, must be called before start()
+		void addNode(unsigned dest);
+		//! Drop the messages received from dest and not read yet
+		void clearMessages(unsigned dest);
+		//! Write message, flushing the stream if flush is true
+		void send(Message& message, bool flush);
+		//! Return the next message from source, throw BootloaderInterface::Error if none comes within timeout ms
+		Message* receive(unsigned source, unsigned timeout);
+		
+		Stream* getStream() const { return stream; }
+	
+	protected:
+		virtual void incomingData(Stream* stream);
+		virtual void connectionClosed(Stream* stream, bool abnormal);
+		
+		static void* threadMain(void* connection);
+	
+	protected:
+		typedef deque<Message*> MessagesQueue;
+		typedef map<unsigned, MessagesQueue> QueuesMap;
+		
+		Stream* stream;
+		pthread_mutex_t mutex; //!< protects queues, closed and stopRequested
+		pthread_cond_t condition; //!< signaled when a message is queued or the connection is closed
+		pthread_mutex_t writeMutex; //!< serializes the writes of the sessions
+		QueuesMap queues; //!< messages not read yet, by source
+		bool closed;
+		bool stopRequested;
+		bool started;
+		pthread_t thread;
+	};
+	
+	FlashOrchestrator::Connection::Connection(const string& target) :
+		stream(0),
+		closed(false),
+		stopRequested(false),
+		started(false)
+	{
+		stream = connect(target);
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&condition, NULL);
+		pthread_mutex_init(&writeMutex, NULL);
+	}
+	
+	FlashOrchestrator::Connection::~Connection()
+	{
+		if (started)
+		{
+			pthread_mutex_lock(&mutex);
+			stopRequested = true;
+			pthread_mutex_unlock(&mutex);
+			pthread_join(thread, NULL);
+		}
+		
+		for (QueuesMap::iterator it = queues.begin(); it != queues.end(); ++it)
+			for (MessagesQueue::iterator jt = it->second.begin(); jt != it->second.end(); ++jt)
+				delete *jt;
+		
+		pthread_mutex_destroy(&writeMutex);
+		pthread_cond_destroy(&condition);
+		pthread_mutex_destroy(&mutex);
+	}
+	
+	void FlashOrchestrator::Connection::start()
+	{
+		started = true;
+		pthread_create(&thread, NULL, threadMain, this);
+	}
+	
+	void FlashOrchestrator::Connection::addNode(unsigned dest)
+	{
+		queues[dest];
+	}
+	
+	void FlashOrchestrator::Connection::clearMessages(unsigned dest)
+	{
+		pthread_mutex_lock(&mutex);
+		MessagesQueue& queue(queues[dest]);
+		for (MessagesQueue::iterator it = queue.begin(); it != queue.end(); ++it)
+			delete *it;
+		queue.clear();
+		pthread_mutex_unlock(&mutex);
+	}
+	
+	void FlashOrchestrator::Connection::send(Message& message, bool flush)
+	{
+		pthread_mutex_lock(&writeMutex);
+		pthread_mutex_lock(&mutex);
+		const bool wasClosed(closed);
+		pthread_mutex_unlock(&mutex);
+		if (wasClosed)
+		{
+			pthread_mutex_unlock(&writeMutex);
+			throw BootloaderInterface::Error("Connection closed");
+		}
+		try
+		{
+			message.serialize(stream);
+			if (flush)
+				stream->flush();
+		}
+		catch (...)
+		{
+			pthread_mutex_unlock(&writeMutex);
+			throw;
+		}
+		pthread_mutex_unlock(&writeMutex);
+	}
+	
+	Message* FlashOrchestrator::Connection::receive(unsigned source, unsigned timeout)
+	{
+		const timespec deadline(deadlineIn(timeout));
+		
+		pthread_mutex_lock(&mutex);
+		MessagesQueue& queue(queues[source]);
+		while (queue.empty() && !closed)
+		{
+			if (pthread_cond_timedwait(&condition, &mutex, &deadline) == ETIMEDOUT)
+				break;
+		}
+		if (queue.empty())
+		{
+			const bool wasClosed(closed);
+			pthread_mutex_unlock(&mutex);
+			if (wasClosed)
+				throw BootloaderInterface::Error("Connection closed");
+			throw BootloaderInterface::Error(FormatableString("No message from node %0 for %1 ms").arg(source).arg(timeout));
+		}
+		Message* message(queue.front());
+		queue.pop_front();
+		pthread_mutex_unlock(&mutex);
+		return message;
+	}
+	
+	void FlashOrchestrator::Connection::incomingData(Stream* stream)
+	{
+		Message* message(Message::receive(stream));
+		
+		pthread_mutex_lock(&mutex);
+		QueuesMap::iterator it(queues.find(message->source));
+		if (it != queues.end())
+		{
+			it->second.push_back(message);
+			pthread_cond_broadcast(&condition);
+		}
+		else
+			delete message;
+		pthread_mutex_unlock(&mutex);
+	}
+	
+	void FlashOrchestrator::Connection::connectionClosed(Stream* stream, bool abnormal)
+	{
+		// the hub deletes the stream once we return, so wait for the write in progress if any
+		pthread_mutex_lock(&writeMutex);
+		pthread_mutex_lock(&mutex);
+		closed = true;
+		pthread_cond_broadcast(&condition);
+		pthread_mutex_unlock(&mutex);
+		pthread_mutex_unlock(&writeMutex);
+	}
+	
+	void* FlashOrchestrator::Connection::threadMain(void* connection)
+	{
+		Connection* that(static_cast<Connection*>(connection));
+		while (true)
+		{
+			pthread_mutex_lock(&that->mutex);
+			const bool stop(that->stopRequested || that->closed);
+			pthread_mutex_unlock(&that->mutex);
+			if (stop)
+				break;
+			
+			try
+			{
+				that->step(50);
+			}
+			catch (DashelException& e)
+			{
+				that->connectionClosed(that->stream, true);
+			}
+		}
+		return NULL;
+	}
+	
+	//! A connection to a single node, polled from the thread of its session so that reads time out
+	class FlashOrchestrator::DirectConnection: public Hub
+	{
+	public:
+		DirectConnection(const string& target);
+		virtual ~DirectConnection();
+		
+		//! Write message, flushing the stream if flush is true
+		void send(Message& message, bool flush);
+		//! Write raw data and flush the stream
+		void send(const uint8* data, size_t size);
+		//! Return the next message, throw BootloaderInterface::Error if none comes within timeout ms
+		Message* receive(unsigned timeout);
+		//! Read size bytes of raw data, throw BootloaderInterface::Error if they do not come within timeout ms
+		void receive(uint8* data, size_t size, unsigned timeout);
+		
+		Stream* getStream() const { return stream; }
+	
+	protected:
+		virtual void incomingData(Stream* stream);
+		virtual void connectionClosed(Stream* stream, bool abnormal);
+		
+		//! Step the hub until the data waited for is there, return false if it does not come within timeout ms
+		bool waitData(unsigned timeout);
+	
+	protected:
+		Stream* stream;
+		deque<Message*> messages; //!< messages not read yet
+		uint8* rawData; //!< where to store the raw data being read
+		size_t rawSize; //!< amount of raw data still to read
+		bool closed;
+	};
+	
+	FlashOrchestrator::DirectConnection::DirectConnection(const string& target) :
+		stream(0),
+		rawData(0),
+		rawSize(0),
+		closed(false)
+	{
+		stream = connect(target);
+	}
+	
+	FlashOrchestrator::DirectConnection::~DirectConnection()
+	{
+		for (deque<Message*>::iterator it = messages.begin(); it != messages.end(); ++it)
+			delete *it;
+	}
+	
+	void FlashOrchestrator::DirectConnection::send(Message& message, bool flush)
+	{
+		// the hub deleted the stream when it was closed
+		if (closed)
+			throw BootloaderInterface::Error("Connection closed");
+		message.serialize(stream);
+		if (flush)
+			stream->flush();
+	}
+	
+	void FlashOrchestrator::DirectConnection::send(const uint8* data, size_t size)
+	{
+		if (closed)
+			throw BootloaderInterface::Error("Connection closed");
+		stream->write(data, size);
+		stream->flush();
+	}
+	
+	Message* FlashOrchestrator::DirectConnection::receive(unsigned timeout)
+	{
+		if (!waitData(timeout))
+			throw BootloaderInterface::Error(FormatableString("No message from node for %0 ms").arg(timeout));
+		Message* message(messages.front());
+		messages.pop_front();
+		return message;
+	}
+	
+	void FlashOrchestrator::DirectConnection::receive(uint8* data, size_t size, unsigned timeout)
+	{
+		rawData = data;
+		rawSize = size;
+		if (!waitData(timeout))
+		{
+			const size_t missing(rawSize);
+			rawData = 0;
+			rawSize = 0;
+			throw BootloaderInterface::Error(FormatableString("Only %0 of %1 bytes from node after %2 ms").arg(size - missing).arg(size).arg(timeout));
+		}
+		rawData = 0;
+	}
+	
+	bool FlashOrchestrator::DirectConnection::waitData(unsigned timeout)
+	{
+		const UnifiedTime start;
+		while (rawData ? rawSize > 0 : messages.empty())
+		{
+			if (closed)
+				throw BootloaderInterface::Error("Connection closed");
+			const UnifiedTime::Value elapsed((UnifiedTime() - start).value);
+			if (elapsed >= timeout)
+				return false;
+			step(int(timeout - elapsed));
+		}
+		return true;
+	}
+	
+	void FlashOrchestrator::DirectConnection::incomingData(Stream* stream)
+	{
+		// raw data is read byte by byte, as poll() only tells that one is there
+		if (rawSize > 0)
+		{
+			stream->read(rawData, 1);
+			++rawData;
+			--rawSize;
+		}
+		else
+			messages.push_back(Message::receive(stream));
+	}
+	
+	void FlashOrchestrator::DirectConnection::connectionClosed(Stream* stream, bool abnormal)
+	{
+		closed = true;
+	}
+	
+	//! A bootloader interface reporting to the orchestrator, and using either a shared or a direct connection
+	class FlashOrchestrator::Interface: public BootloaderInterface
+	{
+	public:
+		Interface(FlashOrchestrator* orchestrator, size_t index, Connection* connection);
+		Interface(FlashOrchestrator* orchestrator, size_t index, DirectConnection* directConnection);
+	
+	protected:
+		virtual void writeHexGotDescription(unsigned pagesCount);
+		virtual void writePageSuccess(unsigned pageNumber, unsigned milliseconds);
+		virtual void writePageSkipped(unsigned pageNumber);
+		virtual void errorWritePageNonFatal(unsigned pageNumber);
+		
+		virtual void sendMessage(Message& message, bool flush);
+		virtual Message* receiveMessage();
+		virtual void sendData(const uint8* data, size_t size);
+		virtual void receiveData(uint8* data, size_t size);
+	
+	protected:
+		FlashOrchestrator* orchestrator;
+		size_t index; //!< index of the node in the statuses of the orchestrator
+		Connection* connection; //!< shared connection, 0 if the connection is direct
+		DirectConnection* directConnection; //!< direct connection, 0 if the connection is shared
+	};
+	
+	FlashOrchestrator::Interface::Interface(FlashOrchestrator* orchestrator, size_t index, Connection* connection) :
+		BootloaderInterface(connection->getStream(), orchestrator->statuses[index].dest),
+		orchestrator(orchestrator),
+		index(index),
+		connection(connection),
+		directConnection(0)
+	{
+		setSkipUnchangedPages(orchestrator->skipUnchangedPages);
+		setPagesInFlight(orchestrator->pagesInFlight);
+	}
+	
+	FlashOrchestrator::Interface::Interface(FlashOrchestrator* orchestrator, size_t index, DirectConnection* directConnection) :
+		BootloaderInterface(directConnection->getStream(), orchestrator->statuses[index].dest),
+		orchestrator(orchestrator),
+		index(index),
+		connection(0),
+		directConnection(directConnection)
+	{
+		setSkipUnchangedPages(orchestrator->skipUnchangedPages);
+		setPagesInFlight(orchestrator->pagesInFlight);
+	}
+	
+	void FlashOrchestrator::Interface::writeHexGotDescription(unsigned pagesCount)
+	{
+		pthread_mutex_lock(&orchestrator->mutex);
+		orchestrator->statuses[index].pagesCount = pagesCount;
+		pthread_mutex_unlock(&orchestrator->mutex);
+	}
+	
+	void FlashOrchestrator::Interface::writePageSuccess(unsigned pageNumber, unsigned milliseconds)
+	{
+		pthread_mutex_lock(&orchestrator->mutex);
+		orchestrator->statuses[index].pagesWritten += 1;
+		orchestrator->statuses[index].bytesWritten += pageSize;
+		pthread_mutex_unlock(&orchestrator->mutex);
+	}
+	
+	void FlashOrchestrator::Interface::writePageSkipped(unsigned pageNumber)
+	{
+		pthread_mutex_lock(&orchestrator->mutex);
+		orchestrator->statuses[index].pagesSkipped += 1;
+		pthread_mutex_unlock(&orchestrator->mutex);
+	}
+	
+	void FlashOrchestrator::Interface::errorWritePageNonFatal(unsigned pageNumber)
+	{
+		pthread_mutex_lock(&orchestrator->mutex);
+		orchestrator->statuses[index].error = FormatableString("Error while writing page %0").arg(pageNumber);
+		pthread_mutex_unlock(&orchestrator->mutex);
+	}
+	
+	void FlashOrchestrator::Interface::sendMessage(Message& message, bool flush)
+	{
+		if (connection)
+			connection->send(message, flush);
+		else
+			directConnection->send(message, flush);
+	}
+	
+	Message* FlashOrchestrator::Interface::receiveMessage()
+	{
+		if (connection)
+			return connection->receive(dest, orchestrator->timeout);
+		else
+			return directConnection->receive(orchestrator->timeout);
+	}
+	
+	void FlashOrchestrator::Interface::sendData(const uint8* data, size_t size)
+	{
+		if (connection)
+			BootloaderInterface::sendData(data, size);
+		else
+			directConnection->send(data, size);
+	}
+	
+	void FlashOrchestrator::Interface::receiveData(uint8* data, size_t size)
+	{
+		if (connection)
+			BootloaderInterface::receiveData(data, size);
+		else
+			directConnection->receive(data, size, orchestrator->timeout);
+	}
+	
+	//! The thread flashing a node
+	class FlashOrchestrator::Session
+	{
+	public:
+		Session(FlashOrchestrator* orchestrator, size_t index, Connection* connection) :
+			orchestrator(orchestrator),
+			index(index),
+			connection(connection)
+		{}
+		
+		void start() { pthread_create(&thread, NULL, threadMain, this); }
+		void join() { pthread_join(thread, NULL); }
+		
+		FlashOrchestrator* orchestrator;
+		size_t index; //!< index of the node in the statuses of the orchestrator
+		Connection* connection; //!< shared connection, 0 to connect directly
+	
+	protected:
+		static void* threadMain(void* session)
+		{
+			Session* that(static_cast<Session*>(session));
+			that->orchestrator->flashNode(that);
+			return NULL;
+		}
+		
+		pthread_t thread;
+	};
+	
+	FlashOrchestrator::NodeStatus::NodeStatus(const string& target, unsigned dest) :
+		target(target),
+		dest(dest),
+		state(PENDING),
+		attempts(0),
+		pagesCount(0),
+		pagesWritten(0),
+		pagesSkipped(0),
+		bytesWritten(0),
+		duration(0)
+	{
+	}
+	
+	FlashOrchestrator::FlashOrchestrator() :
+		attempts(3),
+		timeout(5000),
+		reportPeriod(1000),
+		skipUnchangedPages(false),
+		pagesInFlight(1),
+		reset(true),
+		simple(false),
+		runningSessions(0)
+	{
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&condition, NULL);
+	}
+	
+	FlashOrchestrator::~FlashOrchestrator()
+	{
+		pthread_cond_destroy(&condition);
+		pthread_mutex_destroy(&mutex);
+	}
+	
+	void FlashOrchestrator::addNode(const string& target, unsigned dest)
+	{
+		pthread_mutex_lock(&mutex);
+		statuses.push_back(NodeStatus(target, dest));
+		pthread_mutex_unlock(&mutex);
+	}
+	
+	FlashOrchestrator::NodeStatuses FlashOrchestrator::getStatuses() const
+	{
+		pthread_mutex_lock(&mutex);
+		NodeStatuses currentStatuses(statuses);
+		pthread_mutex_unlock(&mutex);
+		return currentStatuses;
+	}
+	
+	bool FlashOrchestrator::run(const string& hexFileName, bool reset, bool simple)
+	{
+		// check the file once rather than failing in every session
+		HexFile hexFile;
+		hexFile.read(hexFileName);
+		
+		if (!simple && pagesInFlight > 1)
+			throw BootloaderInterface::Error("Writing several pages in flight requires the simple protocol");
+		if (simple)
+		{
+			for (size_t i = 0; i < statuses.size(); ++i)
+				for (size_t j = 0; j < i; ++j)
+					if (statuses[j].target == statuses[i].target)
+						throw BootloaderInterface::Error(FormatableString("Target %0 leads to several nodes, but the simple protocol needs direct access to each node").arg(statuses[i].target));
+		}
+		
+		this->hexFileName = hexFileName;
+		this->reset = reset;
+		this->simple = simple;
+		const UnifiedTime startTime;
+		
+		// reset statuses from a previous run
+		pthread_mutex_lock(&mutex);
+		for (size_t i = 0; i < statuses.size(); ++i)
+			statuses[i] = NodeStatus(statuses[i].target, statuses[i].dest);
+		pthread_mutex_unlock(&mutex);
+		
+		// create the sessions, and with the complete protocol, the connections they share
+		for (size_t i = 0; i < statuses.size(); ++i)
+		{
+			const string& target(statuses[i].target);
+			Connection* connection(0);
+			if (!simple)
+			{
+				map<string, Connection*>::iterator it(connections.find(target));
+				if (it == connections.end())
+				{
+					try
+					{
+						connection = new Connection(target);
+					}
+					catch (DashelException& e)
+					{
+						pthread_mutex_lock(&mutex);
+						statuses[i].state = NodeStatus::FAILED;
+						statuses[i].error = FormatableString("Cannot connect to %0: %1").arg(target).arg(e.what());
+						pthread_mutex_unlock(&mutex);
+						continue;
+					}
+					connections[target] = connection;
+				}
+				else
+					connection = it->second;
+				connection->addNode(statuses[i].dest);
+			}
+			sessions.push_back(new Session(this, i, connection));
+		}
+		
+		// start everything, then report progress until all sessions are done
+		for (map<string, Connection*>::iterator it = connections.begin(); it != connections.end(); ++it)
+			it->second->start();
+		runningSessions = sessions.size();
+		for (size_t i = 0; i < sessions.size(); ++i)
+			sessions[i]->start();
+		
+		pthread_mutex_lock(&mutex);
+		while (runningSessions > 0)
+		{
+			const timespec deadline(deadlineIn(reportPeriod));
+			if (pthread_cond_timedwait(&condition, &mutex, &deadline) == ETIMEDOUT)
+			{
+				const NodeStatuses currentStatuses(statuses);
+				pthread_mutex_unlock(&mutex);
+				reportProgress(currentStatuses, unsigned((UnifiedTime() - startTime).value));
+				pthread_mutex_lock(&mutex);
+			}
+		}
+		pthread_mutex_unlock(&mutex);
+		
+		for (size_t i = 0; i < sessions.size(); ++i)
+		{
+			sessions[i]->join();
+			delete sessions[i];
+		}
+		sessions.clear();
+		for (map<string, Connection*>::iterator it = connections.begin(); it != connections.end(); ++it)
+			delete it->second;
+		connections.clear();
+		
+		const NodeStatuses finalStatuses(getStatuses());
+		reportProgress(finalStatuses, unsigned((UnifiedTime() - startTime).value));
+		
+		for (size_t i = 0; i < finalStatuses.size(); ++i)
+			if (finalStatuses[i].state != NodeStatus::DONE)
+				return false;
+		return true;
+	}
+	
+	void FlashOrchestrator::flashNode(Session* session)
+	{
+		const size_t index(session->index);
+		pthread_mutex_lock(&mutex);
+		const string target(statuses[index].target);
+		const unsigned dest(statuses[index].dest);
+		pthread_mutex_unlock(&mutex);
+		
+		for (unsigned attempt = 1; attempt <= attempts; ++attempt)
+		{
+			pthread_mutex_lock(&mutex);
+			statuses[index].state = NodeStatus::FLASHING;
+			statuses[index].attempts = attempt;
+			statuses[index].pagesWritten = 0;
+			statuses[index].pagesSkipped = 0;
+			pthread_mutex_unlock(&mutex);
+			
+			const UnifiedTime attemptStart;
+			string error;
+			try
+			{
+				if (session->connection)
+				{
+					// messages left by a previous attempt must not be taken as answers
+					session->connection->clearMessages(dest);
+					Interface bootloader(this, index, session->connection);
+					bootloader.writeHex(hexFileName, reset, simple);
+				}
+				else
+				{
+					DirectConnection connection(target);
+					Interface bootloader(this, index, &connection);
+					bootloader.writeHex(hexFileName, reset, simple);
+				}
+			}
+			catch (BootloaderInterface::Error& e)
+			{
+				error = e.what();
+			}
+			catch (DashelException& e)
+			{
+				error = e.what();
+			}
+			catch (HexFile::Error& e)
+			{
+				error = e.toString();
+			}
+			
+			pthread_mutex_lock(&mutex);
+			NodeStatus& status(statuses[index]);
+			status.duration += (UnifiedTime() - attemptStart).value;
+			if (error.empty())
+				status.state = NodeStatus::DONE;
+			else
+			{
+				status.error = error;
+				if (attempt == attempts)
+					status.state = NodeStatus::FAILED;
+			}
+			const bool finished(status.state != NodeStatus::FLASHING);
+			pthread_mutex_unlock(&mutex);
+			if (finished)
+				break;
+		}
+		
+		pthread_mutex_lock(&mutex);
+		--runningSessions;
+		pthread_cond_signal(&condition);
+		pthread_mutex_unlock(&mutex);
+	}
+} // namespace Aseba
@@ -0,0 +1,142 @@
+/*
+	Aseba - an event-based framework for distributed robot control
+	Copyright (C) 2007--2012:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+		and other contributors, see authors.txt for details
+	
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+	
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ASEBA_FLASH_ORCHESTRATOR_H
+#define ASEBA_FLASH_ORCHESTRATOR_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+#include "../../common/utils/utils.h"
+
+namespace Aseba
+{
+	/** \addtogroup multiflash */
+	/*@{*/
+	
+	//! Upgrade the firmware of many nodes in parallel
+	/**
+		Every node is flashed by its own BootloaderInterface, in its own thread.
+		Nodes reached through the same target, for instance a switch, share a
+		single connection: a thread reads the messages of this connection and
+		dispatches them to the sessions according to their source, while the
+		sessions take turn to write.
+		The simple protocol needs direct access to the node, so each target must
+		lead to a single node, and is connected anew for every attempt; the
+		session then polls this connection itself, as raw data follows some
+		messages, so that waiting for the node times out as well.
+		A session that fails, including when its node stays silent for longer
+		than the timeout, is restarted from the beginning, until the number of
+		attempts is reached.
+	*/
+	class FlashOrchestrator
+	{
+	public:
+		//! State and statistics of the upgrade of a node
+		struct NodeStatus
+		{
+			enum State
+			{
+				PENDING,
+				FLASHING,
+				DONE,
+				FAILED
+			};
+			
+			std::string target; //!< Dashel target through which the node is reached
+			unsigned dest; //!< id of the node
+			State state;
+			unsigned attempts; //!< number of attempts so far
+			unsigned pagesCount; //!< number of pages in the hex file
+			unsigned pagesWritten; //!< pages written in the current attempt
+			unsigned pagesSkipped; //!< pages found unchanged in the current attempt
+			unsigned bytesWritten; //!< bytes written over all attempts
+			UnifiedTime::Value duration; //!< time spent in sessions, in ms
+			std::string error; //!< last error, empty if none
+			
+			NodeStatus(const std::string& target, unsigned dest);
+		};
+		typedef std::vector<NodeStatus> NodeStatuses;
+	
+	public:
+		FlashOrchestrator();
+		virtual ~FlashOrchestrator();
+		
+		//! Add node dest, reached through target, to the nodes to flash
+		void addNode(const std::string& target, unsigned dest);
+		//! Set how many times a node is tried before being reported as failed
+		void setAttempts(unsigned count) { attempts = count > 0 ? count : 1; }
+		//! Set how long a session waits for a message from its node before failing, in ms
+		void setTimeout(unsigned milliseconds) { timeout = milliseconds; }
+		//! Set the period at which reportProgress() is called, in ms
+		void setReportPeriod(unsigned milliseconds) { reportPeriod = milliseconds; }
+		//! See BootloaderInterface::setSkipUnchangedPages()
+		void setSkipUnchangedPages(bool skip) { skipUnchangedPages = skip; }
+		//! See BootloaderInterface::setPagesInFlight()
+		void setPagesInFlight(unsigned count) { pagesInFlight = count; }
+		
+		//! Write hexFileName to all nodes, using the simple protocol if simple is true; return whether all nodes were flashed
+		bool run(const std::string& hexFileName, bool reset, bool simple);
+		
+		//! Return a copy of the status of all nodes, can be called while run() is in progress
+		NodeStatuses getStatuses() const;
+	
+	protected:
+		//! Called from run() every report period and once at the end, with the time elapsed since the start, in ms
+		virtual void reportProgress(const NodeStatuses& statuses, unsigned elapsed) {}
+	
+	protected:
+		class Connection;
+		class DirectConnection;
+		class Session;
+		class Interface;
+		friend class Connection;
+		friend class DirectConnection;
+		friend class Session;
+		friend class Interface;
+		
+		//! Flash the node of session, with retries; called from the thread of the session
+		void flashNode(Session* session);
+	
+	protected:
+		unsigned attempts;
+		unsigned timeout;
+		unsigned reportPeriod;
+		bool skipUnchangedPages;
+		unsigned pagesInFlight;
+		
+		// state of a run
+		std::string hexFileName;
+		bool reset;
+		bool simple;
+		std::map<std::string, Connection*> connections; //!< shared connections, by target
+		std::vector<Session*> sessions;
+		
+		mutable pthread_mutex_t mutex; //!< protects statuses and runningSessions
+		pthread_cond_t condition; //!< signaled when a session ends
+		NodeStatuses statuses;
+		unsigned runningSessions;
+	};
+	
+	/*@}*/
+} // namespace Aseba
+
+#endif // ASEBA_FLASH_ORCHESTRATOR_H
@@ -0,0 +1,267 @@
+/*
+	Aseba - an event-based framework for distributed robot control
+	Copyright (C) 2007--2012:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+		and other contributors, see authors.txt for details
+	
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+	
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dashel/dashel.h>
+#include "../../common/consts.h"
+#include "../../common/utils/HexFile.h"
+#include "../../common/utils/BootloaderInterface.h"
+#include "../../transport/dashel_plugins/dashel-plugins.h"
+#include "FlashOrchestrator.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <utility>
+#include <cstring>
+#include <cstdlib>
+
+namespace Aseba
+{
+	using namespace std;
+	
+	//! Show usage
+	void dumpHelp(ostream &stream, const char *programName)
+	{
+		stream << "Aseba multiflash, upgrade the firmware of many nodes in parallel, usage:\n";
+		stream << programName << " [options] [-t target -n nodes] ... [-t target -n nodes] HEX_FILE\n";
+		stream << "Options:\n";
+		stream << "    -t, --target TARGET     : connect to TARGET (default: " ASEBA_DEFAULT_TARGET ")\n";
+		stream << "    -n, --nodes IDS         : flash nodes IDS through the last target, for instance 1,4,10-20\n";
+		stream << "    -u, --simple            : use the simple protocol, every target leads directly to a\n";
+		stream << "                              single node, such as a Thymio II on a serial port (default id: 1)\n";
+		stream << "    -a, --attempts N        : try each node up to N times (default: 3)\n";
+		stream << "    -w, --timeout MS        : fail an attempt when a node is silent for MS ms (default: 5000)\n";
+		stream << "    -s, --skip-unchanged    : read pages back and only write the changed ones\n";
+		stream << "    -p, --pages-in-flight N : with the simple protocol, write up to N pages before waiting\n";
+		stream << "                              for an acknowledgement, the bootloader must process commands\n";
+		stream << "                              in order\n";
+		stream << "    -h, --help              : shows this help\n";
+		stream << "    -V, --version           : shows the version number\n";
+		stream << "Report bugs to: aseba-dev@gna.org" << std::endl;
+	}
+	
+	//! Show version
+	void dumpVersion(std::ostream &stream)
+	{
+		stream << "Aseba multiflash " << ASEBA_VERSION << std::endl;
+		stream << "Aseba protocol " << ASEBA_PROTOCOL_VERSION << std::endl;
+		stream << "Licence LGPLv3: GNU LGPL version 3 <http://www.gnu.org/licenses/lgpl.html>\n";
+	}
+	
+	//! Produce an error message and dump help and quit
+	void errorMissingArgument(const char *programName)
+	{
+		cerr << "Error, missing argument.\n";
+		dumpHelp(cerr, programName);
+		exit(4);
+	}
+	
+	//! Produce an error message and quit
+	void errorInvalidNodes(const char *nodes)
+	{
+		cerr << "Error, invalid list of nodes " << nodes << ", expected for instance 1,4,10-20" << endl;
+		exit(5);
+	}
+	
+	//! Parse a list of node ids such as 1,4,10-20, quit on error
+	vector<unsigned> parseNodes(const char *nodes)
+	{
+		vector<unsigned> ids;
+		const char *p = nodes;
+		while (*p)
+		{
+			char *end;
+			const unsigned long first = strtoul(p, &end, 10);
+			unsigned long last = first;
+			if (end == p)
+				errorInvalidNodes(nodes);
+			p = end;
+			if (*p == '-')
+			{
+				last = strtoul(p + 1, &end, 10);
+				if (end == p + 1 || last < first)
+					errorInvalidNodes(nodes);
+				p = end;
+			}
+			for (unsigned long id = first; id <= last; ++id)
+				ids.push_back(id);
+			if (*p == ',')
+				++p;
+			else if (*p)
+				errorInvalidNodes(nodes);
+		}
+		return ids;
+	}
+	
+	//! Print the progress of all nodes on the standard output
+	class CmdFlashOrchestrator: public FlashOrchestrator
+	{
+	protected:
+		virtual void reportProgress(const NodeStatuses& statuses, unsigned elapsed)
+		{
+			unsigned done(0), failed(0), pagesWritten(0), pagesSkipped(0), bytesWritten(0), retried(0);
+			for (size_t i = 0; i < statuses.size(); ++i)
+			{
+				const NodeStatus& status(statuses[i]);
+				if (status.state == NodeStatus::DONE)
+					++done;
+				else if (status.state == NodeStatus::FAILED)
+					++failed;
+				if (status.attempts > 1)
+					++retried;
+				pagesWritten += status.pagesWritten;
+				pagesSkipped += status.pagesSkipped;
+				bytesWritten += status.bytesWritten;
+			}
+			const double seconds(elapsed / 1000.);
+			cout << fixed << setprecision(1) << seconds << " s: ";
+			cout << done << "/" << statuses.size() << " nodes done, " << failed << " failed, " << retried << " retried, ";
+			cout << pagesWritten << " pages written, " << pagesSkipped << " skipped, ";
+			cout << (seconds > 0 ? bytesWritten / seconds / 1024. : 0.) << " kB/s" << endl;
+		}
+	};
+	
+	//! Print the outcome of every node
+	void dumpStatuses(ostream &stream, const FlashOrchestrator::NodeStatuses& statuses)
+	{
+		for (size_t i = 0; i < statuses.size(); ++i)
+		{
+			const FlashOrchestrator::NodeStatus& status(statuses[i]);
+			stream << status.target << " node " << status.dest << ": ";
+			if (status.state == FlashOrchestrator::NodeStatus::DONE)
+				stream << "done";
+			else
+				stream << "FAILED";
+			stream << " after " << status.attempts << " attempt(s) in " << fixed << setprecision(1) << status.duration / 1000. << " s, ";
+			stream << status.pagesWritten << " of " << status.pagesCount << " pages written, " << status.pagesSkipped << " skipped";
+			if (!status.error.empty())
+				stream << ", last error: " << status.error;
+			stream << endl;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	Dashel::initPlugins();
+	
+	Aseba::CmdFlashOrchestrator orchestrator;
+	// targets in the order given, and whether nodes were given for them
+	std::vector<std::pair<std::string, bool> > targets;
+	bool simple(false);
+	const char *hexFileName(0);
+	
+	int argCounter = 1;
+	while (argCounter < argc)
+	{
+		const char *arg = argv[argCounter];
+		if ((strcmp(arg, "-t") == 0) || (strcmp(arg, "--target") == 0))
+		{
+			if (++argCounter >= argc)
+				Aseba::errorMissingArgument(argv[0]);
+			targets.push_back(std::make_pair(std::string(argv[argCounter]), false));
+		}
+		else if ((strcmp(arg, "-n") == 0) || (strcmp(arg, "--nodes") == 0))
+		{
+			if (++argCounter >= argc)
+				Aseba::errorMissingArgument(argv[0]);
+			if (targets.empty())
+				targets.push_back(std::make_pair(std::string(ASEBA_DEFAULT_TARGET), false));
+			const std::vector<unsigned> nodes(Aseba::parseNodes(argv[argCounter]));
+			for (size_t i = 0; i < nodes.size(); ++i)
+				orchestrator.addNode(targets.back().first, nodes[i]);
+			targets.back().second = true;
+		}
+		else if ((strcmp(arg, "-u") == 0) || (strcmp(arg, "--simple") == 0))
+		{
+			simple = true;
+		}
+		else if ((strcmp(arg, "-a") == 0) || (strcmp(arg, "--attempts") == 0))
+		{
+			if (++argCounter >= argc)
+				Aseba::errorMissingArgument(argv[0]);
+			orchestrator.setAttempts(atoi(argv[argCounter]));
+		}
+		else if ((strcmp(arg, "-w") == 0) || (strcmp(arg, "--timeout") == 0))
+		{
+			if (++argCounter >= argc)
+				Aseba::errorMissingArgument(argv[0]);
+			orchestrator.setTimeout(atoi(argv[argCounter]));
+		}
+		else if ((strcmp(arg, "-s") == 0) || (strcmp(arg, "--skip-unchanged") == 0))
+		{
+			orchestrator.setSkipUnchangedPages(true);
+		}
+		else if ((strcmp(arg, "-p") == 0) || (strcmp(arg, "--pages-in-flight") == 0))
+		{
+			if (++argCounter >= argc)
+				Aseba::errorMissingArgument(argv[0]);
+			orchestrator.setPagesInFlight(atoi(argv[argCounter]));
+		}
+		else if ((strcmp(arg, "-h") == 0) || (strcmp(arg, "--help") == 0))
+		{
+			Aseba::dumpHelp(std::cout, argv[0]);
+			return 0;
+		}
+		else if ((strcmp(arg, "-V") == 0) || (strcmp(arg, "--version") == 0))
+		{
+			Aseba::dumpVersion(std::cout);
+			return 0;
+		}
+		else
+			hexFileName = arg;
+		argCounter++;
+	}
+	if (!hexFileName)
+		Aseba::errorMissingArgument(argv[0]);
+	if (targets.empty())
+		targets.push_back(std::make_pair(std::string(ASEBA_DEFAULT_TARGET), false));
+	
+	// with the simple protocol, a target without nodes leads to a Thymio II, whose id is 1
+	for (size_t i = 0; i < targets.size(); ++i)
+	{
+		if (targets[i].second)
+			continue;
+		if (!simple)
+		{
+			std::cerr << "Error, no nodes given for target " << targets[i].first << std::endl;
+			return 4;
+		}
+		orchestrator.addNode(targets[i].first, 1);
+	}
+	
+	bool success(false);
+	try
+	{
+		success = orchestrator.run(hexFileName, true, simple);
+	}
+	catch (Aseba::HexFile::Error& e)
+	{
+		std::cerr << "HEX file error: " << e.toString() << std::endl;
+		return 10;
+	}
+	catch (Aseba::BootloaderInterface::Error& e)
+	{
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 9;
+	}
+	
+	Aseba::dumpStatuses(std::cout, orchestrator.getStatuses());
+	return success ? 0 : 1;
+}
@@ -384,6 +384,11 @@ namespace Aseba
 		}
 	}
 	
+	void SignalingDescriptionsManager::requestNodeDescription(unsigned nodeId)
+	{
+		emit nodeDescriptionRequestedSignal(nodeId);
+	}
+	
 	void SignalingDescriptionsManager::nodeDescriptionReceived(unsigned nodeId)
 	{
 		emit nodeDescriptionReceivedSignal(nodeId);
@@ -415,11 +420,21 @@ namespace Aseba
 		connect(&dashelInterface, SIGNAL(messageAvailable(Message *)), SLOT(messageFromDashel(Message *)), Qt::QueuedConnection);
 		connect(&dashelInterface, SIGNAL(dashelDisconnection()), SLOT(disconnectionFromDashel()), Qt::QueuedConnection);
 		
-		// we also connect to the description manager to know when we have a new node available
+		// we also connect to the description manager to request descriptions and to know when we have a new node available
+		connect(&descriptionManager, SIGNAL(nodeDescriptionRequestedSignal(unsigned)), SLOT(requestNodeDescription(unsigned)));
 		connect(&descriptionManager, SIGNAL(nodeDescriptionReceivedSignal(unsigned)), SLOT(nodeDescriptionReceived(unsigned)));
 		
+		// keep the descriptions of nodes across runs, so that reconnecting to known nodes does not wait for them
+		#if QT_VERSION >= 0x040500
+		const QString descriptionsDirectory(QDir(QDesktopServices::storageLocation(QDesktopServices::CacheLocation)).filePath("descriptions"));
+		if (QDir().mkpath(descriptionsDirectory))
+			descriptionManager.setDiskCache(QFile::encodeName(descriptionsDirectory).constData());
+		#endif // QT_VERSION >= 0x040500
+		
 		messagesHandlersMap[ASEBA_MESSAGE_DISCONNECTED] = &Aseba::DashelTarget::receivedDisconnected;
 		messagesHandlersMap[ASEBA_MESSAGE_VARIABLES] = &Aseba::DashelTarget::receivedVariables;
+		messagesHandlersMap[ASEBA_MESSAGE_VARIABLES_DELTA] = &Aseba::DashelTarget::receivedVariablesDelta;
+		messagesHandlersMap[ASEBA_MESSAGE_VARIABLES_UNSUBSCRIBED] = &Aseba::DashelTarget::receivedVariablesUnsubscribed;
 		messagesHandlersMap[ASEBA_MESSAGE_ARRAY_ACCESS_OUT_OF_BOUNDS] = &Aseba::DashelTarget::receivedArrayAccessOutOfBounds;
 		messagesHandlersMap[ASEBA_MESSAGE_DIVISION_BY_ZERO] = &Aseba::DashelTarget::receivedDivisionByZero;
 		messagesHandlersMap[ASEBA_MESSAGE_EVENT_EXECUTION_KILLED] = &Aseba::DashelTarget::receivedEventExecutionKilled;
@@ -508,7 +523,7 @@ namespace Aseba
 			// send bytecode
 			try
 			{
-				sendBytecode(dashelInterface.stream, node, std::vector<uint16>(bytecode.begin(), bytecode.end()));
+				bytecodeUploader.sendBytecode(dashelInterface.stream, node, std::vector<uint16>(bytecode.begin(), bytecode.end()));
 				dashelInterface.stream->flush();
 				dashelInterface.unlock();
 			}
@@ -551,6 +566,7 @@ namespace Aseba
 			try
 			{
 				Reboot(node).serialize(dashelInterface.stream);
+				bytecodeUploader.forget(node);
 				dashelInterface.stream->flush();
 				dashelInterface.unlock();
 			}
@@ -636,6 +652,48 @@ namespace Aseba
 			dashelInterface.unlock();
 	}
 	
+	void DashelTarget::subscribeVariables(unsigned node, unsigned start, unsigned length, unsigned period, bool onChange)
+	{
+		dashelInterface.lock();
+		if (dashelInterface.stream && !writeBlocked)
+		{
+			try
+			{
+				SubscribeVariables(node, start, length, period, onChange).serialize(dashelInterface.stream);
+				dashelInterface.stream->flush();
+				dashelInterface.unlock();
+			}
+			catch(Dashel::DashelException e)
+			{
+				dashelInterface.unlock();
+				handleDashelException(e);
+			}
+		}
+		else
+			dashelInterface.unlock();
+	}
+	
+	void DashelTarget::unsubscribeVariables(unsigned node, unsigned start, unsigned length)
+	{
+		dashelInterface.lock();
+		if (dashelInterface.stream && !writeBlocked)
+		{
+			try
+			{
+				UnsubscribeVariables(node, start, length).serialize(dashelInterface.stream);
+				dashelInterface.stream->flush();
+				dashelInterface.unlock();
+			}
+			catch(Dashel::DashelException e)
+			{
+				dashelInterface.unlock();
+				handleDashelException(e);
+			}
+		}
+		else
+			dashelInterface.unlock();
+	}
+	
 	void DashelTarget::reset(unsigned node)
 	{
 		dashelInterface.lock();
@@ -873,6 +931,8 @@ namespace Aseba
 		
 		// let the description manager filter the message
 		descriptionManager.processMessage(message);
+		// and the bytecode uploader, as the bytecode of nodes might have changed
+		bytecodeUploader.processMessage(message);
 		
 		// see if we have a registered handler for this message
 		MessagesHandlersMap::const_iterator messageHandler = messagesHandlersMap.find(message->type);
@@ -940,12 +1000,34 @@ namespace Aseba
 		emit networkDisconnected();
 		nodes.clear();
 		descriptionManager.reset();
+		bytecodeUploader.reset();
 		
 		// show a dialog box that is trying to reconnect
 		ReconnectionDialog reconnectionDialog(dashelInterface);
 		reconnectionDialog.exec();
 	}
 	
+	void DashelTarget::requestNodeDescription(unsigned node)
+	{
+		dashelInterface.lock();
+		if (dashelInterface.stream && !writeBlocked)
+		{
+			try
+			{
+				GetNodeDescription(node).serialize(dashelInterface.stream);
+				dashelInterface.stream->flush();
+				dashelInterface.unlock();
+			}
+			catch(Dashel::DashelException e)
+			{
+				dashelInterface.unlock();
+				handleDashelException(e);
+			}
+		}
+		else
+			dashelInterface.unlock();
+	}
+	
 	void DashelTarget::nodeDescriptionReceived(unsigned nodeId)
 	{
 		Node& node = nodes[nodeId];
@@ -962,6 +1044,20 @@ namespace Aseba
 		emit variablesMemoryChanged(variables->source, variables->start, variables->variables);
 	}
 	
+	void DashelTarget::receivedVariablesDelta(Message *message)
+	{
+		VariablesDelta *delta = polymorphic_downcast<VariablesDelta *>(message);
+		// the variables not in a run are unchanged, so the memory is up to date once the runs are copied
+		for (size_t i = 0; i < delta->runs.size(); ++i)
+			emit variablesMemoryChanged(delta->source, delta->runs[i].start, delta->runs[i].variables);
+	}
+	
+	void DashelTarget::receivedVariablesUnsubscribed(Message *message)
+	{
+		VariablesUnsubscribed *unsubscribed = polymorphic_downcast<VariablesUnsubscribed *>(message);
+		emit variablesUnsubscribed(unsubscribed->source, unsubscribed->start, unsubscribed->length, unsubscribed->reason);
+	}
+	
 	void DashelTarget::receivedArrayAccessOutOfBounds(Message *message)
 	{
 		ArrayAccessOutOfBounds *aa = polymorphic_downcast<ArrayAccessOutOfBounds *>(message);
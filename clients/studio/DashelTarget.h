@@ -24,6 +24,7 @@
 #include "Target.h"
 #include "../../common/consts.h"
 #include "../../common/msg/descriptions-manager.h"
+#include "../../common/msg/bytecode-uploader.h"
 #include <QString>
 #include <QDialog>
 #include <QQueue>
@@ -122,10 +123,12 @@ namespace Aseba
 		Q_OBJECT
 	
 	signals:
+		void nodeDescriptionRequestedSignal(unsigned nodeId);
 		void nodeDescriptionReceivedSignal(unsigned nodeId);
 	
 	protected:
 		virtual void nodeProtocolVersionMismatch(const std::wstring &nodeName, uint16 protocolVersion);
+		virtual void requestNodeDescription(unsigned nodeId);
 		virtual void nodeDescriptionReceived(unsigned nodeId);
 	};
 	
@@ -155,6 +158,7 @@ namespace Aseba
 		
 		QQueue<UserMessage *> userEventsQueue;
 		SignalingDescriptionsManager descriptionManager;
+		BytecodeUploader bytecodeUploader; //!< only sends the bytecode that changed since the last upload
 		NodesMap nodes;
 		QTimer userEventsTimer;
 		bool writeBlocked; //!< true if write is being blocked by invasive plugins, false if write is allowed
@@ -180,6 +184,8 @@ namespace Aseba
 		
 		virtual void setVariables(unsigned node, unsigned start, const VariablesDataVector &data);
 		virtual void getVariables(unsigned node, unsigned start, unsigned length);
+		virtual void subscribeVariables(unsigned node, unsigned start, unsigned length, unsigned period, bool onChange);
+		virtual void unsubscribeVariables(unsigned node, unsigned start, unsigned length);
 		
 		virtual void reset(unsigned node);
 		virtual void run(unsigned node);
@@ -199,6 +205,7 @@ namespace Aseba
 		void updateUserEvents();
 		void messageFromDashel(Message *message);
 		void disconnectionFromDashel();
+		void requestNodeDescription(unsigned node);
 		void nodeDescriptionReceived(unsigned node);
 	
 	protected:
@@ -207,6 +214,8 @@ namespace Aseba
 		void receivedNativeFunctionDescription(Message *message);
 		void receivedDisconnected(Message *message);
 		void receivedVariables(Message *message);
+		void receivedVariablesDelta(Message *message);
+		void receivedVariablesUnsubscribed(Message *message);
 		void receivedArrayAccessOutOfBounds(Message *message);
 		void receivedDivisionByZero(Message *message);
 		void receivedEventExecutionKilled(Message *message);
@@ -31,6 +31,8 @@
 #include "../../common/consts.h"
 #include "../../common/productids.h"
 #include "../../common/utils/utils.h"
+#include "../../compiler/batch/BatchCompiler.h"
+#include "../../vm/vm.h"
 #include <QtGui>
 #include <QtXml>
 #include <sstream>
@@ -316,7 +318,7 @@ namespace Aseba
 	
 	//////
 	
-	NodeTab::CompilationResult* compilationThread(const TargetDescription targetDescription, const CommonDefinitions commonDefinitions, QString source, bool dump);
+	NodeTab::CompilationResult* compilationThread(Compiler* compiler, const TargetDescription targetDescription, const CommonDefinitions commonDefinitions, QString source, bool dump);
 	
 	NodeTab::NodeTab(MainWindow* mainWindow, Target *target, const CommonDefinitions *commonDefinitions, int id, QWidget *parent) :
 		QSplitter(parent),
@@ -377,7 +379,8 @@ namespace Aseba
 		
 		// get the value of the variables
 		// compile in this thread the first time
-		NodeTab::CompilationResult* result = compilationThread(*target->getDescription(id), *commonDefinitions, editor->toPlainText(), false);
+		compiler.setIncrementalCompilation(true);
+		NodeTab::CompilationResult* result = compilationThread(&compiler, *target->getDescription(id), *commonDefinitions, editor->toPlainText(), false);
 		processCompilationResult(result);
 	}
 
@@ -632,12 +635,17 @@ namespace Aseba
 	void NodeTab::timerEvent ( QTimerEvent * event )
 	{
 		if (mainWindow->nodes->currentWidget() != this)
+		{
+			// nothing is visible, stop the node from sending variables
+			unsubscribeVariables();
 			return;
+		}
 			
 		// only fetch what is visible
 		const QList<TargetVariablesModel::Variable> variables(variablesModel->getVariables());
 		assert(variables.size() == variablesModel->rowCount());
 		
+		QList<VariablesRange> visibleRanges;
 		unsigned currentReqCount(0);
 		unsigned currentReqPos(0);
 		for (int i = 0; i < variables.size(); ++i)
@@ -663,7 +671,7 @@ namespace Aseba
 				else
 				{
 					// flush and reset
-					target->getVariables(id, currentReqPos, currentReqCount);
+					visibleRanges.append(VariablesRange(currentReqPos, currentReqCount));
 					// new request
 					currentReqPos = var.pos;
 					currentReqCount = var.value.size();
@@ -673,10 +681,47 @@ namespace Aseba
 		if (currentReqCount != 0)
 		{
 			// flush request
-			target->getVariables(id, currentReqPos, currentReqCount);
+			visibleRanges.append(VariablesRange(currentReqPos, currentReqCount));
+		}
+		
+		// stop the node from sending the ranges that are not visible anymore
+		for (int i = 0; i < subscribedRanges.size();)
+		{
+			if (visibleRanges.contains(subscribedRanges[i]))
+				++i;
+			else
+			{
+				target->unsubscribeVariables(id, subscribedRanges[i].first, subscribedRanges[i].second);
+				subscribedRanges.removeAt(i);
+			}
+		}
+		
+		// the node sends the subscribed ranges by itself when they change, poll the others, leaving room for other clients;
+		// as the node drops subscriptions that are not renewed, those it drops are subscribed again here
+		const int maxSubscribedRanges(ASEBA_MAX_SUBSCRIPTIONS / 4);
+		for (int i = 0; i < visibleRanges.size(); ++i)
+		{
+			const VariablesRange& range(visibleRanges[i]);
+			if (subscribedRanges.contains(range))
+				continue;
+			if (subscribedRanges.size() < maxSubscribedRanges && !polledRanges.contains(range))
+			{
+				target->subscribeVariables(id, range.first, range.second, 200, true);
+				subscribedRanges.append(range);
+			}
+			else
+				target->getVariables(id, range.first, range.second);
 		}
 	}
 	
+	void NodeTab::unsubscribeVariables()
+	{
+		for (int i = 0; i < subscribedRanges.size(); ++i)
+			target->unsubscribeVariables(id, subscribedRanges[i].first, subscribedRanges[i].second);
+		subscribedRanges.clear();
+		polledRanges.clear();
+	}
+	
 	void NodeTab::variableValueUpdated(const QString& name, const VariablesDataVector& values)
 	{
 		if ((name == ASEBA_PID_VAR_NAME) && (values.size() >= 1))
@@ -800,6 +845,7 @@ namespace Aseba
 		{
 			refreshMemoryButton->setEnabled(true);
 			killTimer(refreshTimer);
+			unsubscribeVariables();
 			refreshMemoryClicked();
 		}
 	}
@@ -1024,26 +1070,51 @@ namespace Aseba
 
 	}
 	
-	NodeTab::CompilationResult* compilationThread(const TargetDescription targetDescription, const CommonDefinitions commonDefinitions, QString source, bool dump)
+	//! Successful compilations shared by all tabs, so that a program loaded to several identical nodes is only compiled once
+	static BatchCompiler compilationCache;
+	
+	//! Compile source with compiler, which is only used by one compilation at a time and reuses the bytecode of what did not change
+	NodeTab::CompilationResult* compilationThread(Compiler* compiler, const TargetDescription targetDescription, const CommonDefinitions commonDefinitions, QString source, bool dump)
 	{
 		NodeTab::CompilationResult* result(new NodeTab::CompilationResult(dump));
 		
-		Compiler compiler;
-		compiler.setTargetDescription(&targetDescription);
-		compiler.setCommonDefinitions(&commonDefinitions);
-		compiler.setTranslateCallback(CompilerTranslator::translate);
+		// the cache does not keep compilation messages, so a dump always compiles
+		const BatchCompiler::Job job(&targetDescription, source.toStdWString());
+		CompiledProgram program;
+		if (!dump && compilationCache.findInCache(job, commonDefinitions, program))
+		{
+			result->success = program.success;
+			result->bytecode = program.bytecode;
+			result->allocatedVariablesCount = program.allocatedVariablesCount;
+			result->variablesMap = program.variablesMap;
+			result->subroutineTable = program.subroutineTable;
+			result->error = program.error;
+			return result;
+		}
+		
+		compiler->setTargetDescription(&targetDescription);
+		compiler->setCommonDefinitions(&commonDefinitions);
+		compiler->setTranslateCallback(CompilerTranslator::translate);
 		
 		std::wistringstream is(source.toStdWString());
 		
 		if (dump)
-			result->success = compiler.compile(is, result->bytecode, result->allocatedVariablesCount, result->error, &result->compilationMessages);
+			result->success = compiler->compile(is, result->bytecode, result->allocatedVariablesCount, result->error, &result->compilationMessages);
 		else
-			result->success = compiler.compile(is, result->bytecode, result->allocatedVariablesCount, result->error);
+			result->success = compiler->compile(is, result->bytecode, result->allocatedVariablesCount, result->error);
 		
 		if (result->success)
 		{
-			result->variablesMap = *compiler.getVariablesMap();
-			result->subroutineTable = *compiler.getSubroutineTable();
+			result->variablesMap = *compiler->getVariablesMap();
+			result->subroutineTable = *compiler->getSubroutineTable();
+			
+			// most keystrokes give programs that do not compile, only keep the ones that do
+			program.success = true;
+			program.bytecode = result->bytecode;
+			program.allocatedVariablesCount = result->allocatedVariablesCount;
+			program.variablesMap = result->variablesMap;
+			program.subroutineTable = result->subroutineTable;
+			compilationCache.addToCache(job, commonDefinitions, program);
 		}
 		
 		return result;
@@ -1057,7 +1128,7 @@ namespace Aseba
 		else
 		{
 			bool dump(mainWindow->nodes->currentWidget() == this);
-			compilationFuture = QtConcurrent::run(compilationThread, *target->getDescription(id), *commonDefinitions, editor->toPlainText(), dump);
+			compilationFuture = QtConcurrent::run(compilationThread, &compiler, *target->getDescription(id), *commonDefinitions, editor->toPlainText(), dump);
 			compilationWatcher.setFuture(compilationFuture);
 			compilationDirty = false;
 			
@@ -1263,6 +1334,16 @@ namespace Aseba
 		vmMemoryModel->setVariablesData(start, variables);
 	}
 	
+	void NodeTab::variablesUnsubscribed(unsigned start, unsigned length, unsigned reason)
+	{
+		// the next auto refresh subscribes again, unless the node has no room, in which case it polls
+		const VariablesRange range(start, length);
+		if (!subscribedRanges.removeOne(range))
+			return;
+		if (reason == ASEBA_UNSUBSCRIBED_NO_ROOM)
+			polledRanges.append(range);
+	}
+	
 	void NodeTab::setBreakpoint(unsigned line)
 	{
 		rehighlight();
@@ -2843,6 +2924,14 @@ namespace Aseba
 		tab->vmMemoryModel->setVariablesData(start, variables);
 	}
 	
+	//! A node stopped sending some variables by itself
+	void MainWindow::variablesUnsubscribed(unsigned node, unsigned start, unsigned length, unsigned reason)
+	{
+		NodeTab* tab = getTabFromId(node);
+		if (tab)
+			tab->variablesUnsubscribed(start, length, reason);
+	}
+	
 	//! The result of a set breakpoint is known
 	void MainWindow::breakpointSetResult(unsigned node, unsigned line, bool success)
 	{
@@ -3210,6 +3299,7 @@ namespace Aseba
 		connect(target, SIGNAL(variablesMemoryEstimatedDirty(unsigned)), SLOT(variablesMemoryEstimatedDirty(unsigned)));
 		
 		connect(target, SIGNAL(variablesMemoryChanged(unsigned, unsigned, const VariablesDataVector &)), SLOT(variablesMemoryChanged(unsigned, unsigned, const VariablesDataVector &)));
+		connect(target, SIGNAL(variablesUnsubscribed(unsigned, unsigned, unsigned, unsigned)), SLOT(variablesUnsubscribed(unsigned, unsigned, unsigned, unsigned)));
 		
 		connect(target, SIGNAL(breakpointSetResult(unsigned, unsigned, bool)), SLOT(breakpointSetResult(unsigned, unsigned, bool)));
 	}
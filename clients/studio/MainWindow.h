@@ -219,6 +219,7 @@ namespace Aseba
 		unsigned productId() const  { return pid; }
 		
 		void variablesMemoryChanged(unsigned start, const VariablesDataVector &variables);
+		void variablesUnsubscribed(unsigned start, unsigned length, unsigned reason);
 		
 	signals:
 		void uploadReadynessChanged(bool);
@@ -226,6 +227,7 @@ namespace Aseba
 	protected:
 		virtual void timerEvent ( QTimerEvent * event );
 		virtual void variableValueUpdated(const QString& name, const VariablesDataVector& values);
+		void unsubscribeVariables();
 		void setupWidgets();
 		void setupConnections();
 		virtual SavedPlugins savePlugins() const;
@@ -351,6 +353,9 @@ namespace Aseba
 		NodeToolInterfaces tools;
 		
 		int refreshTimer; //!< id of timer for auto refresh of variables, if active
+		typedef QPair<unsigned, unsigned> VariablesRange;
+		QList<VariablesRange> subscribedRanges; //!< start and length of the variables the node sends by itself during auto refresh
+		QList<VariablesRange> polledRanges; //!< ranges the node had no room to send by itself, polled until auto refresh stops
 		
 		QString lastCompiledSource; //!< content of last source considered for compilation following a textChanged signal
 		int errorPos; //!< position of last error, -1 if compilation was success
@@ -358,6 +363,7 @@ namespace Aseba
 		Target::ExecutionMode previousMode;
 		bool showHidden;
 		
+		Compiler compiler; //!< compiler kept across compilations, so that it only recompiles what changed
 		QFuture<CompilationResult*> compilationFuture;
 		QFutureWatcher<CompilationResult*> compilationWatcher;
 		bool compilationDirty;
@@ -473,6 +479,7 @@ namespace Aseba
 		void variablesMemoryEstimatedDirty(unsigned node);
 		
 		void variablesMemoryChanged(unsigned node, unsigned start, const VariablesDataVector &variables);
+		void variablesUnsubscribed(unsigned node, unsigned start, unsigned length, unsigned reason);
 		
 		void breakpointSetResult(unsigned node, unsigned line, bool success);
 	
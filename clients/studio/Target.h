@@ -83,6 +83,9 @@ namespace Aseba
 		//! The content of the variables memory of a node has changed.
 		void variablesMemoryChanged(unsigned node, unsigned start, const VariablesDataVector &variables);
 		
+		//! A node stopped sending some variables by itself, for a reason of AsebaUnsubscribedReasons
+		void variablesUnsubscribed(unsigned node, unsigned start, unsigned length, unsigned reason);
+		
 		//! The result of a set breakpoint call
 		void breakpointSetResult(unsigned node, unsigned line, bool success);
 		
@@ -130,6 +133,12 @@ namespace Aseba
 		//! Get part of variables memory
 		virtual void getVariables(unsigned node, unsigned start, unsigned length) = 0;
 		
+		//! Ask a node to send part of variables memory by itself, every period ms or, if onChange, only when it changed
+		virtual void subscribeVariables(unsigned node, unsigned start, unsigned length, unsigned period, bool onChange) = 0;
+		
+		//! Stop a node from sending part of variables memory by itself
+		virtual void unsubscribeVariables(unsigned node, unsigned start, unsigned length) = 0;
+		
 		// execution
 		
 		//! Reset the execution of a node, do not clear bytecode nor breakpoints
@@ -47,6 +47,12 @@ namespace Aseba
 		emit flashProgress((100*pagesDoneCount)/pagesCount);
 	}
 	
+	void QtBootloaderInterface::writePageSkipped(unsigned pageNumber)
+	{
+		pagesDoneCount += 1;
+		emit flashProgress((100*pagesDoneCount)/pagesCount);
+	}
+	
 	void QtBootloaderInterface::errorWritePageNonFatal(unsigned pageNumber)
 	{
 		qDebug() << "Warning, error while writing page" << pageNumber << "continuing ...";
@@ -162,6 +168,8 @@ namespace Aseba
 		{
 			QtBootloaderInterface bootloaderInterface(stream, 1);
 			connect(&bootloaderInterface, SIGNAL(flashProgress(int)), this, SLOT(flashProgress(int)), Qt::QueuedConnection);
+			// only write the pages that differ from the firmware already on the robot
+			bootloaderInterface.setSkipUnchangedPages(true);
 			bootloaderInterface.writeHex(hexFileName, true, true);
 		}
 		catch (HexFile::Error& e)
@@ -30,6 +30,7 @@ namespace Aseba
 	protected:
 		virtual void writeHexGotDescription(unsigned pagesCount);
 		virtual void writePageStart(unsigned pageNumber, const uint8* data, bool simple);
+		virtual void writePageSkipped(unsigned pageNumber);
 		virtual void errorWritePageNonFatal(unsigned pageNumber);
 	
 	protected:
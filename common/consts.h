@@ -33,7 +33,7 @@
 #define ASEBA_VERSION_INT 10301
 
 /*! version of aseba protocol, including bytecodes types and constants */
-#define ASEBA_PROTOCOL_VERSION 4
+#define ASEBA_PROTOCOL_VERSION 8
 
 /*! default listen target for aseba */
 #define ASEBA_DEFAULT_LISTEN_TARGET "tcpin:33333"
@@ -163,6 +163,10 @@ typedef enum
 	ASEBA_MESSAGE_NODE_SPECIFIC_ERROR,
 	ASEBA_MESSAGE_EXECUTION_STATE_CHANGED,
 	ASEBA_MESSAGE_BREAKPOINT_SET_RESULT,
+	ASEBA_MESSAGE_VARIABLES_DELTA,
+	ASEBA_MESSAGE_DESCRIPTION_HASH,
+	ASEBA_MESSAGE_PACKED_DESCRIPTION,
+	ASEBA_MESSAGE_VARIABLES_UNSUBSCRIBED,
 	
 	/* from IDE to all nodes */
 	ASEBA_MESSAGE_GET_DESCRIPTION = 0xA000,
@@ -183,6 +187,9 @@ typedef enum
 	ASEBA_MESSAGE_WRITE_BYTECODE,
 	ASEBA_MESSAGE_REBOOT,
 	ASEBA_MESSAGE_SUSPEND_TO_RAM,
+	ASEBA_MESSAGE_SUBSCRIBE_VARIABLES,
+	ASEBA_MESSAGE_UNSUBSCRIBE_VARIABLES,
+	ASEBA_MESSAGE_GET_NODE_DESCRIPTION,
 	
 	ASEBA_MESSAGE_INVALID = 0xFFFF
 } AsebaSystemMessagesTypes;
@@ -194,6 +201,14 @@ typedef enum
 	ASEBA_DEST_INVALID = 0xFFFF
 } AsebaMessagesDests;
 
+/*! Why a node stopped sending some variables by itself, see ASEBA_MESSAGE_VARIABLES_UNSUBSCRIBED */
+typedef enum
+{
+	ASEBA_UNSUBSCRIBED_BY_CLIENT = 0,	/*!< a client asked so */
+	ASEBA_UNSUBSCRIBED_NO_ROOM,	/*!< a newer subscription took its place, clients should poll these variables */
+	ASEBA_UNSUBSCRIBED_EXPIRED	/*!< no client renewed the subscription in time, clients still interested should subscribe again */
+} AsebaUnsubscribedReasons;
+
 /*! Limits for static buffers allocation */
 typedef enum
 {
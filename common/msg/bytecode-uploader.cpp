@@ -0,0 +1,109 @@
+/*
+	Aseba - an event-based framework for distributed robot control
+	Copyright (C) 2007--2012:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+		and other contributors, see authors.txt for details
+	
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+	
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "bytecode-uploader.h"
+#include "../consts.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace Aseba
+{
+	void BytecodeUploader::processMessage(const Message* message)
+	{
+		// the node might have restarted or be another one with the same identifier,
+		// nodes announce themselves with their description or, if asked for presence only, with its hash
+		if (dynamic_cast<const Description *>(message) || dynamic_cast<const DescriptionHash *>(message) || dynamic_cast<const Disconnected *>(message))
+		{
+			forget(message->source);
+			return;
+		}
+		
+		// another client changed the bytecode of the node, or had it reloaded from flash
+		if (dynamic_cast<const SetBytecode *>(message) || dynamic_cast<const Reboot *>(message) || dynamic_cast<const BootloaderReset *>(message))
+			forget(static_cast<const CmdMessage *>(message)->dest);
+	}
+	
+	void BytecodeUploader::sendBytecode(Dashel::Stream* stream, uint16 dest, const std::vector<uint16>& bytecode)
+	{
+		vector<Message*> messages;
+		sendBytecode(messages, dest, bytecode);
+		for (size_t i = 0; i < messages.size(); ++i)
+		{
+			messages[i]->serialize(stream);
+			delete messages[i];
+		}
+	}
+	
+	void BytecodeUploader::sendBytecode(std::vector<Message*>& messagesVector, uint16 dest, const std::vector<uint16>& bytecode)
+	{
+		BytecodesMap::iterator it(bytecodes.find(dest));
+		if (it == bytecodes.end())
+		{
+			Aseba::sendBytecode(messagesVector, dest, bytecode);
+			bytecodes[dest] = bytecode;
+			return;
+		}
+		
+		// send the changed ranges, merging the ones separated by less than a message header
+		const vector<uint16>& previous(it->second);
+		const unsigned bytecodePayloadSize = ASEBA_MAX_EVENT_ARG_COUNT-2;
+		const unsigned bytecodeCount = bytecode.size();
+		const size_t messagesCount(messagesVector.size());
+		unsigned pos = 0;
+		while (pos < bytecodeCount)
+		{
+			if (pos < previous.size() && previous[pos] == bytecode[pos])
+			{
+				++pos;
+				continue;
+			}
+			
+			const unsigned start = pos;
+			unsigned end = pos + 1;
+			for (unsigned i = end; i < bytecodeCount && i - start < bytecodePayloadSize && i - end < MAX_GAP; ++i)
+				if (i >= previous.size() || previous[i] != bytecode[i])
+					end = i + 1;
+			
+			SetBytecode* setBytecodeMessage = new SetBytecode(dest, start);
+			setBytecodeMessage->bytecode.resize(end - start);
+			copy(bytecode.begin()+start, bytecode.begin()+end, setBytecodeMessage->bytecode.begin());
+			messagesVector.push_back(setBytecodeMessage);
+			pos = end;
+		}
+		
+		// a node resets when it receives bytecode, do it as well if nothing changed
+		if (messagesVector.size() == messagesCount)
+			messagesVector.push_back(new Reset(dest));
+		
+		it->second = bytecode;
+	}
+	
+	void BytecodeUploader::forget(uint16 node)
+	{
+		bytecodes.erase(node);
+	}
+	
+	void BytecodeUploader::reset()
+	{
+		bytecodes.clear();
+	}
+}
@@ -0,0 +1,66 @@
+/*
+	Aseba - an event-based framework for distributed robot control
+	Copyright (C) 2007--2012:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+		and other contributors, see authors.txt for details
+	
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+	
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ASEBA_BYTECODE_UPLOADER_H
+#define ASEBA_BYTECODE_UPLOADER_H
+
+#include "msg.h"
+#include <map>
+#include <vector>
+
+namespace Aseba
+{
+	/** \addtogroup msg */
+	/*@{*/
+	
+	//! This helper class remembers the bytecode last uploaded to each node, and only sends the ranges that changed since.
+	//! The bytecode of a node is forgotten, leading to a full upload, whenever something else might have changed it:
+	//! the node (re)sending its description or the hash of it, disconnecting, rebooting, or receiving bytecode from another client.
+	class BytecodeUploader
+	{
+	public:
+		//! Number of unchanged words under which two changed ranges are sent in a single message, the size of the header of a SetBytecode
+		static const unsigned MAX_GAP = 5;
+		
+	public:
+		//! Process a message seen on the network and forget the bytecode of the nodes it concerns, if relevant
+		void processMessage(const Message* message);
+		
+		//! Send to stream what changed in the bytecode of dest
+		void sendBytecode(Dashel::Stream* stream, uint16 dest, const std::vector<uint16>& bytecode);
+		//! Add to messagesVector the messages sending what changed in the bytecode of dest
+		void sendBytecode(std::vector<Message*>& messagesVector, uint16 dest, const std::vector<uint16>& bytecode);
+		
+		//! Forget the bytecode of node, so that the next upload to it sends everything
+		void forget(uint16 node);
+		//! Forget the bytecode of all nodes, for instance when a network was disconnected and is reconnected
+		void reset();
+		
+	protected:
+		//! Map from nodes id to the bytecode last uploaded to them
+		typedef std::map<uint16, std::vector<uint16> > BytecodesMap;
+		BytecodesMap bytecodes; //!< bytecode of all nodes we uploaded to
+	};
+	
+	/*@}*/
+}
+
+#endif
@@ -20,7 +20,19 @@
 
 #include "descriptions-manager.h"
 #include "msg.h"
+#include "../utils/utils.h"
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <cstdio>
+#ifndef WIN32
+	#include <unistd.h>
+#else // WIN32
+	#include <process.h>
+	#define getpid _getpid
+#endif // WIN32
 
 using namespace std;
 
@@ -41,17 +53,36 @@ namespace Aseba
 	{
 	}
 	
+	//! Return whether all named variables, local events and native functions have been received
+	bool DescriptionsManager::NodeDescription::isComplete() const
+	{
+		return (namedVariablesReceptionCounter == namedVariables.size()) &&
+			(localEventsReceptionCounter == localEvents.size()) &&
+			(nativeFunctionReceptionCounter == nativeFunctions.size());
+	}
+	
+	//! Mark all named variables, local events and native functions as received
+	void DescriptionsManager::NodeDescription::setComplete()
+	{
+		namedVariablesReceptionCounter = namedVariables.size();
+		localEventsReceptionCounter = localEvents.size();
+		nativeFunctionReceptionCounter = nativeFunctions.size();
+	}
+	
 	void DescriptionsManager::processMessage(const Message* message)
 	{
 		// if we have a disconnection message
 		{
 			const Disconnected *disconnected = dynamic_cast<const Disconnected *>(message);
 			if (disconnected)
-			{
-				NodesDescriptionsMap::iterator it = nodesDescriptions.find(disconnected->source);
-				if (it != nodesDescriptions.end())
-					nodesDescriptions.erase(it);
-			}
+				nodeDisconnected(disconnected->source);
+		}
+		
+		// if a node announces itself
+		{
+			const DescriptionHash *hash = dynamic_cast<const DescriptionHash *>(message);
+			if (hash)
+				processDescriptionHash(hash);
 		}
 		
 		// if we have an initial description
@@ -72,6 +103,9 @@ namespace Aseba
 					return;
 				}
 				
+				// this node might have been waiting for the same description from another node, but sends its own
+				stopWaiting(description->source);
+				
 				// create node and copy description into it
 				nodesDescriptions[description->source] = NodeDescription(*description);
 				checkIfNodeDescriptionComplete(description->source, nodesDescriptions[description->source]);
@@ -82,72 +116,215 @@ namespace Aseba
 		{
 			const NamedVariableDescription *description = dynamic_cast<const NamedVariableDescription *>(message);
 			if (description)
-			{
-				NodesDescriptionsMap::iterator it = nodesDescriptions.find(description->source);
-				
-				// we must have received a description first
-				if (it == nodesDescriptions.end())
-					return;
-				
-				// copy description into array if array is empty
-				if (it->second.namedVariablesReceptionCounter < it->second.namedVariables.size())
-				{
-					it->second.namedVariables[it->second.namedVariablesReceptionCounter++] = *description;
-					checkIfNodeDescriptionComplete(it->first, it->second);
-				}
-			}
+				addNamedVariable(description->source, *description);
 		}
 		
 		// if we have a local event description
 		{
 			const LocalEventDescription *description = dynamic_cast<const LocalEventDescription *>(message);
 			if (description)
-			{
-				NodesDescriptionsMap::iterator it = nodesDescriptions.find(description->source);
-				
-				// we must have received a description first
-				if (it == nodesDescriptions.end())
-					return;
-				
-				// copy description into array if array is empty
-				if (it->second.localEventsReceptionCounter < it->second.localEvents.size())
-				{
-					it->second.localEvents[it->second.localEventsReceptionCounter++] = *description;
-					checkIfNodeDescriptionComplete(it->first, it->second);
-				}
-			}
+				addLocalEvent(description->source, *description);
 		}
 		
 		// if we have a native function description
 		{
 			const NativeFunctionDescription *description = dynamic_cast<const NativeFunctionDescription *>(message);
+			if (description)
+				addNativeFunction(description->source, *description);
+		}
+		
+		// if we have several of the above in one message
+		{
+			const PackedDescription *description = dynamic_cast<const PackedDescription *>(message);
 			if (description)
 			{
-				NodesDescriptionsMap::iterator it = nodesDescriptions.find(description->source);
-				
-				// we must have received a description first
-				if (it == nodesDescriptions.end())
-					return;
-				
-				// copy description into array
-				if (it->second.nativeFunctionReceptionCounter < it->second.nativeFunctions.size())
-				{
-					it->second.nativeFunctions[it->second.nativeFunctionReceptionCounter++] = *description;
-					checkIfNodeDescriptionComplete(it->first, it->second);
-				}
+				for (size_t i = 0; i < description->namedVariables.size(); ++i)
+					addNamedVariable(description->source, description->namedVariables[i]);
+				for (size_t i = 0; i < description->localEvents.size(); ++i)
+					addLocalEvent(description->source, description->localEvents[i]);
+				for (size_t i = 0; i < description->nativeFunctions.size(); ++i)
+					addNativeFunction(description->source, description->nativeFunctions[i]);
+			}
+		}
+	}
+	
+	//! Use the cached description announced by a node if any, otherwise request it from the node, unless another node is already sending it
+	void DescriptionsManager::processDescriptionHash(const DescriptionHash* hash)
+	{
+		const unsigned id(hash->source);
+		
+		// We can receive a hash several times, for instance if there is another IDE connected
+		NodesDescriptionsMap::iterator it = nodesDescriptions.find(id);
+		if (it != nodesDescriptions.end())
+		{
+			if (it->second.isComplete())
+				return;
+			// parts of the description might have been lost, start again
+			nodesDescriptions.erase(it);
+		}
+		
+		// Call a user function when a node protocol version mismatches
+		if (hash->protocolVersion != ASEBA_PROTOCOL_VERSION)
+		{
+			nodeProtocolVersionMismatch(hash->name, hash->protocolVersion);
+			return;
+		}
+		
+		const DescriptionKey key(hash->name, hash->crc);
+		
+		// if we already know this description, possibly from an earlier run, there is nothing to request
+		DescriptionsCache::const_iterator cached = descriptionsCache.find(key);
+		if (cached == descriptionsCache.end())
+		{
+			TargetDescription description;
+			if (loadFromDisk(key, description))
+				cached = descriptionsCache.insert(std::make_pair(key, description)).first;
+		}
+		if (cached != descriptionsCache.end())
+		{
+			stopWaiting(id);
+			NodeDescription& description(nodesDescriptions[id]);
+			description = NodeDescription(cached->second);
+			description.setComplete();
+			nodeDescriptionReceived(id);
+			return;
+		}
+		
+		// if another node is sending the same description, wait for it
+		for (RequestedDescriptionsMap::const_iterator requested = requestedDescriptions.begin(); requested != requestedDescriptions.end(); ++requested)
+		{
+			if ((requested->first != id) && (requested->second == key))
+			{
+				stopWaiting(id);
+				waitingNodes.insert(std::make_pair(key, id));
+				return;
+			}
+		}
+		
+		requestDescription(id, key);
+	}
+	
+	//! Request the full description of a node, that announced the given key
+	void DescriptionsManager::requestDescription(unsigned id, const DescriptionKey& key)
+	{
+		requestedDescriptions[id] = key;
+		requestNodeDescription(id);
+	}
+	
+	void DescriptionsManager::addNamedVariable(unsigned id, const TargetDescription::NamedVariable& namedVariable)
+	{
+		NodesDescriptionsMap::iterator it = nodesDescriptions.find(id);
+		
+		// we must have received a description first
+		if (it == nodesDescriptions.end())
+			return;
+		
+		// copy description into array if array is empty
+		if (it->second.namedVariablesReceptionCounter < it->second.namedVariables.size())
+		{
+			it->second.namedVariables[it->second.namedVariablesReceptionCounter++] = namedVariable;
+			checkIfNodeDescriptionComplete(it->first, it->second);
+		}
+	}
+	
+	void DescriptionsManager::addLocalEvent(unsigned id, const TargetDescription::LocalEvent& localEvent)
+	{
+		NodesDescriptionsMap::iterator it = nodesDescriptions.find(id);
+		
+		// we must have received a description first
+		if (it == nodesDescriptions.end())
+			return;
+		
+		// copy description into array if array is empty
+		if (it->second.localEventsReceptionCounter < it->second.localEvents.size())
+		{
+			it->second.localEvents[it->second.localEventsReceptionCounter++] = localEvent;
+			checkIfNodeDescriptionComplete(it->first, it->second);
+		}
+	}
+	
+	void DescriptionsManager::addNativeFunction(unsigned id, const TargetDescription::NativeFunction& nativeFunction)
+	{
+		NodesDescriptionsMap::iterator it = nodesDescriptions.find(id);
+		
+		// we must have received a description first
+		if (it == nodesDescriptions.end())
+			return;
+		
+		// copy description into array
+		if (it->second.nativeFunctionReceptionCounter < it->second.nativeFunctions.size())
+		{
+			it->second.nativeFunctions[it->second.nativeFunctionReceptionCounter++] = nativeFunction;
+			checkIfNodeDescriptionComplete(it->first, it->second);
+		}
+	}
+	
+	//! Forget a node; if its description was being received, request it from a node waiting for it
+	void DescriptionsManager::nodeDisconnected(unsigned id)
+	{
+		nodesDescriptions.erase(id);
+		stopWaiting(id);
+		
+		RequestedDescriptionsMap::iterator requested = requestedDescriptions.find(id);
+		if (requested != requestedDescriptions.end())
+		{
+			const DescriptionKey key(requested->second);
+			requestedDescriptions.erase(requested);
+			
+			WaitingNodesMap::iterator waiting = waitingNodes.find(key);
+			if (waiting != waitingNodes.end())
+			{
+				const unsigned waitingId(waiting->second);
+				waitingNodes.erase(waiting);
+				requestDescription(waitingId, key);
 			}
 		}
 	}
+	
+	//! Remove a node from the nodes waiting for a description from another node
+	void DescriptionsManager::stopWaiting(unsigned id)
+	{
+		for (WaitingNodesMap::iterator it = waitingNodes.begin(); it != waitingNodes.end();)
+		{
+			if (it->second == id)
+				waitingNodes.erase(it++);
+			else
+				++it;
+		}
+	}
 
 	void DescriptionsManager::checkIfNodeDescriptionComplete(unsigned id, const NodeDescription& description)
 	{
 		// we will call the virtual function only when we have received all local events and native functions
-		if ((description.namedVariablesReceptionCounter == description.namedVariables.size()) &&
-			(description.localEventsReceptionCounter == description.localEvents.size()) &&
-			(description.nativeFunctionReceptionCounter == description.nativeFunctions.size())
-		)
+		if (!description.isComplete())
+			return;
+		
+		// if we requested this description, cache it under the key announced by the node
+		RequestedDescriptionsMap::iterator requested = requestedDescriptions.find(id);
+		if (requested == requestedDescriptions.end())
 		{
 			nodeDescriptionReceived(id);
+			return;
+		}
+		const DescriptionKey key(requested->second);
+		requestedDescriptions.erase(requested);
+		const TargetDescription& cachedDescription(descriptionsCache[key] = description);
+		saveToDisk(key, cachedDescription);
+		
+		// the nodes waiting for this description get it as well
+		std::vector<unsigned> waitingIds;
+		std::pair<WaitingNodesMap::iterator, WaitingNodesMap::iterator> waiting(waitingNodes.equal_range(key));
+		for (WaitingNodesMap::iterator it = waiting.first; it != waiting.second; ++it)
+			waitingIds.push_back(it->second);
+		waitingNodes.erase(waiting.first, waiting.second);
+		
+		nodeDescriptionReceived(id);
+		for (size_t i = 0; i < waitingIds.size(); ++i)
+		{
+			NodeDescription& waitingDescription(nodesDescriptions[waitingIds[i]]);
+			waitingDescription = NodeDescription(cachedDescription);
+			waitingDescription.setComplete();
+			nodeDescriptionReceived(waitingIds[i]);
 		}
 	}
 	
@@ -265,5 +442,179 @@ namespace Aseba
 	void DescriptionsManager::reset()
 	{
 		nodesDescriptions.clear();
+		requestedDescriptions.clear();
+		waitingNodes.clear();
+	}
+	
+	void DescriptionsManager::setDiskCache(const std::string& directory)
+	{
+		diskCacheDirectory = directory;
+	}
+	
+	// format of the files of the disk cache, all numbers are 16-bit little endian and strings are UTF-8 prefixed by their length
+	static const uint16 diskCacheFormatVersion = 1;
+	
+	static void writeUInt16(ostream& stream, unsigned value)
+	{
+		stream.put(char(value & 0xff));
+		stream.put(char((value >> 8) & 0xff));
+	}
+	
+	static void writeString(ostream& stream, const std::wstring& s)
+	{
+		const std::string utf8(WStringToUTF8(s));
+		writeUInt16(stream, utf8.size());
+		stream.write(utf8.data(), utf8.size());
+	}
+	
+	static uint16 readUInt16(istream& stream)
+	{
+		unsigned char bytes[2] = { 0, 0 };
+		stream.read(reinterpret_cast<char*>(bytes), 2);
+		return uint16(bytes[0] | (bytes[1] << 8));
+	}
+	
+	static std::wstring readString(istream& stream)
+	{
+		std::string utf8(readUInt16(stream), '\0');
+		if (!utf8.empty())
+			stream.read(&utf8[0], utf8.size());
+		return UTF8ToWString(utf8);
+	}
+	
+	//! Return the name of the file of the disk cache holding the description with the given key
+	std::string DescriptionsManager::diskCacheFileName(const DescriptionKey& key) const
+	{
+		ostringstream oss;
+		oss << diskCacheDirectory << "/";
+		oss << hex << setfill('0') << setw(4) << crcXModem(0, key.first) << "-" << setw(4) << key.second;
+		oss << "-" << dec << ASEBA_PROTOCOL_VERSION << ".description";
+		return oss.str();
+	}
+	
+	//! If the description with the given key is in the disk cache, read it to description and return true
+	bool DescriptionsManager::loadFromDisk(const DescriptionKey& key, TargetDescription& description) const
+	{
+		if (diskCacheDirectory.empty())
+			return false;
+		
+		const std::string fileName(diskCacheFileName(key));
+		ifstream stream(fileName.c_str(), ios::in | ios::binary);
+		if (!stream)
+			return false;
+		
+		// the key is stored as well, so that a collision of the hashes of names cannot give a wrong description
+		const uint16 formatVersion(readUInt16(stream));
+		const uint16 protocolVersion(readUInt16(stream));
+		const uint16 crc(readUInt16(stream));
+		description.name = readString(stream);
+		if (!stream || formatVersion != diskCacheFormatVersion || protocolVersion != ASEBA_PROTOCOL_VERSION || crc != key.second || description.name != key.first)
+			return false;
+		description.protocolVersion = protocolVersion;
+		
+		description.bytecodeSize = readUInt16(stream);
+		description.variablesSize = readUInt16(stream);
+		description.stackSize = readUInt16(stream);
+		
+		description.namedVariables.resize(readUInt16(stream));
+		for (size_t i = 0; stream && i < description.namedVariables.size(); ++i)
+		{
+			description.namedVariables[i].size = readUInt16(stream);
+			description.namedVariables[i].name = readString(stream);
+		}
+		description.localEvents.resize(stream ? readUInt16(stream) : 0);
+		for (size_t i = 0; stream && i < description.localEvents.size(); ++i)
+		{
+			description.localEvents[i].name = readString(stream);
+			description.localEvents[i].description = readString(stream);
+		}
+		description.nativeFunctions.resize(stream ? readUInt16(stream) : 0);
+		for (size_t i = 0; stream && i < description.nativeFunctions.size(); ++i)
+		{
+			TargetDescription::NativeFunction& function(description.nativeFunctions[i]);
+			function.name = readString(stream);
+			function.description = readString(stream);
+			function.parameters.resize(stream ? readUInt16(stream) : 0);
+			for (size_t j = 0; stream && j < function.parameters.size(); ++j)
+			{
+				function.parameters[j].size = sint16(readUInt16(stream));
+				function.parameters[j].name = readString(stream);
+			}
+		}
+		
+		// a truncated or corrupted file is removed, the description will be requested and stored again
+		if (!stream || stream.peek() != char_traits<char>::eof() || description.crc() != key.second)
+		{
+			stream.close();
+			remove(fileName.c_str());
+			return false;
+		}
+		return true;
+	}
+	
+	//! Store the description with the given key in the disk cache, if enabled
+	void DescriptionsManager::saveToDisk(const DescriptionKey& key, const TargetDescription& description) const
+	{
+		if (diskCacheDirectory.empty())
+			return;
+		
+		// write to a temporary file of this process and rename it, so that other processes never read a partial file
+		const std::string fileName(diskCacheFileName(key));
+		ostringstream temporaryFileNameStream;
+		temporaryFileNameStream << fileName << "." << getpid();
+		const std::string temporaryFileName(temporaryFileNameStream.str());
+		{
+			ofstream stream(temporaryFileName.c_str(), ios::out | ios::binary | ios::trunc);
+			if (!stream)
+				return;
+			
+			writeUInt16(stream, diskCacheFormatVersion);
+			writeUInt16(stream, ASEBA_PROTOCOL_VERSION);
+			writeUInt16(stream, key.second);
+			writeString(stream, key.first);
+			
+			writeUInt16(stream, description.bytecodeSize);
+			writeUInt16(stream, description.variablesSize);
+			writeUInt16(stream, description.stackSize);
+			
+			writeUInt16(stream, description.namedVariables.size());
+			for (size_t i = 0; i < description.namedVariables.size(); ++i)
+			{
+				writeUInt16(stream, description.namedVariables[i].size);
+				writeString(stream, description.namedVariables[i].name);
+			}
+			writeUInt16(stream, description.localEvents.size());
+			for (size_t i = 0; i < description.localEvents.size(); ++i)
+			{
+				writeString(stream, description.localEvents[i].name);
+				writeString(stream, description.localEvents[i].description);
+			}
+			writeUInt16(stream, description.nativeFunctions.size());
+			for (size_t i = 0; i < description.nativeFunctions.size(); ++i)
+			{
+				const TargetDescription::NativeFunction& function(description.nativeFunctions[i]);
+				writeString(stream, function.name);
+				writeString(stream, function.description);
+				writeUInt16(stream, function.parameters.size());
+				for (size_t j = 0; j < function.parameters.size(); ++j)
+				{
+					writeUInt16(stream, uint16(function.parameters[j].size));
+					writeString(stream, function.parameters[j].name);
+				}
+			}
+			
+			stream.close();
+			if (!stream)
+			{
+				remove(temporaryFileName.c_str());
+				return;
+			}
+		}
+		#ifdef WIN32
+		// rename() does not replace an existing file on Windows
+		remove(fileName.c_str());
+		#endif // WIN32
+		if (rename(temporaryFileName.c_str(), fileName.c_str()) != 0)
+			remove(temporaryFileName.c_str());
 	}
 } // namespace Aseba
@@ -23,6 +23,8 @@
 
 #include "msg.h"
 #include <string>
+#include <map>
+#include <utility>
 
 namespace Aseba
 {
@@ -30,6 +32,9 @@ namespace Aseba
 	/*@{*/
 	
 	//! This helper class builds complete descriptions out of multiple message parts.
+	//! Nodes announce themselves with a hash of their description; the full description is only requested,
+	//! through requestNodeDescription(), if no description with the same node name and hash was received before.
+	//! Optionally, received descriptions are also stored in a directory, to be reused by later runs.
 	//! For now, it does not support the disconnection of a whole network nor the update of the description of any node
 	class DescriptionsManager
 	{
@@ -40,6 +45,9 @@ namespace Aseba
 			NodeDescription();
 			NodeDescription(const TargetDescription& targetDescription);
 			
+			bool isComplete() const;
+			void setComplete();
+			
 			unsigned namedVariablesReceptionCounter; //!< what is the status of the reception of named variables
 			unsigned localEventsReceptionCounter; //!< what is the status of the reception of local events
 			unsigned nativeFunctionReceptionCounter; //!< what is the status of the reception of native functions
@@ -48,6 +56,19 @@ namespace Aseba
 		typedef std::map<unsigned, NodeDescription> NodesDescriptionsMap;
 		NodesDescriptionsMap nodesDescriptions; //!< all known nodes descriptions
 		
+		//! Identifies a description: name of the node and CRC of its description
+		typedef std::pair<std::wstring, uint16> DescriptionKey;
+		//! Map from descriptions keys to complete descriptions
+		typedef std::map<DescriptionKey, TargetDescription> DescriptionsCache;
+		DescriptionsCache descriptionsCache; //!< all complete descriptions that were requested and received, kept across reset()
+		//! Map from nodes id to the key they announced, for nodes whose full description was requested
+		typedef std::map<unsigned, DescriptionKey> RequestedDescriptionsMap;
+		RequestedDescriptionsMap requestedDescriptions; //!< nodes whose full description is being received
+		//! Map from descriptions keys to the nodes waiting for it to be received from another node
+		typedef std::multimap<DescriptionKey, unsigned> WaitingNodesMap;
+		WaitingNodesMap waitingNodes; //!< nodes waiting for the description of another node that announced the same key
+		std::string diskCacheDirectory; //!< directory where descriptions are kept across runs, empty if disabled
+		
 	public:
 		//! Virtual destructor
 		virtual ~DescriptionsManager() {}
@@ -65,19 +86,35 @@ namespace Aseba
 		unsigned getVariablePos(unsigned nodeId, const std::wstring& name, bool *ok = 0) const;
 		//! Return the length of a variable and set ok to true, if provided; if invalid, return 0xFFFFFFFF and set ok to false
 		unsigned getVariableSize(unsigned nodeId, const std::wstring& name, bool *ok = 0) const;
-		//! Reset all descriptions, for instance when a network was disconnected and is reconnected
+		//! Reset all descriptions, for instance when a network was disconnected and is reconnected; descriptions received so far are still reused for nodes announcing the same
 		void reset();
+		//! Store descriptions in directory, which must exist, and reuse the ones stored there by earlier runs; an empty directory disables the disk cache
+		void setDiskCache(const std::string& directory);
 		
 		// TODO: reverse lookup?
 		// TODO: move bytecode sender manager here, rename class?
 		
 	protected:
+		void processDescriptionHash(const DescriptionHash* hash);
+		void requestDescription(unsigned id, const DescriptionKey& key);
+		void addNamedVariable(unsigned id, const TargetDescription::NamedVariable& namedVariable);
+		void addLocalEvent(unsigned id, const TargetDescription::LocalEvent& localEvent);
+		void addNativeFunction(unsigned id, const TargetDescription::NativeFunction& nativeFunction);
+		void nodeDisconnected(unsigned id);
+		void stopWaiting(unsigned id);
+		std::string diskCacheFileName(const DescriptionKey& key) const;
+		bool loadFromDisk(const DescriptionKey& key, TargetDescription& description) const;
+		void saveToDisk(const DescriptionKey& key, const TargetDescription& description) const;
+		
 		//! Check if a node description has been fully received, and if so, call the nodeDescriptionReceived() virtual function
 		void checkIfNodeDescriptionComplete(unsigned id, const NodeDescription& description);
 		
 		//! Virtual function that is called when a version mismatches
 		virtual void nodeProtocolVersionMismatch(const std::wstring &nodeName, uint16 protocolVersion) { }
 		
+		//! Virtual function that is called when the full description of a node is needed, it must send a GetNodeDescription message to this node
+		virtual void requestNodeDescription(unsigned nodeId) = 0;
+		
 		//! Virtual function that is called when a node description has been fully received
 		virtual void nodeDescriptionReceived(unsigned nodeId) { }
 	};
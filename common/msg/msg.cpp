@@ -22,9 +22,14 @@
 #include "endian.h"
 #include "../utils/utils.h"
 #include <typeinfo>
+#include <cassert>
 #include <iostream>
 #include <iomanip>
 #include <map>
+#include <set>
+#include <memory>
+#include <cstring>
+#include <algorithm>
 #include <dashel/dashel.h>
 
 using namespace std;
@@ -50,6 +55,10 @@ namespace Aseba
 			registerMessageType<NativeFunctionDescription>(ASEBA_MESSAGE_NATIVE_FUNCTION_DESCRIPTION);
 			registerMessageType<Disconnected>(ASEBA_MESSAGE_DISCONNECTED);
 			registerMessageType<Variables>(ASEBA_MESSAGE_VARIABLES);
+			registerMessageType<VariablesDelta>(ASEBA_MESSAGE_VARIABLES_DELTA);
+			registerMessageType<VariablesUnsubscribed>(ASEBA_MESSAGE_VARIABLES_UNSUBSCRIBED);
+			registerMessageType<DescriptionHash>(ASEBA_MESSAGE_DESCRIPTION_HASH);
+			registerMessageType<PackedDescription>(ASEBA_MESSAGE_PACKED_DESCRIPTION);
 			registerMessageType<ArrayAccessOutOfBounds>(ASEBA_MESSAGE_ARRAY_ACCESS_OUT_OF_BOUNDS);
 			registerMessageType<DivisionByZero>(ASEBA_MESSAGE_DIVISION_BY_ZERO);
 			registerMessageType<EventExecutionKilled>(ASEBA_MESSAGE_EVENT_EXECUTION_KILLED);
@@ -81,6 +90,9 @@ namespace Aseba
 			registerMessageType<WriteBytecode>(ASEBA_MESSAGE_WRITE_BYTECODE);
 			registerMessageType<Reboot>(ASEBA_MESSAGE_REBOOT);
 			registerMessageType<Sleep>(ASEBA_MESSAGE_SUSPEND_TO_RAM);
+			registerMessageType<SubscribeVariables>(ASEBA_MESSAGE_SUBSCRIBE_VARIABLES);
+			registerMessageType<UnsubscribeVariables>(ASEBA_MESSAGE_UNSUBSCRIBE_VARIABLES);
+			registerMessageType<GetNodeDescription>(ASEBA_MESSAGE_GET_NODE_DESCRIPTION);
 		}
 		
 		//! Register a message type by storing a pointer to its constructor
@@ -88,6 +100,9 @@ namespace Aseba
 		void registerMessageType(uint16 type)
 		{
 			messagesTypes[type] = &Creator<Sub>;
+			const auto_ptr<Message> message(Creator<Sub>());
+			if (dynamic_cast<CmdMessage*>(message.get()))
+				commandTypes.insert(type);
 		}
 		
 		//! Create an instance of a registered message type
@@ -99,6 +114,12 @@ namespace Aseba
 				return messagesTypes[type]();
 		}
 		
+		//! Return whether type is the one of a command, whose payload starts with a destination
+		bool isCommand(uint16 type) const
+		{
+			return commandTypes.find(type) != commandTypes.end();
+		}
+		
 		//! Print the list of registered messages types to stream
 		void dumpKnownMessagesTypes(wostream &stream) const
 		{
@@ -112,6 +133,7 @@ namespace Aseba
 		//! Pointer to constructor of class Message
 		typedef Message* (*CreatorFunc)();
 		map<uint16, CreatorFunc> messagesTypes; //!< table of known messages types
+		set<uint16> commandTypes; //!< types of known messages inheriting from CmdMessage
 		
 		//! Create a new message of type Sub
 		template<typename Sub>
@@ -179,20 +201,25 @@ namespace Aseba
 		message->rawData.resize(len);
 		if (len)
 			stream->read(&message->rawData[0], len);
-		message->readPos = 0;
 		
 		// deserialize it
-		message->deserializeSpecific();
+		message->deserialize();
 		
-		if (message->readPos != message->rawData.size())
+		return message;
+	}
+	
+	void Message::deserialize()
+	{
+		readPos = 0;
+		deserializeSpecific();
+		
+		if (readPos != rawData.size())
 		{
-			cerr << "Message::receive() : fatal error: message not fully read.\n";
-			cerr << "type: " << type << ", readPos: " << message->readPos << ", rawData size: " << message->rawData.size() << endl;
-			message->dumpBuffer(wcerr);
+			cerr << "Message::deserialize() : fatal error: message not fully read.\n";
+			cerr << "type: " << type << ", readPos: " << readPos << ", rawData size: " << rawData.size() << endl;
+			dumpBuffer(wcerr);
 			abort();
 		}
-		
-		return message;
 	}
 	
 	void Message::dump(wostream &stream) const
@@ -271,8 +298,133 @@ namespace Aseba
 		return s;
 	}
 	
+	//! Append the payload of another message to ours
+	void Message::addEmbedded(Message& message)
+	{
+		message.rawData.resize(0);
+		message.serializeSpecific();
+		copy(message.rawData.begin(), message.rawData.end(), back_inserter(rawData));
+	}
+	
+	//! Read the payload of another message from ours, at the current position
+	void Message::getEmbedded(Message& message)
+	{
+		message.source = source;
+		message.rawData.assign(rawData.begin() + readPos, rawData.end());
+		message.readPos = 0;
+		message.deserializeSpecific();
+		readPos += message.readPos;
+	}
+	
 	//
-
+	
+	RawMessage::RawMessage() :
+		payloadSize(0)
+	{
+		memset(buffer, 0, headerSize);
+		setBufferWord(4, ASEBA_MESSAGE_INVALID);
+	}
+	
+	void RawMessage::receive(Stream* stream)
+	{
+		// read header in place
+		stream->read(buffer, headerSize);
+		const uint16 len(getBufferWord(0));
+		if (len > ASEBA_MAX_EVENT_ARG_SIZE)
+		{
+			// only this stream is broken, let the hub close it
+			cerr << "RawMessage::receive() : error: message size exceed maximum packet size.\n";
+			cerr << "message payload size: " << len << ", maximum packet payload size (excluding type): " << ASEBA_MAX_EVENT_ARG_SIZE << ", message type: " << hex << showbase << getType() << dec << noshowbase;
+			cerr << endl;
+			throw DashelException(DashelException::IOError, 0, "Message size exceeds maximum packet size", stream);
+		}
+		
+		// read payload just after it
+		payloadSize = len;
+		if (len)
+			stream->read(buffer + headerSize, len);
+	}
+	
+	void RawMessage::serialize(Stream* stream) const
+	{
+		stream->write(buffer, headerSize + payloadSize);
+	}
+	
+	//! Create the typed message corresponding to this packet, the caller is responsible to delete it
+	Message *RawMessage::decode() const
+	{
+		Message *message = messageTypesInitializer.createMessage(getType());
+		
+		message->source = getSource();
+		message->type = getType();
+		message->rawData.assign(buffer + headerSize, buffer + headerSize + payloadSize);
+		message->deserialize();
+		
+		return message;
+	}
+	
+	uint16 RawMessage::getSource() const
+	{
+		return getBufferWord(2);
+	}
+	
+	void RawMessage::setSource(uint16 source)
+	{
+		setBufferWord(2, source);
+	}
+	
+	uint16 RawMessage::getType() const
+	{
+		return getBufferWord(4);
+	}
+	
+	//! Return whether this is a command message carrying a destination, which getDest() and setDest() access
+	bool RawMessage::isCommand() const
+	{
+		return payloadSize >= 2 && messageTypesInitializer.isCommand(getType());
+	}
+	
+	uint16 RawMessage::getDest() const
+	{
+		assert(isCommand());
+		return getWord(0);
+	}
+	
+	void RawMessage::setDest(uint16 dest)
+	{
+		assert(isCommand());
+		setWord(0, dest);
+	}
+	
+	//! Return the index-th 16-bit word of the payload, in host byte order
+	uint16 RawMessage::getWord(size_t index) const
+	{
+		assert(index < getWordsCount());
+		return getBufferWord(headerSize + index * 2);
+	}
+	
+	//! Set the index-th 16-bit word of the payload, value being in host byte order
+	void RawMessage::setWord(size_t index, uint16 value)
+	{
+		assert(index < getWordsCount());
+		setBufferWord(headerSize + index * 2, value);
+	}
+	
+	uint16 RawMessage::getBufferWord(size_t pos) const
+	{
+		uint16 value;
+		memcpy(&value, buffer + pos, 2);
+		return swapEndianCopy(value);
+	}
+	
+	void RawMessage::setBufferWord(size_t pos, uint16 value)
+	{
+		const uint16 swappedValue(swapEndianCopy(value));
+		memcpy(buffer + pos, &swappedValue, 2);
+	}
+	
+	//
+	
 	UserMessage::UserMessage(uint16 type, const sint16* data, const size_t length):
 		Message(type)
 	{
@@ -535,6 +687,87 @@ namespace Aseba
 	
 	//
 	
+	void DescriptionHash::serializeSpecific()
+	{
+		add(WStringToUTF8(name));
+		add(protocolVersion);
+		add(crc);
+	}
+	
+	void DescriptionHash::deserializeSpecific()
+	{
+		name = UTF8ToWString(get<string>());
+		protocolVersion = get<uint16>();
+		crc = get<uint16>();
+	}
+	
+	void DescriptionHash::dumpSpecific(wostream &stream) const
+	{
+		stream << "Node " << name << " using protocol version " << protocolVersion << ", description crc " << hex << showbase << crc << dec << noshowbase;
+	}
+	
+	//
+	
+	void PackedDescription::serializeSpecific()
+	{
+		// each entry is the payload of the corresponding single-entry message, preceded by its type
+		for (size_t i = 0; i < namedVariables.size(); i++)
+		{
+			add(static_cast<uint16>(ASEBA_MESSAGE_NAMED_VARIABLE_DESCRIPTION));
+			addEmbedded(namedVariables[i]);
+		}
+		for (size_t i = 0; i < localEvents.size(); i++)
+		{
+			add(static_cast<uint16>(ASEBA_MESSAGE_LOCAL_EVENT_DESCRIPTION));
+			addEmbedded(localEvents[i]);
+		}
+		for (size_t i = 0; i < nativeFunctions.size(); i++)
+		{
+			add(static_cast<uint16>(ASEBA_MESSAGE_NATIVE_FUNCTION_DESCRIPTION));
+			addEmbedded(nativeFunctions[i]);
+		}
+	}
+	
+	void PackedDescription::deserializeSpecific()
+	{
+		namedVariables.clear();
+		localEvents.clear();
+		nativeFunctions.clear();
+		while (readPos < rawData.size())
+		{
+			const uint16 entryType(get<uint16>());
+			switch (entryType)
+			{
+				case ASEBA_MESSAGE_NAMED_VARIABLE_DESCRIPTION:
+				namedVariables.push_back(NamedVariableDescription());
+				getEmbedded(namedVariables.back());
+				break;
+				
+				case ASEBA_MESSAGE_LOCAL_EVENT_DESCRIPTION:
+				localEvents.push_back(LocalEventDescription());
+				getEmbedded(localEvents.back());
+				break;
+				
+				case ASEBA_MESSAGE_NATIVE_FUNCTION_DESCRIPTION:
+				nativeFunctions.push_back(NativeFunctionDescription());
+				getEmbedded(nativeFunctions.back());
+				break;
+				
+				default:
+				cerr << "PackedDescription::deserializeSpecific() : fatal error: unknown entry type " << hex << showbase << entryType << dec << noshowbase << endl;
+				dumpBuffer(wcerr);
+				abort();
+			}
+		}
+	}
+	
+	void PackedDescription::dumpSpecific(wostream &stream) const
+	{
+		stream << namedVariables.size() << " named variables, " << localEvents.size() << " local events, " << nativeFunctions.size() << " native functions";
+	}
+	
+	//
+	
 	void Variables::serializeSpecific()
 	{
 		add(start);
@@ -560,6 +793,87 @@ namespace Aseba
 	
 	//
 	
+	//! Copy the changed variables to memory, a copy of the variables of the node starting at address memoryStart
+	void VariablesDelta::apply(unsigned memoryStart, std::vector<sint16>& memory) const
+	{
+		const unsigned memoryEnd(memoryStart + memory.size());
+		for (size_t i = 0; i < runs.size(); i++)
+		{
+			const Run& run(runs[i]);
+			const unsigned begin(std::max<unsigned>(run.start, memoryStart));
+			const unsigned end(std::min<unsigned>(run.start + run.variables.size(), memoryEnd));
+			for (unsigned address = begin; address < end; address++)
+				memory[address - memoryStart] = run.variables[address - run.start];
+		}
+	}
+	
+	void VariablesDelta::serializeSpecific()
+	{
+		add(start);
+		add(length);
+		for (size_t i = 0; i < runs.size(); i++)
+		{
+			add(runs[i].start);
+			add(uint16(runs[i].variables.size()));
+			for (size_t j = 0; j < runs[i].variables.size(); j++)
+				add(runs[i].variables[j]);
+		}
+	}
+	
+	void VariablesDelta::deserializeSpecific()
+	{
+		start = get<uint16>();
+		length = get<uint16>();
+		runs.clear();
+		while (readPos + 4 <= rawData.size())
+		{
+			Run run;
+			run.start = get<uint16>();
+			run.variables.resize(get<uint16>());
+			for (size_t i = 0; i < run.variables.size(); i++)
+				run.variables[i] = get<sint16>();
+			runs.push_back(run);
+		}
+	}
+	
+	void VariablesDelta::dumpSpecific(wostream &stream) const
+	{
+		size_t changedCount(0);
+		for (size_t i = 0; i < runs.size(); i++)
+			changedCount += runs[i].variables.size();
+		stream << "start " << start << ", length " << length << ", " << changedCount << " changed in " << runs.size() << " runs";
+	}
+	
+	//
+	
+	void VariablesUnsubscribed::serializeSpecific()
+	{
+		add(start);
+		add(length);
+		add(reason);
+	}
+	
+	void VariablesUnsubscribed::deserializeSpecific()
+	{
+		start = get<uint16>();
+		length = get<uint16>();
+		reason = get<uint16>();
+	}
+	
+	void VariablesUnsubscribed::dumpSpecific(wostream &stream) const
+	{
+		stream << "start " << start << ", length " << length;
+		switch (reason)
+		{
+			case ASEBA_UNSUBSCRIBED_BY_CLIENT: stream << ", by a client"; break;
+			case ASEBA_UNSUBSCRIBED_NO_ROOM: stream << ", no room"; break;
+			case ASEBA_UNSUBSCRIBED_EXPIRED: stream << ", expired"; break;
+			default: stream << ", reason " << reason; break;
+		}
+	}
+	
+	//
+	
 	void ArrayAccessOutOfBounds::serializeSpecific()
 	{
 		add(pc);
@@ -953,4 +1267,76 @@ namespace Aseba
 		
 		stream << "start " << start << ", variables vector of size " << variables.size();
 	}
+	
+	//
+	
+	SubscribeVariables::SubscribeVariables(uint16 dest, uint16 start, uint16 length, uint16 period, bool onChange) :
+		CmdMessage(ASEBA_MESSAGE_SUBSCRIBE_VARIABLES, dest),
+		start(start),
+		length(length),
+		period(period),
+		onChange(onChange ? 1 : 0)
+	{
+	}
+	
+	void SubscribeVariables::serializeSpecific()
+	{
+		CmdMessage::serializeSpecific();
+		
+		add(start);
+		add(length);
+		add(period);
+		add(onChange);
+	}
+	
+	void SubscribeVariables::deserializeSpecific()
+	{
+		CmdMessage::deserializeSpecific();
+		
+		start = get<uint16>();
+		length = get<uint16>();
+		period = get<uint16>();
+		onChange = get<uint16>();
+	}
+	
+	void SubscribeVariables::dumpSpecific(wostream &stream) const
+	{
+		CmdMessage::dumpSpecific(stream);
+		
+		stream << "start " << start << ", length " << length << ", period " << period << " ms";
+		if (onChange)
+			stream << ", on change";
+	}
+	
+	//
+	
+	UnsubscribeVariables::UnsubscribeVariables(uint16 dest, uint16 start, uint16 length) :
+		CmdMessage(ASEBA_MESSAGE_UNSUBSCRIBE_VARIABLES, dest),
+		start(start),
+		length(length)
+	{
+	}
+	
+	void UnsubscribeVariables::serializeSpecific()
+	{
+		CmdMessage::serializeSpecific();
+		
+		add(start);
+		add(length);
+	}
+	
+	void UnsubscribeVariables::deserializeSpecific()
+	{
+		CmdMessage::deserializeSpecific();
+		
+		start = get<uint16>();
+		length = get<uint16>();
+	}
+	
+	void UnsubscribeVariables::dumpSpecific(wostream &stream) const
+	{
+		CmdMessage::dumpSpecific(stream);
+		
+		stream << "start " << start << ", length " << length;
+	}
 } // namespace Aseba
@@ -63,14 +63,67 @@ namespace Aseba
 		virtual void deserializeSpecific() = 0;
 		virtual void dumpSpecific(std::wostream &stream) const = 0;
 		virtual operator const char * () const { return "message super class"; }
+		
+		void deserialize();
 	
 	protected:
 		template<typename T> void add(const T& val);
 		template<typename T> T get();
+		void addEmbedded(Message& message);
+		void getEmbedded(Message& message);
 		
 	protected:
 		std::vector<uint8> rawData;
 		size_t readPos;
+		
+		friend class RawMessage;
+	};
+	
+	//! A message kept in its network format, in a buffer reused from one message to the next
+	/*!
+		Receiving a RawMessage neither allocates memory nor decodes the payload:
+		the packet is read in place, its header and payload words are decoded
+		on demand, and it can be written back as is to other streams.
+		This makes it suitable for routing; use decode() to get the corresponding
+		typed Message when its fields are actually needed.
+	*/
+	class RawMessage
+	{
+	public:
+		RawMessage();
+		
+		void receive(Dashel::Stream* stream);
+		void serialize(Dashel::Stream* stream) const;
+		Message *decode() const;
+		
+		uint16 getSource() const;
+		void setSource(uint16 source);
+		uint16 getType() const;
+		//! Return whether this is an event emitted by a script, as opposed to a bootloader or debug message
+		bool isUserMessage() const { return getType() < ASEBA_MESSAGE_BOOTLOADER_RESET; }
+		bool isCommand() const;
+		uint16 getDest() const;
+		void setDest(uint16 dest);
+		
+		//! Return the size of the payload, in bytes
+		size_t getPayloadSize() const { return payloadSize; }
+		//! Return a pointer to the payload, valid until the next call to receive()
+		const uint8 *getPayload() const { return buffer + headerSize; }
+		//! Return the number of 16-bit words of the payload
+		size_t getWordsCount() const { return payloadSize / 2; }
+		uint16 getWord(size_t index) const;
+		void setWord(size_t index, uint16 value);
+		
+	protected:
+		//! Size of the header: len, source, type
+		static const size_t headerSize = 6;
+		
+		uint16 getBufferWord(size_t pos) const;
+		void setBufferWord(size_t pos, uint16 value);
+		
+	protected:
+		uint8 buffer[ASEBA_MAX_OUTER_PACKET_SIZE];
+		size_t payloadSize;
 	};
 	
 	//! Any message sent by a script on a node
@@ -220,6 +273,42 @@ namespace Aseba
 		virtual operator const char * () const { return "native function description"; }
 	};
 	
+	//! Presence of a node, with a hash of its description; a client that does not know this description requests it using GetNodeDescription
+	class DescriptionHash : public Message
+	{
+	public:
+		std::wstring name; //!< name of the node
+		uint16 protocolVersion; //!< version of the protocol of the node
+		uint16 crc; //!< hash of the description of the node, as given by TargetDescription::crc()
+		
+	public:
+		DescriptionHash() : Message(ASEBA_MESSAGE_DESCRIPTION_HASH), protocolVersion(0), crc(0) { }
+		
+	protected:
+		virtual void serializeSpecific();
+		virtual void deserializeSpecific();
+		virtual void dumpSpecific(std::wostream &stream) const;
+		virtual operator const char * () const { return "description hash"; }
+	};
+	
+	//! Several named variables, local events and native functions descriptions of a node in a single message, the description of the node itself must have been sent first
+	class PackedDescription : public Message
+	{
+	public:
+		std::vector<NamedVariableDescription> namedVariables;
+		std::vector<LocalEventDescription> localEvents;
+		std::vector<NativeFunctionDescription> nativeFunctions;
+		
+	public:
+		PackedDescription() : Message(ASEBA_MESSAGE_PACKED_DESCRIPTION) { }
+		
+	protected:
+		virtual void serializeSpecific();
+		virtual void deserializeSpecific();
+		virtual void dumpSpecific(std::wostream &stream) const;
+		virtual operator const char * () const { return "packed description"; }
+	};
+	
 	//! A node has disconnected from the network
 	class Disconnected : public Message
 	{
@@ -250,6 +339,52 @@ namespace Aseba
 		virtual operator const char * () const { return "variables"; }
 	};
 	
+	//! Variables of a subscription that changed since the node last sent them; the others kept the value last sent
+	class VariablesDelta : public Message
+	{
+	public:
+		//! Consecutive variables, some of which changed
+		struct Run
+		{
+			uint16 start;
+			std::vector<sint16> variables;
+		};
+		typedef std::vector<Run> RunsVector;
+		
+		uint16 start; //!< address of the first variable of the range that was sent
+		uint16 length; //!< number of variables of the range that was sent
+		RunsVector runs; //!< changed variables, in increasing addresses
+		
+	public:
+		VariablesDelta() : Message(ASEBA_MESSAGE_VARIABLES_DELTA), start(0), length(0) { }
+		
+		void apply(unsigned memoryStart, std::vector<sint16>& memory) const;
+		
+	protected:
+		virtual void serializeSpecific();
+		virtual void deserializeSpecific();
+		virtual void dumpSpecific(std::wostream &stream) const;
+		virtual operator const char * () const { return "variables delta"; }
+	};
+	
+	//! The node stopped sending some variables by itself
+	class VariablesUnsubscribed : public Message
+	{
+	public:
+		uint16 start;
+		uint16 length;
+		uint16 reason; //!< see AsebaUnsubscribedReasons
+		
+	public:
+		VariablesUnsubscribed() : Message(ASEBA_MESSAGE_VARIABLES_UNSUBSCRIBED), start(0), length(0), reason(ASEBA_UNSUBSCRIBED_BY_CLIENT) { }
+		
+	protected:
+		virtual void serializeSpecific();
+		virtual void deserializeSpecific();
+		virtual void dumpSpecific(std::wostream &stream) const;
+		virtual operator const char * () const { return "variables unsubscribed"; }
+	};
+	
 	//! Exception: an array acces attempted to read past memory
 	class ArrayAccessOutOfBounds : public Message
 	{
@@ -635,6 +770,55 @@ namespace Aseba
 		virtual operator const char * () const { return "sleep"; }
 	};
 	
+	//! Ask a node to send some variables by itself, every period ms or, if onChange is set, when they changed since the last send
+	class SubscribeVariables : public CmdMessage
+	{
+	public:
+		uint16 start;
+		uint16 length;
+		uint16 period;
+		uint16 onChange;
+		
+	public:
+		SubscribeVariables() : CmdMessage(ASEBA_MESSAGE_SUBSCRIBE_VARIABLES, ASEBA_DEST_INVALID) { }
+		SubscribeVariables(uint16 dest, uint16 start, uint16 length, uint16 period, bool onChange);
+		
+	protected:
+		virtual void serializeSpecific();
+		virtual void deserializeSpecific();
+		virtual void dumpSpecific(std::wostream &stream) const;
+		virtual operator const char * () const { return "subscribe variables"; }
+	};
+	
+	//! Stop a node from sending some variables it was subscribed to
+	class UnsubscribeVariables : public CmdMessage
+	{
+	public:
+		uint16 start;
+		uint16 length;
+		
+	public:
+		UnsubscribeVariables() : CmdMessage(ASEBA_MESSAGE_UNSUBSCRIBE_VARIABLES, ASEBA_DEST_INVALID) { }
+		UnsubscribeVariables(uint16 dest, uint16 start, uint16 length);
+		
+	protected:
+		virtual void serializeSpecific();
+		virtual void deserializeSpecific();
+		virtual void dumpSpecific(std::wostream &stream) const;
+		virtual operator const char * () const { return "unsubscribe variables"; }
+	};
+	
+	//! Request a node to send its full description
+	class GetNodeDescription : public CmdMessage
+	{
+	public:
+		GetNodeDescription() : CmdMessage(ASEBA_MESSAGE_GET_NODE_DESCRIPTION, ASEBA_DEST_INVALID) { }
+		GetNodeDescription(uint16 dest) : CmdMessage(ASEBA_MESSAGE_GET_NODE_DESCRIPTION, dest) { }
+		
+	protected:
+		virtual operator const char * () const { return "get node description"; }
+	};
+	
 	/*@}*/
 } // namespace Aseba
 
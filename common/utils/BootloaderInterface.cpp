@@ -26,6 +26,7 @@
 #include "FormatableString.h"
 #include <dashel/dashel.h>
 #include <memory>
+#include <algorithm>
 #include <unistd.h>
 
 namespace Aseba 
@@ -38,7 +39,9 @@ namespace Aseba
 		dest(dest),
 		pageSize(0),
 		pagesStart(0),
-		pagesCount(0)
+		pagesCount(0),
+		skipUnchangedPages(false),
+		maxPagesInFlight(1)
 	{
 		
 	}
@@ -54,14 +57,13 @@ namespace Aseba
 		BootloaderReadPage message;
 		message.dest = dest;
 		message.pageNumber = pageNumber;
-		message.serialize(stream);
-		stream->flush();
+		sendMessage(message, true);
 		unsigned dataRead = 0;
 		
 		// get data
 		while (true)
 		{
-			auto_ptr<Message> message(Message::receive(stream));
+			auto_ptr<Message> message(receiveMessage());
 			
 			// handle ack
 			BootloaderAck *ackMessage = dynamic_cast<BootloaderAck *>(message.get());
@@ -83,11 +85,14 @@ namespace Aseba
 			if (dataMessage && (dataMessage->source == dest))
 			{
 				if (dataRead >= pageSize)
+				{
 					cerr << "Warning, reading oversized page (" << dataRead << "/" << pageSize << ") bytes.\n";
-				copy(dataMessage->data, dataMessage->data + sizeof(dataMessage->data), data);
-				data += sizeof(dataMessage->data);
-				dataRead += sizeof(dataMessage->data);
-				cout << "Page read so far (" << dataRead << "/" << pageSize << ") bytes.\n";
+					continue;
+				}
+				const unsigned amountToCopy = min<unsigned>(sizeof(dataMessage->data), pageSize - dataRead);
+				copy(dataMessage->data, dataMessage->data + amountToCopy, data);
+				data += amountToCopy;
+				dataRead += amountToCopy;
 			}
 		}
 		
@@ -99,14 +104,20 @@ namespace Aseba
 		BootloaderReadPage message;
 		message.dest = dest;
 		message.pageNumber = pageNumber;
-		message.serialize(stream);
-		stream->flush();
+		sendMessage(message, true);
 		
-		stream->read(data, 2048);
+		receiveData(data, 2048);
 		return true;
 	}
 	
 	bool BootloaderInterface::writePage(unsigned pageNumber, const uint8 *data, bool simple)
+	{
+		if (!sendPage(pageNumber, data, simple))
+			return false;
+		return receivePageAck();
+	}
+	
+	bool BootloaderInterface::sendPage(unsigned pageNumber, const uint8 *data, bool simple)
 	{
 		writePageStart(pageNumber, data, simple);
 		
@@ -114,33 +125,23 @@ namespace Aseba
 		BootloaderWritePage writePage;
 		writePage.dest = dest;
 		writePage.pageNumber = pageNumber;
-		writePage.serialize(stream);
 		
 		if (simple)
 		{
 			// just write the complete page at ounce
-			stream->write(data,pageSize);
+			sendMessage(writePage, false);
+			sendData(data, pageSize);
 		}
 		else
 		{
 			// flush command
-			stream->flush();
+			sendMessage(writePage, true);
 			
 			// wait ACK
-			while (true)
+			if (!waitAck())
 			{
-				auto_ptr<Message> message(Message::receive(stream));
-				
-				// handle ack
-				BootloaderAck *ackMessage = dynamic_cast<BootloaderAck *>(message.get());
-				if (ackMessage && (ackMessage->source == dest))
-				{
-					uint16 errorCode = ackMessage->errorCode;
-					if(errorCode == BootloaderAck::SUCCESS)
-						break;
-					else
-						return false;
-				}
+				writePageFailure(pageNumber);
+				return false;
 			}
 			
 			// write data
@@ -149,59 +150,73 @@ namespace Aseba
 				BootloaderPageDataWrite pageData;
 				pageData.dest = dest;
 				copy(data + dataWritten, data + dataWritten + sizeof(pageData.data), pageData.data);
-				pageData.serialize(stream);
 				dataWritten += sizeof(pageData.data);
-				//cout << "." << std::flush;
-				
-				/*
-				while (true)
-				{
-					auto_ptr<Message> message(Message::receive(stream));
-					
-					// handle ack
-					BootloaderAck *ackMessage = dynamic_cast<BootloaderAck *>(message);
-					if (ackMessage && (ackMessage->source == dest))
-					{
-						uint16 errorCode = ackMessage->errorCode;
-						if(errorCode == BootloaderAck::SUCCESS)
-							break;
-						else
-							return false;
-					}
-				}
-				*/
+				// flush only after the last chunk to save bandwidth
+				sendMessage(pageData, dataWritten >= pageSize);
 			}
-			
 		}
 		
-		// flush only here to save bandwidth
-		stream->flush();
+		pagesInFlight.push_back(PageInFlight(pageNumber));
+		return true;
+	}
+	
+	bool BootloaderInterface::receivePageAck()
+	{
+		const PageInFlight page(pagesInFlight.front());
+		pagesInFlight.pop_front();
 		
+		writePageWaitAck(page.number);
+		if (waitAck())
+		{
+			writePageSuccess(page.number, unsigned((UnifiedTime() - page.start).value));
+			return true;
+		}
+		else
+		{
+			writePageFailure(page.number);
+			return false;
+		}
+	}
+	
+	void BootloaderInterface::completePage(bool simple)
+	{
+		const unsigned pageNumber(pagesInFlight.front().number);
+		if (!receivePageAck())
+		{
+			if (simple)
+				errorWritePageNonFatal(pageNumber);
+			else
+				throw Error(FormatableString("Error while writing page %0").arg(pageNumber));
+		}
+	}
+	
+	bool BootloaderInterface::waitAck()
+	{
 		while (true)
 		{
-			writePageWaitAck();
-			auto_ptr<Message> message(Message::receive(stream));
+			auto_ptr<Message> message(receiveMessage());
 			
 			// handle ack
 			BootloaderAck *ackMessage = dynamic_cast<BootloaderAck *>(message.get());
 			if (ackMessage && (ackMessage->source == dest))
-			{
-				uint16 errorCode = ackMessage->errorCode;
-				if(errorCode == BootloaderAck::SUCCESS)
-				{
-					writePageSuccess();
-					return true;
-				}
-				else
-				{
-					writePageFailure();
-					return false;
-				}
-			}
+				return ackMessage->errorCode == BootloaderAck::SUCCESS;
 		}
-		
-		// should not happen
-		return true;
+	}
+	
+	bool BootloaderInterface::isPageUnchanged(unsigned pageNumber, const vector<uint8>& data, bool simple)
+	{
+		vector<uint8> current(max<unsigned>(pageSize, 2048), 0);
+		if (simple)
+		{
+			if (!readPageSimple(pageNumber, &current[0]))
+				return false;
+		}
+		else
+		{
+			if (!readPage(pageNumber, &current[0]))
+				return false;
+		}
+		return equal(data.begin(), data.end(), current.begin());
 	}
 	
 	void BootloaderInterface::writeHex(const string &fileName, bool reset, bool simple)
@@ -210,13 +225,15 @@ namespace Aseba
 		HexFile hexFile;
 		hexFile.read(fileName);
 		
+		if (!simple && maxPagesInFlight > 1)
+			throw Error("Writing several pages in flight requires the simple protocol");
+		
 		writeHexStart(fileName, reset, simple);
 		
 		if (reset) 
 		{
 			Reboot msg(dest);
-			msg.serialize(stream);
-			stream->flush();
+			sendMessage(msg, true);
 			
 			writeHexEnteringBootloader();
 		}
@@ -230,7 +247,7 @@ namespace Aseba
 			// wait for disconnected message
 			while (true)
 			{
-				auto_ptr<Message> message(Message::receive(stream));
+				auto_ptr<Message> message(receiveMessage());
 				Disconnected* disconnectedMessage(dynamic_cast<Disconnected*>(message.get()));
 				if (disconnectedMessage)
 					break;
@@ -244,7 +261,7 @@ namespace Aseba
 			// get bootloader description
 			while (true)
 			{
-				auto_ptr<Message> message(Message::receive(stream));
+				auto_ptr<Message> message(receiveMessage());
 				BootloaderDescription *bDescMessage = dynamic_cast<BootloaderDescription *>(message.get());
 				if (bDescMessage && (bDescMessage->source == dest))
 				{
@@ -294,49 +311,89 @@ namespace Aseba
 		
 		writeHexGotDescription(pageMap.size());
 		
-		if (simple)
+		// List pages to write, in simple mode page 0 is written last as it holds the reset vector
+		vector<unsigned> pagesToWrite;
+		for (PageMap::iterator it = pageMap.begin(); it != pageMap.end(); it ++)
 		{
-			// Write pages
-			for (PageMap::iterator it = pageMap.begin(); it != pageMap.end(); it ++)
+			unsigned pageIndex = it->first;
+			if (simple)
 			{
-				unsigned pageIndex = it->first;
 				if (pageIndex != 0)
-					if (!writePage(pageIndex, &it->second[0], true))
-						errorWritePageNonFatal(pageIndex);
+					pagesToWrite.push_back(pageIndex);
 			}
-			// Now look for the index 0 page
-			for (PageMap::iterator it = pageMap.begin(); it != pageMap.end(); it ++)
+			else if ((pageIndex >= pagesStart) && (pageIndex < pagesStart + pagesCount))
+				pagesToWrite.push_back(pageIndex);
+		}
+		if (simple && (pageMap.find(0) != pageMap.end()))
+			pagesToWrite.push_back(0);
+		
+		// Read pages back and drop the ones already holding the right content
+		if (skipUnchangedPages)
+		{
+			vector<unsigned> changedPages;
+			for (size_t i = 0; i < pagesToWrite.size(); ++i)
 			{
-				unsigned pageIndex = it->first;
-				if (pageIndex == 0)
-					if (!writePage(pageIndex, &it->second[0], true))
-						errorWritePageNonFatal(pageIndex);
+				const unsigned pageIndex = pagesToWrite[i];
+				if (isPageUnchanged(pageIndex, pageMap[pageIndex], simple))
+					writePageSkipped(pageIndex);
+				else
+					changedPages.push_back(pageIndex);
 			}
+			pagesToWrite.swap(changedPages);
 		}
-		else
+		
+		// Write pages, keeping at most maxPagesInFlight pages not acknowledged
+		pagesInFlight.clear();
+		for (size_t i = 0; i < pagesToWrite.size(); ++i)
 		{
-			// Write pages
-			for (PageMap::iterator it = pageMap.begin(); it != pageMap.end(); it ++)
+			const unsigned pageIndex = pagesToWrite[i];
+			while (pagesInFlight.size() >= maxPagesInFlight)
+				completePage(simple);
+			if (!sendPage(pageIndex, &pageMap[pageIndex][0], simple))
 			{
-				unsigned pageIndex = it->first;
-				if ((pageIndex >= pagesStart) && (pageIndex < pagesStart + pagesCount))
-					if (!writePage(pageIndex, &it->second[0], false))
-						throw Error(FormatableString("Error while writing page %0").arg(pageIndex));
+				if (simple)
+					errorWritePageNonFatal(pageIndex);
+				else
+					throw Error(FormatableString("Error while writing page %0").arg(pageIndex));
 			}
 		}
+		while (!pagesInFlight.empty())
+			completePage(simple);
 		
 		writeHexWritten();
 
 		if (reset) 
 		{
 			BootloaderReset msg(dest);
-			msg.serialize(stream);
-			stream->flush();
+			sendMessage(msg, true);
 			
 			writeHexExitingBootloader();
 		}
 	}
 	
+	void BootloaderInterface::sendMessage(Message& message, bool flush)
+	{
+		message.serialize(stream);
+		if (flush)
+			stream->flush();
+	}
+	
+	Message* BootloaderInterface::receiveMessage()
+	{
+		return Message::receive(stream);
+	}
+	
+	void BootloaderInterface::sendData(const uint8* data, size_t size)
+	{
+		stream->write(data, size);
+		stream->flush();
+	}
+	
+	void BootloaderInterface::receiveData(uint8* data, size_t size)
+	{
+		stream->read(data, size);
+	}
+	
 	void BootloaderInterface::readHex(const string &fileName)
 	{
 		HexFile hexFile;
@@ -23,7 +23,10 @@
 
 #include <string>
 #include <stdexcept>
+#include <vector>
+#include <deque>
 #include "../types.h"
+#include "utils.h"
 
 
 namespace Dashel
@@ -33,6 +36,8 @@ namespace Dashel
 
 namespace Aseba 
 {
+	class Message;
+	
 	// TODO: change API to use HexFile instead of file names
 	
 	//! Manage interactions with an aseba-compatible bootloader
@@ -42,6 +47,13 @@ namespace Aseba
 		as it transmits all data using the Aseba message protocol.
 		The simple version requires direct access to the device to be flashed,
 		because it breaks the Aseba message protocol for page transmission.
+		
+		When writing an hex file, pages whose content is already on the device
+		can be read back and skipped. With the simple protocol, several pages can
+		be written without waiting for the acknowledgement of the previous ones,
+		if the bootloader processes its commands in order. The complete protocol
+		cannot do so, as the data of a page can only be sent once its write command
+		is acknowledged, which happens after the previous page is written.
 	*/
 	class BootloaderInterface
 	{
@@ -61,6 +73,12 @@ namespace Aseba
 		//! Return the size of a page
 		int getPageSize() const { return pageSize; }
 		
+		//! If skip is true, writeHex() reads pages back and does not write the ones already holding the right content
+		void setSkipUnchangedPages(bool skip) { skipUnchangedPages = skip; }
+		
+		//! Set how many pages writeHex() can write before waiting for the acknowledgement of the first one; 1 waits for every page, more requires the simple protocol
+		void setPagesInFlight(unsigned count) { maxPagesInFlight = count > 0 ? count : 1; }
+		
 		//! Read a page
 		bool readPage(unsigned pageNumber, uint8* data);
 		
@@ -81,9 +99,10 @@ namespace Aseba
 		
 		// progress
 		virtual void writePageStart(unsigned pageNumber, const uint8* data, bool simple) {}
-		virtual void writePageWaitAck() {}
-		virtual void writePageSuccess() {}
-		virtual void writePageFailure() {}
+		virtual void writePageWaitAck(unsigned pageNumber) {}
+		virtual void writePageSuccess(unsigned pageNumber, unsigned milliseconds) {}
+		virtual void writePageFailure(unsigned pageNumber) {}
+		virtual void writePageSkipped(unsigned pageNumber) {}
 		
 		virtual void writeHexStart(const std::string &fileName, bool reset, bool simple) {}
 		virtual void writeHexEnteringBootloader() {}
@@ -96,13 +115,50 @@ namespace Aseba
 		//! Warn about an error but do not quit
 		virtual void errorWritePageNonFatal(unsigned pageNumber) {}
 		
+		// message exchange, override to share the stream with other users
+		
+		//! Send a message to the bootloader, flushing the stream if flush is true
+		virtual void sendMessage(Message& message, bool flush);
+		//! Receive the next message from the stream, the caller takes ownership of it
+		virtual Message* receiveMessage();
+		//! Send raw data following a message, as the simple protocol does for pages, and flush the stream
+		virtual void sendData(const uint8* data, size_t size);
+		//! Receive raw data, as the simple protocol does for pages that are read
+		virtual void receiveData(uint8* data, size_t size);
+		
 	protected:
+		// internal functions
+		
+		//! Send a page to write, without waiting for its final acknowledgement; return false if the bootloader refused it
+		bool sendPage(unsigned pageNumber, const uint8 *data, bool simple);
+		//! Wait for the acknowledgement of the oldest page in flight, return whether it was written successfully
+		bool receivePageAck();
+		//! Wait for the acknowledgement of the oldest page in flight, report or throw on failure
+		void completePage(bool simple);
+		//! Wait for an acknowledgement from the bootloader, return whether it reports success
+		bool waitAck();
+		//! Read a page back and return whether it already holds data
+		bool isPageUnchanged(unsigned pageNumber, const std::vector<uint8>& data, bool simple);
+		
+	protected:
+		//! A page sent to the bootloader but not acknowledged yet
+		struct PageInFlight
+		{
+			unsigned number;
+			UnifiedTime start;
+			PageInFlight(unsigned number) : number(number) {}
+		};
+		
+
 		// member variables
 		Dashel::Stream* stream;
 		int dest;
 		unsigned pageSize;
 		unsigned pagesStart;
 		unsigned pagesCount;
+		bool skipUnchangedPages;
+		unsigned maxPagesInFlight;
+		std::deque<PageInFlight> pagesInFlight;
 	};
 } // namespace Aseba
 
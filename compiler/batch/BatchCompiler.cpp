@@ -0,0 +1,490 @@
+/*
+	Aseba - an event-based framework for distributed robot control
+	Copyright (C) 2007--2013:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+		and other contributors, see authors.txt for details
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "BatchCompiler.h"
+#include "../../common/consts.h"
+#include <QFile>
+#include <QDir>
+#include <QFileInfo>
+#include <QDataStream>
+#include <QCryptographicHash>
+#include <QCoreApplication>
+#include <QDomDocument>
+#include <QVector>
+#include <QHash>
+#include <QMutexLocker>
+#include <QtConcurrentMap>
+#include <sstream>
+#include <algorithm>
+#include <sys/types.h>
+#ifndef WIN32
+#include <utime.h>
+#else // WIN32
+#include <sys/utime.h>
+#endif // WIN32
+
+namespace Aseba
+{
+	/** \addtogroup compiler */
+	/*@{*/
+
+	// AeslProject
+
+	//! Load the project from fileName, return false and set errorMessage on error
+	bool AeslProject::load(const QString& fileName, QString& errorMessage)
+	{
+		commonDefinitions.clear();
+		programs.clear();
+
+		QFile file(fileName);
+		if (!file.open(QFile::ReadOnly))
+		{
+			errorMessage = QString("Cannot open file %0").arg(fileName);
+			return false;
+		}
+
+		QDomDocument document("aesl-source");
+		QString errorMsg;
+		int errorLine;
+		int errorColumn;
+		if (!document.setContent(&file, false, &errorMsg, &errorLine, &errorColumn))
+		{
+			errorMessage = QString("Error in XML source file: %0 at line %1, column %2").arg(errorMsg).arg(errorLine).arg(errorColumn);
+			return false;
+		}
+
+		QDomNode domNode = document.documentElement().firstChild();
+		while (!domNode.isNull())
+		{
+			if (domNode.isElement())
+			{
+				QDomElement element = domNode.toElement();
+				if (element.tagName() == "node")
+				{
+					programs.push_back(AeslNodeProgram(
+						element.attribute("name").toStdWString(),
+						element.attribute("nodeId", 0).toUInt(),
+						element.firstChild().toText().data().toStdWString()
+					));
+				}
+				else if (element.tagName() == "event")
+				{
+					const QString eventName(element.attribute("name"));
+					const unsigned eventSize(element.attribute("size").toUInt());
+					if (eventSize > ASEBA_MAX_EVENT_ARG_SIZE)
+					{
+						errorMessage = QString("Event %1 has a length %2 larger than maximum %3").arg(eventName).arg(eventSize).arg(ASEBA_MAX_EVENT_ARG_SIZE);
+						return false;
+					}
+					commonDefinitions.events.push_back(NamedValue(eventName.toStdWString(), eventSize));
+				}
+				else if (element.tagName() == "constant")
+				{
+					commonDefinitions.constants.push_back(NamedValue(element.attribute("name").toStdWString(), element.attribute("value").toUInt()));
+				}
+			}
+			domNode = domNode.nextSibling();
+		}
+		return true;
+	}
+
+	// BatchCompiler
+
+	//! A compilation to run on the thread pool
+	struct PendingCompilation
+	{
+		const BatchCompiler::Job* job;
+		const CommonDefinitions* commonDefinitions;
+		CompiledProgram result;
+	};
+
+	//! Compile pending->job with its own compiler, called from the thread pool
+	static void compilePending(PendingCompilation& pending)
+	{
+		Compiler compiler;
+		compiler.setTargetDescription(pending.job->targetDescription);
+		compiler.setCommonDefinitions(pending.commonDefinitions);
+
+		std::wistringstream is(pending.job->source);
+		CompiledProgram& result(pending.result);
+		result.success = compiler.compile(is, result.bytecode, result.allocatedVariablesCount, result.error);
+		if (result.success)
+		{
+			result.variablesMap = *compiler.getVariablesMap();
+			result.subroutineTable = *compiler.getSubroutineTable();
+		}
+	}
+
+	//! Return whether the two vectors have the same names and values, in the same order
+	static bool sameNamedValues(const NamedValuesVector& a, const NamedValuesVector& b)
+	{
+		if (a.size() != b.size())
+			return false;
+		for (size_t i = 0; i < a.size(); ++i)
+			if (a[i].name != b[i].name || a[i].value != b[i].value)
+				return false;
+		return true;
+	}
+
+	//! Version of the format of the files of the disk cache, to increment when it changes
+	static const quint32 diskCacheFormatVersion = 1;
+
+	uint qHash(const BatchCompiler::CacheKey& key)
+	{
+		// FNV-1a
+		uint hash(2166136261u ^ key.targetCrc);
+		for (size_t i = 0; i < key.source.size(); ++i)
+		{
+			hash ^= uint(key.source[i]);
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+
+	BatchCompiler::BatchCompiler() :
+		cache(DEFAULT_CACHE_SIZE),
+		diskCacheMaxSize(DEFAULT_DISK_CACHE_SIZE),
+		diskCacheSize(0),
+		cacheHitsCount(0),
+		diskCacheHitsCount(0),
+		cacheMissesCount(0)
+	{
+	}
+
+	/*!
+		Compile jobs with commonDefinitions, and return their results in the same order.
+		The jobs that are not in the cache are compiled concurrently, identical ones only once.
+	*/
+	BatchCompiler::CompiledProgramsVector BatchCompiler::compile(const JobsVector& jobs, const CommonDefinitions& commonDefinitions)
+	{
+		CompiledProgramsVector results(jobs.size());
+
+		// look into the cache, and collect the distinct jobs to compile
+		QVector<PendingCompilation> pendings;
+		std::vector<int> pendingIndexes(jobs.size(), -1);
+		{
+			QMutexLocker locker(&mutex);
+			useCommonDefinitions(commonDefinitions);
+			QHash<CacheKey, int> pendingsByKey;
+			for (size_t i = 0; i < jobs.size(); ++i)
+			{
+				const CacheKey key(jobs[i]);
+				const CompiledProgram* cached(cache.object(key));
+				if (cached)
+				{
+					results[i] = *cached;
+					++cacheHitsCount;
+				}
+				else if (pendingsByKey.contains(key))
+				{
+					pendingIndexes[i] = pendingsByKey.value(key);
+					++cacheHitsCount;
+				}
+				else if (loadFromDisk(jobs[i], results[i]))
+				{
+					cache.insert(key, new CompiledProgram(results[i]));
+					++diskCacheHitsCount;
+				}
+				else
+				{
+					PendingCompilation pending;
+					pending.job = &jobs[i];
+					pending.commonDefinitions = &commonDefinitions;
+					pendingIndexes[i] = pendings.size();
+					pendingsByKey[key] = pendings.size();
+					pendings.push_back(pending);
+				}
+			}
+		}
+
+		// compile them
+		if (pendings.size() > 1)
+			QtConcurrent::blockingMap(pendings, compilePending);
+		else if (pendings.size() == 1)
+			compilePending(pendings[0]);
+
+		// store them in the cache
+		{
+			QMutexLocker locker(&mutex);
+			useCommonDefinitions(commonDefinitions);
+			cacheMissesCount += pendings.size();
+			for (int i = 0; i < pendings.size(); ++i)
+			{
+				if (pendings[i].result.success)
+					cache.insert(CacheKey(*pendings[i].job), new CompiledProgram(pendings[i].result));
+				saveToDisk(*pendings[i].job, pendings[i].result);
+			}
+			if (!pendings.empty())
+				evictFromDisk();
+		}
+
+		for (size_t i = 0; i < jobs.size(); ++i)
+			if (pendingIndexes[i] >= 0)
+				results[i] = pendings[pendingIndexes[i]].result;
+		return results;
+	}
+
+	//! If job was compiled with commonDefinitions, copy its result to program and return true
+	bool BatchCompiler::findInCache(const Job& job, const CommonDefinitions& commonDefinitions, CompiledProgram& program)
+	{
+		QMutexLocker locker(&mutex);
+		useCommonDefinitions(commonDefinitions);
+		const CompiledProgram* cached(cache.object(CacheKey(job)));
+		if (cached)
+		{
+			program = *cached;
+			++cacheHitsCount;
+			return true;
+		}
+		if (loadFromDisk(job, program))
+		{
+			cache.insert(CacheKey(job), new CompiledProgram(program));
+			++diskCacheHitsCount;
+			return true;
+		}
+		return false;
+	}
+
+	//! Add program, which is the result of compiling job with commonDefinitions elsewhere, to the cache if it is a successful compilation
+	void BatchCompiler::addToCache(const Job& job, const CommonDefinitions& commonDefinitions, const CompiledProgram& program)
+	{
+		QMutexLocker locker(&mutex);
+		useCommonDefinitions(commonDefinitions);
+		++cacheMissesCount;
+		if (!program.success)
+			return;
+		cache.insert(CacheKey(job), new CompiledProgram(program));
+		saveToDisk(job, program);
+		evictFromDisk();
+	}
+
+	//! Clear the cache in memory, the disk cache is kept
+	void BatchCompiler::clearCache()
+	{
+		QMutexLocker locker(&mutex);
+		cache.clear();
+	}
+
+	//! Keep at most maxPrograms programs in the cache in memory, dropping the least recently used ones
+	void BatchCompiler::setCacheSize(int maxPrograms)
+	{
+		QMutexLocker locker(&mutex);
+		cache.setMaxCost(maxPrograms);
+	}
+
+	//! Store successful compilations in directory, removing the least recently used ones beyond maxSize bytes; an empty directory disables the disk cache
+	void BatchCompiler::setDiskCache(const QString& directory, qint64 maxSize)
+	{
+		QMutexLocker locker(&mutex);
+		diskCacheDirectory = directory;
+		diskCacheMaxSize = maxSize;
+		if (!diskCacheDirectory.isEmpty())
+		{
+			QDir().mkpath(diskCacheDirectory);
+			scanDiskCache();
+		}
+	}
+
+	//! Return the number of compilations avoided, because their result was in the cache or being compiled
+	unsigned BatchCompiler::getCacheHitsCount() const
+	{
+		QMutexLocker locker(&mutex);
+		return cacheHitsCount;
+	}
+
+	//! Return the number of compilations avoided, because their result was in the disk cache
+	unsigned BatchCompiler::getDiskCacheHitsCount() const
+	{
+		QMutexLocker locker(&mutex);
+		return diskCacheHitsCount;
+	}
+
+	//! Return the number of compilations that were not found in any cache
+	unsigned BatchCompiler::getCacheMissesCount() const
+	{
+		QMutexLocker locker(&mutex);
+		return cacheMissesCount;
+	}
+
+	//! Clear the cache if commonDefinitions differ from the ones its programs were compiled with, mutex must be locked
+	void BatchCompiler::useCommonDefinitions(const CommonDefinitions& commonDefinitions)
+	{
+		if (sameNamedValues(commonDefinitions.events, cacheCommonDefinitions.events) && sameNamedValues(commonDefinitions.constants, cacheCommonDefinitions.constants))
+			return;
+		cache.clear();
+		cacheCommonDefinitions = commonDefinitions;
+	}
+
+	//! Return everything the compilation of job depends on, with the current common definitions, mutex must be locked
+	QByteArray BatchCompiler::diskCacheKey(const Job& job) const
+	{
+		QByteArray key;
+		QDataStream stream(&key, QIODevice::WriteOnly);
+		stream.setVersion(QDataStream::Qt_4_0);
+		stream << diskCacheFormatVersion << QString(ASEBA_VERSION) << quint16(ASEBA_PROTOCOL_VERSION) << quint16(job.targetDescription->crc());
+		stream << quint32(cacheCommonDefinitions.events.size());
+		for (size_t i = 0; i < cacheCommonDefinitions.events.size(); ++i)
+			stream << QString::fromStdWString(cacheCommonDefinitions.events[i].name) << qint32(cacheCommonDefinitions.events[i].value);
+		stream << quint32(cacheCommonDefinitions.constants.size());
+		for (size_t i = 0; i < cacheCommonDefinitions.constants.size(); ++i)
+			stream << QString::fromStdWString(cacheCommonDefinitions.constants[i].name) << qint32(cacheCommonDefinitions.constants[i].value);
+		stream << QString::fromStdWString(job.source);
+		return key;
+	}
+
+	//! Return the name of the file of the disk cache for key
+	QString BatchCompiler::diskCacheFileName(const QByteArray& key) const
+	{
+		const QByteArray hash(QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex());
+		return QDir(diskCacheDirectory).filePath(QString::fromLatin1(hash) + ".bytecode");
+	}
+
+	//! If job is in the disk cache, read its result to program and return true, mutex must be locked
+	bool BatchCompiler::loadFromDisk(const Job& job, CompiledProgram& program)
+	{
+		if (diskCacheDirectory.isEmpty())
+			return false;
+
+		const QByteArray key(diskCacheKey(job));
+		QFile file(diskCacheFileName(key));
+		if (!file.open(QFile::ReadOnly))
+			return false;
+		QDataStream stream(&file);
+		stream.setVersion(QDataStream::Qt_4_0);
+
+		// the key is stored as well, so that a collision of hashes cannot give a wrong program
+		QByteArray fileKey;
+		stream >> fileKey;
+		if (fileKey != key)
+		{
+			removeFromDisk(file);
+			return false;
+		}
+
+		CompiledProgram result;
+		quint32 allocatedVariablesCount, count;
+		stream >> allocatedVariablesCount >> count;
+		result.allocatedVariablesCount = allocatedVariablesCount;
+		for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i)
+		{
+			quint16 bytecode, line;
+			stream >> bytecode >> line;
+			result.bytecode.push_back(BytecodeElement(bytecode, line));
+		}
+		stream >> count;
+		for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i)
+		{
+			QString name;
+			quint32 pos, size;
+			stream >> name >> pos >> size;
+			result.variablesMap[name.toStdWString()] = std::make_pair(unsigned(pos), unsigned(size));
+		}
+		stream >> count;
+		for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i)
+		{
+			QString name;
+			quint32 address, line;
+			stream >> name >> address >> line;
+			result.subroutineTable.push_back(Compiler::SubroutineDescriptor(name.toStdWString(), address, line));
+		}
+		if (stream.status() != QDataStream::Ok)
+		{
+			removeFromDisk(file);
+			return false;
+		}
+		file.close();
+
+		// mark the file as recently used, for eviction
+		utime(QFile::encodeName(file.fileName()).constData(), 0);
+
+		result.success = true;
+		program = result;
+		return true;
+	}
+
+	//! Write program, the result of job, to the disk cache if it is a successful compilation, mutex must be locked
+	void BatchCompiler::saveToDisk(const Job& job, const CompiledProgram& program)
+	{
+		if (diskCacheDirectory.isEmpty() || !program.success)
+			return;
+
+		const QByteArray key(diskCacheKey(job));
+		const QString fileName(diskCacheFileName(key));
+		if (QFile::exists(fileName))
+			return;
+
+		// write to a temporary file and rename it, so that other processes never read a partial file
+		QFile file(QString("%0.%1").arg(fileName).arg(QCoreApplication::applicationPid()));
+		if (!file.open(QFile::WriteOnly))
+			return;
+		QDataStream stream(&file);
+		stream.setVersion(QDataStream::Qt_4_0);
+		stream << key;
+		stream << quint32(program.allocatedVariablesCount) << quint32(program.bytecode.size());
+		for (BytecodeVector::const_iterator it(program.bytecode.begin()); it != program.bytecode.end(); ++it)
+			stream << quint16(it->bytecode) << quint16(it->line);
+		stream << quint32(program.variablesMap.size());
+		for (VariablesMap::const_iterator it(program.variablesMap.begin()); it != program.variablesMap.end(); ++it)
+			stream << QString::fromStdWString(it->first) << quint32(it->second.first) << quint32(it->second.second);
+		stream << quint32(program.subroutineTable.size());
+		for (size_t i = 0; i < program.subroutineTable.size(); ++i)
+			stream << QString::fromStdWString(program.subroutineTable[i].name) << quint32(program.subroutineTable[i].address) << quint32(program.subroutineTable[i].line);
+		file.close();
+		if (file.error() != QFile::NoError || !file.rename(fileName))
+			file.remove();
+		else
+			diskCacheSize += file.size();
+	}
+
+	//! Remove file, which cannot be read back, so that the program is written again once compiled, mutex must be locked
+	void BatchCompiler::removeFromDisk(QFile& file)
+	{
+		const qint64 size(file.size());
+		file.close();
+		if (file.remove())
+			diskCacheSize = std::max<qint64>(diskCacheSize - size, 0);
+	}
+
+	//! If the files written since the last scan push the disk cache beyond its maximum size, scan it, mutex must be locked
+	void BatchCompiler::evictFromDisk()
+	{
+		if (!diskCacheDirectory.isEmpty() && diskCacheSize > diskCacheMaxSize)
+			scanDiskCache();
+	}
+
+	//! Remove the least recently used files of the disk cache until it fits its maximum size, and update its size, mutex must be locked
+	void BatchCompiler::scanDiskCache()
+	{
+		// most recently used first
+		const QFileInfoList files(QDir(diskCacheDirectory).entryInfoList(QStringList("*.bytecode"), QDir::Files, QDir::Time));
+		qint64 size(0);
+		diskCacheSize = 0;
+		for (int i = 0; i < files.size(); ++i)
+		{
+			size += files[i].size();
+			if (size > diskCacheMaxSize)
+				QFile::remove(files[i].filePath());
+			else
+				diskCacheSize = size;
+		}
+	}
+
+	/*@}*/
+} // namespace Aseba
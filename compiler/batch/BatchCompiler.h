@@ -0,0 +1,156 @@
+/*
+	Aseba - an event-based framework for distributed robot control
+	Copyright (C) 2007--2013:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+		and other contributors, see authors.txt for details
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ASEBA_BATCH_COMPILER_H
+#define ASEBA_BATCH_COMPILER_H
+
+#include "../compiler.h"
+#include <QString>
+#include <QByteArray>
+#include <QCache>
+#include <QMutex>
+#include <vector>
+#include <string>
+
+class QFile;
+
+namespace Aseba
+{
+	/** \addtogroup compiler */
+	/*@{*/
+
+	//! The program of a node in an .aesl project
+	struct AeslNodeProgram
+	{
+		std::wstring name; //!< name of the node
+		unsigned nodeId; //!< preferred identifier of the node, 0 if none
+		std::wstring source; //!< source code of the program
+
+		AeslNodeProgram(const std::wstring& name, unsigned nodeId, const std::wstring& source) : name(name), nodeId(nodeId), source(source) { }
+	};
+
+	//! An .aesl project: the definitions common to all nodes and the programs of the nodes, in file order
+	struct AeslProject
+	{
+		CommonDefinitions commonDefinitions;
+		std::vector<AeslNodeProgram> programs;
+
+		bool load(const QString& fileName, QString& errorMessage);
+	};
+
+	//! Result of the compilation of a program
+	struct CompiledProgram
+	{
+		bool success; //!< whether the compilation succeeded
+		BytecodeVector bytecode; //!< bytecode, if success
+		unsigned allocatedVariablesCount; //!< number of variables used, if success
+		VariablesMap variablesMap; //!< variables of the program, if success
+		Compiler::SubroutineTable subroutineTable; //!< subroutines of the program, if success
+		Error error; //!< error, if not success
+
+		CompiledProgram() : success(false), allocatedVariablesCount(0) { }
+	};
+
+	/*!
+		Compile the programs of several nodes concurrently on the global thread pool of Qt,
+		each with its own Compiler. Successful compilations are cached, keyed by the source of
+		the program and by the CRC of the description of its target, so that a program loaded
+		to several identical nodes is only compiled once. The cache is for given common
+		definitions, and is cleared when they change. It holds a maximum number of programs,
+		beyond which the least recently used ones are dropped. All methods can be called
+		from any thread.
+
+		Optionally, successful compilations are also stored in a directory, to be reused
+		by later runs. Each file is named by the SHA-1 of everything the compilation depends
+		on: the source, the common definitions, the CRC of the target description and the
+		version of Aseba. When the directory grows beyond a maximum size, the least recently
+		used files are removed. The directory is only listed when the files written
+		push the cache beyond this size, not after every compilation.
+	*/
+	class BatchCompiler
+	{
+	public:
+		//! A program to compile for a target
+		struct Job
+		{
+			const TargetDescription* targetDescription; //!< description of the target, must outlive the compilation
+			std::wstring source; //!< source code of the program
+
+			Job(const TargetDescription* targetDescription, const std::wstring& source) : targetDescription(targetDescription), source(source) { }
+		};
+		typedef std::vector<Job> JobsVector;
+		typedef std::vector<CompiledProgram> CompiledProgramsVector;
+
+		//! Default maximum number of programs in the cache in memory
+		enum { DEFAULT_CACHE_SIZE = 256 };
+		//! Default maximum size of the disk cache, in bytes
+		enum { DEFAULT_DISK_CACHE_SIZE = 16 * 1024 * 1024 };
+
+	public:
+		BatchCompiler();
+
+		CompiledProgramsVector compile(const JobsVector& jobs, const CommonDefinitions& commonDefinitions);
+		bool findInCache(const Job& job, const CommonDefinitions& commonDefinitions, CompiledProgram& program);
+		void addToCache(const Job& job, const CommonDefinitions& commonDefinitions, const CompiledProgram& program);
+		void clearCache();
+		void setCacheSize(int maxPrograms);
+		void setDiskCache(const QString& directory, qint64 maxSize = DEFAULT_DISK_CACHE_SIZE);
+		unsigned getCacheHitsCount() const;
+		unsigned getDiskCacheHitsCount() const;
+		unsigned getCacheMissesCount() const;
+
+	protected:
+		//! Key of the cache
+		struct CacheKey
+		{
+			std::wstring source;
+			uint16 targetCrc;
+
+			CacheKey(const Job& job) : source(job.source), targetCrc(job.targetDescription->crc()) { }
+			bool operator==(const CacheKey& that) const { return targetCrc == that.targetCrc && source == that.source; }
+		};
+		friend uint qHash(const CacheKey& key);
+		typedef QCache<CacheKey, CompiledProgram> Cache;
+
+		void useCommonDefinitions(const CommonDefinitions& commonDefinitions);
+		QByteArray diskCacheKey(const Job& job) const;
+		QString diskCacheFileName(const QByteArray& key) const;
+		bool loadFromDisk(const Job& job, CompiledProgram& program);
+		void saveToDisk(const Job& job, const CompiledProgram& program);
+		void removeFromDisk(QFile& file);
+		void evictFromDisk();
+		void scanDiskCache();
+
+	protected:
+		mutable QMutex mutex; //!< protects all members below
+		Cache cache; //!< successfully compiled programs, least recently used ones dropped first
+		CommonDefinitions cacheCommonDefinitions; //!< common definitions used to compile the programs of the cache
+		QString diskCacheDirectory; //!< directory of the disk cache, empty if disabled
+		qint64 diskCacheMaxSize; //!< maximum size of the files in diskCacheDirectory, in bytes
+		qint64 diskCacheSize; //!< size of the files in diskCacheDirectory at the last scan, plus the ones written since, in bytes
+		unsigned cacheHitsCount; //!< number of compilations avoided thanks to the cache
+		unsigned diskCacheHitsCount; //!< number of compilations avoided thanks to the disk cache
+		unsigned cacheMissesCount; //!< number of compilations actually done
+	};
+
+	/*@}*/
+} // namespace Aseba
+
+#endif // ASEBA_BATCH_COMPILER_H
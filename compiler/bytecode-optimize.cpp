@@ -0,0 +1,373 @@
+/*
+	Aseba - an event-based framework for distributed robot control
+	Copyright (C) 2007--2012:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+		and other contributors, see authors.txt for details
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "compiler.h"
+#include "../common/consts.h"
+#include "../common/types.h"
+#include <cassert>
+#include <cstdlib>
+#include <vector>
+
+namespace Aseba
+{
+	/** \addtogroup compiler */
+	/*@{*/
+
+	/*
+	 * Bytecode optimization: peephole pass on each event and subroutine, after fixup
+	 *   - The bytecode is decoded into a list of instructions, in which jumps point to
+	 *     instructions instead of using relative displacements
+	 *   - Patterns are rewritten until none matches anymore:
+	 *       - jumps to jumps are threaded, jumps to STOP or RET are replaced by the latter
+	 *       - jumps to the next instruction are removed
+	 *       - LOAD x, STORE x is removed
+	 *       - binary operations with a neutral immediate operand are removed
+	 *       - unary operations on an immediate are folded, large immediates are shrunk
+	 *       - instructions not reachable from the entry point are removed
+	 *   - A pattern spanning several instructions is only rewritten if no jump lands
+	 *     inside it. Removed instructions keep their line, so the instruction taking their
+	 *     place as jump target keeps its own.
+	 *   - Displacements are recomputed when encoding back. If a threaded jump does not fit
+	 *     its displacement anymore, the bytecode is left untouched.
+	 */
+
+	//! An instruction of the bytecode being optimized
+	struct BytecodeInstruction
+	{
+		std::vector<BytecodeElement> words; //!< the words of the instruction, displacements are ignored
+		int target; //!< index of the instruction a jump or a conditional branch goes to, -1 otherwise
+		bool removed; //!< whether this instruction has been removed
+
+		BytecodeInstruction() : target(-1), removed(false) {}
+		unsigned type() const { return words[0].bytecode >> 12; }
+		unsigned short argument() const { return words[0].bytecode & 0x0fff; }
+		bool isImmediate() const { return type() == ASEBA_BYTECODE_SMALL_IMMEDIATE || type() == ASEBA_BYTECODE_LARGE_IMMEDIATE; }
+		sint16 immediateValue() const
+		{
+			if (type() == ASEBA_BYTECODE_SMALL_IMMEDIATE)
+				return ((sint16)(words[0].bytecode << 4)) >> 4;
+			else
+				return (sint16)words[1].bytecode;
+		}
+		void setImmediateValue(sint16 value)
+		{
+			const unsigned short line(words[0].line);
+			words.clear();
+			if ((abs(value) >> 11) == 0)
+			{
+				words.push_back(BytecodeElement(AsebaBytecodeFromId(ASEBA_BYTECODE_SMALL_IMMEDIATE) | (((unsigned)value) & 0x0fff), line));
+			}
+			else
+			{
+				words.push_back(BytecodeElement(AsebaBytecodeFromId(ASEBA_BYTECODE_LARGE_IMMEDIATE), line));
+				words.push_back(BytecodeElement(value, line));
+			}
+		}
+	};
+
+	typedef std::vector<BytecodeInstruction> BytecodeInstructions;
+
+	//! Return the index of the first instruction not removed at or after index, instructions.size() if none
+	static int nextInstruction(const BytecodeInstructions& instructions, int index)
+	{
+		while (index < (int)instructions.size() && instructions[index].removed)
+			++index;
+		return index;
+	}
+
+	//! Return whether operand is the neutral element on the right of op
+	static bool isRightNeutral(unsigned op, sint16 operand)
+	{
+		switch (op)
+		{
+			case ASEBA_OP_SHIFT_LEFT:
+			case ASEBA_OP_SHIFT_RIGHT:
+			case ASEBA_OP_ADD:
+			case ASEBA_OP_SUB:
+			case ASEBA_OP_BIT_OR:
+			case ASEBA_OP_BIT_XOR:
+				return operand == 0;
+			case ASEBA_OP_MULT:
+			case ASEBA_OP_DIV:
+				return operand == 1;
+			case ASEBA_OP_BIT_AND:
+				return operand == -1;
+			default:
+				return false;
+		}
+	}
+
+	//! Decode bytecode into instructions, return false if it contains a jump outside of it
+	static bool decodeBytecode(const BytecodeVector& bytecode, BytecodeInstructions& instructions)
+	{
+		std::vector<int> instructionAt(bytecode.size() + 1, -1);
+		std::vector<int> targetAddress;
+		for (size_t pc = 0; pc < bytecode.size();)
+		{
+			const unsigned size(bytecode[pc].getWordSize());
+			if (pc + size > bytecode.size())
+				return false;
+			BytecodeInstruction instruction;
+			for (unsigned i = 0; i < size; ++i)
+				instruction.words.push_back(bytecode[pc + i]);
+			instructionAt[pc] = instructions.size();
+			if (instruction.type() == ASEBA_BYTECODE_JUMP)
+				targetAddress.push_back(int(pc) + (((sint16)(bytecode[pc].bytecode << 4)) >> 4));
+			else if (instruction.type() == ASEBA_BYTECODE_CONDITIONAL_BRANCH)
+				targetAddress.push_back(int(pc) + (sint16)bytecode[pc + 1].bytecode);
+			else
+				targetAddress.push_back(-1);
+			instructions.push_back(instruction);
+			pc += size;
+		}
+		for (size_t i = 0; i < instructions.size(); ++i)
+		{
+			if (targetAddress[i] < 0)
+				continue;
+			if (targetAddress[i] >= (int)bytecode.size() || instructionAt[targetAddress[i]] < 0)
+				return false;
+			instructions[i].target = instructionAt[targetAddress[i]];
+		}
+		return true;
+	}
+
+	//! Encode instructions into bytecode, return false if a displacement does not fit
+	static bool encodeBytecode(const BytecodeInstructions& instructions, BytecodeVector& bytecode)
+	{
+		std::vector<int> address(instructions.size(), 0);
+		int pc = 0;
+		for (size_t i = 0; i < instructions.size(); ++i)
+		{
+			address[i] = pc;
+			pc += instructions[i].words.size();
+		}
+
+		bytecode.clear();
+		for (size_t i = 0; i < instructions.size(); ++i)
+		{
+			const BytecodeInstruction& instruction(instructions[i]);
+			std::vector<BytecodeElement> words(instruction.words);
+			if (instruction.target >= 0)
+			{
+				const int disp = address[instruction.target] - address[i];
+				if (instruction.type() == ASEBA_BYTECODE_JUMP)
+				{
+					if (disp < -2048 || disp > 2047)
+						return false;
+					words[0].bytecode = AsebaBytecodeFromId(ASEBA_BYTECODE_JUMP) | (disp & 0x0fff);
+				}
+				else
+					words[1].bytecode = (unsigned short)disp;
+			}
+			for (size_t j = 0; j < words.size(); ++j)
+				bytecode.push_back(words[j]);
+		}
+		return true;
+	}
+
+	//! Apply one round of peephole rewriting, return whether anything changed
+	static bool rewriteInstructions(BytecodeInstructions& instructions)
+	{
+		const int count = instructions.size();
+		bool changed = false;
+
+		// count jumps landing on each instruction
+		std::vector<unsigned> incoming(count, 0);
+		for (int i = 0; i < count; ++i)
+			if (!instructions[i].removed && instructions[i].target >= 0)
+				++incoming[instructions[i].target];
+
+		for (int i = 0; i < count; ++i)
+		{
+			BytecodeInstruction& instruction(instructions[i]);
+			if (instruction.removed)
+				continue;
+			const int next = nextInstruction(instructions, i + 1);
+
+			// thread jumps to jumps, the number of hops avoids looping forever on cycles
+			if (instruction.target >= 0)
+			{
+				int target = instruction.target;
+				for (int hops = 0; hops < count && instructions[target].type() == ASEBA_BYTECODE_JUMP && instructions[target].target != target; ++hops)
+					target = instructions[target].target;
+				if (target != instruction.target)
+				{
+					instruction.target = target;
+					changed = true;
+				}
+			}
+
+			if (instruction.type() == ASEBA_BYTECODE_JUMP)
+			{
+				const BytecodeInstruction& destination(instructions[instruction.target]);
+				if (destination.type() == ASEBA_BYTECODE_STOP || destination.type() == ASEBA_BYTECODE_SUB_RET)
+				{
+					// jump to the end, end directly
+					instruction.words[0].bytecode = destination.words[0].bytecode;
+					instruction.target = -1;
+					changed = true;
+				}
+				else if (instruction.target == next)
+				{
+					// jump to the next instruction
+					instruction.removed = true;
+					changed = true;
+				}
+				continue;
+			}
+
+			if (next == count || incoming[next] != 0)
+				continue;
+			BytecodeInstruction& following(instructions[next]);
+
+			if (instruction.type() == ASEBA_BYTECODE_LOAD && following.type() == ASEBA_BYTECODE_STORE && instruction.argument() == following.argument())
+			{
+				// x = x
+				instruction.removed = true;
+				following.removed = true;
+				changed = true;
+			}
+			else if (instruction.isImmediate() && following.type() == ASEBA_BYTECODE_BINARY_ARITHMETIC &&
+				isRightNeutral(following.argument() & ASEBA_BINARY_OPERATOR_MASK, instruction.immediateValue()))
+			{
+				// x + 0, x * 1, ...
+				instruction.removed = true;
+				following.removed = true;
+				changed = true;
+			}
+			else if (instruction.isImmediate() && following.type() == ASEBA_BYTECODE_UNARY_ARITHMETIC)
+			{
+				// fold unary operation on a constant, with the same arithmetic as the VM
+				const sint16 value(instruction.immediateValue());
+				switch (following.argument() & ASEBA_UNARY_OPERATOR_MASK)
+				{
+					case ASEBA_UNARY_OP_SUB: instruction.setImmediateValue(-value); break;
+					case ASEBA_UNARY_OP_ABS: instruction.setImmediateValue(value >= 0 ? value : -value); break;
+					case ASEBA_UNARY_OP_BIT_NOT: instruction.setImmediateValue(~value); break;
+					default: continue;
+				}
+				following.removed = true;
+				changed = true;
+			}
+		}
+
+		// shrink large immediates
+		for (int i = 0; i < count; ++i)
+		{
+			BytecodeInstruction& instruction(instructions[i]);
+			if (!instruction.removed && instruction.type() == ASEBA_BYTECODE_LARGE_IMMEDIATE && (abs(instruction.immediateValue()) >> 11) == 0)
+			{
+				instruction.setImmediateValue(instruction.immediateValue());
+				changed = true;
+			}
+		}
+
+		// remove instructions not reachable from the entry point
+		std::vector<bool> reachable(count, false);
+		std::vector<int> toVisit(1, nextInstruction(instructions, 0));
+		while (!toVisit.empty())
+		{
+			const int i = toVisit.back();
+			toVisit.pop_back();
+			if (i >= count || reachable[i])
+				continue;
+			reachable[i] = true;
+			const unsigned type(instructions[i].type());
+			if (instructions[i].target >= 0)
+				toVisit.push_back(nextInstruction(instructions, instructions[i].target));
+			if (type != ASEBA_BYTECODE_JUMP && type != ASEBA_BYTECODE_STOP && type != ASEBA_BYTECODE_SUB_RET)
+				toVisit.push_back(nextInstruction(instructions, i + 1));
+		}
+		for (int i = 0; i < count; ++i)
+		{
+			if (!instructions[i].removed && !reachable[i])
+			{
+				instructions[i].removed = true;
+				changed = true;
+			}
+		}
+
+		return changed;
+	}
+
+	//! Optimize the bytecode of an event or a subroutine, return the number of words saved
+	static unsigned optimizeBytecodeVector(BytecodeVector& bytecode)
+	{
+		BytecodeInstructions instructions;
+		if (!decodeBytecode(bytecode, instructions) || instructions.empty())
+			return 0;
+
+		bool changed;
+		do
+		{
+			changed = rewriteInstructions(instructions);
+
+			// drop removed instructions, jumps to them go to the next instruction
+			std::vector<int> newIndex(instructions.size() + 1, 0);
+			int newCount = 0;
+			for (size_t i = 0; i < instructions.size(); ++i)
+			{
+				newIndex[i] = newCount;
+				if (!instructions[i].removed)
+					++newCount;
+			}
+			newIndex[instructions.size()] = newCount;
+			BytecodeInstructions compacted;
+			for (size_t i = 0; i < instructions.size(); ++i)
+			{
+				if (instructions[i].removed)
+					continue;
+				compacted.push_back(instructions[i]);
+				if (instructions[i].target >= 0)
+					compacted.back().target = newIndex[instructions[i].target];
+			}
+			instructions.swap(compacted);
+		}
+		while (changed);
+
+		// as the bytecode always ends with STOP or RET, a target is always valid
+		for (size_t i = 0; i < instructions.size(); ++i)
+			assert(instructions[i].target < (int)instructions.size());
+
+		BytecodeVector optimized;
+		if (!encodeBytecode(instructions, optimized))
+			return 0;
+		const unsigned saved(bytecode.size() - optimized.size());
+		optimized.maxStackDepth = bytecode.maxStackDepth;
+		optimized.callDepth = bytecode.callDepth;
+		optimized.lastLine = bytecode.lastLine;
+		bytecode = optimized;
+		return saved;
+	}
+
+	//! Optimize the bytecode of all events and subroutines, return the number of words saved
+	unsigned Compiler::optimizeBytecode(PreLinkBytecode& preLinkBytecode)
+	{
+		unsigned saved = 0;
+		for (PreLinkBytecode::EventsBytecode::iterator it = preLinkBytecode.events.begin(); it != preLinkBytecode.events.end(); ++it)
+			saved += optimizeBytecodeVector(it->second);
+		for (PreLinkBytecode::SubroutinesBytecode::iterator it = preLinkBytecode.subroutines.begin(); it != preLinkBytecode.subroutines.end(); ++it)
+			saved += optimizeBytecodeVector(it->second);
+		return saved;
+	}
+
+	/*@}*/
+
+} // namespace Aseba
@@ -32,6 +32,7 @@
 #include <iomanip>
 #include <memory>
 #include <limits>
+#include <iterator>
 
 namespace Aseba
 {
@@ -117,7 +118,17 @@ namespace Aseba
 		commonDefinitions = 0;
 		freeVariableIndex = 0;
 		endVariableIndex = 0;
-		TranslatableError::setTranslateCB(ErrorMessages::defaultCallback);
+		maxEndVariableIndex = 0;
+		vectorNativesThreshold = 8; // shorter vector assignments save little bytecode, if any
+		vectorNativesScratch = Node::E_NOVAL;
+		vectorNativesCount = 0;
+		vectorNativesSavedWords = 0;
+		bytecodeOptimization = true;
+		dataflowOptimization = true;
+		incrementalCompilation = false;
+		reusedHandlersCount = 0;
+		lastAllocatedVariablesCount = 0;
+		temporaryVariablesUid = 0;
 	}
 	
 	//! Set the description of the target as returned by the microcontroller. You must call this function before any call to compile().
@@ -132,6 +143,18 @@ namespace Aseba
 		commonDefinitions = definitions;
 	}
 	
+	//! Enable or disable incremental compilation: when enabled, compile() keeps the bytecode of each event,
+	//! subroutine and of the initialization code, and reuses it in the next compilations as long as
+	//! their tokens and the declarations they depend on do not change. This speeds up the repeated
+	//! compilation of large programs that are edited one handler at a time.
+	void Compiler::setIncrementalCompilation(bool enabled)
+	{
+		incrementalCompilation = enabled;
+		incrementalContext.clear();
+		compiledHandlers.clear();
+		lastSource.clear();
+	}
+	
 	//! Compile a new condition
 	//! \param source stream to read the source code from
 	//! \param bytecode destination array for bytecode
@@ -144,10 +167,41 @@ namespace Aseba
 		assert(targetDescription);
 		assert(commonDefinitions);
 		
-		unsigned indent = 0;
+		if (incrementalCompilation)
+			return compileIncrementally(source, bytecode, allocatedVariablesCount, errorDescription, dump);
+		
+		reusedHandlersCount = 0;
+		
+		// tokenization
+		if (!tokenizeSource(source, errorDescription, dump))
+			return false;
 		
+		// parsing
+		std::auto_ptr<Node> program;
+		if (!parseTokens(program, errorDescription))
+			return false;
+		
+		// from the syntax tree to bytecode
+		PreLinkBytecode preLinkBytecode;
+		if (!compileTree(program, preLinkBytecode, errorDescription, dump))
+			return false;
+		
+		// set the number of allocated variables
+		allocatedVariablesCount = freeVariableIndex;
+		
+		return linkProgram(preLinkBytecode, bytecode, errorDescription, dump);
+	}
+	
+	//! Reset the state of the compiler and tokenize source
+	bool Compiler::tokenizeSource(std::wistream& source, Error &errorDescription, std::wostream* dump)
+	{
 		// we need to build maps at each compilation in case previous ones produced errors and messed maps up
 		buildMaps();
+		endVariableIndex = 0;
+		maxEndVariableIndex = 0;
+		vectorNativesScratch = Node::E_NOVAL;
+		vectorNativesCount = 0;
+		vectorNativesSavedWords = 0;
 		if (freeVariableIndex > targetDescription->variablesSize)
 		{
 			errorDescription = TranslatableError(SourcePos(), ERROR_BROKEN_TARGET).toError();
@@ -172,8 +226,12 @@ namespace Aseba
 			*dump << "\n\n";
 		}
 		
-		// parsing
-		std::auto_ptr<Node> program;
+		return true;
+	}
+	
+	//! Parse the tokens into program
+	bool Compiler::parseTokens(std::auto_ptr<Node>& program, Error &errorDescription)
+	{
 		try
 		{
 			program.reset(parseProgram());
@@ -184,6 +242,17 @@ namespace Aseba
 			return false;
 		}
 		
+		// temporary variables of statements may be live at the same time as the ones allocated from now on
+		endVariableIndex = maxEndVariableIndex;
+		
+		return true;
+	}
+	
+	//! Check, expand, optimize, and generate the bytecode of a parsed program, or of some of its handlers
+	bool Compiler::compileTree(std::auto_ptr<Node>& program, PreLinkBytecode& preLinkBytecode, Error &errorDescription, std::wostream* dump)
+	{
+		unsigned indent = 0;
+		
 		if (dump)
 		{
 			*dump << "Vectorial syntax tree:\n";
@@ -232,6 +301,8 @@ namespace Aseba
 		}
 
 		// expand the vectorial nodes into scalar operations
+		const unsigned vectorNativesCountBefore(vectorNativesCount);
+		const unsigned vectorNativesSavedWordsBefore(vectorNativesSavedWords);
 		try
 		{
 			Node* expandedProgram(program->expandVectorialNodes(dump, this));
@@ -246,6 +317,8 @@ namespace Aseba
 
 		if (dump)
 		{
+			if (vectorNativesCount != vectorNativesCountBefore)
+				*dump << "Compiled " << vectorNativesCount - vectorNativesCountBefore << " vector assignments to native function calls, saving " << vectorNativesSavedWords - vectorNativesSavedWordsBefore << " words of bytecode\n\n";
 			*dump << "Expanded syntax tree (pass 2):\n";
 			program->dump(*dump, indent);
 			*dump << "\n\n";
@@ -267,9 +340,21 @@ namespace Aseba
 		{
 			*dump << "correct.\n";
 			*dump << "\n\n";
-			*dump << "Optimizations:\n";
 		}
 		
+		// dataflow optimization
+		if (dataflowOptimization)
+		{
+			if (dump)
+				*dump << "Dataflow optimizations:\n";
+			optimizeDataflow(program.get(), dump);
+			if (dump)
+				*dump << "\n\n";
+		}
+		
+		if (dump)
+			*dump << "Optimizations:\n";
+		
 		// optimization
 		try
 		{
@@ -291,23 +376,33 @@ namespace Aseba
 			*dump << "\n\n";
 		}
 		
-		// set the number of allocated variables
-		allocatedVariablesCount = freeVariableIndex;
-		
-		if (dump)
-		{
-			const float fillPercentage = float(allocatedVariablesCount * 100.f) / float(targetDescription->variablesSize);
-			*dump << "Using " << allocatedVariablesCount << " on " << targetDescription->variablesSize << " (" << fillPercentage << " %) words of variable space\n";
-			*dump << "\n\n";
-		}
-		
 		// code generation
-		PreLinkBytecode preLinkBytecode;
 		program->emit(preLinkBytecode);
 		
 		// fix-up (add of missing STOP and RET bytecodes at code generation)
 		preLinkBytecode.fixup(subroutineTable);
 		
+		// bytecode optimization
+		if (bytecodeOptimization)
+		{
+			const unsigned savedWords(optimizeBytecode(preLinkBytecode));
+			if (dump)
+				*dump << "Bytecode optimization saved " << savedWords << " words of bytecode\n\n";
+		}
+		
+		return true;
+	}
+	
+	//! Check the stack usage of the bytecode of all handlers, and link it into bytecode
+	bool Compiler::linkProgram(PreLinkBytecode& preLinkBytecode, BytecodeVector& bytecode, Error &errorDescription, std::wostream* dump)
+	{
+		if (dump)
+		{
+			const float fillPercentage = float(freeVariableIndex * 100.f) / float(targetDescription->variablesSize);
+			*dump << "Using " << freeVariableIndex << " on " << targetDescription->variablesSize << " (" << fillPercentage << " %) words of variable space\n";
+			*dump << "\n\n";
+		}
+		
 		// stack check
 		if (!verifyStackCalls(preLinkBytecode))
 		{
@@ -332,6 +427,199 @@ namespace Aseba
 		return true;
 	}
 	
+	//! Return a string describing the target, the common definitions and the settings, which the bytecode of every handler depends on
+	std::wstring Compiler::settingsSignature() const
+	{
+		std::wostringstream signature;
+		signature << targetDescription->variablesSize << L" " << targetDescription->stackSize << L" " << targetDescription->bytecodeSize << L"\n";
+		for (size_t i = 0; i < targetDescription->namedVariables.size(); ++i)
+			signature << targetDescription->namedVariables[i].name << L" " << targetDescription->namedVariables[i].size << L"\n";
+		for (size_t i = 0; i < targetDescription->localEvents.size(); ++i)
+			signature << targetDescription->localEvents[i].name << L"\n";
+		for (size_t i = 0; i < targetDescription->nativeFunctions.size(); ++i)
+		{
+			const TargetDescription::NativeFunction& native(targetDescription->nativeFunctions[i]);
+			signature << native.name;
+			for (size_t j = 0; j < native.parameters.size(); ++j)
+				signature << L" " << native.parameters[j].name << L" " << native.parameters[j].size;
+			signature << L"\n";
+		}
+		for (size_t i = 0; i < commonDefinitions->events.size(); ++i)
+			signature << commonDefinitions->events[i].name << L" " << commonDefinitions->events[i].value << L"\n";
+		for (size_t i = 0; i < commonDefinitions->constants.size(); ++i)
+			signature << commonDefinitions->constants[i].name << L" " << commonDefinitions->constants[i].value << L"\n";
+		signature << vectorNativesThreshold << L" " << bytecodeOptimization << L" " << dataflowOptimization << L"\n";
+		return signature.str();
+	}
+	
+	//! Fill keys with the tokens of the initialization code and of each event and subroutine, in order,
+	//! and firstLines with the line of their first token. Lines in keys are relative to this first line.
+	void Compiler::splitTokensByHandler(std::vector<std::wstring>& keys, std::vector<unsigned>& firstLines) const
+	{
+		std::wostringstream key;
+		unsigned firstLine(tokens.empty() ? 0 : tokens.front().pos.row);
+		for (std::deque<Token>::const_iterator it = tokens.begin(); it != tokens.end() && *it != Token::TOKEN_END_OF_STREAM; ++it)
+		{
+			// events and subroutines can only be declared at the top level of the program
+			if (*it == Token::TOKEN_STR_onevent || *it == Token::TOKEN_STR_sub)
+			{
+				keys.push_back(key.str());
+				firstLines.push_back(firstLine);
+				key.str(L"");
+				firstLine = it->pos.row;
+			}
+			key << int(it->type) << L" " << it->sValue << L" " << it->pos.row - firstLine << L"\n";
+		}
+		keys.push_back(key.str());
+		firstLines.push_back(firstLine);
+	}
+	
+	//! Move the lines of bytecode by lineShift, which wraps around for upward moves
+	static void shiftLines(BytecodeVector& bytecode, unsigned lineShift)
+	{
+		for (BytecodeVector::iterator it = bytecode.begin(); it != bytecode.end(); ++it)
+			it->line += lineShift;
+		bytecode.lastLine += lineShift;
+	}
+	
+	//! Compile, reusing the bytecode of the handlers that did not change, see setIncrementalCompilation()
+	bool Compiler::compileIncrementally(std::wistream& source, BytecodeVector& bytecode, unsigned& allocatedVariablesCount, Error &errorDescription, std::wostream* dump)
+	{
+		reusedHandlersCount = 0;
+		
+		// an unchanged source gives the same result
+		const std::wstring text((std::istreambuf_iterator<wchar_t>(source)), std::istreambuf_iterator<wchar_t>());
+		const std::wstring settings(settingsSignature());
+		if (!lastSource.empty() && text == lastSource && settings == lastSettings)
+		{
+			if (dump)
+				*dump << "Source unchanged since the previous compilation, reusing its bytecode\n\n";
+			reusedHandlersCount = compiledHandlers.size();
+			bytecode = lastBytecode;
+			allocatedVariablesCount = lastAllocatedVariablesCount;
+			return true;
+		}
+		lastSource.clear();
+		
+		// tokenization
+		std::wistringstream textStream(text);
+		if (!tokenizeSource(textStream, errorDescription, dump))
+			return false;
+		std::vector<std::wstring> keys;
+		std::vector<unsigned> firstLines;
+		splitTokensByHandler(keys, firstLines);
+		
+		// parsing
+		std::auto_ptr<Node> program;
+		if (!parseTokens(program, errorDescription))
+			return false;
+		
+		// handlers depend on the declarations, on the subroutines' ids, and on where temporary variables start
+		std::wostringstream context;
+		context << settings << keys[0] << endVariableIndex << L"\n";
+		for (size_t i = 0; i < subroutineTable.size(); ++i)
+			context << subroutineTable[i].name << L"\n";
+		if (context.str() != incrementalContext)
+		{
+			incrementalContext = context.str();
+			compiledHandlers.clear();
+		}
+		
+		// split the program into the initialization code and each event and subroutine
+		std::vector<Node*> handlers;
+		handlers.push_back(new ProgramNode(program->sourcePos));
+		for (size_t i = 0; i < program->children.size(); ++i)
+		{
+			Node* child(program->children[i]);
+			if (dynamic_cast<EventDeclNode*>(child) || dynamic_cast<SubDeclNode*>(child))
+				handlers.push_back(new ProgramNode(child->sourcePos));
+			handlers.back()->children.push_back(child);
+		}
+		program->children.clear();
+		
+		// there is one handler per group of tokens in a parsed program, the tree is the reference
+		if (handlers.size() != keys.size())
+		{
+			keys.assign(handlers.size(), std::wstring());
+			firstLines.assign(handlers.size(), 0);
+		}
+		
+		// compile or reuse each handler
+		const unsigned parsedEndVariableIndex(endVariableIndex);
+		PreLinkBytecode preLinkBytecode;
+		CompiledHandlersMap usedHandlers;
+		bool ok(true);
+		for (size_t i = 0; i < handlers.size(); ++i)
+		{
+			std::auto_ptr<Node> handler(handlers[i]);
+			if (!ok)
+				continue;
+			
+			CompiledHandler compiledHandler;
+			const CompiledHandlersMap::const_iterator it(keys[i].empty() ? compiledHandlers.end() : compiledHandlers.find(keys[i]));
+			if (it != compiledHandlers.end())
+			{
+				compiledHandler = it->second;
+				vectorNativesCount += compiledHandler.vectorNativesCount;
+				vectorNativesSavedWords += compiledHandler.vectorNativesSavedWords;
+				++reusedHandlersCount;
+			}
+			else
+			{
+				endVariableIndex = parsedEndVariableIndex;
+				vectorNativesScratch = Node::E_NOVAL;
+				PreLinkBytecode handlerBytecode;
+				const unsigned vectorNativesCountBefore(vectorNativesCount);
+				const unsigned vectorNativesSavedWordsBefore(vectorNativesSavedWords);
+				if (!compileTree(handler, handlerBytecode, errorDescription, dump))
+				{
+					ok = false;
+					continue;
+				}
+				compiledHandler.firstLine = firstLines[i];
+				compiledHandler.events = handlerBytecode.events;
+				compiledHandler.subroutines = handlerBytecode.subroutines;
+				compiledHandler.vectorNativesCount = vectorNativesCount - vectorNativesCountBefore;
+				compiledHandler.vectorNativesSavedWords = vectorNativesSavedWords - vectorNativesSavedWordsBefore;
+			}
+			if (!keys[i].empty())
+				usedHandlers[keys[i]] = compiledHandler;
+			
+			// bring the bytecode to where the handler now is in the source
+			const unsigned lineShift(firstLines[i] - compiledHandler.firstLine);
+			for (std::map<unsigned, BytecodeVector>::const_iterator jt = compiledHandler.events.begin(); jt != compiledHandler.events.end(); ++jt)
+				shiftLines(preLinkBytecode.events[jt->first] = jt->second, lineShift);
+			for (std::map<unsigned, BytecodeVector>::const_iterator jt = compiledHandler.subroutines.begin(); jt != compiledHandler.subroutines.end(); ++jt)
+				shiftLines(preLinkBytecode.subroutines[jt->first] = jt->second, lineShift);
+		}
+		
+		// keep the handlers of this program, and the previous ones if it has errors, as they are likely to be fixed soon
+		if (ok)
+			compiledHandlers.swap(usedHandlers);
+		else
+		{
+			compiledHandlers.insert(usedHandlers.begin(), usedHandlers.end());
+			return false;
+		}
+		if (dump)
+			*dump << "Reused the bytecode of " << reusedHandlersCount << " unchanged handlers\n\n";
+		
+		// the initialization code may be empty
+		preLinkBytecode.fixup(subroutineTable);
+		
+		// set the number of allocated variables
+		allocatedVariablesCount = freeVariableIndex;
+		
+		if (!linkProgram(preLinkBytecode, bytecode, errorDescription, dump))
+			return false;
+		
+		lastSource = text;
+		lastSettings = settings;
+		lastBytecode = bytecode;
+		lastAllocatedVariablesCount = allocatedVariablesCount;
+		return true;
+	}
+	
 	//! Create the final bytecode for a microcontroller
 	bool Compiler::link(const PreLinkBytecode& preLinkBytecode, BytecodeVector& bytecode)
 	{
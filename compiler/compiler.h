@@ -28,6 +28,7 @@
 #include <set>
 #include <utility>
 #include <istream>
+#include <memory>
 
 #include "errors_code.h"
 #include "../common/types.h"
@@ -361,8 +362,21 @@ namespace Aseba
 		typedef std::map<std::wstring, int> ConstantsMap;
 		//! Lookup table for event name => id
 		typedef std::map<std::wstring, unsigned> EventsMap;
+		
+		//! Bytecode of an event, a subroutine, or the initialization code, kept by incremental compilation
+		struct CompiledHandler
+		{
+			unsigned firstLine; //!< line of the first token of the handler, its bytecode must be moved by as many lines as this token moved
+			std::map<unsigned, BytecodeVector> events; //!< bytecode of the event or of the initialization code, if any
+			std::map<unsigned, BytecodeVector> subroutines; //!< bytecode of the subroutine, if any
+			unsigned vectorNativesCount; //!< number of vector assignments compiled to native function calls
+			unsigned vectorNativesSavedWords; //!< number of words of bytecode saved by doing so
+		};
+		//! Lookup table for tokens of a handler => its bytecode
+		typedef std::map<std::wstring, CompiledHandler> CompiledHandlersMap;
 
 		friend struct AssignmentNode;
+		friend struct ProgramNode;
 	
 	public:
 		Compiler();
@@ -375,6 +389,17 @@ namespace Aseba
 		void setTranslateCallback(ErrorMessages::ErrorCallback newCB) { TranslatableError::setTranslateCB(newCB); }
 		static std::wstring translate(ErrorCode error) { return TranslatableError::translateCB(error); }
 		static bool isKeyword(const std::wstring& word);
+		void setVectorNativesThreshold(unsigned threshold) { vectorNativesThreshold = threshold; }
+		unsigned getVectorNativesThreshold() const { return vectorNativesThreshold; }
+		unsigned getVectorNativesCount() const { return vectorNativesCount; }
+		unsigned getVectorNativesSavedWords() const { return vectorNativesSavedWords; }
+		void setBytecodeOptimization(bool enabled) { bytecodeOptimization = enabled; }
+		bool getBytecodeOptimization() const { return bytecodeOptimization; }
+		void setDataflowOptimization(bool enabled) { dataflowOptimization = enabled; }
+		bool getDataflowOptimization() const { return dataflowOptimization; }
+		void setIncrementalCompilation(bool enabled);
+		bool getIncrementalCompilation() const { return incrementalCompilation; }
+		unsigned getReusedHandlersCount() const { return reusedHandlersCount; }
 		
 	protected:
 		void internalCompilerError() const;
@@ -412,6 +437,15 @@ namespace Aseba
 		wchar_t getNextCharacter(std::wistream& source, SourcePos& pos);
 		bool testNextCharacter(std::wistream& source, SourcePos& pos, wchar_t test, Token::Type tokenIfTrue);
 		void dumpTokens(std::wostream &dest) const;
+		bool tokenizeSource(std::wistream& source, Error &errorDescription, std::wostream* dump);
+		bool parseTokens(std::auto_ptr<Node>& program, Error &errorDescription);
+		bool compileTree(std::auto_ptr<Node>& program, PreLinkBytecode& preLinkBytecode, Error &errorDescription, std::wostream* dump);
+		bool compileIncrementally(std::wistream& source, BytecodeVector& bytecode, unsigned& allocatedVariablesCount, Error &errorDescription, std::wostream* dump);
+		std::wstring settingsSignature() const;
+		void splitTokensByHandler(std::vector<std::wstring>& keys, std::vector<unsigned>& firstLines) const;
+		bool linkProgram(PreLinkBytecode& preLinkBytecode, BytecodeVector& bytecode, Error &errorDescription, std::wostream* dump);
+		void optimizeDataflow(Node* program, std::wostream* dump);
+		unsigned optimizeBytecode(PreLinkBytecode& preLinkBytecode);
 		bool verifyStackCalls(PreLinkBytecode& preLinkBytecode);
 		bool link(const PreLinkBytecode& preLinkBytecode, BytecodeVector& bytecode);
 		void disassemble(BytecodeVector& bytecode, const PreLinkBytecode& preLinkBytecode, std::wostream& dump) const;
@@ -471,10 +505,26 @@ namespace Aseba
 		SubroutineReverseTable subroutineReverseTable; //!< subroutine reverse lookup
 		unsigned freeVariableIndex; //!< index pointing to the first free variable
 		unsigned endVariableIndex; //!< (endMemory - endVariableIndex) is pointing to the first free variable at the end
+		unsigned maxEndVariableIndex; //!< largest endVariableIndex reached while parsing, temporary memory allocated after parsing starts there
 		const TargetDescription *targetDescription; //!< description of the target VM
 		const CommonDefinitions *commonDefinitions; //!< common definitions, such as events or some constants
-
-		ErrorMessages translator;
+		unsigned vectorNativesThreshold; //!< minimum size of vector assignments to compile to native function calls instead of unrolling them, 0 to always unroll
+		unsigned vectorNativesScratch; //!< address of the temporary variable passing scalar arguments to these native function calls
+		unsigned vectorNativesCount; //!< number of vector assignments compiled to native function calls during the last compilation
+		unsigned vectorNativesSavedWords; //!< number of words of bytecode saved by doing so
+		bool bytecodeOptimization; //!< whether to run the peephole optimizer on the bytecode of events and subroutines
+		bool dataflowOptimization; //!< whether to propagate constants and reuse common subexpressions within events and subroutines
+		std::vector<unsigned> handlersEndVariableIndex; //!< endVariableIndex reached by expanding the initialization code and each event and subroutine, in order
+		
+		bool incrementalCompilation; //!< whether to reuse the bytecode of the handlers whose tokens did not change since the previous compilation
+		unsigned reusedHandlersCount; //!< number of handlers whose bytecode was reused during the last compilation
+		std::wstring incrementalContext; //!< what the bytecode of every handler depends on besides its tokens, compiledHandlers is cleared when it changes
+		CompiledHandlersMap compiledHandlers; //!< bytecode of the handlers of the last successful compilation, and of the ones compiled since
+		std::wstring lastSource; //!< source of the last successful incremental compilation
+		std::wstring lastSettings; //!< settings signature of the last successful incremental compilation
+		BytecodeVector lastBytecode; //!< bytecode produced by the last successful incremental compilation
+		unsigned lastAllocatedVariablesCount; //!< number of variables allocated by the last successful incremental compilation
+		unsigned temporaryVariablesUid; //!< identifier of the next temporary variable, per compiler so that several ones can run in parallel
 	}; // Compiler
 	
 	//! Bytecode use for compilation previous to linking
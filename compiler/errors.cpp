@@ -29,6 +29,9 @@ namespace Aseba
 	/*@{*/
 	
 	static const wchar_t* error_map[ERROR_END];
+	
+	//! Fill error_map once at startup, so that compilers running in parallel only read it
+	static const ErrorMessages errorMessages;
 
 	ErrorMessages::ErrorMessages()
 	{
@@ -201,7 +204,7 @@ namespace Aseba
 		return oss.str();
 	}
 
-	ErrorMessages::ErrorCallback TranslatableError::translateCB = NULL;
+	ErrorMessages::ErrorCallback TranslatableError::translateCB = ErrorMessages::defaultCallback;
 
 	TranslatableError::TranslatableError(const SourcePos& pos, ErrorCode error)
 	{
@@ -253,6 +253,8 @@ namespace Aseba
 		unsigned endOfMemory = targetDescription->variablesSize - endVariableIndex;
 		unsigned varAddr = endOfMemory - size;
 		endVariableIndex += size;
+		if (endVariableIndex > maxEndVariableIndex)
+			maxEndVariableIndex = endVariableIndex;
 
 		// free space check
 		if (freeVariableIndex + endVariableIndex > targetDescription->variablesSize)
@@ -263,14 +265,12 @@ namespace Aseba
 
 	AssignmentNode* Compiler::allocateTemporaryVariable(const SourcePos varPos, Node* rValue)
 	{
-		static unsigned uid = 0;
-
 		// allocate the temporary variable
 		const unsigned size = rValue->getVectorSize();
 		const unsigned addr = allocateTemporaryMemory(varPos, size);
 
 		// create assignment
-		MemoryVectorNode* lValue = new MemoryVectorNode(varPos, addr, size, WFormatableString(L"temp%0").arg(uid++));
+		MemoryVectorNode* lValue = new MemoryVectorNode(varPos, addr, size, WFormatableString(L"temp%0").arg(temporaryVariablesUid++));
 		return new AssignmentNode(varPos, lValue, rValue);
 	}
 	
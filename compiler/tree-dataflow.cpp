@@ -0,0 +1,654 @@
+/*
+	Aseba - an event-based framework for distributed robot control
+	Copyright (C) 2007--2012:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+		and other contributors, see authors.txt for details
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tree.h"
+#include "power-of-two.h"
+#include "../common/types.h"
+#include <cassert>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <sstream>
+
+namespace Aseba
+{
+	/** \addtogroup compiler */
+	/*@{*/
+
+	/*
+	 * Dataflow optimization: constant propagation and common subexpression elimination,
+	 * on the expanded syntax tree, before optimize()
+	 *   - Each event and subroutine is walked in execution order, tracking which variables
+	 *     hold a known constant and which variables hold the value of an expression
+	 *   - A first walk replaces loads of known constants by immediates, which optimize() folds
+	 *     later on. A second walk replaces expressions whose value is held by a variable by a
+	 *     load of this variable, and stores expressions used often enough in the handler into
+	 *     temporary variables, just before the first statement using them
+	 *   - Writes forget what depends on the written variables, array writes at an unknown index
+	 *     forget the whole array. Native functions and subroutines may write anywhere, so their
+	 *     calls forget everything. Emits only read memory, the values they send are unchanged
+	 *   - Both branches of a conditional are walked, only what holds in both is kept afterwards.
+	 *     Loops forget the variables written in their body before walking it
+	 *   - Constants are not propagated where optimize() would turn a runtime error into a
+	 *     compilation error, or would fold to a different result than the VM would compute.
+	 *     They are not propagated into the conditions of "when" and "while" either, as optimize()
+	 *     handles constant conditions there differently than the VM would execute them
+	 */
+
+	//! A range of memory read by an expression
+	struct MemoryRange
+	{
+		unsigned addr; //!< address of the first variable
+		unsigned size; //!< number of variables
+
+		MemoryRange(unsigned addr, unsigned size) : addr(addr), size(size) {}
+		bool overlaps(unsigned otherAddr, unsigned otherSize) const { return addr < otherAddr + otherSize && otherAddr < addr + size; }
+	};
+
+	typedef std::vector<MemoryRange> MemoryRanges;
+
+	//! What is known about memory at some point of an event or subroutine
+	struct DataflowFacts
+	{
+		//! An expression whose value is held by a variable
+		struct HeldExpression
+		{
+			unsigned holder; //!< address of the variable holding the value
+			MemoryRanges reads; //!< memory the expression reads
+
+			bool operator==(const HeldExpression& that) const { return holder == that.holder; }
+		};
+
+		typedef std::map<unsigned, int> Constants;
+		typedef std::map<std::wstring, HeldExpression> Expressions;
+
+		Constants constants; //!< variables holding a known constant
+		Expressions expressions; //!< expressions held by variables, by key
+
+		//! Forget what depends on the variables in [addr, addr+size)
+		void forget(unsigned addr, unsigned size)
+		{
+			constants.erase(constants.lower_bound(addr), constants.lower_bound(addr + size));
+			for (Expressions::iterator it = expressions.begin(); it != expressions.end();)
+			{
+				bool depends(MemoryRange(it->second.holder, 1).overlaps(addr, size));
+				for (size_t i = 0; i < it->second.reads.size(); ++i)
+					depends = depends || it->second.reads[i].overlaps(addr, size);
+				if (depends)
+					expressions.erase(it++);
+				else
+					++it;
+			}
+		}
+
+		//! Forget everything
+		void forgetAll()
+		{
+			constants.clear();
+			expressions.clear();
+		}
+
+		//! Only keep what is also known in that
+		void intersect(const DataflowFacts& that)
+		{
+			for (Constants::iterator it = constants.begin(); it != constants.end();)
+			{
+				Constants::const_iterator other(that.constants.find(it->first));
+				if (other == that.constants.end() || other->second != it->second)
+					constants.erase(it++);
+				else
+					++it;
+			}
+			for (Expressions::iterator it = expressions.begin(); it != expressions.end();)
+			{
+				Expressions::const_iterator other(that.expressions.find(it->first));
+				if (other == that.expressions.end() || !(other->second == it->second))
+					expressions.erase(it++);
+				else
+					++it;
+			}
+		}
+	};
+
+	//! Return whether node is an arithmetic expression worth reusing
+	static bool isReusable(const Node* node)
+	{
+		const BinaryArithmeticNode* binary(dynamic_cast<const BinaryArithmeticNode*>(node));
+		if (binary)
+			return binary->op <= ASEBA_OP_BIT_AND;
+		const UnaryArithmeticNode* unary(dynamic_cast<const UnaryArithmeticNode*>(node));
+		if (unary)
+			return unary->op != ASEBA_UNARY_OP_NOT;
+		const ArrayReadNode* arrayRead(dynamic_cast<const ArrayReadNode*>(node));
+		if (arrayRead)
+			return dynamic_cast<const ImmediateNode*>(arrayRead->children[0]) == 0;
+		return false;
+	}
+
+	//! Return a key identifying the value of a side-effect free expression and append the memory it reads, an empty key if node is not such an expression
+	static std::wstring expressionKey(const Node* node, MemoryRanges& reads)
+	{
+		std::wostringstream key;
+		const ImmediateNode* immediate(dynamic_cast<const ImmediateNode*>(node));
+		const LoadNode* load(dynamic_cast<const LoadNode*>(node));
+		const ArrayReadNode* arrayRead(dynamic_cast<const ArrayReadNode*>(node));
+		const BinaryArithmeticNode* binary(dynamic_cast<const BinaryArithmeticNode*>(node));
+		const UnaryArithmeticNode* unary(dynamic_cast<const UnaryArithmeticNode*>(node));
+		if (immediate)
+		{
+			key << L"#" << immediate->value;
+		}
+		else if (load)
+		{
+			key << L"@" << load->varAddr;
+			reads.push_back(MemoryRange(load->varAddr, 1));
+		}
+		else if (arrayRead)
+		{
+			const ImmediateNode* index(dynamic_cast<const ImmediateNode*>(arrayRead->children[0]));
+			if (index && index->value >= 0 && unsigned(index->value) < arrayRead->arraySize)
+			{
+				// same key as the load optimize() will make of it
+				key << L"@" << arrayRead->arrayAddr + index->value;
+				reads.push_back(MemoryRange(arrayRead->arrayAddr + index->value, 1));
+			}
+			else
+			{
+				const std::wstring indexKey(expressionKey(arrayRead->children[0], reads));
+				if (indexKey.empty())
+					return L"";
+				key << L"@" << arrayRead->arrayAddr << L"[" << arrayRead->arraySize << L"," << indexKey << L"]";
+				reads.push_back(MemoryRange(arrayRead->arrayAddr, arrayRead->arraySize));
+			}
+		}
+		else if (binary)
+		{
+			const std::wstring left(expressionKey(binary->children[0], reads));
+			const std::wstring right(expressionKey(binary->children[1], reads));
+			if (left.empty() || right.empty())
+				return L"";
+			key << L"(" << binary->op << L" " << left << L" " << right << L")";
+		}
+		else if (unary)
+		{
+			const std::wstring operand(expressionKey(unary->children[0], reads));
+			if (operand.empty())
+				return L"";
+			key << L"(u" << unary->op << L" " << operand << L")";
+		}
+		else
+			return L"";
+		return key.str();
+	}
+
+	//! Return the number of words of bytecode of an expression
+	static unsigned expressionSize(const Node* node)
+	{
+		const ImmediateNode* immediate(dynamic_cast<const ImmediateNode*>(node));
+		if (immediate)
+			return (abs(immediate->value) >> 11) == 0 ? 1 : 2;
+		if (dynamic_cast<const ArrayReadNode*>(node) && !dynamic_cast<const ImmediateNode*>(node->children[0]))
+			return expressionSize(node->children[0]) + 2;
+		unsigned size(1);
+		if (dynamic_cast<const BinaryArithmeticNode*>(node) || dynamic_cast<const UnaryArithmeticNode*>(node))
+			for (size_t i = 0; i < node->children.size(); ++i)
+				size += expressionSize(node->children[i]);
+		return size;
+	}
+
+	//! Return whether an expression folds to a constant in optimize(), and if so its value in value
+	static bool constantValue(const Node* node, int& value)
+	{
+		const ImmediateNode* immediate(dynamic_cast<const ImmediateNode*>(node));
+		if (immediate)
+		{
+			value = immediate->value;
+			return true;
+		}
+
+		const UnaryArithmeticNode* unary(dynamic_cast<const UnaryArithmeticNode*>(node));
+		int operand;
+		if (unary && constantValue(unary->children[0], operand))
+		{
+			switch (unary->op)
+			{
+				case ASEBA_UNARY_OP_SUB: value = -operand; return true;
+				case ASEBA_UNARY_OP_ABS: value = abs(operand); return true;
+				case ASEBA_UNARY_OP_BIT_NOT: value = ~operand; return true;
+				default: return false;
+			}
+		}
+
+		const BinaryArithmeticNode* binary(dynamic_cast<const BinaryArithmeticNode*>(node));
+		int left, right;
+		if (binary && constantValue(binary->children[0], left) && constantValue(binary->children[1], right))
+		{
+			// leave divisions that would trap to the checks of optimize(), which report them
+			if ((binary->op == ASEBA_OP_DIV || binary->op == ASEBA_OP_MOD) && (right == 0 || (left == -32768 && right == -1)))
+				return false;
+			switch (binary->op)
+			{
+				case ASEBA_OP_SHIFT_LEFT: value = left << right; return true;
+				case ASEBA_OP_SHIFT_RIGHT: value = left >> right; return true;
+				case ASEBA_OP_ADD: value = left + right; return true;
+				case ASEBA_OP_SUB: value = left - right; return true;
+				case ASEBA_OP_MULT: value = left * right; return true;
+				case ASEBA_OP_DIV: value = left / right; return true;
+				case ASEBA_OP_MOD: value = left % right; return true;
+				case ASEBA_OP_BIT_OR: value = left | right; return true;
+				case ASEBA_OP_BIT_XOR: value = left ^ right; return true;
+				case ASEBA_OP_BIT_AND: value = left & right; return true;
+				case ASEBA_OP_EQUAL: value = left == right; return true;
+				case ASEBA_OP_NOT_EQUAL: value = left != right; return true;
+				case ASEBA_OP_BIGGER_THAN: value = left > right; return true;
+				case ASEBA_OP_BIGGER_EQUAL_THAN: value = left >= right; return true;
+				case ASEBA_OP_SMALLER_THAN: value = left < right; return true;
+				case ASEBA_OP_SMALLER_EQUAL_THAN: value = left <= right; return true;
+				case ASEBA_OP_OR: value = left || right; return true;
+				case ASEBA_OP_AND: value = left && right; return true;
+				default: return false;
+			}
+		}
+
+		return false;
+	}
+
+	//! Return whether optimize() handles node the same way the VM would execute it, given the constants of its children, which were already checked
+	static bool foldsLikeVM(const Node* node, const Node* original)
+	{
+		int value;
+		const UnaryArithmeticNode* unary(dynamic_cast<const UnaryArithmeticNode*>(node));
+		if (unary && constantValue(unary->children[0], value))
+		{
+			// optimize() aborts on "not" of a constant and rejects abs(-32768)
+			if (unary->op == ASEBA_UNARY_OP_NOT || (unary->op == ASEBA_UNARY_OP_ABS && value == -32768))
+				return false;
+		}
+
+		const BinaryArithmeticNode* binary(dynamic_cast<const BinaryArithmeticNode*>(node));
+		int left, right;
+		if (binary && constantValue(binary->children[1], right))
+		{
+			const bool leftConstant(constantValue(binary->children[0], left));
+			switch (binary->op)
+			{
+				case ASEBA_OP_DIV:
+				case ASEBA_OP_MOD:
+					// division by zero is a runtime error, and optimize() turns divisions by powers of two into shifts, rounding towards minus infinity
+					if (right == 0 || (binary->op == ASEBA_OP_DIV && !leftConstant && isPOT(right) && !constantValue(original->children[1], value)))
+						return false;
+				break;
+				case ASEBA_OP_SHIFT_LEFT:
+				case ASEBA_OP_SHIFT_RIGHT:
+					if (leftConstant && (right < 0 || right > 15))
+						return false;
+				break;
+				default: break;
+			}
+		}
+
+		const ArrayReadNode* arrayRead(dynamic_cast<const ArrayReadNode*>(node));
+		const ArrayWriteNode* arrayWrite(dynamic_cast<const ArrayWriteNode*>(node));
+		if (arrayRead || arrayWrite)
+		{
+			// out of bound accesses are a runtime error
+			const unsigned arraySize(arrayRead ? arrayRead->arraySize : arrayWrite->arraySize);
+			if (constantValue(node->children[0], value) && (value < 0 || unsigned(value) >= arraySize))
+				return false;
+		}
+
+		// the VM computes on 16 bits
+		if (constantValue(node, value) && (value < -32768 || value > 32767))
+			return false;
+
+		return true;
+	}
+
+	//! Walks events and subroutines, see above
+	struct DataflowOptimizer
+	{
+		typedef Node::NodesVector NodesVector;
+
+		std::wostream* dump; //!< stream to send dump messages to
+		bool eliminateSubexpressions; //!< if false, propagate constants, if true, reuse subexpressions
+		std::map<std::wstring, int> uses; //!< number of uses of each reusable expression not walked yet in the current event or subroutine
+		unsigned tempTop; //!< end of the memory available for temporary variables
+		unsigned tempBottom; //!< beginning of the memory available for temporary variables
+		unsigned tempUsed; //!< number of temporary variables used by the walked event or subroutine
+		unsigned tempMaxUsed; //!< maximum of tempUsed over all events and subroutines
+		unsigned propagatedCount; //!< number of constants propagated
+		unsigned reusedCount; //!< number of subexpressions reused
+
+		DataflowOptimizer(std::wostream* dump, unsigned tempBottom) :
+			dump(dump),
+			eliminateSubexpressions(false),
+			tempTop(tempBottom),
+			tempBottom(tempBottom),
+			tempUsed(0),
+			tempMaxUsed(0),
+			propagatedCount(0),
+			reusedCount(0)
+		{}
+
+		//! Replace loads of known constants in an expression, return the new expression
+		Node* propagateConstants(Node* node, const DataflowFacts& facts)
+		{
+			LoadNode* load(dynamic_cast<LoadNode*>(node));
+			if (load)
+			{
+				DataflowFacts::Constants::const_iterator it(facts.constants.find(load->varAddr));
+				if (it == facts.constants.end())
+					return node;
+				++propagatedCount;
+				Node* immediate(new ImmediateNode(load->sourcePos, it->second));
+				delete node;
+				return immediate;
+			}
+
+			if (!dynamic_cast<BinaryArithmeticNode*>(node) && !dynamic_cast<UnaryArithmeticNode*>(node) &&
+				!dynamic_cast<ArrayReadNode*>(node) && !dynamic_cast<ArrayWriteNode*>(node))
+				return node;
+
+			// if propagating makes optimize() differ from the VM, revert to the original node
+			std::auto_ptr<Node> original(node->deepCopy());
+			const unsigned propagatedBefore(propagatedCount);
+			for (size_t i = 0; i < node->children.size(); ++i)
+				node->children[i] = propagateConstants(node->children[i], facts);
+			if (foldsLikeVM(node, original.get()))
+				return node;
+			propagatedCount = propagatedBefore;
+			delete node;
+			return original.release();
+		}
+
+		//! Reuse held subexpressions in an expression, and hoist the ones worth it to hoisted if not 0, return the new expression
+		Node* reuseSubexpressions(Node* node, DataflowFacts& facts, NodesVector* hoisted, bool isRoot = false)
+		{
+			MemoryRanges reads;
+			const std::wstring key(isReusable(node) ? expressionKey(node, reads) : L"");
+			if (!key.empty())
+			{
+				DataflowFacts::Expressions::const_iterator it(facts.expressions.find(key));
+				if (it != facts.expressions.end())
+				{
+					if (dump)
+						*dump << node->sourcePos.toWString() << L": common subexpression reused\n";
+					++reusedCount;
+					countUses(node, -1);
+					Node* reloaded(new LoadNode(node->sourcePos, it->second.holder));
+					delete node;
+					return reloaded;
+				}
+			}
+
+			const int remainingUses(key.empty() ? 0 : uses[key]--);
+			for (size_t i = 0; i < node->children.size(); ++i)
+				node->children[i] = reuseSubexpressions(node->children[i], facts, hoisted);
+
+			// storing the value costs a store and a load, each later use saves the size of the expression minus a load
+			const int size(expressionSize(node));
+			if (key.empty() || isRoot || !hoisted || (remainingUses - 1) * (size - 1) <= 2)
+				return node;
+			if (tempBottom + tempUsed + 1 > tempTop)
+				return node;
+			const unsigned tempAddr(tempTop - 1 - tempUsed);
+			++tempUsed;
+			if (tempUsed > tempMaxUsed)
+				tempMaxUsed = tempUsed;
+			if (dump)
+				*dump << node->sourcePos.toWString() << L": common subexpression stored in temporary variable\n";
+			const SourcePos pos(node->sourcePos);
+			hoisted->push_back(new AssignmentNode(pos, new StoreNode(pos, tempAddr), node));
+			DataflowFacts::HeldExpression held;
+			held.holder = tempAddr;
+			held.reads = reads;
+			facts.expressions[key] = held;
+			return new LoadNode(pos, tempAddr);
+		}
+
+		//! Process an expression, hoisting to hoisted if not 0
+		Node* walkExpression(Node* node, DataflowFacts& facts, NodesVector* hoisted, bool allowConstants, bool isRoot = false)
+		{
+			if (eliminateSubexpressions)
+				return reuseSubexpressions(node, facts, hoisted, isRoot);
+			if (!allowConstants)
+				return node;
+			const unsigned propagatedBefore(propagatedCount);
+			const SourcePos pos(node->sourcePos);
+			node = propagateConstants(node, facts);
+			if (dump && propagatedCount != propagatedBefore)
+				*dump << pos.toWString() << L": " << propagatedCount - propagatedBefore << L" constants propagated\n";
+			return node;
+		}
+
+		//! Add delta to the uses of the reusable expressions in node
+		void countUses(const Node* node, int delta)
+		{
+			if (dynamic_cast<const CallNode*>(node))
+				return;
+			MemoryRanges reads;
+			if (isReusable(node))
+			{
+				const std::wstring key(expressionKey(node, reads));
+				if (!key.empty())
+					uses[key] += delta;
+			}
+			for (size_t i = 0; i < node->children.size(); ++i)
+				if (node->children[i])
+					countUses(node->children[i], delta);
+		}
+
+		//! Collect the memory node may write, return false if it may write anywhere
+		static bool collectWrites(const Node* node, MemoryRanges& writes)
+		{
+			if (dynamic_cast<const CallNode*>(node) || dynamic_cast<const CallSubNode*>(node))
+				return false;
+			const StoreNode* store(dynamic_cast<const StoreNode*>(node));
+			if (store)
+				writes.push_back(MemoryRange(store->varAddr, 1));
+			const ArrayWriteNode* arrayWrite(dynamic_cast<const ArrayWriteNode*>(node));
+			if (arrayWrite)
+				writes.push_back(MemoryRange(arrayWrite->arrayAddr, arrayWrite->arraySize));
+			for (size_t i = 0; i < node->children.size(); ++i)
+				if (node->children[i] && !collectWrites(node->children[i], writes))
+					return false;
+			return true;
+		}
+
+		//! Process an assignment, hoisting to hoisted if not 0
+		void walkAssignment(AssignmentNode* assignment, DataflowFacts& facts, NodesVector* hoisted)
+		{
+			for (size_t i = 0; i < assignment->children.size(); i += 2)
+			{
+				// later pairs are evaluated after the first ones have been stored
+				NodesVector* pairHoisted(i == 0 ? hoisted : 0);
+				MemoryRanges reads;
+				const std::wstring key(isReusable(assignment->children[i+1]) ? expressionKey(assignment->children[i+1], reads) : L"");
+
+				// value, then destination
+				assignment->children[i+1] = walkExpression(assignment->children[i+1], facts, pairHoisted, true, true);
+				ArrayWriteNode* arrayWrite(dynamic_cast<ArrayWriteNode*>(assignment->children[i]));
+				if (arrayWrite)
+					assignment->children[i] = walkExpression(arrayWrite, facts, pairHoisted, true);
+
+				// effect of the write
+				unsigned addr;
+				arrayWrite = dynamic_cast<ArrayWriteNode*>(assignment->children[i]);
+				const StoreNode* store(dynamic_cast<const StoreNode*>(assignment->children[i]));
+				int index;
+				if (store)
+					addr = store->varAddr;
+				else if (arrayWrite && constantValue(arrayWrite->children[0], index))
+					addr = arrayWrite->arrayAddr + index;
+				else
+				{
+					assert(arrayWrite);
+					facts.forget(arrayWrite->arrayAddr, arrayWrite->arraySize);
+					continue;
+				}
+				facts.forget(addr, 1);
+				int value;
+				if (!eliminateSubexpressions && constantValue(assignment->children[i+1], value))
+					facts.constants[addr] = sint16(value);
+				bool readsDestination(false);
+				for (size_t j = 0; j < reads.size(); ++j)
+					readsDestination = readsDestination || reads[j].overlaps(addr, 1);
+				// keep the current holder if any, so that branches agree more often
+				if (eliminateSubexpressions && !key.empty() && !readsDestination && facts.expressions.find(key) == facts.expressions.end())
+				{
+					DataflowFacts::HeldExpression held;
+					held.holder = addr;
+					held.reads = reads;
+					facts.expressions[key] = held;
+				}
+			}
+		}
+
+		//! Process the statement in slot, wrapping it in a block if it needs hoisted statements
+		void walkSlot(Node*& slot, DataflowFacts& facts)
+		{
+			NodesVector hoisted;
+			walkStatement(slot, facts, &hoisted);
+			if (hoisted.empty())
+				return;
+			BlockNode* block(new BlockNode(slot->sourcePos));
+			block->children = hoisted;
+			block->children.push_back(slot);
+			slot = block;
+		}
+
+		//! Process the statements of a block from begin to end, update end if statements are hoisted
+		void walkStatements(NodesVector& statements, size_t begin, size_t& end, DataflowFacts& facts)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				NodesVector hoisted;
+				walkStatement(statements[i], facts, &hoisted);
+				statements.insert(statements.begin() + i, hoisted.begin(), hoisted.end());
+				i += hoisted.size();
+				end += hoisted.size();
+			}
+		}
+
+		//! Process a statement, hoisting to hoisted if not 0
+		void walkStatement(Node* statement, DataflowFacts& facts, NodesVector* hoisted)
+		{
+			if (!statement)
+				return;
+
+			BlockNode* block(dynamic_cast<BlockNode*>(statement));
+			AssignmentNode* assignment(dynamic_cast<AssignmentNode*>(statement));
+			IfWhenNode* ifWhen(dynamic_cast<IfWhenNode*>(statement));
+			WhileNode* whileNode(dynamic_cast<WhileNode*>(statement));
+			EmitNode* emit(dynamic_cast<EmitNode*>(statement));
+
+			if (block)
+			{
+				size_t end(block->children.size());
+				walkStatements(block->children, 0, end, facts);
+			}
+			else if (assignment)
+			{
+				walkAssignment(assignment, facts, hoisted);
+			}
+			else if (ifWhen)
+			{
+				ifWhen->children[0] = walkExpression(ifWhen->children[0], facts, hoisted, !ifWhen->edgeSensitive);
+				DataflowFacts falseFacts(facts);
+				walkSlot(ifWhen->children[1], facts);
+				if (ifWhen->children.size() > 2)
+					walkSlot(ifWhen->children[2], falseFacts);
+				facts.intersect(falseFacts);
+			}
+			else if (whileNode)
+			{
+				MemoryRanges writes;
+				if (collectWrites(whileNode, writes))
+					for (size_t i = 0; i < writes.size(); ++i)
+						facts.forget(writes[i].addr, writes[i].size);
+				else
+					facts.forgetAll();
+				whileNode->children[0] = walkExpression(whileNode->children[0], facts, 0, false);
+				DataflowFacts bodyFacts(facts);
+				walkSlot(whileNode->children[1], bodyFacts);
+			}
+			else if (emit)
+			{
+				// the children store the arguments, emit then only reads them
+				for (size_t i = 0; i < emit->children.size(); ++i)
+					walkStatement(emit->children[i], facts, 0);
+			}
+			else if (dynamic_cast<ReturnNode*>(statement))
+			{
+				// nothing is executed after, so any fact holds
+			}
+			else
+			{
+				// native function calls, subroutine calls, and anything unknown
+				facts.forgetAll();
+			}
+		}
+
+		//! Process an event, a subroutine, or the initialization code, from begin to end, using temporary variables below handlerTempTop
+		void walkHandler(NodesVector& statements, size_t begin, size_t& end, unsigned handlerTempTop)
+		{
+			tempTop = handlerTempTop;
+			DataflowFacts constantsFacts;
+			eliminateSubexpressions = false;
+			walkStatements(statements, begin, end, constantsFacts);
+
+			uses.clear();
+			for (size_t i = begin; i < end; ++i)
+				countUses(statements[i], 1);
+			DataflowFacts expressionsFacts;
+			eliminateSubexpressions = true;
+			tempUsed = 0;
+			walkStatements(statements, begin, end, expressionsFacts);
+		}
+	};
+
+	//! Propagate constants and reuse common subexpressions in each event and subroutine of program
+	void Compiler::optimizeDataflow(Node* program, std::wostream* dump)
+	{
+		DataflowOptimizer optimizer(dump, freeVariableIndex);
+
+		// the program is a flat list of statements, each event or subroutine declaration starts a new handler
+		Node::NodesVector& statements(program->children);
+		size_t begin(0);
+		size_t handler(0);
+		while (begin < statements.size())
+		{
+			size_t end(begin + 1);
+			while (end < statements.size() && !dynamic_cast<EventDeclNode*>(statements[end]) && !dynamic_cast<SubDeclNode*>(statements[end]))
+				++end;
+			// temporary variables go below the ones of the expansion of the handler, they are not live when it calls a subroutine
+			assert(handler < handlersEndVariableIndex.size());
+			optimizer.walkHandler(statements, begin, end, targetDescription->variablesSize - handlersEndVariableIndex[handler]);
+			begin = end;
+			++handler;
+		}
+
+		if (dump)
+			*dump << "Propagated " << optimizer.propagatedCount << " constants, reused " << optimizer.reusedCount << " subexpressions using " << optimizer.tempMaxUsed << " temporary variables\n";
+	}
+
+	/*@}*/
+
+} // namespace Aseba
@@ -21,6 +21,7 @@
 #include "compiler.h"
 #include "tree.h"
 #include "../common/utils/FormatableString.h"
+#include "../common/utils/utils.h"
 
 #include <cassert>
 #include <memory>
@@ -184,13 +185,31 @@ namespace Aseba
 		return false;
 	}
 
-	//! This is the root node, take in charge the tree creation / deletion
+	//! This is the root node, take in charge the tree creation / deletion.
+	//! Events and subroutines never run at the same time, so each of them starts over
+	//! allocating temporary variables where parsing stopped.
 	Node* ProgramNode::expandVectorialNodes(std::wostream *dump, Compiler* compiler, unsigned int index)
 	{
-		Node* newMe = Node::expandVectorialNodes(dump, compiler, index);
+		std::auto_ptr<Node> newMe(this->shallowCopy());
+		newMe->children.clear();
+
+		const unsigned parsedEndVariableIndex(compiler->endVariableIndex);
+		compiler->handlersEndVariableIndex.clear();
+		for (unsigned int i = 0; i < this->children.size(); i++)
+		{
+			// a declaration starts a new handler, unless there is no initialization code
+			if (i > 0 && (dynamic_cast<EventDeclNode*>(children[i]) || dynamic_cast<SubDeclNode*>(children[i])))
+			{
+				compiler->handlersEndVariableIndex.push_back(compiler->endVariableIndex);
+				compiler->endVariableIndex = parsedEndVariableIndex;
+				compiler->vectorNativesScratch = E_NOVAL;
+			}
+			newMe->children.push_back(this->children[i]->expandVectorialNodes(dump, compiler, index));
+		}
+		compiler->handlersEndVariableIndex.push_back(compiler->endVariableIndex);
 
 		delete this;	// delete the whole (obsolete) vectorial tree
-		return newMe;
+		return newMe.release();
 	}
 
 	//! Generic implementation for non-vectorial nodes
@@ -207,7 +226,175 @@ namespace Aseba
 		return newMe.release();
 	}
 
-	//! Assignment between vectors is expanded into multiple scalar assignments
+	/*
+	 * helper function returning the compile-time address of node if it is a MemoryVectorNode
+	 * that a native function iterating over dest upwards can read from, E_NOVAL otherwise
+	 */
+	static unsigned nativeSourceAddr(const Node* node, unsigned destAddr, unsigned size)
+	{
+		if (!dynamic_cast<const MemoryVectorNode*>(node))
+			return Node::E_NOVAL;
+		const unsigned addr(node->getVectorAddr());
+		if (addr == Node::E_NOVAL)
+			return Node::E_NOVAL;
+		// an element of the source must not be overwritten before being read
+		if (addr < destAddr && addr + size > destAddr)
+			return Node::E_NOVAL;
+		return addr;
+	}
+
+	/*
+	 * helper function returning true and setting value if node is a vector of
+	 * identical constants
+	 */
+	static bool isUniformImmediateVector(Node* node, Compiler* compiler, int& value)
+	{
+		if (!dynamic_cast<TupleVectorNode*>(node))
+			return false;
+		for (unsigned i = 0; i < node->getVectorSize(); i++)
+		{
+			// elements might be nested tuples, so look at their expansion
+			std::auto_ptr<Node> element(node->expandVectorialNodes(0, compiler, i));
+			ImmediateNode* immediate = dynamic_cast<ImmediateNode*>(element.get());
+			if (!immediate || (i > 0 && immediate->value != value))
+				return false;
+			value = immediate->value;
+		}
+		return true;
+	}
+
+	//! helper function returning the number of words of bytecode emitted by node
+	static unsigned emittedSize(const Node* node)
+	{
+		PreLinkBytecode bytecodes;
+		node->emit(bytecodes);
+		unsigned size = 0;
+		for (BytecodeVector::const_iterator it = bytecodes.current->begin(); it != bytecodes.current->end(); ++it)
+			size += it->getWordSize();
+		return size;
+	}
+
+	//! Return the id of the native function named name if it takes the given
+	//! number of arguments, all of templated size except scalarArg, E_NOVAL otherwise
+	unsigned AssignmentNode::findVectorNative(Compiler* compiler, const std::wstring& name, unsigned argsCount, unsigned scalarArg) const
+	{
+		FunctionsMap::const_iterator it(compiler->functionsMap.find(name));
+		if (it == compiler->functionsMap.end())
+			return E_NOVAL;
+		const TargetDescription::NativeFunction& function(compiler->targetDescription->nativeFunctions[it->second]);
+		if (function.parameters.size() != argsCount)
+			return E_NOVAL;
+		for (unsigned i = 0; i < argsCount; i++)
+			if (function.parameters[i].size != (i == scalarArg ? 1 : -1))
+				return E_NOVAL;
+		return it->second;
+	}
+
+	//! If the assignment is at least vectorNativesThreshold long and works on
+	//! compile-time memory ranges, return a call to the equivalent standard
+	//! native function (math.copy, math.fill, math.add, math.addscalar,
+	//! math.sub or math.mul), or NULL if the assignment must be unrolled
+	Node* AssignmentNode::expandToVectorNative(Compiler* compiler) const
+	{
+		// constant expressions are expanded without compiler
+		if (!compiler || compiler->vectorNativesThreshold == 0)
+			return 0;
+
+		const MemoryVectorNode* leftVector = polymorphic_downcast<const MemoryVectorNode*>(children[0]);
+		Node* rightVector = children[1];
+		const unsigned size = leftVector->getVectorSize();
+		const unsigned destAddr = leftVector->getVectorAddr();
+		if (size < compiler->vectorNativesThreshold || destAddr == E_NOVAL)
+			return 0;
+
+		// find the native function and its source arguments
+		std::vector<unsigned> sources;
+		unsigned funcId = E_NOVAL;
+		bool useScalar = false;
+		int scalar = 0;
+		const BinaryArithmeticNode* binary = dynamic_cast<const BinaryArithmeticNode*>(rightVector);
+		if (isUniformImmediateVector(rightVector, compiler, scalar))
+		{
+			// dest = [c, ..., c]
+			funcId = findVectorNative(compiler, L"math.fill", 2, 1);
+			useScalar = true;
+		}
+		else if (!binary)
+		{
+			// dest = src
+			sources.push_back(nativeSourceAddr(rightVector, destAddr, size));
+			funcId = findVectorNative(compiler, L"math.copy", 2, 2);
+		}
+		else if ((binary->op == ASEBA_OP_ADD || binary->op == ASEBA_OP_SUB) && isUniformImmediateVector(binary->children[1], compiler, scalar))
+		{
+			// dest = src +/- [c, ..., c]
+			if (binary->op == ASEBA_OP_SUB)
+				scalar = -scalar;
+			sources.push_back(nativeSourceAddr(binary->children[0], destAddr, size));
+			funcId = findVectorNative(compiler, L"math.addscalar", 3, 2);
+			useScalar = true;
+		}
+		else if (binary->op == ASEBA_OP_ADD && isUniformImmediateVector(binary->children[0], compiler, scalar))
+		{
+			// dest = [c, ..., c] + src
+			sources.push_back(nativeSourceAddr(binary->children[1], destAddr, size));
+			funcId = findVectorNative(compiler, L"math.addscalar", 3, 2);
+			useScalar = true;
+		}
+		else if (binary->op == ASEBA_OP_ADD || binary->op == ASEBA_OP_SUB || binary->op == ASEBA_OP_MULT)
+		{
+			// dest = src1 (op) src2
+			sources.push_back(nativeSourceAddr(binary->children[0], destAddr, size));
+			sources.push_back(nativeSourceAddr(binary->children[1], destAddr, size));
+			const wchar_t* name(binary->op == ASEBA_OP_ADD ? L"math.add" : (binary->op == ASEBA_OP_SUB ? L"math.sub" : L"math.mul"));
+			funcId = findVectorNative(compiler, name, 3, 3);
+		}
+		if (funcId == E_NOVAL)
+			return 0;
+		for (size_t i = 0; i < sources.size(); i++)
+			if (sources[i] == E_NOVAL)
+				return 0;
+
+		// the scalar argument is passed through a temporary variable shared by all these calls
+		if (useScalar && compiler->vectorNativesScratch == E_NOVAL)
+			compiler->vectorNativesScratch = compiler->allocateTemporaryMemory(sourcePos, 1);
+
+		// build the call
+		std::auto_ptr<CallNode> call(new CallNode(sourcePos, funcId));
+		call->templateArgs.push_back(size);
+		call->children.push_back(new ImmediateNode(sourcePos, destAddr));
+		for (size_t i = 0; i < sources.size(); i++)
+			call->children.push_back(new ImmediateNode(sourcePos, sources[i]));
+		if (useScalar)
+		{
+			std::auto_ptr<BlockNode> block(new BlockNode(sourcePos));
+			block->children.push_back(new AssignmentNode(sourcePos,
+								     new StoreNode(sourcePos, compiler->vectorNativesScratch),
+								     new ImmediateNode(sourcePos, scalar)));
+			block->children.push_back(new ImmediateNode(sourcePos, compiler->vectorNativesScratch));
+			call->children.push_back(block.release());
+		}
+
+		// only use it if it is smaller than the unrolled version
+		std::auto_ptr<BlockNode> unrolled(new BlockNode(sourcePos));
+		for (unsigned int i = 0; i < size; i++)
+		{
+			unrolled->children.push_back(new AssignmentNode(sourcePos,
+									 children[0]->expandVectorialNodes(0, compiler, i),
+									 children[1]->expandVectorialNodes(0, compiler, i)));
+		}
+		const unsigned unrolledSize(emittedSize(unrolled.get()));
+		const unsigned callSize(emittedSize(call.get()));
+		if (callSize >= unrolledSize)
+			return 0;
+
+		compiler->vectorNativesCount++;
+		compiler->vectorNativesSavedWords += unrolledSize - callSize;
+		return call.release();
+	}
+
+	//! Assignment between vectors is expanded into multiple scalar assignments,
+	//! or into a native function call for long vectors
 	Node* AssignmentNode::expandVectorialNodes(std::wostream *dump, Compiler* compiler, unsigned int index)
 	{
 		assert(children.size() == 2);
@@ -221,6 +408,11 @@ namespace Aseba
 		// right vector can be anything
 		Node* rightVector = children[1];
 
+		// use a native function if possible
+		Node* call = expandToVectorNative(compiler);
+		if (call)
+			return call;
+
 		// check if the left vector appears somewhere on the right side
 		if (matchNameInMemoryVector(rightVector, leftVector->arrayName) && leftVector->getVectorSize() > 1)
 		{
@@ -145,6 +145,10 @@ namespace Aseba
 		virtual void emit(PreLinkBytecode& bytecodes) const;
 		virtual std::wstring toWString() const { return L"Assign"; }
 		virtual std::wstring toNodeName() const { return L"assignment"; }
+
+	protected:
+		Node* expandToVectorNative(Compiler* compiler) const;
+		unsigned findVectorNative(Compiler* compiler, const std::wstring& name, unsigned argsCount, unsigned scalarArg) const;
 	};
 	
 	//! Node for L"if" and L"when".
@@ -60,6 +60,14 @@ bool Shell::isValid() const
 	return shellStream && targetStream;
 }
 
+void Shell::requestNodeDescription(unsigned nodeId)
+{
+	// the node announced a description we do not know yet, request it
+	GetNodeDescription getNodeDescription(nodeId);
+	getNodeDescription.serialize(targetStream);
+	targetStream->flush();
+}
+
 void Shell::nodeDescriptionReceived(unsigned nodeId)
 {
 	wcerr << '\r';
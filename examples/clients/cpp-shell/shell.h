@@ -64,6 +64,7 @@ public:
 	
 protected:
 	// reimplemented from parent classes
+	virtual void requestNodeDescription(unsigned nodeId);
 	virtual void nodeDescriptionReceived(unsigned nodeId);
 	virtual void incomingData(Dashel::Stream *stream);
 	
@@ -24,6 +24,7 @@
 #include <memory>
 #include <functional>
 #include <cstdlib>
+#include <cstring>
 #include "botspeak.h"
 #include "../../common/utils/utils.h"
 #include "../../transport/dashel_plugins/dashel-plugins.h"
@@ -200,6 +201,8 @@ namespace Aseba
 		commonDefinitions.events.push_back(NamedValue(L"running_ping", 0));
 		commonDefinitions.events.push_back(NamedValue(L"update_inputs", 0));
 		commonDefinitions.events.push_back(NamedValue(L"update_outputs", 0));
+		compiler.setCommonDefinitions(&commonDefinitions);
+		compiler.setIncrementalCompilation(true);
 		
 		// connect to the Aseba target
 		connect(asebaTarget);
@@ -252,6 +255,13 @@ namespace Aseba
 			abort();
 	}
 	
+	void BotSpeakBridge::requestNodeDescription(unsigned nodeId)
+	{
+		GetNodeDescription getNodeDescription(nodeId);
+		getNodeDescription.serialize(asebaStream);
+		asebaStream->flush();
+	}
+	
 	void BotSpeakBridge::nodeDescriptionReceived(unsigned nodeId)
 	{
 		if (verbose)
@@ -642,9 +652,7 @@ namespace Aseba
 		BytecodeVector bytecode;
 		unsigned allocatedVariablesCount;
 		wistringstream is(asebaSource);
-		Compiler compiler;
 		compiler.setTargetDescription(getDescription(nodeId));
-		compiler.setCommonDefinitions(&commonDefinitions);
 		const bool result(compiler.compile(is, bytecode, allocatedVariablesCount, error));
 		
 		if (result)
@@ -854,17 +862,26 @@ namespace Aseba
 
 int showHelp(const char* programName)
 {
-	std::cerr << "Usage: " << programName << " ASEBA_TARGET [BOTSPEAK_PORT]" << std::endl;
+	std::cerr << "Usage: " << programName << " [--cache DIRECTORY] ASEBA_TARGET [BOTSPEAK_PORT]" << std::endl;
+	std::cerr << "DIRECTORY must exist, the description of the Aseba node is kept there across runs" << std::endl;
 	return 1;
 }
 
 int main(int argc, char *argv[])
 {
 	unsigned botSpeakPort(9999);
+	const char* cacheDirectory("");
+	const char* programName(argv[0]);
 	
 	// process command line
+	if (argc > 2 && strcmp(argv[1], "--cache") == 0)
+	{
+		cacheDirectory = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc < 2)
-		return showHelp(argv[0]);
+		return showHelp(programName);
 	if (argc > 2)
 		botSpeakPort = atoi(argv[2]);
 	
@@ -875,6 +892,7 @@ int main(int argc, char *argv[])
 	try
 	{
 		Aseba::BotSpeakBridge bridge(botSpeakPort, argv[1]);
+		bridge.setDiskCache(cacheDirectory);
 		bridge.run();
 	}
 	catch(Dashel::DashelException e)
@@ -79,6 +79,9 @@ namespace Aseba
 		// events used for running botspeak code
 		CommonDefinitions commonDefinitions;
 		
+		// compiler kept across scripts, it only recompiles the parts of the program that changed
+		Compiler compiler;
+		
 		// known variables until now
 		unsigned freeVariableIndex;
 		VariablesMap variablesMap;
@@ -111,6 +114,7 @@ namespace Aseba
 		virtual void connectionCreated(Dashel::Stream *stream);
 		virtual void connectionClosed(Dashel::Stream * stream, bool abnormal);
 		virtual void incomingData(Dashel::Stream *stream);
+		virtual void requestNodeDescription(unsigned nodeId);
 		virtual void nodeDescriptionReceived(unsigned nodeId);
 		
 		// main handlers for activites on streams
@@ -19,6 +19,7 @@
 */
 
 #include <QCoreApplication>
+#include <QFile>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
@@ -27,6 +28,7 @@
 #include <valarray>
 #include <vector>
 #include <iterator>
+#include <algorithm>
 #include "medulla.h"
 #include "../../common/consts.h"
 #include "../../common/types.h"
@@ -105,13 +107,22 @@ namespace Aseba
 		deleteLater();
 	}
 	
-	AsebaNetworkInterface::AsebaNetworkInterface(Hub* hub, bool systemBus) :
+	AsebaNetworkInterface::AsebaNetworkInterface(Hub* hub, bool systemBus, const QString& cacheDirectory) :
 		QDBusAbstractAdaptor(hub),
 		hub(hub),
 		systemBus(systemBus),
 		eventsFiltersCounter(0)
 	{
 		qDBusRegisterMetaType<Values>();
+		batchCompiler.setDiskCache(cacheDirectory);
+		// the directory now exists, it also keeps the descriptions of the nodes
+		if (!cacheDirectory.isEmpty())
+			setDiskCache(QFile::encodeName(cacheDirectory).constData());
+		
+		// periodically forget the variables nobody reads anymore
+		QTimer* expirationTimer(new QTimer(this));
+		connect(expirationTimer, SIGNAL(timeout()), SLOT(expireSubscriptions()));
+		expirationTimer->start(SUBSCRIPTION_TIMEOUT / 10);
 		
 		//FIXME: here no error handling is done, with system bus these calls can fail	
 		DBusConnectionBus().registerObject("/", hub);
@@ -126,6 +137,9 @@ namespace Aseba
 		// scan this message for nodes descriptions
 		DescriptionsManager::processMessage(message);
 		
+		// and for changes of the bytecode of nodes by others
+		bytecodeUploader.processMessage(message);
+		
 		// if user message, send to D-Bus as well
 		UserMessage *userMessage = dynamic_cast<UserMessage *>(message);
 		if (userMessage)
@@ -133,31 +147,88 @@ namespace Aseba
 			sendEventOnDBus(userMessage->type, fromAsebaVector(userMessage->data));
 		}
 		
-		// if variables, check for pending answers
+		// if variables, update subscriptions and check for pending answers
 		Variables *variables = dynamic_cast<Variables *>(message);
 		if (variables)
 		{
-			const unsigned nodeId(variables->source);
-			const unsigned pos(variables->start);
-			for (RequestsList::iterator it = pendingReads.begin(); it != pendingReads.end(); ++it)
-			{
-				RequestData* request(*it);
-				if (request->nodeId == nodeId && request->pos == pos)
-				{
-					QDBusMessage &reply(request->reply);
-					Values values(fromAsebaVector(variables->variables));
-					reply << QVariant::fromValue(values);
-					DBusConnectionBus().send(reply);
-					delete request;
-					pendingReads.erase(it);
-					break;
-				}
-			}
+			variablesReceived(variables->source, variables->start, variables->variables.size(), variables->variables);
+			answerPendingReads(VariablesKey(variables->source, variables->start), fromAsebaVector(variables->variables));
 		}
+		VariablesDelta *variablesDelta = dynamic_cast<VariablesDelta *>(message);
+		if (variablesDelta)
+			variablesDeltaReceived(variablesDelta);
+		VariablesUnsubscribed *variablesUnsubscribedMessage = dynamic_cast<VariablesUnsubscribed *>(message);
+		if (variablesUnsubscribedMessage)
+			variablesUnsubscribed(variablesUnsubscribedMessage);
 		
 		delete message;
 	}
 	
+	//! Copy the variables a node sent, or that were written to it, to the subscribed variables they overlap
+	void AsebaNetworkInterface::variablesReceived(unsigned nodeId, unsigned start, unsigned length, const std::vector<sint16>& values)
+	{
+		SubscriptionsMap::iterator it(subscriptions.lowerBound(VariablesKey(nodeId, 0)));
+		for (; it != subscriptions.end() && it.key().first == nodeId; ++it)
+		{
+			const unsigned pos(it.key().second);
+			if (pos == start && it->length == length)
+			{
+				it->values = values;
+				it->receptionTime = UnifiedTime();
+			}
+			else if (!it->values.empty())
+			{
+				const unsigned begin(std::max(pos, start));
+				const unsigned end(std::min(pos + it->length, start + length));
+				for (unsigned address = begin; address < end; ++address)
+					it->values[address - pos] = values[address - start];
+			}
+		}
+	}
+	
+	//! Apply the changes of variables a node sent to the subscribed variables they overlap
+	void AsebaNetworkInterface::variablesDeltaReceived(const VariablesDelta* delta)
+	{
+		const VariablesKey key(delta->source, delta->start);
+		SubscriptionsMap::iterator it(subscriptions.lowerBound(VariablesKey(delta->source, 0)));
+		for (; it != subscriptions.end() && it.key().first == delta->source; ++it)
+		{
+			// without the values first sent, changes cannot be applied
+			if (it->values.empty())
+				continue;
+			delta->apply(it.key().second, it->values);
+			if (it.key() == key && it->length == delta->length)
+			{
+				it->receptionTime = UnifiedTime();
+				answerPendingReads(key, fromAsebaVector(it->values));
+			}
+		}
+	}
+	
+	//! Forget a subscription the node dropped, reads subscribe again unless the node had no room for it
+	void AsebaNetworkInterface::variablesUnsubscribed(const VariablesUnsubscribed* unsubscribed)
+	{
+		const VariablesKey key(unsubscribed->source, unsubscribed->start);
+		SubscriptionsMap::iterator it(subscriptions.find(key));
+		if (it == subscriptions.end() || it->length != unsubscribed->length)
+			return;
+		subscriptions.erase(it);
+		if (unsubscribed->reason == ASEBA_UNSUBSCRIBED_NO_ROOM)
+			polledVariables.insert(key);
+	}
+	
+	void AsebaNetworkInterface::answerPendingReads(const VariablesKey& key, const Values& values)
+	{
+		PendingReadsMap::iterator it(pendingReads.find(key));
+		while (it != pendingReads.end() && it.key() == key)
+		{
+			QDBusMessage &reply(it.value());
+			reply << QVariant::fromValue(values);
+			DBusConnectionBus().send(reply);
+			it = pendingReads.erase(it);
+		}
+	}
+	
 	void AsebaNetworkInterface::sendEventOnDBus(const quint16 event, const Values& data)
 	{
 		QList<EventFilterInterface*> filters = eventsFilters.values(event);
@@ -189,99 +260,66 @@ namespace Aseba
 	
 	void AsebaNetworkInterface::LoadScripts(const QString& fileName, const QDBusMessage &message)
 	{
-		QFile file(fileName);
-		if (!file.open(QFile::ReadOnly))
-		{
-			DBusConnectionBus().send(message.createErrorReply(QDBusError::InvalidArgs, QString("file %0 does not exists").arg(fileName)));
-			return;
-		}
-		
-		QDomDocument document("aesl-source");
-		QString errorMsg;
-		int errorLine;
-		int errorColumn;
-		if (!document.setContent(&file, false, &errorMsg, &errorLine, &errorColumn))
+		AeslProject project;
+		QString errorMessage;
+		if (!project.load(fileName, errorMessage))
 		{
-			DBusConnectionBus().send(message.createErrorReply(QDBusError::Other, QString("Error in XML source file: %0 at line %1, column %2").arg(errorMsg).arg(errorLine).arg(errorColumn)));
+			DBusConnectionBus().send(message.createErrorReply(QDBusError::InvalidArgs, errorMessage));
 			return;
 		}
 		
-		commonDefinitions.events.clear();
-		commonDefinitions.constants.clear();
+		commonDefinitions = project.commonDefinitions;
 		userDefinedVariablesMap.clear();
 		
+		// compile the programs of the nodes present in the network, concurrently
+		BatchCompiler::JobsVector jobs;
+		std::vector<const AeslNodeProgram*> programs;
+		std::vector<unsigned> programsNodeIds;
 		int noNodeCount = 0;
-		QDomNode domNode = document.documentElement().firstChild();
+		for (size_t i = 0; i < project.programs.size(); ++i)
+		{
+			const AeslNodeProgram& program(project.programs[i]);
+			bool ok;
+			const unsigned nodeId(getNodeId(program.name, program.nodeId, &ok));
+			if (ok)
+			{
+				jobs.push_back(BatchCompiler::Job(getDescription(nodeId), program.source));
+				programs.push_back(&program);
+				programsNodeIds.push_back(nodeId);
+			}
+			else
+				noNodeCount++;
+		}
+		const BatchCompiler::CompiledProgramsVector results(batchCompiler.compile(jobs, commonDefinitions));
+		std::wcerr << QString("Compilation cache: %0 hits, %1 disk hits, %2 misses").arg(batchCompiler.getCacheHitsCount()).arg(batchCompiler.getDiskCacheHitsCount()).arg(batchCompiler.getCacheMissesCount()).toStdWString() << std::endl;
 		
-		// FIXME: this code depends on event and contants being before any code
+		// load them, in file order
 		bool wasError = false;
-		while (!domNode.isNull())
+		for (size_t i = 0; i < results.size(); ++i)
 		{
-			if (domNode.isElement())
+			const CompiledProgram& result(results[i]);
+			const unsigned nodeId(programsNodeIds[i]);
+			if (result.success)
 			{
-				QDomElement element = domNode.toElement();
-				if (element.tagName() == "node")
-				{
-					bool ok;
-					const unsigned nodeId(getNodeId(element.attribute("name").toStdWString(), element.attribute("nodeId", 0).toUInt(), &ok));
-					if (ok)
-					{
-						std::wistringstream is(element.firstChild().toText().data().toStdWString());
-						Error error;
-						BytecodeVector bytecode;
-						unsigned allocatedVariablesCount;
-						
-						Compiler compiler;
-						compiler.setTargetDescription(getDescription(nodeId));
-						compiler.setCommonDefinitions(&commonDefinitions);
-						bool result = compiler.compile(is, bytecode, allocatedVariablesCount, error);
-						
-						if (result)
-						{
-							typedef std::vector<Message*> MessageVector;
-							MessageVector messages;
-							sendBytecode(messages, nodeId, std::vector<uint16>(bytecode.begin(), bytecode.end()));
-							for (MessageVector::const_iterator it = messages.begin(); it != messages.end(); ++it)
-							{
-								hub->sendMessage(*it);
-								delete *it;
-							}
-							Run msg(nodeId);
-							hub->sendMessage(msg);
-						}
-						else
-						{
-							DBusConnectionBus().send(message.createErrorReply(QDBusError::Failed, QString::fromStdWString(error.toWString())));
-							wasError = true;
-							break;
-						}
-						// retrieve user-defined variables for use in get/set
-						userDefinedVariablesMap[element.attribute("name")] = *compiler.getVariablesMap();
-					}
-					else
-						noNodeCount++;
-				}
-				else if (element.tagName() == "event")
+				typedef std::vector<Message*> MessageVector;
+				MessageVector messages;
+				bytecodeUploader.sendBytecode(messages, nodeId, std::vector<uint16>(result.bytecode.begin(), result.bytecode.end()));
+				for (MessageVector::const_iterator it = messages.begin(); it != messages.end(); ++it)
 				{
-					const QString eventName(element.attribute("name"));
-					const unsigned eventSize(element.attribute("size").toUInt());
-					if (eventSize > ASEBA_MAX_EVENT_ARG_SIZE)
-					{
-						DBusConnectionBus().send(message.createErrorReply(QDBusError::Failed, QString("Event %1 has a length %2 larger than maximum %3").arg(eventName).arg(eventSize).arg(ASEBA_MAX_EVENT_ARG_SIZE)));
-						wasError = true;
-						break;
-					}
-					else
-					{
-						commonDefinitions.events.push_back(NamedValue(eventName.toStdWString(), eventSize));
-					}
-				}
-				else if (element.tagName() == "constant")
-				{
-					commonDefinitions.constants.push_back(NamedValue(element.attribute("name").toStdWString(), element.attribute("value").toUInt()));
+					hub->sendMessage(*it);
+					delete *it;
 				}
+				Run msg(nodeId);
+				hub->sendMessage(msg);
 			}
-			domNode = domNode.nextSibling();
+			else
+			{
+				DBusConnectionBus().send(message.createErrorReply(QDBusError::Failed, QString::fromStdWString(result.error.toWString())));
+				wasError = true;
+				break;
+			}
+			// retrieve user-defined variables for use in get/set
+			userDefinedVariablesMap[QString::fromStdWString(programs[i]->name)] = result.variablesMap;
 		}
 		
 		// check if there was an error
@@ -355,7 +393,7 @@ namespace Aseba
 		}
 	}
 	
-	void AsebaNetworkInterface::SetVariable(const QString& node, const QString& variable, const Values& data, const QDBusMessage &message) const
+	void AsebaNetworkInterface::SetVariable(const QString& node, const QString& variable, const Values& data, const QDBusMessage &message)
 	{
 		// make sure the node exists
 		NodesNamesMap::const_iterator nodeIt(nodesNames.find(node));
@@ -394,6 +432,9 @@ namespace Aseba
 		
 		SetVariables msg(nodeId, pos, toAsebaVector(data));
 		hub->sendMessage(msg);
+		
+		// so that reads answered from subscriptions do not return the values from before this write
+		variablesReceived(nodeId, pos, msg.variables.size(), msg.variables);
 	}
 	
 	Values AsebaNetworkInterface::GetVariable(const QString& node, const QString& variable, const QDBusMessage &message)
@@ -436,20 +477,41 @@ namespace Aseba
 			}
 		}
 		
-		// send request to aseba network
+		// if the node sends this variable by itself, answer with its last values, if recent enough
+		const VariablesKey key(nodeId, pos);
+		SubscriptionsMap::iterator subscriptionIt(subscriptions.find(key));
+		if (subscriptionIt != subscriptions.end() && subscriptionIt->length != length)
+		{
+			subscriptions.erase(subscriptionIt);
+			subscriptionIt = subscriptions.end();
+		}
+		if (subscriptionIt != subscriptions.end())
+		{
+			subscriptionIt->readTime = UnifiedTime();
+			if (!subscriptionIt->values.empty() && (UnifiedTime() - subscriptionIt->receptionTime).value < 3 * SUBSCRIPTION_PERIOD)
+				return fromAsebaVector(subscriptionIt->values);
+		}
+		
+		// send request to aseba network: subscribe if the variable fits in a single message and the node has room, the node then sends it right away
+		if (length < ASEBA_MAX_EVENT_ARG_COUNT && !polledVariables.contains(key))
+		{
+			SubscribeVariables msg(nodeId, pos, length, SUBSCRIPTION_PERIOD, false);
+			hub->sendMessage(msg);
+			
+			SubscribedVariables& subscription(subscriptions[key]);
+			subscription.length = length;
+			subscription.values.clear();
+			subscription.readTime = UnifiedTime();
+		}
+		else
 		{
 			GetVariables msg(nodeId, pos, length);
 			hub->sendMessage(msg);
 		}
 		
 		// build bookkeeping for async reply
-		RequestData *request = new RequestData;
-		request->nodeId = nodeId;
-		request->pos = pos;
 		message.setDelayedReply(true);
-		request->reply = message.createReply();
-		
-		pendingReads.push_back(request);
+		pendingReads.insert(key, message.createReply());
 		return Values();
 	}
 	
@@ -479,9 +541,50 @@ namespace Aseba
 		return path;
 	}
 	
+	void AsebaNetworkInterface::requestNodeDescription(unsigned nodeId)
+	{
+		GetNodeDescription message(nodeId);
+		hub->sendMessage(message);
+	}
+	
 	void AsebaNetworkInterface::nodeDescriptionReceived(unsigned nodeId)
 	{
 		nodesNames[QString::fromStdWString(nodesDescriptions[nodeId].name)] = nodeId;
+		
+		// the node has restarted and forgotten its subscriptions
+		SubscriptionsMap::iterator it(subscriptions.begin());
+		while (it != subscriptions.end())
+		{
+			if (it.key().first == nodeId)
+				it = subscriptions.erase(it);
+			else
+				++it;
+		}
+		QSet<VariablesKey>::iterator jt(polledVariables.begin());
+		while (jt != polledVariables.end())
+		{
+			if (jt->first == nodeId)
+				jt = polledVariables.erase(jt);
+			else
+				++jt;
+		}
+	}
+	
+	void AsebaNetworkInterface::expireSubscriptions()
+	{
+		const UnifiedTime now;
+		SubscriptionsMap::iterator it(subscriptions.begin());
+		while (it != subscriptions.end())
+		{
+			if ((now - it->readTime).value >= SUBSCRIPTION_TIMEOUT)
+			{
+				UnsubscribeVariables msg(it.key().first, it.key().second, it->length);
+				hub->sendMessage(msg);
+				it = subscriptions.erase(it);
+			}
+			else
+				++it;
+		}
 	}
 
 	inline QDBusConnection AsebaNetworkInterface::DBusConnectionBus() const
@@ -494,7 +597,7 @@ namespace Aseba
 	
 	// the following methods run in the main thread (event loop)
 	
-	Hub::Hub(unsigned port, bool verbose, bool dump, bool forward, bool rawTime, bool systemBus) :
+	Hub::Hub(unsigned port, bool verbose, bool dump, bool forward, bool rawTime, bool systemBus, const QString& cacheDirectory) :
 		#ifdef DASHEL_VERSION_INT
 		Dashel::Hub(verbose || dump),
 		#endif // DASHEL_VERSION_INT
@@ -504,7 +607,7 @@ namespace Aseba
 		rawTime(rawTime)
 	{
 		// TODO: work in progress to remove ugly delay
-		AsebaNetworkInterface* network(new AsebaNetworkInterface(this, systemBus));
+		AsebaNetworkInterface* network(new AsebaNetworkInterface(this, systemBus, cacheDirectory));
 		QObject::connect(this, SIGNAL(messageAvailable(Message*, Dashel::Stream*)), network, SLOT(processMessage(Message*, Dashel::Stream*)));
 		QObject::connect(this, SIGNAL(firstConnectionCreated()), SLOT(firstConnectionAvailable()));
 		ostringstream oss;
@@ -632,6 +735,7 @@ void dumpHelp(std::ostream &stream, const char *programName)
 	stream << "-p port         : listens to incoming connection on this port\n";
 	stream << "--rawtime       : shows time in the form of sec:usec since 1970\n";
 	stream << "--system        : connects medulla to the system d-bus bus\n";	
+	stream << "--cache dir     : keeps compiled scripts and nodes descriptions in dir across runs\n";
 	stream << "-h, --help      : shows this help\n";
 	stream << "-V, --version   : shows the version number\n";
 	stream << "Additional targets are any valid Dashel targets." << std::endl;
@@ -657,6 +761,7 @@ int main(int argc, char *argv[])
 	bool forward = true;
 	bool rawTime = false;
 	bool systemBus = false;
+	QString cacheDirectory;
 	std::vector<std::string> additionalTargets;
 	
 	int argCounter = 1;
@@ -690,6 +795,11 @@ int main(int argc, char *argv[])
 		{
 			systemBus = true;
 		}
+		else if (strcmp(arg, "--cache") == 0)
+		{
+			arg = argv[++argCounter];
+			cacheDirectory = QString::fromLocal8Bit(arg);
+		}
 		else if ((strcmp(arg, "-h") == 0) || (strcmp(arg, "--help") == 0))
 		{
 			dumpHelp(std::cout, argv[0]);
@@ -707,7 +817,7 @@ int main(int argc, char *argv[])
 		argCounter++;
 	}
 	
-	Aseba::Hub hub(port, verbose, dump, forward, rawTime, systemBus);
+	Aseba::Hub hub(port, verbose, dump, forward, rawTime, systemBus, cacheDirectory);
 	
 	try
 	{
@@ -30,8 +30,14 @@
 #include <QDBusMessage>
 #include <QMetaType>
 #include <QList>
+#include <QMap>
+#include <QSet>
+#include <QPair>
 #include "../../common/msg/msg.h"
 #include "../../common/msg/descriptions-manager.h"
+#include "../../common/msg/bytecode-uploader.h"
+#include "../../common/utils/utils.h"
+#include "../../compiler/batch/BatchCompiler.h"
 
 typedef QList<qint16> Values;
 
@@ -82,15 +88,25 @@ namespace Aseba
 		Q_CLASSINFO("D-Bus Interface", "ch.epfl.mobots.AsebaNetwork")
 		
 		protected:
-			struct RequestData
+			//! Variables of a node, identified by the node and their position
+			typedef QPair<unsigned, unsigned> VariablesKey;
+			
+			//! Variables that a node sends by itself, to answer reads without asking the node each time
+			struct SubscribedVariables
 			{
-				unsigned nodeId;
-				unsigned pos;
-				QDBusMessage reply;
+				unsigned length; //!< number of variables
+				std::vector<sint16> values; //!< values last sent by the node, kept up to date by the changes it sends, empty if none yet
+				UnifiedTime receptionTime; //!< when values were received
+				UnifiedTime readTime; //!< when values were last read through D-Bus
 			};
 			
+			//! Period at which nodes send subscribed variables, in ms
+			enum { SUBSCRIPTION_PERIOD = 100 };
+			//! Subscribed variables not read for that long, in ms, are unsubscribed
+			enum { SUBSCRIPTION_TIMEOUT = 10000 };
+			
 		public:
-			AsebaNetworkInterface(Hub* hub, bool systemBus);
+			AsebaNetworkInterface(Hub* hub, bool systemBus, const QString& cacheDirectory);
 		
 		private slots:
 			friend class Hub;
@@ -100,31 +116,42 @@ namespace Aseba
 			void listenEvent(EventFilterInterface* filter, quint16 event);
 			void ignoreEvent(EventFilterInterface* filter, quint16 event);
 			void filterDestroyed(EventFilterInterface* filter);
+			void expireSubscriptions();
 		
 		public slots:
 			Q_NOREPLY void LoadScripts(const QString& fileName, const QDBusMessage &message);
 			QStringList GetNodesList() const;
 			qint16 GetNodeId(const QString& node, const QDBusMessage &message) const;
 			QStringList GetVariablesList(const QString& node) const;
-			Q_NOREPLY void SetVariable(const QString& node, const QString& variable, const Values& data, const QDBusMessage &message) const;
+			Q_NOREPLY void SetVariable(const QString& node, const QString& variable, const Values& data, const QDBusMessage &message);
 			Values GetVariable(const QString& node, const QString& variable, const QDBusMessage &message);
 			Q_NOREPLY void SendEvent(const quint16 event, const Values& data);
 			Q_NOREPLY void SendEventName(const QString& name, const Values& data, const QDBusMessage &message);
 			QDBusObjectPath CreateEventFilter();
 		
 		protected:
+			virtual void requestNodeDescription(unsigned nodeId);
 			virtual void nodeDescriptionReceived(unsigned nodeId);
+			void variablesReceived(unsigned nodeId, unsigned start, unsigned length, const std::vector<sint16>& values);
+			void variablesDeltaReceived(const VariablesDelta* delta);
+			void variablesUnsubscribed(const VariablesUnsubscribed* unsubscribed);
+			void answerPendingReads(const VariablesKey& key, const Values& values);
 			QDBusConnection DBusConnectionBus() const;
 			
 		protected:
 			Hub* hub;
 			CommonDefinitions commonDefinitions;
+			BatchCompiler batchCompiler; //!< compiles the scripts, keeping the results across loads
+			BytecodeUploader bytecodeUploader; //!< only sends what changed when scripts are reloaded
 			typedef QMap<QString, unsigned> NodesNamesMap;
 			NodesNamesMap nodesNames;
 			typedef QMap<QString, VariablesMap> UserDefinedVariablesMap;
 			UserDefinedVariablesMap userDefinedVariablesMap;
-			typedef QList<RequestData*> RequestsList;
-			RequestsList pendingReads;
+			typedef QMultiMap<VariablesKey, QDBusMessage> PendingReadsMap;
+			PendingReadsMap pendingReads; //!< replies waiting for the variables of a node
+			typedef QMap<VariablesKey, SubscribedVariables> SubscriptionsMap;
+			SubscriptionsMap subscriptions; //!< variables nodes send by themselves
+			QSet<VariablesKey> polledVariables; //!< variables nodes had no room to send by themselves
 			typedef QMultiMap<quint16, EventFilterInterface*> EventsFiltersMap;
 			EventsFiltersMap eventsFilters;
 			bool systemBus;
@@ -149,8 +176,10 @@ namespace Aseba
 				@param dump should we dump content of each message
 				@param forward should we only forward messages instead of transmit them back to the sender
 				@param rawTime should the time be printed as integer
+				@param systemBus should we connect to the system bus instead of the session one
+				@param cacheDirectory directory where compiled scripts and nodes descriptions are kept across runs, none if empty
 			*/
-			Hub(unsigned port, bool verbose, bool dump, bool forward, bool rawTime, bool systemBus);
+			Hub(unsigned port, bool verbose, bool dump, bool forward, bool rawTime, bool systemBus, const QString& cacheDirectory);
 			
 			/*! Sends a message to Dashel peers.
 				Does not delete the message, should be called by the main thread.
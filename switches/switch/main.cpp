@@ -0,0 +1,204 @@
+/*
+	Aseba - an event-based framework for distributed robot control
+	Copyright (C) 2007--2012:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+		and other contributors, see authors.txt for details
+	
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+	
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "switch.h"
+#include "../../transport/dashel_plugins/dashel-plugins.h"
+#include "../../common/consts.h"
+
+#define DEFAULT_WRITER_QUEUE_CAPACITY 256
+
+//! Show usage
+void dumpHelp(std::ostream &stream, const char *programName)
+{
+	stream << "Aseba switch, connects aseba components together, usage:\n";
+	stream << programName << " [options] [additional targets]*\n";
+	stream << "Options:\n";
+	stream << "-v, --verbose   : makes the switch verbose\n";
+	stream << "-d, --dump      : makes the switch dump all data\n";
+	stream << "-l, --loop      : makes the switch transmit messages back to the send, not only forward them.\n";
+	stream << "-p port         : listens to incoming connection on this port\n";
+	stream << "--rawtime       : shows time in the form of sec:usec since 1970\n";
+	#ifdef ASEBA_SWITCH_WRITER_THREADS
+	stream << "-t, --threads   : writes to each connection from its own thread, so that slow ones do not delay the others\n";
+	stream << "--queue size    : with -t, maximum number of user messages queued per connection (default: " << DEFAULT_WRITER_QUEUE_CAPACITY << ")\n";
+	stream << "--drop-newest   : with -t, drops new user messages instead of the oldest queued ones when a queue is full\n";
+	stream << "--stats seconds : with -t, shows the depth of queues and the number of dropped messages periodically\n";
+	#endif // ASEBA_SWITCH_WRITER_THREADS
+	stream << "-h, --help      : shows this help\n";
+	stream << "-V, --version   : shows the version number\n";
+	stream << "Additional targets are any valid Dashel targets." << std::endl;
+	stream << "Report bugs to: aseba-dev@gna.org" << std::endl;
+}
+
+//! Show version
+void dumpVersion(std::ostream &stream)
+{
+	stream << "Aseba switch " << ASEBA_VERSION << std::endl;
+	stream << "Aseba protocol " << ASEBA_PROTOCOL_VERSION << std::endl;
+	stream << "Licence LGPLv3: GNU LGPL version 3 <http://www.gnu.org/licenses/lgpl.html>\n";
+}
+ 
+int main(int argc, char *argv[])
+{
+	Dashel::initPlugins();
+	unsigned port = ASEBA_DEFAULT_PORT;
+	bool verbose = false;
+	bool dump = false;
+	bool forward = true;
+	bool rawTime = false;
+	#ifdef ASEBA_SWITCH_WRITER_THREADS
+	bool writerThreads = false;
+	size_t writerQueueCapacity = DEFAULT_WRITER_QUEUE_CAPACITY;
+	Aseba::ConnectionWriter::DropPolicy writerDropPolicy = Aseba::ConnectionWriter::DROP_OLDEST;
+	unsigned statsInterval = 0;
+	#endif // ASEBA_SWITCH_WRITER_THREADS
+	std::vector<std::string> additionalTargets;
+	
+	int argCounter = 1;
+	
+	while (argCounter < argc)
+	{
+		const char *arg = argv[argCounter];
+		
+		if ((strcmp(arg, "-v") == 0) || (strcmp(arg, "--verbose") == 0))
+		{
+			verbose = true;
+		}
+		else if ((strcmp(arg, "-d") == 0) || (strcmp(arg, "--dump") == 0))
+		{
+			dump = true;
+		}
+		else if ((strcmp(arg, "-l") == 0) || (strcmp(arg, "--loop") == 0))
+		{
+			forward = false;
+		}
+		else if (strcmp(arg, "-p") == 0)
+		{
+			if (argCounter + 1 >= argc)
+			{
+				std::cerr << "port value needed" << std::endl;
+				return 1;
+			}
+			arg = argv[++argCounter];
+			port = atoi(arg);
+		}
+		else if (strcmp(arg, "--rawtime") == 0)
+		{
+			rawTime = true;
+		}
+		#ifdef ASEBA_SWITCH_WRITER_THREADS
+		else if ((strcmp(arg, "-t") == 0) || (strcmp(arg, "--threads") == 0))
+		{
+			writerThreads = true;
+		}
+		else if (strcmp(arg, "--queue") == 0)
+		{
+			if (argCounter + 1 >= argc)
+			{
+				std::cerr << "queue size needed" << std::endl;
+				return 1;
+			}
+			arg = argv[++argCounter];
+			writerQueueCapacity = atoi(arg);
+		}
+		else if (strcmp(arg, "--drop-newest") == 0)
+		{
+			writerDropPolicy = Aseba::ConnectionWriter::DROP_NEWEST;
+		}
+		else if (strcmp(arg, "--stats") == 0)
+		{
+			if (argCounter + 1 >= argc)
+			{
+				std::cerr << "stats period needed" << std::endl;
+				return 1;
+			}
+			arg = argv[++argCounter];
+			statsInterval = atoi(arg);
+		}
+		#endif // ASEBA_SWITCH_WRITER_THREADS
+		else if ((strcmp(arg, "-h") == 0) || (strcmp(arg, "--help") == 0))
+		{
+			dumpHelp(std::cout, argv[0]);
+			return 0;
+		}
+		else if ((strcmp(arg, "-V") == 0) || (strcmp(arg, "--version") == 0))
+		{
+			dumpVersion(std::cout);
+			return 0;
+		}
+		else
+		{
+			additionalTargets.push_back(argv[argCounter]);
+		}
+		argCounter++;
+	}
+	
+	try
+	{
+		Aseba::Switch aswitch(port, verbose, dump, forward, rawTime);
+		#ifdef ASEBA_SWITCH_WRITER_THREADS
+		if (writerThreads)
+		{
+			aswitch.enableWriterThreads(std::max<size_t>(writerQueueCapacity, 1), writerDropPolicy);
+			aswitch.setStatsInterval(statsInterval);
+		}
+		#endif // ASEBA_SWITCH_WRITER_THREADS
+		for (size_t i = 0; i < additionalTargets.size(); i++)
+		{
+			const std::string& target(additionalTargets[i]);
+			Dashel::Stream* stream = aswitch.connect(target);
+			
+			// see whether we have to remap the id of this stream
+			Dashel::ParameterSet remapIdDecoder;
+			remapIdDecoder.add("dummy:remapLocal=-1;remapTarget=1");
+			remapIdDecoder.add(target.c_str());
+			const int remappedLocalId(remapIdDecoder.get<int>("remapLocal"));
+			const int remappedTargetId(remapIdDecoder.get<int>("remapTarget"));
+			if (target.find("remapLocal=") != std::string::npos)
+			{
+				aswitch.remapId(stream, uint16(remappedLocalId), uint16(remappedTargetId));
+				if (verbose)
+					std::cout << "Remapping local " << remappedLocalId << " with remote " << remappedTargetId << std::endl;
+			}
+		}
+		/*
+		Uncomment this and comment aswitch.run() to flood all pears with dummy user messages
+		while (1)
+		{
+			aswitch.step(10);
+			aswitch.broadcastDummyUserMessage();
+		}*/
+		aswitch.run();
+	}
+	catch(Dashel::DashelException e)
+	{
+		std::cerr << e.what() << std::endl;
+	}
+	
+	return 0;
+}
+
+
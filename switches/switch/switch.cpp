@@ -26,8 +26,9 @@
 #include <valarray>
 #include <vector>
 #include <iterator>
+#include <memory>
+#include <algorithm>
 #include "switch.h"
-#include "../../transport/dashel_plugins/dashel-plugins.h"
 #include "../../common/consts.h"
 #include "../../common/utils/utils.h"
 #include "../../common/msg/msg.h"
@@ -41,6 +42,136 @@ namespace Aseba
 	/** \addtogroup switch */
 	/*@{*/
 
+	#ifdef ASEBA_SWITCH_WRITER_THREADS
+	
+	ConnectionWriter::ConnectionWriter(Dashel::Stream* stream, size_t capacity, DropPolicy dropPolicy) :
+		stream(stream),
+		capacity(capacity),
+		dropPolicy(dropPolicy),
+		userMessagesCount(0),
+		stopRequested(false)
+	{
+		stats.depth = 0;
+		stats.maxDepth = 0;
+		stats.droppedCount = 0;
+		stats.failed = false;
+		
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&condition, NULL);
+		pthread_create(&thread, NULL, threadMain, this);
+	}
+	
+	//! Stop the thread, dropping the messages not written yet
+	ConnectionWriter::~ConnectionWriter()
+	{
+		pthread_mutex_lock(&mutex);
+		stopRequested = true;
+		pthread_cond_signal(&condition);
+		pthread_mutex_unlock(&mutex);
+		
+		pthread_join(thread, NULL);
+		pthread_cond_destroy(&condition);
+		pthread_mutex_destroy(&mutex);
+	}
+	
+	//! Queue a copy of message, to be written by the thread
+	void ConnectionWriter::push(const RawMessage& message)
+	{
+		pthread_mutex_lock(&mutex);
+		
+		bool queue(!stats.failed);
+		if (queue && message.isUserMessage() && userMessagesCount >= capacity)
+		{
+			// the queue is full, drop a user message
+			++stats.droppedCount;
+			if (dropPolicy == DROP_OLDEST)
+			{
+				for (MessagesQueue::iterator it = messages.begin(); it != messages.end(); ++it)
+				{
+					if (it->isUserMessage())
+					{
+						messages.erase(it);
+						--userMessagesCount;
+						break;
+					}
+				}
+			}
+			else
+				queue = false;
+		}
+		
+		if (queue)
+		{
+			messages.push_back(message);
+			if (message.isUserMessage())
+				++userMessagesCount;
+			stats.maxDepth = std::max(stats.maxDepth, messages.size());
+			pthread_cond_signal(&condition);
+		}
+		
+		pthread_mutex_unlock(&mutex);
+	}
+	
+	ConnectionWriter::Stats ConnectionWriter::getStats() const
+	{
+		pthread_mutex_lock(&mutex);
+		Stats currentStats(stats);
+		currentStats.depth = messages.size();
+		pthread_mutex_unlock(&mutex);
+		return currentStats;
+	}
+	
+	void* ConnectionWriter::threadMain(void* writer)
+	{
+		static_cast<ConnectionWriter*>(writer)->writeLoop();
+		return NULL;
+	}
+	
+	//! Write all queued messages at once outside the lock, then flush, until stop is requested or writing fails
+	void ConnectionWriter::writeLoop()
+	{
+		MessagesQueue batch;
+		pthread_mutex_lock(&mutex);
+		while (true)
+		{
+			while (messages.empty() && !stopRequested)
+				pthread_cond_wait(&condition, &mutex);
+			if (stopRequested)
+				break;
+			
+			batch.swap(messages);
+			userMessagesCount = 0;
+			pthread_mutex_unlock(&mutex);
+			
+			bool failed(false);
+			try
+			{
+				for (MessagesQueue::const_iterator it = batch.begin(); it != batch.end(); ++it)
+					it->serialize(stream);
+				stream->flush();
+			}
+			catch (DashelException e)
+			{
+				// if this stream has a problem, stop writing to it, and let Hub call connectionClosed later.
+				std::cerr << "error while writing" << std::endl;
+				failed = true;
+			}
+			batch.clear();
+			
+			pthread_mutex_lock(&mutex);
+			if (failed)
+			{
+				stats.failed = true;
+				messages.clear();
+				userMessagesCount = 0;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+	
+	#endif // ASEBA_SWITCH_WRITER_THREADS
+	
 	//! Broadcast messages form any data stream to all others data streams including itself.
 	Switch::Switch(unsigned port, bool verbose, bool dump, bool forward, bool rawTime) :
 		#ifdef DASHEL_VERSION_INT
@@ -50,12 +181,115 @@ namespace Aseba
 		dump(dump),
 		forward(forward),
 		rawTime(rawTime)
+		#ifdef ASEBA_SWITCH_WRITER_THREADS
+		,
+		statsInterval(0),
+		writerQueueCapacity(0),
+		writerDropPolicy(ConnectionWriter::DROP_OLDEST)
+		#endif // ASEBA_SWITCH_WRITER_THREADS
 	{
 		ostringstream oss;
 		oss << "tcpin:port=" << port;
 		connect(oss.str());
 	}
 	
+	Switch::~Switch()
+	{
+		#ifdef ASEBA_SWITCH_WRITER_THREADS
+		for (WritersMap::iterator it = writers.begin(); it != writers.end(); ++it)
+			delete it->second;
+		#endif // ASEBA_SWITCH_WRITER_THREADS
+	}
+	
+	void Switch::run()
+	{
+		#ifdef ASEBA_SWITCH_WRITER_THREADS
+		if (statsInterval)
+		{
+			UnifiedTime lastStatsTime;
+			while (step(statsInterval * 1000))
+			{
+				flushStreams();
+				if ((UnifiedTime() - lastStatsTime).value >= statsInterval * 1000)
+				{
+					dumpStats(cout);
+					lastStatsTime = UnifiedTime();
+				}
+			}
+			flushStreams();
+			return;
+		}
+		#endif // ASEBA_SWITCH_WRITER_THREADS
+		
+		while (step(-1))
+			flushStreams();
+		flushStreams();
+	}
+	
+	#ifdef ASEBA_SWITCH_WRITER_THREADS
+	
+	void Switch::enableWriterThreads(size_t capacity, ConnectionWriter::DropPolicy dropPolicy)
+	{
+		writerQueueCapacity = capacity;
+		writerDropPolicy = dropPolicy;
+	}
+	
+	void Switch::setStatsInterval(unsigned interval)
+	{
+		statsInterval = interval;
+	}
+	
+	void Switch::dumpStats(std::ostream &stream) const
+	{
+		dumpTime(stream, rawTime);
+		stream << "Queues of " << writers.size() << " connections" << endl;
+		for (WritersMap::const_iterator it = writers.begin(); it != writers.end(); ++it)
+		{
+			const ConnectionWriter::Stats stats(it->second->getStats());
+			stream << "  " << it->first->getTargetName() << " : depth " << stats.depth << ", max depth " << stats.maxDepth << ", dropped " << stats.droppedCount;
+			if (stats.failed)
+				stream << ", failed";
+			stream << endl;
+		}
+	}
+	
+	#endif // ASEBA_SWITCH_WRITER_THREADS
+	
+	//! Write message to destStream, directly or through its writer if writer threads are enabled
+	void Switch::sendMessage(Stream* destStream, const RawMessage& message)
+	{
+		#ifdef ASEBA_SWITCH_WRITER_THREADS
+		if (writerQueueCapacity)
+		{
+			WritersMap::iterator writerIt(writers.find(destStream));
+			if (writerIt == writers.end())
+				writerIt = writers.insert(WritersMap::value_type(destStream, new ConnectionWriter(destStream, writerQueueCapacity, writerDropPolicy))).first;
+			writerIt->second->push(message);
+			return;
+		}
+		#endif // ASEBA_SWITCH_WRITER_THREADS
+		
+		message.serialize(destStream);
+		streamsToFlush.insert(destStream);
+	}
+	
+	void Switch::flushStreams()
+	{
+		for (StreamsSet::iterator it = streamsToFlush.begin(); it != streamsToFlush.end(); ++it)
+		{
+			try
+			{
+				(*it)->flush();
+			}
+			catch (DashelException e)
+			{
+				// if this stream has a problem, ignore it for now, and let Hub call connectionClosed later.
+				std::cerr << "error while writing" << std::endl;
+			}
+		}
+		streamsToFlush.clear();
+	}
+	
 	void Switch::connectionCreated(Stream *stream)
 	{
 		if (verbose)
@@ -67,26 +301,28 @@ namespace Aseba
 	
 	void Switch::incomingData(Stream *stream)
 	{
-		Message* message(Message::receive(stream));
+		// the message is kept in its network format, so that forwarding it neither allocates nor copies
+		RawMessage& message(receivedMessage);
+		message.receive(stream);
 		
 		// remap source
 		{
 			const IdRemapTable::const_iterator remapIt(idRemapTable.find(stream));
 			if (remapIt != idRemapTable.end() &&
-				(message->source == remapIt->second.second)
+				(message.getSource() == remapIt->second.second)
 			)
-				message->source = remapIt->second.first;
+				message.setSource(remapIt->second.first);
 		}
 		
 		// if requested, dump
 		if (dump)
 		{
-			message->dump(std::wcout);
+			const auto_ptr<Message> decodedMessage(message.decode());
+			decodedMessage->dump(std::wcout);
 			std::wcout << std::endl;
 		}
 		
-		// write on all connected streams
-		CmdMessage* cmdMessage(dynamic_cast<CmdMessage*>(message));
+		// write on all connected streams, they will be flushed at the end of the hub step
 		for (StreamsSet::iterator it = dataStreams.begin(); it != dataStreams.end();++it)
 		{
 			Stream* destStream = *it;
@@ -96,23 +332,23 @@ namespace Aseba
 			
 			try
 			{
+				// the destination is only parsed if the id of this stream is remapped
 				const IdRemapTable::const_iterator remapIt(idRemapTable.find(destStream));
-				if (cmdMessage && 
-					remapIt != idRemapTable.end())
+				if (remapIt != idRemapTable.end() &&
+					message.isCommand())
 				{
-					if (cmdMessage->dest == remapIt->second.first)
+					if (message.getDest() == remapIt->second.first)
 					{
-						const uint16 oldDest(cmdMessage->dest);
-						cmdMessage->dest = remapIt->second.second;
-						message->serialize(destStream);
-						cmdMessage->dest = oldDest;
+						const uint16 oldDest(message.getDest());
+						message.setDest(remapIt->second.second);
+						sendMessage(destStream, message);
+						message.setDest(oldDest);
 					}
 				}
 				else
 				{
-					message->serialize(destStream);
+					sendMessage(destStream, message);
 				}
-				destStream->flush();
 			}
 			catch (DashelException e)
 			{
@@ -120,12 +356,20 @@ namespace Aseba
 				std::cerr << "error while writing" << std::endl;
 			}
 		}
-		
-		delete message;
 	}
 	
 	void Switch::connectionClosed(Stream *stream, bool abnormal)
 	{
+		streamsToFlush.erase(stream);
+		#ifdef ASEBA_SWITCH_WRITER_THREADS
+		const WritersMap::iterator writerIt(writers.find(stream));
+		if (writerIt != writers.end())
+		{
+			delete writerIt->second;
+			writers.erase(writerIt);
+		}
+		#endif // ASEBA_SWITCH_WRITER_THREADS
+		
 		if (verbose)
 		{
 			dumpTime(cout);
@@ -155,127 +399,3 @@ namespace Aseba
 	
 	/*@}*/
 };
-
-//! Show usage
-void dumpHelp(std::ostream &stream, const char *programName)
-{
-	stream << "Aseba switch, connects aseba components together, usage:\n";
-	stream << programName << " [options] [additional targets]*\n";
-	stream << "Options:\n";
-	stream << "-v, --verbose   : makes the switch verbose\n";
-	stream << "-d, --dump      : makes the switch dump all data\n";
-	stream << "-l, --loop      : makes the switch transmit messages back to the send, not only forward them.\n";
-	stream << "-p port         : listens to incoming connection on this port\n";
-	stream << "--rawtime       : shows time in the form of sec:usec since 1970\n";
-	stream << "-h, --help      : shows this help\n";
-	stream << "-V, --version   : shows the version number\n";
-	stream << "Additional targets are any valid Dashel targets." << std::endl;
-	stream << "Report bugs to: aseba-dev@gna.org" << std::endl;
-}
-
-//! Show version
-void dumpVersion(std::ostream &stream)
-{
-	stream << "Aseba switch " << ASEBA_VERSION << std::endl;
-	stream << "Aseba protocol " << ASEBA_PROTOCOL_VERSION << std::endl;
-	stream << "Licence LGPLv3: GNU LGPL version 3 <http://www.gnu.org/licenses/lgpl.html>\n";
-}
- 
-int main(int argc, char *argv[])
-{
-	Dashel::initPlugins();
-	unsigned port = ASEBA_DEFAULT_PORT;
-	bool verbose = false;
-	bool dump = false;
-	bool forward = true;
-	bool rawTime = false;
-	std::vector<std::string> additionalTargets;
-	
-	int argCounter = 1;
-	
-	while (argCounter < argc)
-	{
-		const char *arg = argv[argCounter];
-		
-		if ((strcmp(arg, "-v") == 0) || (strcmp(arg, "--verbose") == 0))
-		{
-			verbose = true;
-		}
-		else if ((strcmp(arg, "-d") == 0) || (strcmp(arg, "--dump") == 0))
-		{
-			dump = true;
-		}
-		else if ((strcmp(arg, "-l") == 0) || (strcmp(arg, "--loop") == 0))
-		{
-			forward = false;
-		}
-		else if (strcmp(arg, "-p") == 0)
-		{
-			if (argCounter + 1 >= argc)
-			{
-				std::cerr << "port value needed" << std::endl;
-				return 1;
-			}
-			arg = argv[++argCounter];
-			port = atoi(arg);
-		}
-		else if (strcmp(arg, "--rawtime") == 0)
-		{
-			rawTime = true;
-		}
-		else if ((strcmp(arg, "-h") == 0) || (strcmp(arg, "--help") == 0))
-		{
-			dumpHelp(std::cout, argv[0]);
-			return 0;
-		}
-		else if ((strcmp(arg, "-V") == 0) || (strcmp(arg, "--version") == 0))
-		{
-			dumpVersion(std::cout);
-			return 0;
-		}
-		else
-		{
-			additionalTargets.push_back(argv[argCounter]);
-		}
-		argCounter++;
-	}
-	
-	try
-	{
-		Aseba::Switch aswitch(port, verbose, dump, forward, rawTime);
-		for (size_t i = 0; i < additionalTargets.size(); i++)
-		{
-			const std::string& target(additionalTargets[i]);
-			Dashel::Stream* stream = aswitch.connect(target);
-			
-			// see whether we have to remap the id of this stream
-			Dashel::ParameterSet remapIdDecoder;
-			remapIdDecoder.add("dummy:remapLocal=-1;remapTarget=1");
-			remapIdDecoder.add(target.c_str());
-			const int remappedLocalId(remapIdDecoder.get<int>("remapLocal"));
-			const int remappedTargetId(remapIdDecoder.get<int>("remapTarget"));
-			if (target.find("remapLocal=") != std::string::npos)
-			{
-				aswitch.remapId(stream, uint16(remappedLocalId), uint16(remappedTargetId));
-				if (verbose)
-					std::cout << "Remapping local " << remappedLocalId << " with remote " << remappedTargetId << std::endl;
-			}
-		}
-		/*
-		Uncomment this and comment aswitch.run() to flood all pears with dummy user messages
-		while (1)
-		{
-			aswitch.step(10);
-			aswitch.broadcastDummyUserMessage();
-		}*/
-		aswitch.run();
-	}
-	catch(Dashel::DashelException e)
-	{
-		std::cerr << e.what() << std::endl;
-	}
-	
-	return 0;
-}
-
-
@@ -23,7 +23,12 @@
 
 #include <dashel/dashel.h>
 #include <map>
+#include <deque>
+#ifdef ASEBA_SWITCH_WRITER_THREADS
+#include <pthread.h>
+#endif // ASEBA_SWITCH_WRITER_THREADS
 #include "../../common/types.h"
+#include "../../common/msg/msg.h"
 
 namespace Aseba
 {
@@ -31,6 +36,63 @@ namespace Aseba
 	\defgroup switch Software router of messages.
 	*/
 	/*@{*/
+	
+	#ifdef ASEBA_SWITCH_WRITER_THREADS
+	
+	/*!
+		Queue of messages to write to a connection, drained by its own thread,
+		so that a slow or stalled peer does not delay delivery to the others.
+		The queue holds at most capacity user messages; when it is full, either
+		the oldest queued one or the new one is dropped. Bootloader and debug
+		messages are never dropped.
+	*/
+	class ConnectionWriter
+	{
+		public:
+			//! What to do with user messages when the queue is full
+			enum DropPolicy
+			{
+				DROP_OLDEST, //!< drop the oldest queued user message
+				DROP_NEWEST //!< drop the user message being queued
+			};
+			
+			//! Statistics about the queue
+			struct Stats
+			{
+				size_t depth; //!< number of messages currently queued
+				size_t maxDepth; //!< maximum number of messages ever queued
+				unsigned droppedCount; //!< number of user messages dropped
+				bool failed; //!< whether writing to the stream failed
+			};
+			
+		public:
+			ConnectionWriter(Dashel::Stream* stream, size_t capacity, DropPolicy dropPolicy);
+			~ConnectionWriter();
+			
+			void push(const RawMessage& message);
+			Stats getStats() const;
+			
+		protected:
+			static void* threadMain(void* writer);
+			void writeLoop();
+			
+		protected:
+			Dashel::Stream* const stream; //!< stream to write to
+			const size_t capacity; //!< maximum number of queued user messages
+			const DropPolicy dropPolicy; //!< what to do when the queue is full
+			
+			typedef std::deque<RawMessage> MessagesQueue;
+			MessagesQueue messages; //!< messages waiting to be written, protected by mutex
+			size_t userMessagesCount; //!< number of user messages in messages
+			Stats stats; //!< statistics, protected by mutex
+			bool stopRequested; //!< whether the thread must stop, protected by mutex
+			
+			mutable pthread_mutex_t mutex; //!< protects the members shared with the thread
+			pthread_cond_t condition; //!< signaled when messages are queued or stop is requested
+			pthread_t thread; //!< thread writing messages to stream
+	};
+	
+	#endif // ASEBA_SWITCH_WRITER_THREADS
 
 	/*!
 		Route Aseba messages on the TCP part of the network.
@@ -44,6 +106,25 @@ namespace Aseba
 				@param forward should we only forward messages instead of transmit them back to the sender
 			*/
 			Switch(unsigned port, bool verbose, bool dump, bool forward, bool rawTime);
+			~Switch();
+			
+			/*! Run the hub, flushing the streams messages were written to once at the end of each step,
+				instead of once per message.
+			*/
+			void run();
+			
+			#ifdef ASEBA_SWITCH_WRITER_THREADS
+			/*! Write to each connection from its own thread, through a queue.
+				@param capacity maximum number of user messages queued per connection
+				@param dropPolicy what to do with user messages when a queue is full
+			*/
+			void enableWriterThreads(size_t capacity, ConnectionWriter::DropPolicy dropPolicy);
+			
+			/*! Print statistics about the queues of writers every interval seconds while running.
+				@param interval period in seconds, 0 to disable
+			*/
+			void setStatsInterval(unsigned interval);
+			#endif // ASEBA_SWITCH_WRITER_THREADS
 			
 			/*! Forwards the data received for a connections to the other ones.
 				If forward is false, transmit it back to the sender too.
@@ -65,6 +146,12 @@ namespace Aseba
 			virtual void connectionCreated(Dashel::Stream *stream);
 			virtual void incomingData(Dashel::Stream *stream);
 			virtual void connectionClosed(Dashel::Stream *stream, bool abnormal);
+			
+			void flushStreams();
+			void sendMessage(Dashel::Stream* destStream, const RawMessage& message);
+			#ifdef ASEBA_SWITCH_WRITER_THREADS
+			void dumpStats(std::ostream &stream) const;
+			#endif // ASEBA_SWITCH_WRITER_THREADS
 
 		private:
 			bool verbose; //!< should we print a notification on each message
@@ -77,6 +164,18 @@ namespace Aseba
 			//! A table allowing to remap the aseba node id of streams
 			typedef std::map<Dashel::Stream*, IdPair> IdRemapTable;
 			IdRemapTable idRemapTable; //!< table for remapping id
+			
+			RawMessage receivedMessage; //!< buffer reused for every received message, as the hub processes them one at a time
+			Dashel::StreamsSet streamsToFlush; //!< streams written to during the current step
+			
+			#ifdef ASEBA_SWITCH_WRITER_THREADS
+			unsigned statsInterval; //!< period in seconds at which to print statistics, 0 if disabled
+			size_t writerQueueCapacity; //!< capacity of the queues of writers, 0 if writer threads are disabled
+			ConnectionWriter::DropPolicy writerDropPolicy; //!< drop policy of the queues of writers
+			//! A table of writers, for the data streams having been written to
+			typedef std::map<Dashel::Stream*, ConnectionWriter*> WritersMap;
+			WritersMap writers; //!< writers of streams
+			#endif // ASEBA_SWITCH_WRITER_THREADS
 	};
 	
 	/*@}*/
@@ -61,15 +61,6 @@ inline Derived polymorphic_downcast(Base base)
 
 // Definition of the aseba glue
 
-namespace Enki
-{
-	class AsebaFeedableEPuck;
-}
-
-// map for aseba glue code
-typedef QMap<AsebaVMState*, Enki::AsebaFeedableEPuck*>  VmEPuckMap;
-static VmEPuckMap asebaEPuckMap;
-
 static AsebaNativeFunctionPointer nativeFunctions[] =
 {
 	ASEBA_NATIVES_STD_FUNCTIONS,
@@ -155,6 +146,9 @@ namespace Enki
 		AsebaVMState vm;
 		std::valarray<unsigned short> bytecode;
 		std::valarray<signed short> stack;
+		std::valarray<AsebaVMPredecodedBytecode> predecoded;
+		std::valarray<unsigned short> eventIndex;
+		std::valarray<signed short> variablesShadow;
 		struct Variables
 		{
 			sint16 productId; // product id
@@ -193,13 +187,17 @@ namespace Enki
 		AsebaFeedableEPuck(int id) :
 			stream(0)
 		{
-			asebaEPuckMap[&vm] = this;
-			
+			vm.userData = this;
 			vm.nodeId = 1;
 			
 			bytecode.resize(512);
 			vm.bytecode = &bytecode[0];
 			vm.bytecodeSize = bytecode.size();
+			predecoded.resize(AsebaVMPredecodedSize(bytecode.size()));
+			vm.predecoded = predecoded.size() ? &predecoded[0] : 0;
+			eventIndex.resize(ASEBA_VM_EVENT_INDEX_SIZE);
+			vm.eventIndex = &eventIndex[0];
+			vm.eventIndexSize = eventIndex.size();
 			
 			stack.resize(64);
 			vm.stack = &stack[0];
@@ -207,6 +205,8 @@ namespace Enki
 			
 			vm.variables = reinterpret_cast<sint16 *>(&variables);
 			vm.variablesSize = sizeof(variables) / sizeof(sint16);
+			variablesShadow.resize(vm.variablesSize);
+			vm.variablesShadow = &variablesShadow[0];
 			
 			port = PORT_BASE+id;
 			try
@@ -225,11 +225,6 @@ namespace Enki
 			variables.colorG = 100;
 		}
 		
-		virtual ~AsebaFeedableEPuck()
-		{
-			asebaEPuckMap.remove(&vm);
-		}
-		
 	public:
 		void connectionCreated(Dashel::Stream *stream)
 		{
@@ -269,8 +264,9 @@ namespace Enki
 			if (stream == this->stream)
 			{
 				this->stream = 0;
-				// clear breakpoints
+				// clear breakpoints and subscriptions
 				vm.breakpointsCount = 0;
+				vm.subscriptionsCount = 0;
 			}
 			if (abnormal)
 				qDebug() << this << " : Client has disconnected unexpectedly.";
@@ -350,6 +346,9 @@ namespace Enki
 			// reschedule a periodic event if we are not in step by step
 			if (AsebaMaskIsClear(vm.flags, ASEBA_VM_STEP_BY_STEP_MASK) || AsebaMaskIsClear(vm.flags, ASEBA_VM_EVENT_ACTIVE_MASK))
 				AsebaVMSetupEvent(&vm, ASEBA_EVENT_LOCAL_EVENTS_START);
+			
+			// send the variables clients subscribed to
+			AsebaVMSendSubscribedVariables(&vm, uint16(dt * 1000));
 		
 			// set physical variables
 			leftSpeed = toDoubleClamp(variables.speedL, 1, -13, 13);
@@ -963,13 +962,19 @@ namespace Enki
 
 // Implementation of aseba glue code
 
+//! Return the e-puck running vm
+static Enki::AsebaFeedableEPuck* ePuckFromVM(AsebaVMState *vm)
+{
+	return static_cast<Enki::AsebaFeedableEPuck*>(vm->userData);
+}
+
 extern "C" void AsebaPutVmToSleep(AsebaVMState *vm) 
 {
 }
 
 extern "C" void AsebaSendBuffer(AsebaVMState *vm, const uint8* data, uint16 length)
 {
-	Dashel::Stream* stream = asebaEPuckMap[vm]->stream;
+	Dashel::Stream* stream = ePuckFromVM(vm)->stream;
 	assert(stream);
 
 	try
@@ -990,12 +995,13 @@ extern "C" void AsebaSendBuffer(AsebaVMState *vm, const uint8* data, uint16 leng
 
 extern "C" uint16 AsebaGetBuffer(AsebaVMState *vm, uint8* data, uint16 maxLength, uint16* source)
 {
-	if (asebaEPuckMap[vm]->lastMessageData.size())
+	const Enki::AsebaFeedableEPuck* epuck(ePuckFromVM(vm));
+	if (epuck->lastMessageData.size())
 	{
-		*source = asebaEPuckMap[vm]->lastMessageSource;
-		memcpy(data, &asebaEPuckMap[vm]->lastMessageData[0], asebaEPuckMap[vm]->lastMessageData.size());
+		*source = epuck->lastMessageSource;
+		memcpy(data, &epuck->lastMessageData[0], epuck->lastMessageData.size());
 	}
-	return asebaEPuckMap[vm]->lastMessageData.size();
+	return epuck->lastMessageData.size();
 }
 
 extern "C" const AsebaVMDescription* AsebaGetVMDescription(AsebaVMState *vm)
@@ -26,11 +26,13 @@
 #include "../../vm/natives.h"
 #include "../../common/productids.h"
 #include "../../common/consts.h"
+#include "../../common/utils/utils.h"
 #include "../../transport/buffer/vm-buffer.h"
 #include <dashel/dashel.h>
 #include <iostream>
 #include <sstream>
 #include <valarray>
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
@@ -42,6 +44,9 @@ private:
 	AsebaVMState vm;
 	std::valarray<unsigned short> bytecode;
 	std::valarray<signed short> stack;
+	std::valarray<AsebaVMPredecodedBytecode> predecoded;
+	std::valarray<unsigned short> eventIndex;
+	std::valarray<signed short> variablesShadow;
 	struct Variables
 	{
 		sint16 id;
@@ -51,6 +56,7 @@ private:
 		sint16 user[1024];
 	} variables;
 	char mutableName[12];
+	Aseba::UnifiedTime lastStepTime;
 	
 public:
 	// public because accessed from a glue function
@@ -69,6 +75,11 @@ public:
 		bytecode.resize(512);
 		vm.bytecode = &bytecode[0];
 		vm.bytecodeSize = bytecode.size();
+		predecoded.resize(AsebaVMPredecodedSize(bytecode.size()));
+		vm.predecoded = predecoded.size() ? &predecoded[0] : 0;
+		eventIndex.resize(ASEBA_VM_EVENT_INDEX_SIZE);
+		vm.eventIndex = &eventIndex[0];
+		vm.eventIndexSize = eventIndex.size();
 		
 		stack.resize(64);
 		vm.stack = &stack[0];
@@ -76,6 +87,8 @@ public:
 		
 		vm.variables = reinterpret_cast<sint16 *>(&variables);
 		vm.variablesSize = sizeof(variables) / sizeof(sint16);
+		variablesShadow.resize(vm.variablesSize);
+		vm.variablesShadow = &variablesShadow[0];
 	}
 	
 	void listen(int basePort, int deltaPort)
@@ -121,8 +134,9 @@ public:
 	virtual void connectionClosed(Dashel::Stream *stream, bool abnormal)
 	{
 		this->stream = 0;
-		// clear breakpoints
+		// clear breakpoints and subscriptions
 		vm.breakpointsCount = 0;
+		vm.subscriptionsCount = 0;
 		
 		if (abnormal)
 			std::cerr << this << " : Client has disconnected unexpectedly." << std::endl;
@@ -153,6 +167,11 @@ public:
 		// reschedule a periodic event if we are not in step by step
 		if (AsebaMaskIsClear(vm.flags, ASEBA_VM_STEP_BY_STEP_MASK) || AsebaMaskIsClear(vm.flags, ASEBA_VM_EVENT_ACTIVE_MASK))
 			AsebaVMSetupEvent(&vm, ASEBA_EVENT_LOCAL_EVENTS_START-0);
+		
+		// send the variables clients subscribed to
+		const Aseba::UnifiedTime now;
+		AsebaVMSendSubscribedVariables(&vm, uint16(std::min<Aseba::UnifiedTime::Value>((now - lastStepTime).value, 65535)));
+		lastStepTime = now;
 	}
 } node;
 
@@ -23,7 +23,6 @@
 #include "../../vm/natives.h"
 #include "../../transport/buffer/vm-buffer.h"
 #include <set>
-#include <map>
 #include <cassert>
 #include <cstring>
 #include <algorithm>
@@ -39,9 +38,11 @@
 
 // Implementation of aseba glue code
 
-// map for aseba glue code
-typedef std::map<AsebaVMState*, Enki::AsebaMarxbot*>  VmSocketMap;
-static VmSocketMap asebaSocketMaps;
+//! Return the marXbot one of whose modules runs vm
+static Enki::AsebaMarxbot& marxbotFromVM(AsebaVMState *vm)
+{
+	return *static_cast<Enki::AsebaMarxbot*>(vm->userData);
+}
 
 static AsebaNativeFunctionPointer nativeFunctions[] =
 {
@@ -60,7 +61,7 @@ extern "C" void AsebaPutVmToSleep(AsebaVMState *vm)
 
 extern "C" void AsebaSendBuffer(AsebaVMState *vm, const uint8* data, uint16 length)
 {
-	Enki::AsebaMarxbot& marxBot = *asebaSocketMaps[vm];
+	Enki::AsebaMarxbot& marxBot = marxbotFromVM(vm);
 	Dashel::Stream* stream = marxBot.stream;
 	if (!stream)
 		return;
@@ -96,7 +97,7 @@ extern "C" void AsebaSendBuffer(AsebaVMState *vm, const uint8* data, uint16 leng
 extern "C" uint16 AsebaGetBuffer(AsebaVMState *vm, uint8* data, uint16 maxLength, uint16* source)
 {
 	// TODO: improve this, it is rather ugly
-	Enki::AsebaMarxbot& marxBot = *asebaSocketMaps[vm];
+	Enki::AsebaMarxbot& marxBot = marxbotFromVM(vm);
 	for (size_t i = 0; i < marxBot.modules.size(); ++i)
 	{
 		Enki::AsebaMarxbot::Module& module = *(marxBot.modules[i]);
@@ -206,6 +207,11 @@ namespace Enki
 		bytecode.resize(512);
 		vm.bytecode = &bytecode[0];
 		vm.bytecodeSize = bytecode.size();
+		predecoded.resize(AsebaVMPredecodedSize(bytecode.size()));
+		vm.predecoded = predecoded.size() ? &predecoded[0] : 0;
+		eventIndex.resize(ASEBA_VM_EVENT_INDEX_SIZE);
+		vm.eventIndex = &eventIndex[0];
+		vm.eventIndexSize = eventIndex.size();
 		
 		stack.resize(64);
 		vm.stack = &stack[0];
@@ -240,11 +246,13 @@ namespace Enki
 		distanceSensors.vm.variablesSize = sizeof(distanceSensorVariables) / sizeof(sint16);
 		modules.push_back(&distanceSensors);
 		
-		// fill map
-		asebaSocketMaps[&leftMotor.vm] = this;
-		asebaSocketMaps[&rightMotor.vm] = this;
-		asebaSocketMaps[&proximitySensors.vm] = this;
-		asebaSocketMaps[&distanceSensors.vm] = this;
+		// let the glue code find us from the VMs, and only send changed variables
+		for (size_t i = 0; i < modules.size(); ++i)
+		{
+			modules[i]->vm.userData = this;
+			modules[i]->variablesShadow.resize(modules[i]->vm.variablesSize);
+			modules[i]->vm.variablesShadow = &modules[i]->variablesShadow[0];
+		}
 		
 		// connect to target
 		int port = ASEBA_DEFAULT_PORT + marxbotNumber;
@@ -268,11 +276,6 @@ namespace Enki
 	
 	AsebaMarxbot::~AsebaMarxbot()
 	{
-		// clean map
-		asebaSocketMaps.erase(&leftMotor.vm);
-		asebaSocketMaps.erase(&rightMotor.vm);
-		asebaSocketMaps.erase(&proximitySensors.vm);
-		asebaSocketMaps.erase(&distanceSensors.vm);
 	}
 	
 	void AsebaMarxbot::controlStep(double dt)
@@ -338,6 +341,9 @@ namespace Enki
 			// reschedule a periodic event if we are not in step by step
 			if (AsebaMaskIsClear(vm->flags, ASEBA_VM_STEP_BY_STEP_MASK) || AsebaMaskIsClear(vm->flags, ASEBA_VM_EVENT_ACTIVE_MASK))
 				AsebaVMSetupEvent(vm, ASEBA_EVENT_LOCAL_EVENTS_START);
+			
+			// send the variables clients subscribed to
+			AsebaVMSendSubscribedVariables(vm, uint16(dt * 1000));
 		}
 	}
 	
@@ -374,9 +380,12 @@ namespace Enki
 		if (stream == this->stream)
 		{
 			this->stream = 0;
-			// clear breakpoints
+			// clear breakpoints and subscriptions
 			for (size_t i = 0; i < modules.size(); i++)
+			{
 				(modules[i]->vm).breakpointsCount = 0;
+				(modules[i]->vm).subscriptionsCount = 0;
+			}
 		}
 		if (abnormal)
 			qDebug() << this << " : Client has disconnected unexpectedly.";
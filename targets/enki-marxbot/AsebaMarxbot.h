@@ -82,6 +82,9 @@ namespace Enki
 			AsebaVMState vm;
 			std::valarray<unsigned short> bytecode;
 			std::valarray<signed short> stack;
+			std::valarray<AsebaVMPredecodedBytecode> predecoded;
+			std::valarray<unsigned short> eventIndex;
+			std::valarray<signed short> variablesShadow;
 			//std::deque<Event> events;
 			
 			std::deque<Event> events;
@@ -26,6 +26,7 @@
 #include <QMessageBox>
 #include <QApplication>
 #include <string>
+#include <iostream>
 #include <typeinfo>
 #include <algorithm>
 #include <cassert>
@@ -38,13 +39,42 @@
 
 namespace Aseba
 {
-	// Mapping so that Aseba C callbacks can dispatch to the right objects
-	VMStateToEnvironment vmStateToEnvironment;
-
-	// SimpleDashelConnection
+	// SchedulableNode
+	
+	SchedulableNode::SchedulableNode():
+		externallyScheduled(false),
+		randomState(0)
+	{
+	}
+	
+	//! Same as AsebaNative_rand, but using the random state of this node
+	void SchedulableNode::nativeRand(AsebaVMState *vm)
+	{
+		uint16 destIndex = AsebaNativePopArg(vm);
+		uint16 length = AsebaNativePopArg(vm);
+		
+		for (uint16 i = 0; i < length; i++)
+		{
+			randomState = 25173 * randomState + 13849;
+			vm->variables[destIndex++] = (sint16)randomState;
+		}
+	}
 
-	SimpleDashelConnection::SimpleDashelConnection(unsigned port):
-		stream(0)
+	// DashelNodeConnection
+	
+	uint16 DashelNodeConnection::getBuffer(uint8* data, uint16 maxLength, uint16* source)
+	{
+		if (lastMessageData.size())
+		{
+			*source = lastMessageSource;
+			size_t len(std::min<size_t>(maxLength, lastMessageData.size()));
+			memcpy(data, &lastMessageData[0], len);
+			return len;
+		}
+		return 0;
+	}
+	
+	void DashelNodeConnection::listen(unsigned port)
 	{
 		try
 		{
@@ -52,44 +82,80 @@ namespace Aseba
 		}
 		catch (Dashel::DashelException e)
 		{
-			QMessageBox::critical(0, QApplication::tr("Aseba Playground"), QApplication::tr("Cannot create listening port %0: %1").arg(port).arg(e.what()));
+			const QString message(QApplication::tr("Cannot create listening port %0: %1").arg(port).arg(e.what()));
+			// when running headless, there is no QApplication to show a message box
+			if (qobject_cast<QApplication*>(QCoreApplication::instance()))
+				QMessageBox::critical(0, QApplication::tr("Aseba Playground"), message);
+			else
+				std::cerr << message.toStdString() << std::endl;
 			abort();
 		}
 	}
-
-	void SimpleDashelConnection::sendBuffer(uint16 nodeId, const uint8* data, uint16 length)
+	
+	void DashelNodeConnection::writeMessage(Dashel::Stream* stream, uint16 source, const uint8* data, uint16 length)
 	{
-		if (stream)
+		try
 		{
-			try
-			{
-				uint16 temp;
-				
-				// this may happen if target has disconnected
-				temp = bswap16(length - 2);
-				stream->write(&temp, 2);
-				temp = bswap16(nodeId);
-				stream->write(&temp, 2);
-				stream->write(data, length);
-				stream->flush();
-			}
-			catch (Dashel::DashelException e)
-			{
-				LOG_ERR(QString("Target %0, cannot read from socket: %1").arg(stream->getTargetName().c_str()).arg(e.what()));
-			}
+			uint16 temp;
+			
+			// this may happen if target has disconnected
+			temp = bswap16(length - 2);
+			stream->write(&temp, 2);
+			temp = bswap16(source);
+			stream->write(&temp, 2);
+			stream->write(data, length);
+			stream->flush();
+		}
+		catch (Dashel::DashelException e)
+		{
+			LOG_ERR(QString("Target %0, cannot write to socket: %1").arg(stream->getTargetName().c_str()).arg(e.what()));
 		}
 	}
-
-	uint16 SimpleDashelConnection::getBuffer(uint8* data, uint16 maxLength, uint16* source)
+	
+	bool DashelNodeConnection::readMessage(Dashel::Stream* stream)
 	{
-		if (lastMessageData.size())
+		try
 		{
-			*source = lastMessageSource;
-			size_t len(std::min<size_t>(maxLength, lastMessageData.size()));
-			memcpy(data, &lastMessageData[0], len);
-			return len;
+			uint16 temp;
+			uint16 len;
+			
+			stream->read(&temp, 2);
+			len = bswap16(temp);
+			stream->read(&temp, 2);
+			lastMessageSource = bswap16(temp);
+			lastMessageData.resize(len+2);
+			stream->read(&lastMessageData[0], lastMessageData.size());
+			return true;
 		}
-		return 0;
+		catch (Dashel::DashelException e)
+		{
+			LOG_ERR(QString("Target %0, cannot read from socket: %1").arg(stream->getTargetName().c_str()).arg(e.what()));
+			return false;
+		}
+	}
+	
+	// SimpleDashelConnection
+
+	SimpleDashelConnection::SimpleDashelConnection(unsigned port):
+		stream(0)
+	{
+		listen(port);
+	}
+
+	void SimpleDashelConnection::addNode(AsebaVMState* vm)
+	{
+		nodes.append(vm);
+	}
+	
+	void SimpleDashelConnection::removeNode(AsebaVMState* vm)
+	{
+		nodes.removeAll(vm);
+	}
+
+	void SimpleDashelConnection::sendBuffer(uint16 nodeId, const uint8* data, uint16 length)
+	{
+		if (stream)
+			writeMessage(stream, nodeId, data, length);
 	}
 
 	void SimpleDashelConnection::connectionCreated(Dashel::Stream *stream)
@@ -110,42 +176,145 @@ namespace Aseba
 	void SimpleDashelConnection::incomingData(Dashel::Stream *stream)
 	{
 		assert(stream == this->stream);
-		try
+		if (!readMessage(stream))
+			return;
+		
+		// execute event on all VM that are linked to this connection
+		for (int i = 0; i < nodes.size(); ++i)
+			AsebaProcessIncomingEvents(nodes[i]);
+	}
+
+	void SimpleDashelConnection::connectionClosed(Dashel::Stream *stream, bool abnormal)
+	{
+		if (stream == this->stream)
 		{
-			// receive data
-			uint16 temp;
-			uint16 len;
-			
-			stream->read(&temp, 2);
-			len = bswap16(temp);
-			stream->read(&temp, 2);
-			lastMessageSource = bswap16(temp);
-			lastMessageData.resize(len+2);
-			stream->read(&lastMessageData[0], lastMessageData.size());
+			this->stream = 0;
+			// clear breakpoints and subscriptions on all VM that are linked to this connection
+			for (int i = 0; i < nodes.size(); ++i)
+			{
+				nodes[i]->breakpointsCount = 0;
+				nodes[i]->subscriptionsCount = 0;
+			}
+		}
+		LOG_INFO(QString("Client disconnected properly from ") + stream->getTargetName().c_str());
+	}
+	
+	// SharedDashelHub
+	
+	SharedDashelHub::SharedDashelHub(unsigned port)
+	{
+		addAliasPort(port);
+	}
+	
+	//! Route the commands for the node identifier of vm to it, vm must be linked to this connection
+	void SharedDashelHub::addNode(AsebaVMState* vm)
+	{
+		if (nodes.contains(vm->nodeId))
+			LOG_WARN(QString("Node identifier %0 is used by several nodes sharing the same hub").arg(vm->nodeId));
+		nodes.insert(vm->nodeId, vm);
+	}
+	
+	void SharedDashelHub::removeNode(AsebaVMState* vm)
+	{
+		nodes.remove(vm->nodeId, vm);
+	}
+	
+	//! Also listen on port, clients connecting to it see all nodes
+	void SharedDashelHub::addAliasPort(unsigned port)
+	{
+		listen(port);
+	}
+	
+	//! Deliver the user messages nodes sent since the last step to the other nodes, then process the network traffic
+	bool SharedDashelHub::step(const int timeout)
+	{
+		MessagesMap messages;
+		{
+			QMutexLocker locker(&sendMutex);
+			messages = pendingUserMessages;
+			pendingUserMessages.clear();
+		}
 		
-			// execute event on all VM that are linked to this connection
-			for (VMStateToEnvironment::iterator it(Aseba::vmStateToEnvironment.begin()); it != vmStateToEnvironment.end(); ++it)
+		// sequentially and by source, so that the result does not depend on the order in which the VMs ran
+		for (MessagesMap::const_iterator it(messages.begin()); it != messages.end(); ++it)
+		{
+			const uint16 source(it.key());
+			for (int i = 0; i < it.value().size(); ++i)
 			{
-				if (it.value().second == this)
-					AsebaProcessIncomingEvents(it.key());
+				lastMessageSource = source;
+				lastMessageData.resize(it.value()[i].size());
+				lastMessageData = it.value()[i];
+				for (NodesMap::iterator nodeIt(nodes.begin()); nodeIt != nodes.end(); ++nodeIt)
+					if (nodeIt.key() != source)
+						AsebaProcessIncomingEvents(nodeIt.value());
 			}
 		}
-		catch (Dashel::DashelException e)
+		
+		return Dashel::Hub::step(timeout);
+	}
+	
+	void SharedDashelHub::sendBuffer(uint16 nodeId, const uint8* data, uint16 length)
+	{
+		QMutexLocker locker(&sendMutex);
+		for (Dashel::StreamsSet::iterator it(clients.begin()); it != clients.end(); ++it)
+			writeMessage(*it, nodeId, data, length);
+		
+		// a switch does not send messages back to where they come from, so other nodes receive user messages from here
+		uint16 type;
+		memcpy(&type, data, 2);
+		if (bswap16(type) < 0x8000)
+			pendingUserMessages[nodeId].push_back(std::valarray<uint8>(data, length));
+	}
+	
+	void SharedDashelHub::connectionCreated(Dashel::Stream *stream)
+	{
+		const std::string& targetName(stream->getTargetName());
+		if (targetName.substr(0, targetName.find_first_of(':')) == "tcp")
 		{
-			LOG_ERR(QString("Target %0, cannot read from socket: %1").arg(stream->getTargetName().c_str()).arg(e.what()));
+			clients.insert(stream);
+			LOG_INFO(QString("New client connected from ") + stream->getTargetName().c_str());
 		}
 	}
-
-	void SimpleDashelConnection::connectionClosed(Dashel::Stream *stream, bool abnormal)
+	
+	void SharedDashelHub::incomingData(Dashel::Stream *stream)
 	{
-		if (stream == this->stream)
+		if (!readMessage(stream))
+			return;
+		
+		// forward to the other clients, as on an Aseba network
+		for (Dashel::StreamsSet::iterator it(clients.begin()); it != clients.end(); ++it)
+			if (*it != stream)
+				writeMessage(*it, lastMessageSource, &lastMessageData[0], lastMessageData.size());
+		
+		// commands are only processed by their destination, other messages by all nodes
+		uint16 temp;
+		memcpy(&temp, &lastMessageData[0], 2);
+		const uint16 type(bswap16(temp));
+		if (type >= ASEBA_MESSAGE_BOOTLOADER_RESET && type != ASEBA_MESSAGE_GET_DESCRIPTION)
 		{
-			this->stream = 0;
-			// clear breakpoints on all VM that are linked to this connection
-			for (VMStateToEnvironment::iterator it(Aseba::vmStateToEnvironment.begin()); it != vmStateToEnvironment.end(); ++it)
+			if (lastMessageData.size() < 4)
+				return;
+			memcpy(&temp, &lastMessageData[2], 2);
+			const QList<AsebaVMState*> destinations(nodes.values(bswap16(temp)));
+			for (int i = 0; i < destinations.size(); ++i)
+				AsebaProcessIncomingEvents(destinations[i]);
+		}
+		else
+		{
+			for (NodesMap::iterator it(nodes.begin()); it != nodes.end(); ++it)
+				AsebaProcessIncomingEvents(it.value());
+		}
+	}
+	
+	void SharedDashelHub::connectionClosed(Dashel::Stream *stream, bool abnormal)
+	{
+		if (clients.erase(stream) && clients.empty())
+		{
+			// clear breakpoints and subscriptions on all nodes once nobody can debug them anymore
+			for (NodesMap::iterator it(nodes.begin()); it != nodes.end(); ++it)
 			{
-				if (it.value().second == this)
-					it.key()->breakpointsCount = 0;
+				it.value()->breakpointsCount = 0;
+				it.value()->subscriptionsCount = 0;
 			}
 		}
 		LOG_INFO(QString("Client disconnected properly from ") + stream->getTargetName().c_str());
@@ -162,7 +331,7 @@ extern "C" void AsebaPutVmToSleep(AsebaVMState *vm)
 
 extern "C" void AsebaSendBuffer(AsebaVMState *vm, const uint8* data, uint16 length)
 {
-	const Aseba::NodeEnvironment& environment(Aseba::vmStateToEnvironment.value(vm));
+	const Aseba::NodeEnvironment& environment(Aseba::environmentOf(vm));
 	Aseba::AbstractNodeConnection* connection(environment.second);
 	assert(connection);
 	connection->sendBuffer(vm->nodeId, data, length);
@@ -170,7 +339,7 @@ extern "C" void AsebaSendBuffer(AsebaVMState *vm, const uint8* data, uint16 leng
 
 extern "C" uint16 AsebaGetBuffer(AsebaVMState *vm, uint8* data, uint16 maxLength, uint16* source)
 {
-	const Aseba::NodeEnvironment& environment(Aseba::vmStateToEnvironment.value(vm));
+	const Aseba::NodeEnvironment& environment(Aseba::environmentOf(vm));
 	Aseba::AbstractNodeConnection* connection(environment.second);
 	assert(connection);
 	return connection->getBuffer(data, maxLength, source);
@@ -178,7 +347,7 @@ extern "C" uint16 AsebaGetBuffer(AsebaVMState *vm, uint8* data, uint16 maxLength
 
 extern "C" const AsebaVMDescription* AsebaGetVMDescription(AsebaVMState *vm)
 {
-	const Aseba::NodeEnvironment& environment(Aseba::vmStateToEnvironment.value(vm));
+	const Aseba::NodeEnvironment& environment(Aseba::environmentOf(vm));
 	const Aseba::AbstractNodeGlue* glue(environment.first);
 	assert(glue);
 	return glue->getDescription();
@@ -186,7 +355,7 @@ extern "C" const AsebaVMDescription* AsebaGetVMDescription(AsebaVMState *vm)
 
 extern "C" const AsebaLocalEventDescription * AsebaGetLocalEventsDescriptions(AsebaVMState *vm)
 {
-	const Aseba::NodeEnvironment& environment(Aseba::vmStateToEnvironment.value(vm));
+	const Aseba::NodeEnvironment& environment(Aseba::environmentOf(vm));
 	const Aseba::AbstractNodeGlue* glue(environment.first);
 	assert(glue);
 	return glue->getLocalEventsDescriptions();
@@ -194,7 +363,7 @@ extern "C" const AsebaLocalEventDescription * AsebaGetLocalEventsDescriptions(As
 
 extern "C" const AsebaNativeFunctionDescription * const * AsebaGetNativeFunctionsDescriptions(AsebaVMState *vm)
 {
-	const Aseba::NodeEnvironment& environment(Aseba::vmStateToEnvironment.value(vm));
+	const Aseba::NodeEnvironment& environment(Aseba::environmentOf(vm));
 	const Aseba::AbstractNodeGlue* glue(environment.first);
 	assert(glue);
 	return glue->getNativeFunctionsDescriptions();
@@ -202,7 +371,7 @@ extern "C" const AsebaNativeFunctionDescription * const * AsebaGetNativeFunction
 
 extern "C" void AsebaNativeFunction(AsebaVMState *vm, uint16 id)
 {
-	const Aseba::NodeEnvironment& environment(Aseba::vmStateToEnvironment.value(vm));
+	const Aseba::NodeEnvironment& environment(Aseba::environmentOf(vm));
 	Aseba::AbstractNodeGlue* glue(environment.first);
 	assert(glue);
 	glue->callNativeFunction(id);
@@ -220,7 +389,7 @@ extern "C" void AsebaResetIntoBootloader(AsebaVMState *vm)
 
 extern "C" void AsebaAssert(AsebaVMState *vm, AsebaAssertReason reason)
 {
-	const Aseba::NodeEnvironment& environment(Aseba::vmStateToEnvironment.value(vm));
+	const Aseba::NodeEnvironment& environment(Aseba::environmentOf(vm));
 	const Aseba::AbstractNodeGlue* glue(environment.first);
 	assert(glue);
 	qDebug() << QString::fromStdString(Aseba::FormatableString("\nFatal error: glue %0 with node id %1 of type %2 at has produced exception: ").arg(glue).arg(vm->nodeId).arg(typeid(glue).name()));
@@ -27,7 +27,9 @@
 #include <dashel/dashel.h>
 #include <valarray>
 #include <QMap>
+#include <QList>
 #include <QPair>
+#include <QMutex>
 
 namespace Aseba
 {
@@ -43,30 +45,112 @@ namespace Aseba
 
 	struct AbstractNodeConnection
 	{
+		//! Process the incoming messages for vm, which must use this connection
+		virtual void addNode(AsebaVMState* vm) = 0;
+		virtual void removeNode(AsebaVMState* vm) = 0;
 		virtual void sendBuffer(uint16 nodeId, const uint8* data, uint16 length) = 0;
 		virtual uint16 getBuffer(uint8* data, uint16 maxLength, uint16* source) = 0;
 	};
 
-	// Mapping so that Aseba C callbacks can dispatch to the right objects
+	/*!
+		A node whose VM phase can be run by a scheduler instead of by the control
+		step of its robot, in parallel with the ones of other nodes. In that case,
+		the control step only applies the variables of the VM to the physics.
+	*/
+	struct SchedulableNode
+	{
+		bool externallyScheduled; //!< whether the VM phase is run by a scheduler
+		uint16 randomState; //!< state of math.rand when externally scheduled, so that it does not depend on the execution order of nodes
+		
+		SchedulableNode();
+		virtual ~SchedulableNode() {}
+		
+		//! Process the network traffic of this node, called sequentially for all nodes
+		virtual void networkStep() = 0;
+		//! Copy the sensors to the VM, then run it and its local events, might be called in parallel for different nodes
+		virtual void vmStep() = 0;
+		//! Apply the effects of vmStep() on objects shared between nodes, called sequentially in the order of nodes
+		virtual void finalizeVmStep() {}
+		
+		void nativeRand(AsebaVMState *vm);
+	};
+
+	// Environment of a VM, pointed to by its userData so that Aseba C callbacks can dispatch to the right objects
 	
 	typedef QPair<AbstractNodeGlue*, AbstractNodeConnection*> NodeEnvironment;
-	typedef QMap<AsebaVMState*, NodeEnvironment> VMStateToEnvironment;
-
-	extern VMStateToEnvironment vmStateToEnvironment;
+	
+	//! Return the environment of vm, whose userData must have been set by its node
+	inline const NodeEnvironment& environmentOf(const AsebaVMState* vm)
+	{
+		return *static_cast<const NodeEnvironment*>(vm->userData);
+	}
 	
 	// Implementation of the connection using Dashel
-
-	class SimpleDashelConnection: public AbstractNodeConnection, public Dashel::Hub
+	
+	//! Framing of messages and error handling common to the Dashel connections
+	class DashelNodeConnection: public AbstractNodeConnection, public Dashel::Hub
 	{
-		Dashel::Stream* stream;
+	protected:
 		uint16 lastMessageSource;
 		std::valarray<uint8> lastMessageData;
+		
+	public:
+		virtual uint16 getBuffer(uint8* data, uint16 maxLength, uint16* source);
+		
+	protected:
+		//! Listen on port, abort with an error message if this is not possible
+		void listen(unsigned port);
+		//! Write a message of length bytes, including its type, from source to stream, logging errors
+		void writeMessage(Dashel::Stream* stream, uint16 source, const uint8* data, uint16 length);
+		//! Read a message from stream into lastMessageSource and lastMessageData, return false and log on error
+		bool readMessage(Dashel::Stream* stream);
+	};
+
+	class SimpleDashelConnection: public DashelNodeConnection
+	{
+		Dashel::Stream* stream;
+		QList<AsebaVMState*> nodes; //!< nodes using this connection
 
 	public:
 		SimpleDashelConnection(unsigned port);
 		
+		virtual void addNode(AsebaVMState* vm);
+		virtual void removeNode(AsebaVMState* vm);
+		virtual void sendBuffer(uint16 nodeId, const uint8* data, uint16 length);
+		
+		virtual void connectionCreated(Dashel::Stream *stream);
+		virtual void incomingData(Dashel::Stream *stream);
+		virtual void connectionClosed(Dashel::Stream *stream, bool abnormal);
+	};
+	
+	/*!
+		Connection of all simulated nodes through a single hub, which has to be stepped once
+		per world step. Clients see all nodes as on an Aseba network: commands are routed to
+		the node of their destination, and user messages are delivered to all nodes. The user
+		messages that nodes send are also delivered to the other nodes, at the next step, by
+		order of source node identifier. The hub can listen on additional ports, which are
+		aliases of its main one.
+	*/
+	class SharedDashelHub: public DashelNodeConnection
+	{
+		typedef QMultiMap<uint16, AsebaVMState*> NodesMap;
+		typedef QMap<uint16, QList<std::valarray<uint8> > > MessagesMap;
+		
+		Dashel::StreamsSet clients;
+		NodesMap nodes; //!< nodes by node identifier
+		MessagesMap pendingUserMessages; //!< user messages sent by nodes since the last step, by source node identifier
+		QMutex sendMutex; //!< serialises sending, as the VMs might be run in parallel
+	
+	public:
+		SharedDashelHub(unsigned port);
+		
+		void addAliasPort(unsigned port);
+		bool step(const int timeout = 0);
+		
+		virtual void addNode(AsebaVMState* vm);
+		virtual void removeNode(AsebaVMState* vm);
+		
 		virtual void sendBuffer(uint16 nodeId, const uint8* data, uint16 length);
-		virtual uint16 getBuffer(uint8* data, uint16 maxLength, uint16* source);
 		
 		virtual void connectionCreated(Dashel::Stream *stream);
 		virtual void incomingData(Dashel::Stream *stream);
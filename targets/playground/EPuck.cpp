@@ -20,7 +20,6 @@
 
 #include "EPuck.h"
 #include "Parameters.h"
-#include "PlaygroundViewer.h"
 #include "../../common/productids.h"
 #include "../../common/utils/utils.h"
 
@@ -30,24 +29,29 @@
 
 using namespace Enki;
 
+//! Return the e-puck running vm, these natives are only available on e-pucks
+static AsebaFeedableEPuck* ePuckFromVM(AsebaVMState *vm)
+{
+	return static_cast<AsebaFeedableEPuck*>(Aseba::environmentOf(vm).first);
+}
+
 extern "C" void PlaygroundEPuckNative_energysend(AsebaVMState *vm)
 {
 	int index = AsebaNativePopArg(vm);
 	
-	// find related VM
-	PlaygroundViewer* playgroundViewer(PlaygroundViewer::getInstance());
-	World* world(playgroundViewer->getWorld());
-	for (World::ObjectsIterator objectIt = world->objects.begin(); objectIt != world->objects.end(); ++objectIt)
+	// find related e-puck
+	AsebaFeedableEPuck *epuck(ePuckFromVM(vm));
+	if (epuck && (epuck->energy > EPUCK_INITIAL_ENERGY))
 	{
-		AsebaFeedableEPuck *epuck = dynamic_cast<AsebaFeedableEPuck*>(*objectIt);
-		if (epuck && (&(epuck->vm) == vm) && (epuck->energy > EPUCK_INITIAL_ENERGY))
-		{
-			uint16 amount = vm->variables[index];
-			
-			unsigned toSend = std::min((unsigned)amount, (unsigned)epuck->energy);
-			playgroundViewer->energyPool += toSend;
-			epuck->energy -= toSend;
-		}
+		uint16 amount = vm->variables[index];
+		
+		unsigned toSend = std::min((unsigned)amount, (unsigned)epuck->energy);
+		// when scheduled, other e-pucks might be running, so the pool is only updated in finalizeVmStep()
+		if (epuck->externallyScheduled)
+			epuck->pendingEnergySent += toSend;
+		else
+			AsebaFeedableEPuck::energyPool += toSend;
+		epuck->energy -= toSend;
 	}
 }
 
@@ -58,20 +62,21 @@ extern "C" void PlaygroundEPuckNative_energyreceive(AsebaVMState *vm)
 {
 	int index = AsebaNativePopArg(vm);
 	
-	// find related VM
-	PlaygroundViewer* playgroundViewer(PlaygroundViewer::getInstance());
-	World* world(playgroundViewer->getWorld());
-	for (World::ObjectsIterator objectIt = world->objects.begin(); objectIt != world->objects.end(); ++objectIt)
+	// find related e-puck
+	AsebaFeedableEPuck *epuck(ePuckFromVM(vm));
+	if (epuck)
 	{
-		AsebaFeedableEPuck *epuck = dynamic_cast<AsebaFeedableEPuck*>(*objectIt);
-		if (epuck && (&(epuck->vm) == vm))
+		uint16 amount = vm->variables[index];
+		
+		if (epuck->externallyScheduled)
 		{
-			uint16 amount = vm->variables[index];
-			
-			unsigned toReceive = std::min((unsigned)amount, (unsigned)playgroundViewer->energyPool);
-			playgroundViewer->energyPool -= toReceive;
-			epuck->energy += toReceive;
+			epuck->pendingEnergyRequested += amount;
+			return;
 		}
+		
+		unsigned toReceive = std::min((unsigned)amount, (unsigned)AsebaFeedableEPuck::energyPool);
+		AsebaFeedableEPuck::energyPool -= toReceive;
+		epuck->energy += toReceive;
 	}
 }
 
@@ -82,8 +87,7 @@ extern "C" void PlaygroundEPuckNative_energyamount(AsebaVMState *vm)
 {
 	int index = AsebaNativePopArg(vm);
 	
-	PlaygroundViewer* playgroundViewer(PlaygroundViewer::getInstance());
-	vm->variables[index] = playgroundViewer->energyPool;
+	vm->variables[index] = AsebaFeedableEPuck::energyPool;
 }
 
 extern "C" AsebaNativeFunctionDescription PlaygroundEPuckNativeDescription_energyamount;
@@ -174,14 +178,26 @@ namespace Enki
 	
 	// AsebaFeedableEPuck
 	
-	AsebaFeedableEPuck::AsebaFeedableEPuck(unsigned port, int id):
-		SimpleDashelConnection(port)
+	unsigned AsebaFeedableEPuck::energyPool = INITIAL_POOL_ENERGY;
+	
+	//! Create an e-puck listening on port, or connected through sharedHub if given
+	AsebaFeedableEPuck::AsebaFeedableEPuck(unsigned port, int id, Aseba::SharedDashelHub* sharedHub):
+		ownConnection(sharedHub ? 0 : new Aseba::SimpleDashelConnection(port)),
+		environment(this, sharedHub ? (Aseba::AbstractNodeConnection *)sharedHub : ownConnection.get()),
+		pendingEnergySent(0),
+		pendingEnergyRequested(0)
 	{
 		vm.nodeId = id;
+		randomState = id;
 		
 		bytecode.resize(1024);
 		vm.bytecode = &bytecode[0];
 		vm.bytecodeSize = bytecode.size();
+		predecoded.resize(AsebaVMPredecodedSize(bytecode.size()));
+		vm.predecoded = predecoded.size() ? &predecoded[0] : 0;
+		eventIndex.resize(ASEBA_VM_EVENT_INDEX_SIZE);
+		vm.eventIndex = &eventIndex[0];
+		vm.eventIndexSize = eventIndex.size();
 		
 		stack.resize(32);
 		vm.stack = &stack[0];
@@ -189,25 +205,57 @@ namespace Enki
 		
 		vm.variables = reinterpret_cast<sint16 *>(&variables);
 		vm.variablesSize = sizeof(variables) / sizeof(sint16);
+		variablesShadow.resize(vm.variablesSize);
+		vm.variablesShadow = &variablesShadow[0];
 		
 		AsebaVMInit(&vm);
 		
 		variables.id = id;
 		variables.productId = ASEBA_PID_PLAYGROUND_EPUCK;
 		
-		vmStateToEnvironment[&vm] = qMakePair((Aseba::AbstractNodeGlue*)this, (Aseba::AbstractNodeConnection *)this);
+		vm.userData = &environment;
+		environment.second->addNode(&vm);
 	}
 	
 	AsebaFeedableEPuck::~AsebaFeedableEPuck()
 	{
-		vmStateToEnvironment.remove(&vm);
+		environment.second->removeNode(&vm);
 	}
 	
 	void AsebaFeedableEPuck::controlStep(double dt)
 	{
-		// do a network step
-		Hub::step();
+		if (!externallyScheduled)
+		{
+			networkStep();
+			vmStep();
+			finalizeVmStep();
+		}
 		
+		// send the variables clients subscribed to
+		AsebaVMSendSubscribedVariables(&vm, uint16(dt * 1000));
+		
+		// set physical variables
+		leftSpeed = (double)(variables.speedL * 12.8) / 1000.;
+		rightSpeed = (double)(variables.speedR * 12.8) / 1000.;
+		setColor(Color(
+			Aseba::clamp<double>(variables.colorR*0.01, 0, 1),
+			Aseba::clamp<double>(variables.colorG*0.01, 0, 1),
+			Aseba::clamp<double>(variables.colorB*0.01, 0, 1)
+		));
+		
+		// set motion
+		FeedableEPuck::controlStep(dt);
+	}
+	
+	//! Process the messages of our own connection, the shared hub is stepped once for all nodes
+	void AsebaFeedableEPuck::networkStep()
+	{
+		if (ownConnection.get())
+			ownConnection->step();
+	}
+	
+	void AsebaFeedableEPuck::vmStep()
+	{
 		// get physical variables
 		variables.prox[0] = static_cast<sint16>(infraredSensor0.getValue());
 		variables.prox[1] = static_cast<sint16>(infraredSensor1.getValue());
@@ -237,18 +285,17 @@ namespace Enki
 			AsebaVMSetupEvent(&vm, ASEBA_EVENT_LOCAL_EVENTS_START-1);
 			AsebaVMRun(&vm, 1000);
 		}
-		
-		// set physical variables
-		leftSpeed = (double)(variables.speedL * 12.8) / 1000.;
-		rightSpeed = (double)(variables.speedR * 12.8) / 1000.;
-		setColor(Color(
-			Aseba::clamp<double>(variables.colorR*0.01, 0, 1),
-			Aseba::clamp<double>(variables.colorG*0.01, 0, 1),
-			Aseba::clamp<double>(variables.colorB*0.01, 0, 1)
-		));
-		
-		// set motion
-		FeedableEPuck::controlStep(dt);
+	}
+	
+	void AsebaFeedableEPuck::finalizeVmStep()
+	{
+		// exchange the energy with the pool that the natives requested while scheduled
+		energyPool += pendingEnergySent;
+		const unsigned toReceive(std::min(pendingEnergyRequested, energyPool));
+		energyPool -= toReceive;
+		energy += toReceive;
+		pendingEnergySent = 0;
+		pendingEnergyRequested = 0;
 	}
 	
 	
@@ -310,7 +357,10 @@ namespace Enki
 	
 	void AsebaFeedableEPuck::callNativeFunction(uint16 id)
 	{
-		nativeFunctions[id](&vm);
+		if (externallyScheduled && nativeFunctions[id] == AsebaNative_rand)
+			nativeRand(&vm);
+		else
+			nativeFunctions[id](&vm);
 	}
 	
 } // Enki
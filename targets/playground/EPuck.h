@@ -22,6 +22,7 @@
 #define __CHALLENGE_EPUCK_H
 
 #include "AsebaGlue.h"
+#include <memory>
 #include <enki/PhysicalEngine.h>
 #include <enki/robots/e-puck/EPuck.h>
 
@@ -71,12 +72,22 @@ namespace Enki
 		virtual void controlStep(double dt);
 	};
 	
-	class AsebaFeedableEPuck : public FeedableEPuck, public Aseba::AbstractNodeGlue, public Aseba::SimpleDashelConnection
+	class AsebaFeedableEPuck : public FeedableEPuck, public Aseba::AbstractNodeGlue, public Aseba::SchedulableNode
 	{
 	public:
+		std::auto_ptr<Aseba::SimpleDashelConnection> ownConnection; //!< connection of this node, if it does not use a shared hub
+		Aseba::NodeEnvironment environment; //!< glue and connection of vm, pointed to by its userData
+		
+		static unsigned energyPool; //!< energy shared by all e-pucks
+		unsigned pendingEnergySent; //!< energy sent to the pool during vmStep(), when externally scheduled
+		unsigned pendingEnergyRequested; //!< energy requested from the pool during vmStep(), when externally scheduled
+		
 		AsebaVMState vm;
 		std::valarray<unsigned short> bytecode;
 		std::valarray<signed short> stack;
+		std::valarray<AsebaVMPredecodedBytecode> predecoded;
+		std::valarray<unsigned short> eventIndex;
+		std::valarray<signed short> variablesShadow;
 		struct Variables
 		{
 			sint16 id;
@@ -97,13 +108,19 @@ namespace Enki
 		} variables;
 		
 	public:
-		AsebaFeedableEPuck(unsigned port, int id);
+		AsebaFeedableEPuck(unsigned port, int id, Aseba::SharedDashelHub* sharedHub = 0);
 		virtual ~AsebaFeedableEPuck();
 		
 		// from FeedableEPuck
 		
 		virtual void controlStep(double dt);
 		
+		// from SchedulableNode
+		
+		virtual void networkStep();
+		virtual void vmStep();
+		virtual void finalizeVmStep();
+		
 		// from AbstractNodeGlue
 		
 		virtual const AsebaVMDescription* getDescription() const;
@@ -0,0 +1,133 @@
+/*
+	Playground - An active arena to learn multi-robots programming
+	Copyright (C) 1999--2013:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+	3D models
+	Copyright (C) 2008:
+		Basilio Noris
+	Aseba - an event-based framework for distributed robot control
+	Copyright (C) 2007--2013:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+		and other contributors, see authors.txt for details
+	
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+	
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "HeadlessRunner.h"
+#include "EPuck.h"
+#include "../../common/utils/utils.h"
+#include <enki/PhysicalEngine.h>
+#include <QThreadPool>
+#include <QtConcurrentMap>
+#include <iostream>
+
+namespace Enki
+{
+	using namespace Aseba;
+	
+	//! Run the VM phase of node, called from the pool of threads
+	static void runVmStep(SchedulableNode*& node)
+	{
+		node->vmStep();
+	}
+	
+	//! Take the network and VM phases of nodes, which must be in world, out of their control steps
+	HeadlessRunner::HeadlessRunner(World* world, const NodesVector& nodes, unsigned threadCount, SharedDashelHub* sharedHub) :
+		world(world),
+		threadCount(threadCount),
+		nodes(nodes),
+		sharedHub(sharedHub),
+		networkDuration(0)
+	{
+		for (size_t i = 0; i < nodes.size(); ++i)
+			nodes[i]->externallyScheduled = true;
+		if (threadCount > 1)
+			QThreadPool::globalInstance()->setMaxThreadCount(threadCount);
+	}
+	
+	HeadlessRunner::~HeadlessRunner()
+	{
+		for (size_t i = 0; i < nodes.size(); ++i)
+			nodes[i]->externallyScheduled = false;
+	}
+	
+	/*! Run the world for stepsCount steps of dt seconds, forever if stepsCount is 0.
+		If rate is not 0, do at most rate steps per second, otherwise run as fast as possible.
+		Print the number of steps per second and the time spent in the network at the end.
+	*/
+	void HeadlessRunner::run(double dt, unsigned stepsCount, double rate)
+	{
+		const UnifiedTime startTime;
+		unsigned step(0);
+		for (; stepsCount == 0 || step < stepsCount; ++step)
+		{
+			this->step(dt);
+			
+			if (rate > 0)
+			{
+				const UnifiedTime stepEndTime(startTime + UnifiedTime(UnifiedTime::Value(((step + 1) * 1000.) / rate)));
+				const UnifiedTime now;
+				if (now < stepEndTime)
+					(stepEndTime - now).sleep();
+			}
+		}
+		
+		const UnifiedTime duration(UnifiedTime() - startTime);
+		std::cout << step << " steps of " << nodes.size() << " nodes on " << threadCount << " threads in " << duration.value << " ms";
+		if (duration.value)
+			std::cout << " (" << (step * 1000.) / duration.value << " steps/s)";
+		std::cout << ", network " << networkDuration.value << " ms";
+		if (step)
+			std::cout << " (" << double(networkDuration.value) / step << " ms/step)";
+		std::cout << std::endl;
+	}
+	
+	void HeadlessRunner::step(double dt)
+	{
+		const UnifiedTime networkStartTime;
+		if (sharedHub)
+			sharedHub->step();
+		for (size_t i = 0; i < nodes.size(); ++i)
+			nodes[i]->networkStep();
+		networkDuration += UnifiedTime() - networkStartTime;
+		
+		if (threadCount > 1)
+			QtConcurrent::blockingMap(nodes, runVmStep);
+		else
+			for (size_t i = 0; i < nodes.size(); ++i)
+				nodes[i]->vmStep();
+		
+		for (size_t i = 0; i < nodes.size(); ++i)
+			nodes[i]->finalizeVmStep();
+		
+		world->step(dt);
+	}
+	
+	//! Print the position of robots and the state of e-pucks, to compare runs
+	void HeadlessRunner::dumpState(std::ostream &stream) const
+	{
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			const Robot* robot(dynamic_cast<const Robot*>(nodes[i]));
+			if (robot)
+				stream << robot->pos.x << " " << robot->pos.y << " " << robot->angle;
+			const AsebaFeedableEPuck* epuck(dynamic_cast<const AsebaFeedableEPuck*>(nodes[i]));
+			if (epuck)
+				stream << " energy " << epuck->energy << " score " << epuck->score;
+			stream << std::endl;
+		}
+		stream << "energy pool " << AsebaFeedableEPuck::energyPool << std::endl;
+	}
+} // Enki
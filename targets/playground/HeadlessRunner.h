@@ -0,0 +1,74 @@
+/*
+	Playground - An active arena to learn multi-robots programming
+	Copyright (C) 1999--2013:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+	3D models
+	Copyright (C) 2008:
+		Basilio Noris
+	Aseba - an event-based framework for distributed robot control
+	Copyright (C) 2007--2013:
+		Stephane Magnenat <stephane at magnenat dot net>
+		(http://stephane.magnenat.net)
+		and other contributors, see authors.txt for details
+	
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+	
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+	
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __PLAYGROUND_HEADLESS_RUNNER_H
+#define __PLAYGROUND_HEADLESS_RUNNER_H
+
+#include "AsebaGlue.h"
+#include "../../common/utils/utils.h"
+#include <vector>
+#include <ostream>
+
+namespace Enki
+{
+	class World;
+	
+	/*!
+		Step a world without viewer, at a fixed rate or as fast as possible.
+		The network and VM phases of the Aseba robots are taken out of their
+		control steps: the network is processed sequentially, through a hub
+		shared by all nodes if given, then the VMs are
+		run in parallel on a pool of threads, and finally the effects on shared
+		objects are applied in the order of robots, so that the results do not
+		depend on the number of threads.
+	*/
+	class HeadlessRunner
+	{
+	public:
+		//! Nodes, in the order in which they were created
+		typedef std::vector<Aseba::SchedulableNode*> NodesVector;
+		
+	public:
+		HeadlessRunner(World* world, const NodesVector& nodes, unsigned threadCount, Aseba::SharedDashelHub* sharedHub = 0);
+		~HeadlessRunner();
+		
+		void run(double dt, unsigned stepsCount, double rate);
+		void dumpState(std::ostream &stream) const;
+		
+	protected:
+		void step(double dt);
+		
+	protected:
+		World* world; //!< world to step
+		unsigned threadCount; //!< number of threads running the VMs
+		NodesVector nodes; //!< nodes of the world, in a fixed order
+		Aseba::SharedDashelHub* sharedHub; //!< hub shared by the nodes, if any, stepped once per step
+		Aseba::UnifiedTime networkDuration; //!< time spent processing the network
+	};
+} // Enki
+
+#endif // __PLAYGROUND_HEADLESS_RUNNER_H
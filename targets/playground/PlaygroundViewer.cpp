@@ -30,6 +30,7 @@
 #include "Parameters.h"
 #include "EPuck.h"
 #include "../../common/utils/utils.h"
+#include <iostream>
 
 #ifdef Q_OS_WIN32
 	#define Q_PID_PRINT size_t
@@ -43,11 +44,11 @@ namespace Enki
 	
 	static PlaygroundViewer* playgroundViewer = 0;
 
-	PlaygroundViewer::PlaygroundViewer(World* world) : 
+	PlaygroundViewer::PlaygroundViewer(World* world, SharedDashelHub* sharedHub) : 
 		ViewerWidget(world),
 		font("Courier", 10),
 		logPos(0),
-		energyPool(INITIAL_POOL_ENERGY)
+		sharedHub(sharedHub)
 	{
 		//font.setPixelSize(14);
 		if (playgroundViewer)
@@ -78,6 +79,15 @@ namespace Enki
 		logPos = (logPos+1) % LOG_HISTORY_COUNT;
 	}
 	
+	//! Log to the viewer if there is one, otherwise to the standard error, as when running headless
+	void PlaygroundViewer::logToInstance(const QString& entry, const QColor& color)
+	{
+		if (playgroundViewer)
+			playgroundViewer->log(entry, color);
+		else
+			std::cerr << Aseba::UnifiedTime().toHumanReadableStringFromEpoch() << " " << entry.toLocal8Bit().constData() << std::endl;
+	}
+	
 	void PlaygroundViewer::processStarted()
 	{
 		QProcess* process(polymorphic_downcast<QProcess*>(sender()));
@@ -130,6 +140,14 @@ namespace Enki
 		Q_UNUSED(process);
 	}
 	
+	//! Process the messages of the shared hub once before each world step
+	void PlaygroundViewer::timerEvent(QTimerEvent * event)
+	{
+		if (sharedHub)
+			sharedHub->step();
+		ViewerWidget::timerEvent(event);
+	}
+	
 	void PlaygroundViewer::renderObjectsTypesHook()
 	{
 		managedObjectsAliases[&typeid(AsebaFeedableEPuck)] = &typeid(EPuck);
@@ -162,7 +180,7 @@ namespace Enki
 		
 		renderText(16, 22, scoreString, font);
 		
-		renderText(16, 42, QString("E. in pool: %0 - total score: %1").arg(energyPool).arg(totalScore), font);
+		renderText(16, 42, QString("E. in pool: %0 - total score: %1").arg(AsebaFeedableEPuck::energyPool).arg(totalScore), font);
 		
 		// console background
 		glEnable(GL_BLEND);
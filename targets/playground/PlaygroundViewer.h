@@ -32,13 +32,18 @@
 #include <viewer/Viewer.h>
 #include <QProcess>
 
-#define LOG_COLOR(t,c) Enki::PlaygroundViewer::getInstance()->log(t,c)
-#define LOG_INFO(t) Enki::PlaygroundViewer::getInstance()->log(t,Qt::white)
-#define LOG_WARN(t) Enki::PlaygroundViewer::getInstance()->log(t,Qt::yellow)
-#define LOG_ERR(t) Enki::PlaygroundViewer::getInstance()->log(t,Qt::red)
+#define LOG_COLOR(t,c) Enki::PlaygroundViewer::logToInstance(t,c)
+#define LOG_INFO(t) Enki::PlaygroundViewer::logToInstance(t,Qt::white)
+#define LOG_WARN(t) Enki::PlaygroundViewer::logToInstance(t,Qt::yellow)
+#define LOG_ERR(t) Enki::PlaygroundViewer::logToInstance(t,Qt::red)
 
 #define LOG_HISTORY_COUNT 20
 
+namespace Aseba
+{
+	class SharedDashelHub;
+}
+
 namespace Enki
 {
 	class World;
@@ -53,16 +58,17 @@ namespace Enki
 		QColor logColor[LOG_HISTORY_COUNT];
 		Aseba::UnifiedTime logTime[LOG_HISTORY_COUNT];
 		unsigned logPos;
-		unsigned energyPool;
+		Aseba::SharedDashelHub* sharedHub; //!< hub shared by the robots, if any, stepped once per world step
 		
 	public:
-		PlaygroundViewer(World* world);
+		PlaygroundViewer(World* world, Aseba::SharedDashelHub* sharedHub = 0);
 		virtual ~PlaygroundViewer();
 		
 		World* getWorld() const;
 		static PlaygroundViewer* getInstance();
 		
 		void log(const QString& entry, const QColor& color);
+		static void logToInstance(const QString& entry, const QColor& color);
 		
 	public slots:
 		void processStarted();
@@ -71,6 +77,7 @@ namespace Enki
 		void processFinished(int exitCode, QProcess::ExitStatus exitStatus);
 		
 	protected:
+		virtual void timerEvent(QTimerEvent * event);
 		virtual void renderObjectsTypesHook();
 		virtual void sceneCompletedHook();
 	};
@@ -40,14 +40,22 @@ namespace Enki
 	
 	// AsebaThymio2
 	
-	AsebaThymio2::AsebaThymio2(unsigned port):
-		SimpleDashelConnection(port)
+	//! Create a Thymio II listening on port, or connected through sharedHub if given
+	AsebaThymio2::AsebaThymio2(unsigned port, int id, Aseba::SharedDashelHub* sharedHub):
+		ownConnection(sharedHub ? 0 : new Aseba::SimpleDashelConnection(port)),
+		environment(this, sharedHub ? (Aseba::AbstractNodeConnection *)sharedHub : ownConnection.get())
 	{
-		vm.nodeId = 1;
+		vm.nodeId = id;
+		randomState = port;
 		
 		bytecode.resize(766+768);
 		vm.bytecode = &bytecode[0];
 		vm.bytecodeSize = bytecode.size();
+		predecoded.resize(AsebaVMPredecodedSize(bytecode.size()));
+		vm.predecoded = predecoded.size() ? &predecoded[0] : 0;
+		eventIndex.resize(ASEBA_VM_EVENT_INDEX_SIZE);
+		vm.eventIndex = &eventIndex[0];
+		vm.eventIndexSize = eventIndex.size();
 		
 		stack.resize(32);
 		vm.stack = &stack[0];
@@ -55,25 +63,50 @@ namespace Enki
 		
 		vm.variables = reinterpret_cast<sint16 *>(&variables);
 		vm.variablesSize = sizeof(variables) / sizeof(sint16);
+		variablesShadow.resize(vm.variablesSize);
+		vm.variablesShadow = &variablesShadow[0];
 		
 		AsebaVMInit(&vm);
 		
 		variables.id = vm.nodeId;
 		variables.productId = ASEBA_PID_THYMIO2;
 		
-		vmStateToEnvironment[&vm] = qMakePair((Aseba::AbstractNodeGlue*)this, (Aseba::AbstractNodeConnection *)this);
+		vm.userData = &environment;
+		environment.second->addNode(&vm);
 	}
 	
 	AsebaThymio2::~AsebaThymio2()
 	{
-		vmStateToEnvironment.remove(&vm);
+		environment.second->removeNode(&vm);
 	}
 	
 	void AsebaThymio2::controlStep(double dt)
 	{
-		// do a network step
-		Hub::step();
+		if (!externallyScheduled)
+		{
+			networkStep();
+			vmStep();
+		}
+		
+		// send the variables clients subscribed to
+		AsebaVMSendSubscribedVariables(&vm, uint16(dt * 1000));
+		
+		// set physical variables
+		// TODO: implement
 		
+		// set motion
+		Thymio2::controlStep(dt);
+	}
+	
+	//! Process the messages of our own connection, the shared hub is stepped once for all nodes
+	void AsebaThymio2::networkStep()
+	{
+		if (ownConnection.get())
+			ownConnection->step();
+	}
+	
+	void AsebaThymio2::vmStep()
+	{
 		// get physical variables
 		// TODO: implement
 		
@@ -86,12 +119,6 @@ namespace Enki
 		{
 			// TODO: implement events
 		}
-		
-		// set physical variables
-		// TODO: implement
-		
-		// set motion
-		Thymio2::controlStep(dt);
 	}
 	
 	
@@ -142,7 +169,10 @@ namespace Enki
 	
 	void AsebaThymio2::callNativeFunction(uint16 id)
 	{
-		nativeFunctions[id](&vm);
+		if (externallyScheduled && nativeFunctions[id] == AsebaNative_rand)
+			nativeRand(&vm);
+		else
+			nativeFunctions[id](&vm);
 	}
 	
 } // Enki
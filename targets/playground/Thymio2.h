@@ -22,6 +22,7 @@
 #define __CHALLENGE_THYMIO2_H
 
 #include "AsebaGlue.h"
+#include <memory>
 #include <enki/PhysicalEngine.h>
 // TODO: switch to Thymio2 when robot implemented in Enki
 #include <enki/robots/e-puck/EPuck.h>
@@ -32,12 +33,18 @@ namespace Enki
 	// TODO: remove this placeholder once the Thymio2 exists in Enki
 	typedef EPuck Thymio2;
 	
-	class AsebaThymio2 : public Thymio2, public Aseba::AbstractNodeGlue, public Aseba::SimpleDashelConnection
+	class AsebaThymio2 : public Thymio2, public Aseba::AbstractNodeGlue, public Aseba::SchedulableNode
 	{
 	public:
+		std::auto_ptr<Aseba::SimpleDashelConnection> ownConnection; //!< connection of this node, if it does not use a shared hub
+		Aseba::NodeEnvironment environment; //!< glue and connection of vm, pointed to by its userData
+		
 		AsebaVMState vm;
 		std::valarray<unsigned short> bytecode;
 		std::valarray<signed short> stack;
+		std::valarray<AsebaVMPredecodedBytecode> predecoded;
+		std::valarray<unsigned short> eventIndex;
+		std::valarray<signed short> variablesShadow;
 		struct Variables
 		{
 			sint16 id;
@@ -50,13 +57,18 @@ namespace Enki
 		
 		
 	public:
-		AsebaThymio2(unsigned port);
+		AsebaThymio2(unsigned port, int id = 1, Aseba::SharedDashelHub* sharedHub = 0);
 		virtual ~AsebaThymio2();
 		
 		// from THymio2
 		
 		virtual void controlStep(double dt);
 		
+		// from SchedulableNode
+		
+		virtual void networkStep();
+		virtual void vmStep();
+		
 		// from AbstractNodeGlue
 		
 		virtual const AsebaVMDescription* getDescription() const;
@@ -31,81 +31,24 @@
 #include "EPuck.h"
 #include "Thymio2.h"
 #include "PlaygroundViewer.h"
+#include "HeadlessRunner.h"
 #include <QtXml>
 #include <QApplication>
 #include <QFileDialog>
 #include <QMessageBox>
 #include <QProcess>
+#include <QThread>
+#include <iostream>
+#include <memory>
+#include <cstring>
 
-int main(int argc, char *argv[])
+//! Default duration of a step when running headless, in seconds
+#define HEADLESS_DEFAULT_DT 0.03
+
+//! Create the world described in domDocument, without any object
+static Enki::World* createWorld(const QDomDocument& domDocument, QMap<QString, Enki::Color>& colorsMap)
 {
-	QApplication app(argc, argv);
-	
-	/*
-	// Translation support
-	QTranslator qtTranslator;
-	qtTranslator.load("qt_" + QLocale::system().name());
-	app.installTranslator(&qtTranslator);
-	
-	QTranslator translator;
-	translator.load(QString(":/asebachallenge_") + QLocale::system().name());
-	app.installTranslator(&translator);
-	*/
-	
-	// create document
-	QDomDocument domDocument("aseba-playground");
-	
-	// Get cmd line arguments
-	QString fileName;
-	bool ask = true;
-	if (argc > 1)
-	{
-		fileName = argv[1];
-		ask = false;
-	}
-	
-	// Try to load xml config file
-	do
-	{
-		if (ask)
-		{
-			QString lastFileName = QSettings("EPFL-LSRO-Mobots", "Aseba Playground").value("last file").toString();
-			fileName = QFileDialog::getOpenFileName(0, app.tr("Open Scenario"), lastFileName, app.tr("playground scenario (*.playground)"));
-		}
-		ask = true;
-		
-		if (fileName.isEmpty())
-		{
-			std::cerr << "You must specify a valid setup scenario on the command line or choose one in the file dialog\n";
-			exit(1);
-		}
-		
-		QFile file(fileName);
-		if (file.open(QIODevice::ReadOnly))
-		{
-			QString errorStr;
-			int errorLine, errorColumn;
-			if (!domDocument.setContent(&file, false, &errorStr, &errorLine, &errorColumn))
-			{
-				QMessageBox::information(0, "Aseba Playground",
-										app.tr("Parse error at file %1, line %2, column %3:\n%4")
-										.arg(fileName)
-										.arg(errorLine)
-										.arg(errorColumn)
-										.arg(errorStr));
-			}
-			else
-			{
-				QSettings("EPFL-LSRO-Mobots", "Aseba Playground").setValue("last file", fileName);
-				break;
-			}
-		}
-	}
-	while (true);
-	
 	// Scan for colors
-	typedef QMap<QString, Enki::Color> ColorsMap;
-	ColorsMap colorsMap;
 	QDomElement colorE = domDocument.documentElement().firstChildElement("color");
 	while (!colorE.isNull())
 	{
@@ -118,6 +61,28 @@ int main(int argc, char *argv[])
 		colorE = colorE.nextSiblingElement ("color");
 	}
 	
+	// Create the world
+	QDomElement worldE = domDocument.documentElement().firstChildElement("world");
+	Enki::Color worldColor(Enki::Color::gray);
+	if (!colorsMap.contains(worldE.attribute("color")))
+		std::cerr << "Warning, world walls color " << worldE.attribute("color").toStdString() << " undefined\n";
+	else
+		worldColor = colorsMap[worldE.attribute("color")];
+	return new Enki::World(
+		worldE.attribute("w").toDouble(),
+		worldE.attribute("h").toDouble(),
+		worldColor
+	);
+}
+
+/*! Add the objects described in domDocument to world, and return its Aseba nodes, in order.
+	If sharedHub is given, the nodes connect through it, and the ports given explicitly
+	in the scenario are listened to as aliases of the one of the hub.
+*/
+static Enki::HeadlessRunner::NodesVector populateWorld(const QDomDocument& domDocument, const QMap<QString, Enki::Color>& colorsMap, Enki::World& world, Aseba::SharedDashelHub* sharedHub)
+{
+	Enki::HeadlessRunner::NodesVector nodes;
+	
 	// Scan for areas
 	typedef QMap<QString, Enki::Polygone> AreasMap;
 	AreasMap areasMap;
@@ -138,22 +103,6 @@ int main(int argc, char *argv[])
 		areaE = areaE.nextSiblingElement ("area");
 	}
 	
-	// Create the world
-	QDomElement worldE = domDocument.documentElement().firstChildElement("world");
-	Enki::Color worldColor(Enki::Color::gray);
-	if (!colorsMap.contains(worldE.attribute("color")))
-		std::cerr << "Warning, world walls color " << worldE.attribute("color").toStdString() << " undefined\n";
-	else
-		worldColor = colorsMap[worldE.attribute("color")];
-	Enki::World world(
-		worldE.attribute("w").toDouble(),
-		worldE.attribute("h").toDouble(),
-		worldColor
-	);
-	
-	// Create viewer
-	Enki::PlaygroundViewer viewer(&world);
-	
 	// Scan for walls
 	QDomElement wallE = domDocument.documentElement().firstChildElement("wall");
 	while (!wallE.isNull())
@@ -268,13 +217,19 @@ int main(int argc, char *argv[])
 	while (!ePuckE.isNull())
 	{
 		const unsigned port(ePuckE.attribute("port", QString("%0").arg(ASEBA_DEFAULT_PORT+asebaServerCount)).toUInt());	
-		Enki::AsebaFeedableEPuck* epuck(new Enki::AsebaFeedableEPuck(port, asebaServerCount + 1));
+		Enki::AsebaFeedableEPuck* epuck(new Enki::AsebaFeedableEPuck(port, asebaServerCount + 1, sharedHub));
+		if (sharedHub && ePuckE.hasAttribute("port"))
+			sharedHub->addAliasPort(port);
 		asebaServerCount++;
 		epuck->pos.x = ePuckE.attribute("x").toDouble();
 		epuck->pos.y = ePuckE.attribute("y").toDouble();
 		epuck->angle = ePuckE.attribute("angle").toDouble();
 		world.addObject(epuck);
-		viewer.log(QString("New e-puck on port %0").arg(port), Qt::white);
+		nodes.push_back(epuck);
+		if (sharedHub)
+			LOG_INFO(QString("New e-puck with node identifier %0").arg(epuck->vm.nodeId));
+		else
+			LOG_INFO(QString("New e-puck on port %0").arg(port));
 		ePuckE = ePuckE.nextSiblingElement ("e-puck");
 	}
 	
@@ -283,17 +238,29 @@ int main(int argc, char *argv[])
 	while (!thymioE.isNull())
 	{
 		const unsigned port(thymioE.attribute("port", QString("%0").arg(ASEBA_DEFAULT_PORT+asebaServerCount)).toUInt());
-		Enki::AsebaThymio2* thymio(new Enki::AsebaThymio2(port));
+		// on a shared hub, node identifiers must be unique
+		Enki::AsebaThymio2* thymio(new Enki::AsebaThymio2(port, sharedHub ? asebaServerCount + 1 : 1, sharedHub));
+		if (sharedHub && thymioE.hasAttribute("port"))
+			sharedHub->addAliasPort(port);
 		asebaServerCount++;
 		thymio->pos.x = thymioE.attribute("x").toDouble();
 		thymio->pos.y = thymioE.attribute("y").toDouble();
 		thymio->angle = thymioE.attribute("angle").toDouble();
 		world.addObject(thymio);
-		viewer.log(QString("New Thymio II on port %0").arg(port), Qt::white);
+		nodes.push_back(thymio);
+		if (sharedHub)
+			LOG_INFO(QString("New Thymio II with node identifier %0").arg(thymio->vm.nodeId));
+		else
+			LOG_INFO(QString("New Thymio II on port %0").arg(port));
 		thymioE = thymioE.nextSiblingElement ("thymio2");
 	}
 	
-	// Scan for external processes
+	return nodes;
+}
+
+//! Start the external processes described in domDocument, logging their output to viewer if any
+static QList<QProcess*> startProcesses(const QDomDocument& domDocument, Enki::PlaygroundViewer* viewer)
+{
 	QList<QProcess*> processes;
 	QDomElement procssE(domDocument.documentElement().firstChildElement("process"));
 	while (!procssE.isNull())
@@ -303,10 +270,13 @@ int main(int argc, char *argv[])
 		processes.push_back(new QProcess());
 		processes.back()->setProcessChannelMode(QProcess::MergedChannels);
 		// make sure it is killed when we close the window
-		QObject::connect(processes.back(), SIGNAL(started()), &viewer, SLOT(processStarted()));
-		QObject::connect(processes.back(), SIGNAL(error(QProcess::ProcessError)), &viewer, SLOT(processError(QProcess::ProcessError)));
-		QObject::connect(processes.back(), SIGNAL(readyReadStandardOutput()), &viewer, SLOT(processReadyRead()));
-		QObject::connect(processes.back(), SIGNAL(finished(int, QProcess::ExitStatus)), &viewer, SLOT(processFinished(int, QProcess::ExitStatus)));
+		if (viewer)
+		{
+			QObject::connect(processes.back(), SIGNAL(started()), viewer, SLOT(processStarted()));
+			QObject::connect(processes.back(), SIGNAL(error(QProcess::ProcessError)), viewer, SLOT(processError(QProcess::ProcessError)));
+			QObject::connect(processes.back(), SIGNAL(readyReadStandardOutput()), viewer, SLOT(processReadyRead()));
+			QObject::connect(processes.back(), SIGNAL(finished(int, QProcess::ExitStatus)), viewer, SLOT(processFinished(int, QProcess::ExitStatus)));
+		}
 		// start the process
 		if (!command.isEmpty() && command[0] == ':')
 		{
@@ -320,13 +290,12 @@ int main(int argc, char *argv[])
 		}
 		procssE = procssE.nextSiblingElement("process");
 	}
-	
-	// Show and run
-	viewer.setWindowTitle("Playground - Stephane Magnenat (code) - Basilio Noris (gfx)");
-	viewer.show();
-	const int exitValue(app.exec());
-	
-	// Stop and delete ongoing processes
+	return processes;
+}
+
+//! Stop and delete ongoing processes
+static void stopProcesses(QList<QProcess*>& processes)
+{
 	foreach(QProcess*process,processes)
 	{
 		process->terminate();
@@ -334,6 +303,172 @@ int main(int argc, char *argv[])
 			process->kill();
 		delete process;
 	}
+	processes.clear();
+}
+
+//! Show usage
+static void dumpHelp(std::ostream &stream, const char *programName)
+{
+	stream << "Aseba playground, simulates robots running Aseba, usage:\n";
+	stream << programName << " [options] [scenario file]\n";
+	stream << "Options:\n";
+	stream << "--headless      : runs without viewer, stepping the robots in parallel\n";
+	stream << "--steps n       : in headless mode, stops after n steps (default: run forever)\n";
+	stream << "--dt seconds    : in headless mode, duration of a step (default: " << HEADLESS_DEFAULT_DT << ")\n";
+	stream << "--rate r        : in headless mode, runs at most r steps per second (default: as fast as possible)\n";
+	stream << "--threads n     : in headless mode, runs the robots on n threads (default: number of cores)\n";
+	stream << "--shared-hub p  : connects all robots through a single hub listening on port p\n";
+	stream << "-h, --help      : shows this help\n";
+	stream << "Report bugs to: aseba-dev@gna.org" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	// The viewer needs a QApplication, but running headless must not need a display
+	bool headless(false);
+	for (int i = 1; i < argc; ++i)
+		if (strcmp(argv[i], "--headless") == 0)
+			headless = true;
+	std::auto_ptr<QCoreApplication> app(headless ? new QCoreApplication(argc, argv) : new QApplication(argc, argv));
+	
+	/*
+	// Translation support
+	QTranslator qtTranslator;
+	qtTranslator.load("qt_" + QLocale::system().name());
+	app->installTranslator(&qtTranslator);
+	
+	QTranslator translator;
+	translator.load(QString(":/asebachallenge_") + QLocale::system().name());
+	app->installTranslator(&translator);
+	*/
+	
+	// Get cmd line arguments
+	QString fileName;
+	unsigned stepsCount(0);
+	double dt(HEADLESS_DEFAULT_DT);
+	double rate(0);
+	unsigned threadCount(std::max(QThread::idealThreadCount(), 1));
+	unsigned sharedHubPort(0);
+	const QStringList args(app->arguments());
+	for (int i = 1; i < args.size(); ++i)
+	{
+		const QString& arg(args[i]);
+		const bool hasValue(i + 1 < args.size());
+		if (arg == "--headless")
+			continue;
+		else if (arg == "--steps" && hasValue)
+			stepsCount = args[++i].toUInt();
+		else if (arg == "--dt" && hasValue)
+			dt = args[++i].toDouble();
+		else if (arg == "--rate" && hasValue)
+			rate = args[++i].toDouble();
+		else if (arg == "--threads" && hasValue)
+			threadCount = std::max(args[++i].toUInt(), 1u);
+		else if (arg == "--shared-hub" && hasValue)
+			sharedHubPort = args[++i].toUInt();
+		else if (arg == "-h" || arg == "--help")
+		{
+			dumpHelp(std::cout, argv[0]);
+			return 0;
+		}
+		else if (arg.startsWith("-"))
+		{
+			std::cerr << "Invalid or incomplete option " << arg.toStdString() << std::endl;
+			dumpHelp(std::cerr, argv[0]);
+			return 1;
+		}
+		else
+			fileName = arg;
+	}
+	bool ask(fileName.isEmpty() && !headless);
+	
+	// create document
+	QDomDocument domDocument("aseba-playground");
+	
+	// Try to load xml config file
+	do
+	{
+		if (ask)
+		{
+			QString lastFileName = QSettings("EPFL-LSRO-Mobots", "Aseba Playground").value("last file").toString();
+			fileName = QFileDialog::getOpenFileName(0, app->tr("Open Scenario"), lastFileName, app->tr("playground scenario (*.playground)"));
+		}
+		ask = true;
+		
+		if (fileName.isEmpty())
+		{
+			std::cerr << "You must specify a valid setup scenario on the command line or choose one in the file dialog\n";
+			exit(1);
+		}
+		
+		QFile file(fileName);
+		if (file.open(QIODevice::ReadOnly))
+		{
+			QString errorStr;
+			int errorLine, errorColumn;
+			if (!domDocument.setContent(&file, false, &errorStr, &errorLine, &errorColumn))
+			{
+				const QString message(app->tr("Parse error at file %1, line %2, column %3:\n%4")
+										.arg(fileName)
+										.arg(errorLine)
+										.arg(errorColumn)
+										.arg(errorStr));
+				if (headless)
+				{
+					std::cerr << message.toStdString() << std::endl;
+					exit(1);
+				}
+				QMessageBox::information(0, "Aseba Playground", message);
+			}
+			else
+			{
+				if (!headless)
+					QSettings("EPFL-LSRO-Mobots", "Aseba Playground").setValue("last file", fileName);
+				break;
+			}
+		}
+		else if (headless)
+		{
+			std::cerr << "Cannot open scenario " << fileName.toStdString() << std::endl;
+			exit(1);
+		}
+	}
+	while (true);
+	
+	// Create the hub shared by all robots if requested, before the world so that it outlives them
+	std::auto_ptr<Aseba::SharedDashelHub> sharedHub(sharedHubPort ? new Aseba::SharedDashelHub(sharedHubPort) : 0);
+	
+	// Create the world
+	QMap<QString, Enki::Color> colorsMap;
+	std::auto_ptr<Enki::World> world(createWorld(domDocument, colorsMap));
+	
+	if (headless)
+	{
+		const Enki::HeadlessRunner::NodesVector nodes(populateWorld(domDocument, colorsMap, *world, sharedHub.get()));
+		QList<QProcess*> processes(startProcesses(domDocument, 0));
+		
+		// Run and print the final state
+		{
+			Enki::HeadlessRunner runner(world.get(), nodes, threadCount, sharedHub.get());
+			runner.run(dt, stepsCount, rate);
+			runner.dumpState(std::cout);
+		}
+		
+		stopProcesses(processes);
+		return 0;
+	}
+	
+	// Create viewer, before the robots so that it shows their creation
+	Enki::PlaygroundViewer viewer(world.get(), sharedHub.get());
+	populateWorld(domDocument, colorsMap, *world, sharedHub.get());
+	QList<QProcess*> processes(startProcesses(domDocument, &viewer));
+	
+	// Show and run
+	viewer.setWindowTitle("Playground - Stephane Magnenat (code) - Basilio Noris (gfx)");
+	viewer.show();
+	const int exitValue(app->exec());
+	
+	stopProcesses(processes);
 	
 	return exitValue;
 }
@@ -0,0 +1,429 @@
+// Aseba
+#include "../transport/can/can-net.h"
+#include "../common/consts.h"
+
+// C++
+#include <vector>
+#include <deque>
+#include <string>
+#include <iostream>
+#include <algorithm>
+
+// C
+#include <getopt.h>		// getopt_long()
+#include <stdlib.h>		// exit(), atoi(), atof(), rand()
+#include <string.h>		// memcpy(), strcmp()
+
+// defines
+#define DEFAULT_NODES		8
+#define DEFAULT_BITRATE		1000
+#define DEFAULT_DURATION	10
+#define DEFAULT_POLL_PERIOD	1000
+#define SEND_QUEUE_SIZE		128
+#define RECV_QUEUE_SIZE		756
+#define TX_BUFFER_SIZE		4
+
+/*
+	Simulate a CAN bus with several nodes, each running its own instance of the
+	CAN transport layer (ASEBA_CAN_INSTANCES), and report the throughput, the
+	latency and the losses for typical mixes of Aseba traffic. Frames are sent
+	one at a time on the bus: the pending frame with the lowest CAN identifier
+	wins the arbitration, takes as long as its bits at the given bitrate, and
+	is then received by all other nodes, unless lost. Nodes read the packets
+	they received every poll period. Without frame loss, every packet sent
+	must either be received intact by all other nodes or be reported dropped.
+*/
+
+static const char short_options [] = "n:b:l:d:p:m:";
+static const struct option long_options[] = {
+	{ "nodes",		required_argument,	NULL,	'n'},
+	{ "bitrate",	required_argument,	NULL,	'b'},
+	{ "loss",		required_argument,	NULL,	'l'},
+	{ "duration",	required_argument,	NULL,	'd'},
+	{ "poll",		required_argument,	NULL,	'p'},
+	{ "mix",		required_argument,	NULL,	'm'},
+	{ 0, 0, 0, 0 }
+};
+
+//! A kind of message periodically sent by every node
+struct MessageKind
+{
+	unsigned size; //!< size of the packet in bytes, including the message type
+	double period; //!< period in us
+};
+
+//! A mix of traffic, sent by every node
+struct TrafficMix
+{
+	const char* name;
+	MessageKind kinds[3];
+	unsigned kindsCount;
+};
+
+//! Events with three arguments, variables of a node read by a client, and large packets such as bytecode or descriptions
+static const TrafficMix trafficMixes[] = {
+	{ "events", { { 8, 5000 } }, 1 },
+	{ "variables", { { 68, 20000 } }, 1 },
+	{ "mixed", { { 8, 10000 }, { 68, 50000 }, { 256, 500000 } }, 3 },
+};
+static const size_t trafficMixesCount(sizeof(trafficMixes) / sizeof(TrafficMix));
+
+static void usage (int argc, char** argv)
+{
+	std::cerr 	<< "Usage: " << argv[0] << " [options]" << std::endl << std::endl
+			<< "Options:" << std::endl
+			<< "    -n | --nodes        Number of nodes on the bus (default: " << DEFAULT_NODES << ")" << std::endl
+			<< "    -b | --bitrate      Bitrate of the bus in kbit/s (default: " << DEFAULT_BITRATE << ")" << std::endl
+			<< "    -l | --loss         Probability for a node to miss a frame (default: 0)" << std::endl
+			<< "    -d | --duration     Simulated time during which nodes send packets, in s (default: " << DEFAULT_DURATION << ")" << std::endl
+			<< "    -p | --poll         Period at which nodes read received packets, in us (default: " << DEFAULT_POLL_PERIOD << ")" << std::endl
+			<< "    -m | --mix          Traffic mix, one of:";
+	for (size_t i = 0; i < trafficMixesCount; ++i)
+		std::cerr << " " << trafficMixes[i].name;
+	std::cerr << " (default: all of them)" << std::endl;
+}
+
+//! A node on the simulated bus
+struct SimulatedNode
+{
+	uint16 id;
+	AsebaCanInstance* can;
+	std::vector<CanFrame> sendQueue;
+	std::vector<CanFrame> recvQueue;
+	std::deque<CanFrame> txBuffer; //!< frames in the CAN controller, sent in order
+	std::vector<double> nextSendTimes; //!< for each kind of message of the mix
+	std::vector<double> sentTimes; //!< for each packet sent, by sequence number
+	unsigned sentDropped;
+	unsigned receivedDropped;
+
+	SimulatedNode(uint16 id) :
+		id(id),
+		can(AsebaCanNewInstance()),
+		sendQueue(SEND_QUEUE_SIZE),
+		recvQueue(RECV_QUEUE_SIZE),
+		sentDropped(0),
+		receivedDropped(0)
+	{}
+};
+
+// glue of the layer, operating on the node whose instance is selected
+
+static SimulatedNode* currentNode(0);
+
+static void selectNode(SimulatedNode* node)
+{
+	currentNode = node;
+	AsebaCanSelectInstance(node->can);
+}
+
+static void sendFrame(const CanFrame *frame)
+{
+	currentNode->txBuffer.push_back(*frame);
+}
+
+static int isFrameRoom()
+{
+	return currentNode->txBuffer.size() < TX_BUFFER_SIZE;
+}
+
+static void receivedPacketDropped()
+{
+	++currentNode->receivedDropped;
+}
+
+static void sentPacketDropped()
+{
+	++currentNode->sentDropped;
+}
+
+extern "C" void AsebaIdle(void)
+{
+}
+
+extern "C" uint16 AsebaShouldDropPacket(uint16 source, const uint8* data)
+{
+	return 0;
+}
+
+//! Content of the byte at a given position of a packet, so that received packets can be checked
+static uint8 packetByte(uint16 source, unsigned sequence, size_t pos)
+{
+	return uint8(source * 31 + sequence * 7 + pos);
+}
+
+//! Number of bits of a standard frame on the bus, with worst-case bit stuffing and interframe space
+static unsigned frameBits(unsigned len)
+{
+	return 47 + 8 * len + (34 + 8 * len - 1) / 4;
+}
+
+//! The simulated bus and the statistics of a run
+struct Bus
+{
+	std::vector<SimulatedNode*> nodes;
+	double now; //!< current time in us
+	double busyTime;
+	unsigned sentCount;
+	unsigned deliveredCount;
+	unsigned corruptedCount;
+	unsigned lostFrames;
+	std::vector<double> latencies;
+
+	Bus(unsigned nodesCount) :
+		now(0),
+		busyTime(0),
+		sentCount(0),
+		deliveredCount(0),
+		corruptedCount(0),
+		lostFrames(0)
+	{
+		for (unsigned i = 0; i < nodesCount; ++i)
+		{
+			SimulatedNode* node(new SimulatedNode(i + 1));
+			selectNode(node);
+			AsebaCanInit(node->id, sendFrame, isFrameRoom, receivedPacketDropped, sentPacketDropped, &node->sendQueue[0], node->sendQueue.size(), &node->recvQueue[0], node->recvQueue.size());
+			nodes.push_back(node);
+		}
+	}
+
+	~Bus()
+	{
+		AsebaCanSelectInstance(0);
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			AsebaCanDeleteInstance(nodes[i]->can);
+			delete nodes[i];
+		}
+	}
+
+	//! Send a packet of a given size from a node, its first word being its size and the next two its sequence number
+	void send(SimulatedNode* node, unsigned size)
+	{
+		std::vector<uint8> data(size);
+		const uint16 length(size);
+		const unsigned sequence(node->sentTimes.size());
+		memcpy(&data[0], &length, 2);
+		memcpy(&data[2], &sequence, 4);
+		for (size_t i = 6; i < size; ++i)
+			data[i] = packetByte(node->id, sequence, i);
+
+		node->sentTimes.push_back(now);
+		selectNode(node);
+		if (AsebaCanSend(&data[0], size))
+			++sentCount;
+	}
+
+	//! Read the packets received by a node, check and account them
+	void poll(SimulatedNode* node)
+	{
+		uint8 data[ASEBA_MAX_INNER_PACKET_SIZE];
+		uint16 source;
+		uint16 amount;
+
+		selectNode(node);
+		while ((amount = AsebaCanRecv(data, sizeof(data), &source)) != 0)
+		{
+			uint16 length(0);
+			unsigned sequence(0);
+			if (amount >= 6)
+			{
+				memcpy(&length, &data[0], 2);
+				memcpy(&sequence, &data[2], 4);
+			}
+			bool intact(amount >= 6 && length == amount && source >= 1 && source <= nodes.size() && sequence < nodes[source - 1]->sentTimes.size());
+			for (size_t i = 6; intact && i < amount; ++i)
+				intact = data[i] == packetByte(source, sequence, i);
+			if (!intact)
+			{
+				++corruptedCount;
+				continue;
+			}
+			++deliveredCount;
+			latencies.push_back(now - nodes[source - 1]->sentTimes[sequence]);
+		}
+	}
+
+	//! Transmit the pending frame having the lowest identifier, return false if no frame is pending
+	bool transmit(double bitTime, double loss)
+	{
+		SimulatedNode* sender(0);
+		for (size_t i = 0; i < nodes.size(); ++i)
+			if (!nodes[i]->txBuffer.empty() && (!sender || nodes[i]->txBuffer.front().id < sender->txBuffer.front().id))
+				sender = nodes[i];
+		if (!sender)
+			return false;
+
+		const CanFrame frame(sender->txBuffer.front());
+		const double duration(frameBits(frame.len) * bitTime);
+		now += duration;
+		busyTime += duration;
+
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			if (nodes[i] == sender)
+				continue;
+			if (double(rand()) / RAND_MAX < loss)
+			{
+				++lostFrames;
+				continue;
+			}
+			selectNode(nodes[i]);
+			AsebaCanFrameReceived(&frame);
+		}
+
+		sender->txBuffer.pop_front();
+		selectNode(sender);
+		AsebaCanFrameSent();
+		return true;
+	}
+};
+
+//! Return the value at a given fraction of sorted values
+static double percentile(const std::vector<double>& values, double fraction)
+{
+	if (values.empty())
+		return 0;
+	return values[std::min(values.size() - 1, size_t(fraction * values.size()))];
+}
+
+//! Run a mix of traffic on a simulated bus and print statistics, return false if packets were lost without reason
+static bool run(const TrafficMix& mix, unsigned nodesCount, unsigned bitrate, double loss, double duration, double pollPeriod)
+{
+	const double bitTime(1000. / bitrate);
+	const double endTime(duration * 1e6);
+	Bus bus(nodesCount);
+
+	// nodes start sending at random times
+	for (size_t i = 0; i < bus.nodes.size(); ++i)
+		for (unsigned k = 0; k < mix.kindsCount; ++k)
+			bus.nodes[i]->nextSendTimes.push_back(mix.kinds[k].period * rand() / RAND_MAX);
+
+	// run until the end, and then until all frames have been sent
+	double nextPollTime(pollPeriod);
+	while (true)
+	{
+		double nextTime(nextPollTime);
+		if (bus.now < endTime)
+		{
+			for (size_t i = 0; i < bus.nodes.size(); ++i)
+			{
+				SimulatedNode* node(bus.nodes[i]);
+				for (unsigned k = 0; k < mix.kindsCount; ++k)
+				{
+					while (node->nextSendTimes[k] <= bus.now)
+					{
+						bus.send(node, mix.kinds[k].size);
+						node->nextSendTimes[k] += mix.kinds[k].period;
+					}
+					nextTime = std::min(nextTime, node->nextSendTimes[k]);
+				}
+			}
+		}
+
+		if (nextPollTime <= bus.now)
+		{
+			for (size_t i = 0; i < bus.nodes.size(); ++i)
+				bus.poll(bus.nodes[i]);
+			nextPollTime += pollPeriod;
+		}
+
+		if (!bus.transmit(bitTime, loss))
+		{
+			if (bus.now >= endTime)
+				break;
+			bus.now = std::max(bus.now, std::min(nextTime, endTime));
+		}
+	}
+	for (size_t i = 0; i < bus.nodes.size(); ++i)
+		bus.poll(bus.nodes[i]);
+
+	unsigned sentDropped(0);
+	unsigned receivedDropped(0);
+	for (size_t i = 0; i < bus.nodes.size(); ++i)
+	{
+		sentDropped += bus.nodes[i]->sentDropped;
+		receivedDropped += bus.nodes[i]->receivedDropped;
+	}
+	const unsigned expectedCount(bus.sentCount * (nodesCount - 1));
+	std::sort(bus.latencies.begin(), bus.latencies.end());
+
+	std::cout << "mix " << mix.name << ", " << nodesCount << " nodes at " << bitrate << " kbit/s, " << loss << " frame loss, " << duration << " s" << std::endl;
+	std::cout << "  sent " << bus.sentCount << " packets (" << bus.sentCount / duration << " packets/s), " << sentDropped << " dropped by senders" << std::endl;
+	std::cout << "  delivered " << bus.deliveredCount << " of " << expectedCount << " packets (" << bus.deliveredCount / duration << " packets/s), ";
+	std::cout << receivedDropped << " dropped by receivers, " << bus.corruptedCount << " corrupted, " << bus.lostFrames << " frames lost" << std::endl;
+	std::cout << "  bus load " << 100. * bus.busyTime / bus.now << " %" << std::endl;
+	std::cout << "  latency in us: 50% " << percentile(bus.latencies, 0.5) << ", 90% " << percentile(bus.latencies, 0.9) << ", 99% " << percentile(bus.latencies, 0.99) << ", max " << percentile(bus.latencies, 1) << std::endl;
+
+	if (loss == 0 && (bus.corruptedCount != 0 || bus.deliveredCount + receivedDropped != expectedCount))
+	{
+		std::cerr << "packets were lost or corrupted without frame loss" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	unsigned nodesCount(DEFAULT_NODES);
+	unsigned bitrate(DEFAULT_BITRATE);
+	double loss(0);
+	double duration(DEFAULT_DURATION);
+	double pollPeriod(DEFAULT_POLL_PERIOD);
+	const char* mixName(0);
+
+	// parse command line
+	while (1)
+	{
+		int index;
+		int c = getopt_long(argc, argv, short_options, long_options, &index);
+		if (c==-1)
+			break;
+
+		switch(c)
+		{
+			case 'n':
+				nodesCount = atoi(optarg);
+				break;
+			case 'b':
+				bitrate = atoi(optarg);
+				break;
+			case 'l':
+				loss = atof(optarg);
+				break;
+			case 'd':
+				duration = atof(optarg);
+				break;
+			case 'p':
+				pollPeriod = atof(optarg);
+				break;
+			case 'm':
+				mixName = optarg;
+				break;
+			default:
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (nodesCount < 2 || nodesCount > 255 || bitrate == 0 || duration <= 0 || pollPeriod <= 0)
+	{
+		usage(argc, argv);
+		exit(EXIT_FAILURE);
+	}
+
+	bool success(true);
+	bool found(false);
+	for (size_t i = 0; i < trafficMixesCount; ++i)
+	{
+		if (mixName && strcmp(mixName, trafficMixes[i].name) != 0)
+			continue;
+		found = true;
+		success = run(trafficMixes[i], nodesCount, bitrate, loss, duration, pollPeriod) && success;
+	}
+	if (!found)
+	{
+		usage(argc, argv);
+		exit(EXIT_FAILURE);
+	}
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
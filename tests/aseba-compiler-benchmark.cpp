@@ -0,0 +1,235 @@
+// Aseba
+#include "../compiler/compiler.h"
+#include "../vm/vm.h"
+#include "../vm/natives.h"
+#include "../common/consts.h"
+#include "../common/utils/utils.h"
+#include "../common/utils/FormatableString.h"
+using namespace Aseba;
+
+// C++
+#include <string>
+#include <iostream>
+#include <locale>
+#include <fstream>
+#include <sstream>
+
+// C
+#include <getopt.h>		// getopt_long()
+#include <stdlib.h>		// exit()
+
+// defines
+#define DEFAULT_RUNS	20
+
+/*
+	Compare incremental compilation to full compilation: the programs given as
+	argument are edited runs times, as in an editor, by moving them down a few
+	lines, changing a trailing comment, and every other time their last digit.
+	Each edited program is compiled from scratch and by a compiler kept across
+	edits, which must produce exactly the same bytecode, line numbers included,
+	and we report the time each one takes.
+*/
+
+static const char short_options [] = "r:";
+static const struct option long_options[] = {
+	{ "runs",		required_argument,	NULL,	'r'},
+	{ 0, 0, 0, 0 }
+};
+
+static void usage (int argc, char** argv)
+{
+	std::cerr 	<< "Usage: " << argv[0] << " [options] source..." << std::endl << std::endl
+			<< "Options:" << std::endl
+			<< "    -r | --runs         Number of edits of each program (default: " << DEFAULT_RUNS << ")" << std::endl;
+}
+
+// this prevents a link problem, natives might send messages
+extern "C" void AsebaSendMessage(AsebaVMState *vm, uint16 type, const void *data, uint16 size)
+{
+}
+
+//! Return the description of the same target as asebatest's
+static TargetDescription targetDescription()
+{
+	TargetDescription d;
+	d.name = L"benchmarkvm";
+	d.protocolVersion = ASEBA_PROTOCOL_VERSION;
+	d.bytecodeSize = 512;
+	d.variablesSize = 256;
+	d.stackSize = 64;
+
+	static const AsebaNativeFunctionDescription* nativeFunctionsDescriptions[] =
+	{
+		ASEBA_NATIVES_STD_DESCRIPTIONS,
+		0
+	};
+	const AsebaNativeFunctionDescription** nativeDescs(nativeFunctionsDescriptions);
+	while (*nativeDescs)
+	{
+		const AsebaNativeFunctionDescription* nativeDesc(*nativeDescs);
+		std::string name(nativeDesc->name);
+		std::string doc(nativeDesc->doc);
+
+		TargetDescription::NativeFunction native(
+			std::wstring(name.begin(), name.end()),
+			std::wstring(doc.begin(), doc.end())
+		);
+
+		const AsebaNativeFunctionArgumentDescription* params(nativeDesc->arguments);
+		while (params->size)
+		{
+			AsebaNativeFunctionArgumentDescription param(*params);
+			name = param.name;
+			native.parameters.push_back(
+				TargetDescription::NativeFunctionParameter(std::wstring(name.begin(), name.end()), param.size)
+			);
+			++params;
+		}
+
+		d.nativeFunctions.push_back(native);
+
+		++nativeDescs;
+	}
+	return d;
+}
+
+//! Result of a compilation
+struct CompilationResult
+{
+	bool success;
+	BytecodeVector bytecode;
+	unsigned allocatedVariablesCount;
+	Error error;
+
+	bool operator ==(const CompilationResult& that) const
+	{
+		if (success != that.success)
+			return false;
+		if (!success)
+			return true;
+		if (allocatedVariablesCount != that.allocatedVariablesCount || bytecode.size() != that.bytecode.size())
+			return false;
+		for (size_t i = 0; i < bytecode.size(); ++i)
+			if (bytecode[i].bytecode != that.bytecode[i].bytecode || bytecode[i].line != that.bytecode[i].line)
+				return false;
+		return true;
+	}
+};
+
+//! Compile source with compiler, adding the time it took to duration
+static CompilationResult compile(Compiler& compiler, const std::wstring& source, UnifiedTime& duration)
+{
+	CompilationResult result;
+	std::wistringstream is(source);
+	const UnifiedTime startTime;
+	result.success = compiler.compile(is, result.bytecode, result.allocatedVariablesCount, result.error);
+	duration += UnifiedTime() - startTime;
+	return result;
+}
+
+// read source code to a string
+static std::wstring read_source(const std::string& filename)
+{
+	std::ifstream ifs;
+	ifs.open(filename.c_str(), std::ifstream::binary);
+	if (!ifs.is_open())
+	{
+		std::cerr << "Error opening source file " << filename << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::ostringstream oss;
+	oss << ifs.rdbuf();
+	return UTF8ToWString(oss.str());
+}
+
+int main(int argc, char** argv)
+{
+	unsigned runs = DEFAULT_RUNS;
+
+	std::locale::global(std::locale(""));
+
+	// parse the arguments
+	for(;;)
+	{
+		int index;
+		int c = getopt_long(argc, argv, short_options, long_options, &index);
+		if (c==-1)
+			break;
+
+		switch(c)
+		{
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			default:
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind == argc)
+	{
+		usage(argc, argv);
+		exit(EXIT_FAILURE);
+	}
+
+	const TargetDescription d(targetDescription());
+	CommonDefinitions definitions;
+	definitions.events.push_back(NamedValue(L"event1", 0));
+	definitions.events.push_back(NamedValue(L"event2", 3));
+	definitions.constants.push_back(NamedValue(L"FOO", 2));
+
+	bool mismatch(false);
+	UnifiedTime fullTotal(0), incrementalTotal(0);
+	for (int arg = optind; arg < argc; ++arg)
+	{
+		const std::string filename(argv[arg]);
+		const std::wstring source(read_source(filename));
+
+		Compiler incrementalCompiler;
+		incrementalCompiler.setTargetDescription(&d);
+		incrementalCompiler.setCommonDefinitions(&definitions);
+		incrementalCompiler.setIncrementalCompilation(true);
+
+		UnifiedTime fullDuration(0), incrementalDuration(0);
+		unsigned reusedHandlersCount(0);
+		bool differs(false);
+		for (unsigned run = 0; run <= runs; ++run)
+		{
+			// the first run compiles the original source, with an empty cache, every other one changes its last digit
+			std::wstring edited(source);
+			const size_t lastDigit(edited.find_last_of(L"0123456789"));
+			if (run % 2 && lastDigit != std::wstring::npos)
+				edited[lastDigit] = edited[lastDigit] == L'1' ? L'2' : L'1';
+			if (run)
+				edited = std::wstring(run % 3, L'\n') + edited + WFormatableString(L"\n# edit %0\n").arg(run);
+
+			Compiler fullCompiler;
+			fullCompiler.setTargetDescription(&d);
+			fullCompiler.setCommonDefinitions(&definitions);
+			const CompilationResult reference(compile(fullCompiler, edited, fullDuration));
+
+			const CompilationResult result(compile(incrementalCompiler, edited, incrementalDuration));
+			reusedHandlersCount += incrementalCompiler.getReusedHandlersCount();
+			if (!(result == reference))
+				differs = true;
+		}
+
+		std::cout << filename << ": full " << fullDuration.value << " ms, incremental " << incrementalDuration.value << " ms, reused " << reusedHandlersCount << " handlers";
+		if (differs)
+		{
+			std::cout << " (RESULTS DIFFER)";
+			mismatch = true;
+		}
+		std::cout << std::endl;
+		fullTotal += fullDuration;
+		incrementalTotal += incrementalDuration;
+	}
+
+	std::cout << "total: full " << fullTotal.value << " ms, incremental " << incrementalTotal.value << " ms";
+	if (incrementalTotal.value)
+		std::cout << " (speedup " << double(fullTotal.value) / double(incrementalTotal.value) << ")";
+	std::cout << std::endl;
+
+	return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,246 @@
+// Aseba
+#include "../common/msg/msg.h"
+#include "../common/consts.h"
+#include "../common/utils/utils.h"
+using namespace Aseba;
+
+// Dashel
+#include <dashel/dashel.h>
+
+// C++
+#include <vector>
+#include <string>
+#include <memory>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+
+// C
+#include <getopt.h>		// getopt_long()
+#include <stdlib.h>		// exit()
+#include <string.h>		// memcpy()
+
+// defines
+#define DEFAULT_COUNT	100000
+
+/*
+	Compare the number of messages per second that can be forwarded using the
+	typed receive path, Message::receive(), and the raw one, RawMessage, which
+	reuses its buffer. A mix of typical messages is written count times to a
+	memory stream, received and written back to another memory stream by both
+	paths, which must produce the same bytes. Every message of the mix is also
+	decoded from its raw form, which must give the same message as the typed path.
+*/
+
+static const char short_options [] = "c:";
+static const struct option long_options[] = {
+	{ "count",		required_argument,	NULL,	'c'},
+	{ 0, 0, 0, 0 }
+};
+
+static void usage (int argc, char** argv)
+{
+	std::cerr 	<< "Usage: " << argv[0] << " [options]" << std::endl << std::endl
+			<< "Options:" << std::endl
+			<< "    -c | --count        Number of times the mix of messages is forwarded (default: " << DEFAULT_COUNT << ")" << std::endl;
+}
+
+//! A stream writing to and reading from memory
+class MemoryStream: public Dashel::Stream
+{
+public:
+	std::vector<uint8> data;
+	size_t readPos;
+
+public:
+	MemoryStream() : Stream("memory"), readPos(0) { }
+
+	virtual void write(const void *data, const size_t size)
+	{
+		const uint8 *ptr(reinterpret_cast<const uint8 *>(data));
+		this->data.insert(this->data.end(), ptr, ptr + size);
+	}
+
+	virtual void flush() { }
+
+	virtual void read(void *data, size_t size)
+	{
+		if (readPos + size > this->data.size())
+		{
+			std::cerr << "MemoryStream::read() : fatal error: reading past the end of stream" << std::endl;
+			abort();
+		}
+		memcpy(data, &this->data[readPos], size);
+		readPos += size;
+	}
+
+	//! Forget what was written and restart reading from the beginning
+	void clear()
+	{
+		data.clear();
+		readPos = 0;
+	}
+};
+
+//! Return a mix of messages as typically seen by a switch
+static std::vector<Message*> messagesMix()
+{
+	std::vector<Message*> messages;
+
+	UserMessage::DataVector data(32);
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = sint16(i * 3 - 40);
+	messages.push_back(new UserMessage(2, data));
+	messages.push_back(new UserMessage(0));
+
+	Variables* variables(new Variables);
+	variables->start = 24;
+	variables->variables.assign(data.begin(), data.begin() + 16);
+	messages.push_back(variables);
+
+	messages.push_back(new GetVariables(1, 0, 64));
+	messages.push_back(new SetVariables(1, 12, SetVariables::VariablesVector(8, -5)));
+	messages.push_back(new SubscribeVariables(1, 24, 16, 100, true));
+	messages.push_back(new UnsubscribeVariables(1, 24, 16));
+	messages.push_back(new Reset(1));
+	messages.push_back(new ExecutionStateChanged);
+
+	for (size_t i = 0; i < messages.size(); ++i)
+		messages[i]->source = 1;
+	return messages;
+}
+
+//! Return the dump of message as a string
+static std::wstring dumpToString(const Message& message)
+{
+	std::wostringstream oss;
+	message.dump(oss);
+	return oss.str();
+}
+
+//! Print the rate of messages forwarded in duration
+static void printRate(const char* name, const unsigned messagesCount, const UnifiedTime& duration)
+{
+	std::cout << name << ": " << messagesCount << " messages in " << duration.value << " ms";
+	if (duration.value)
+		std::cout << " (" << (messagesCount * 1000ull) / duration.value << " messages/s)";
+	std::cout << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	unsigned count = DEFAULT_COUNT;
+
+	// parse the arguments
+	for(;;)
+	{
+		int index;
+		int c = getopt_long(argc, argv, short_options, long_options, &index);
+		if (c==-1)
+			break;
+
+		switch(c)
+		{
+			case 'c':
+				count = atoi(optarg);
+				break;
+			default:
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc)
+	{
+		usage(argc, argv);
+		exit(EXIT_FAILURE);
+	}
+
+	// check that decoding the raw form of messages gives back the same messages
+	bool mismatch(false);
+	const std::vector<Message*> messages(messagesMix());
+	MemoryStream input, output;
+	for (size_t i = 0; i < messages.size(); ++i)
+	{
+		input.clear();
+		messages[i]->serialize(&input);
+
+		RawMessage rawMessage;
+		rawMessage.receive(&input);
+		const std::auto_ptr<Message> decodedMessage(rawMessage.decode());
+		if (dumpToString(*decodedMessage) != dumpToString(*messages[i]))
+		{
+			std::wcerr << L"decoding mismatch: " << dumpToString(*messages[i]) << L" decoded as " << dumpToString(*decodedMessage) << std::endl;
+			mismatch = true;
+		}
+	}
+
+	// an oversized packet must only break its stream, not the whole program
+	{
+		input.clear();
+		const uint16 header[3] = { ASEBA_MAX_EVENT_ARG_SIZE + 2, 1, ASEBA_MESSAGE_INVALID };
+		input.write(header, sizeof(header));
+		RawMessage rawMessage;
+		bool thrown(false);
+		try
+		{
+			rawMessage.receive(&input);
+		}
+		catch (const Dashel::DashelException& e)
+		{
+			thrown = true;
+		}
+		if (!thrown)
+		{
+			std::cout << "oversized packet accepted" << std::endl;
+			mismatch = true;
+		}
+	}
+
+	// write the mix of messages count times
+	input.clear();
+	for (unsigned run = 0; run < count; ++run)
+		for (size_t i = 0; i < messages.size(); ++i)
+			messages[i]->serialize(&input);
+	const unsigned messagesCount(count * messages.size());
+
+	// forward them through the typed path
+	output.data.reserve(input.data.size());
+	UnifiedTime startTime;
+	for (unsigned i = 0; i < messagesCount; ++i)
+	{
+		Message* message(Message::receive(&input));
+		message->serialize(&output);
+		delete message;
+	}
+	const UnifiedTime typedDuration(UnifiedTime() - startTime);
+	const std::vector<uint8> typedOutput(output.data);
+
+	// forward them through the raw path
+	input.readPos = 0;
+	output.clear();
+	RawMessage rawMessage;
+	startTime = UnifiedTime();
+	for (unsigned i = 0; i < messagesCount; ++i)
+	{
+		rawMessage.receive(&input);
+		rawMessage.serialize(&output);
+	}
+	const UnifiedTime rawDuration(UnifiedTime() - startTime);
+
+	if (output.data != typedOutput || output.data != input.data)
+	{
+		std::cout << "forwarded bytes differ" << std::endl;
+		mismatch = true;
+	}
+
+	printRate("typed", messagesCount, typedDuration);
+	printRate("raw", messagesCount, rawDuration);
+	if (rawDuration.value)
+		std::cout << "speedup " << double(typedDuration.value) / double(rawDuration.value) << std::endl;
+
+	for (size_t i = 0; i < messages.size(); ++i)
+		delete messages[i];
+
+	return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,302 @@
+// Aseba
+#include "../compiler/batch/BatchCompiler.h"
+#include "../common/consts.h"
+#include "../common/utils/utils.h"
+using namespace Aseba;
+
+// Qt
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+
+// C++
+#include <vector>
+#include <string>
+#include <iostream>
+
+// C
+#include <stdlib.h>
+
+/*
+	Check the caches of BatchCompiler: identical jobs are compiled only once,
+	changing the common definitions invalidates the cache, and failures are
+	never cached. Then check the disk cache: a new compiler reuses the programs
+	of an earlier one, but not for another target or other common definitions,
+	a corrupted file is rejected and written again, and the directory is kept
+	within its maximum size.
+*/
+
+//! Return a description of a target without native functions, whose CRC depends on variablesSize
+static TargetDescription targetDescription(unsigned variablesSize)
+{
+	TargetDescription d;
+	d.name = L"batchtest";
+	d.protocolVersion = ASEBA_PROTOCOL_VERSION;
+	d.bytecodeSize = 512;
+	d.variablesSize = variablesSize;
+	d.stackSize = 64;
+	return d;
+}
+
+//! Return whether the compiler counted the given numbers of hits and misses since its creation, print them otherwise
+static bool checkCounts(const BatchCompiler& compiler, unsigned hits, unsigned diskHits, unsigned misses, const char* context)
+{
+	if (compiler.getCacheHitsCount() == hits && compiler.getDiskCacheHitsCount() == diskHits && compiler.getCacheMissesCount() == misses)
+		return true;
+	std::cerr << context << ": got " << compiler.getCacheHitsCount() << " hits, " << compiler.getDiskCacheHitsCount() << " disk hits and " << compiler.getCacheMissesCount() << " misses";
+	std::cerr << " instead of " << hits << ", " << diskHits << " and " << misses << std::endl;
+	return false;
+}
+
+//! Return whether the two programs have the same bytecode, line numbers included
+static bool sameBytecode(const CompiledProgram& a, const CompiledProgram& b)
+{
+	if (a.bytecode.size() != b.bytecode.size() || a.allocatedVariablesCount != b.allocatedVariablesCount)
+		return false;
+	for (size_t i = 0; i < a.bytecode.size(); ++i)
+		if (a.bytecode[i].bytecode != b.bytecode[i].bytecode || a.bytecode[i].line != b.bytecode[i].line)
+			return false;
+	return true;
+}
+
+//! Return whether program compiled successfully to the same bytecode as expected, print the difference otherwise
+static bool checkProgram(const CompiledProgram& program, const CompiledProgram& expected, const char* context)
+{
+	if (!program.success)
+	{
+		std::cerr << context << ": compilation failed: " << WStringToUTF8(program.error.toWString()) << std::endl;
+		return false;
+	}
+	if (!sameBytecode(program, expected))
+	{
+		std::cerr << context << ": the bytecode differs from the one of the first compilation" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+//! Return the files of the disk cache in directory
+static QFileInfoList diskCacheFiles(const QString& directory)
+{
+	return QDir(directory).entryInfoList(QStringList("*.bytecode"), QDir::Files);
+}
+
+//! Remove directory and its files
+static void removeDirectory(const QString& directory)
+{
+	QDir dir(directory);
+	const QStringList files(dir.entryList(QDir::Files | QDir::Hidden));
+	for (int i = 0; i < files.size(); ++i)
+		dir.remove(files[i]);
+	QDir().rmdir(directory);
+}
+
+//! Check the cache in memory, return whether it behaves as expected
+static bool checkMemoryCache(const TargetDescription* target)
+{
+	bool ok(true);
+	BatchCompiler compiler;
+	CommonDefinitions commonDefinitions;
+
+	// identical jobs are compiled once, even within the same batch
+	BatchCompiler::JobsVector jobs;
+	jobs.push_back(BatchCompiler::Job(target, L"var a = 1\nvar b = a + 2\n"));
+	jobs.push_back(BatchCompiler::Job(target, L"var a = 1\nvar b = a + 2\n"));
+	jobs.push_back(BatchCompiler::Job(target, L"var c[3] = [1, 2, 3]\n"));
+	const BatchCompiler::CompiledProgramsVector first(compiler.compile(jobs, commonDefinitions));
+	ok = checkCounts(compiler, 1, 0, 2, "identical jobs") && ok;
+	ok = checkProgram(first[0], first[0], "first job") && ok;
+	ok = checkProgram(first[1], first[0], "identical job") && ok;
+	ok = checkProgram(first[2], first[2], "other job") && ok;
+
+	// and later only found in the cache
+	const BatchCompiler::CompiledProgramsVector second(compiler.compile(jobs, commonDefinitions));
+	ok = checkCounts(compiler, 4, 0, 2, "same jobs again") && ok;
+	for (size_t i = 0; i < jobs.size(); ++i)
+		ok = checkProgram(second[i], first[i], "cached job") && ok;
+
+	// failures are compiled again every time
+	BatchCompiler::JobsVector constantJobs(1, BatchCompiler::Job(target, L"var a = SPEED\n"));
+	CompiledProgram program(compiler.compile(constantJobs, commonDefinitions)[0]);
+	program = compiler.compile(constantJobs, commonDefinitions)[0];
+	ok = checkCounts(compiler, 4, 0, 4, "failing job") && ok;
+	if (program.success)
+	{
+		std::cerr << "a program using an undefined constant compiled" << std::endl;
+		ok = false;
+	}
+
+	// until the common definitions change, which also invalidates all the cache
+	commonDefinitions.constants.push_back(NamedValue(L"SPEED", 10));
+	const CompiledProgram speed10(compiler.compile(constantJobs, commonDefinitions)[0]);
+	ok = checkCounts(compiler, 4, 0, 5, "defined constant") && ok;
+	ok = checkProgram(speed10, speed10, "defined constant") && ok;
+	compiler.compile(jobs, commonDefinitions);
+	ok = checkCounts(compiler, 5, 0, 7, "jobs with other common definitions") && ok;
+
+	// a program compiled with the previous value of a constant must not be reused
+	commonDefinitions.constants[0].value = 20;
+	const CompiledProgram speed20(compiler.compile(constantJobs, commonDefinitions)[0]);
+	ok = checkCounts(compiler, 5, 0, 8, "changed constant") && ok;
+	if (!speed20.success || sameBytecode(speed20, speed10))
+	{
+		std::cerr << "the program was not compiled with the new value of the constant" << std::endl;
+		ok = false;
+	}
+	return ok;
+}
+
+//! Check the cache on disk in directory, return whether it behaves as expected
+static bool checkDiskCache(const TargetDescription* target, const TargetDescription* otherTarget, const QString& directory)
+{
+	bool ok(true);
+	CommonDefinitions commonDefinitions;
+	commonDefinitions.events.push_back(NamedValue(L"ping", 1));
+	BatchCompiler::JobsVector jobs;
+	jobs.push_back(BatchCompiler::Job(target, L"var a = 1\nvar b = a + 2\n"));
+	jobs.push_back(BatchCompiler::Job(target, L"var c[3] = [1, 2, 3]\n"));
+	jobs.push_back(BatchCompiler::Job(target, L"var d = SPEED\n"));
+
+	// only successful compilations are written
+	BatchCompiler::CompiledProgramsVector first;
+	{
+		BatchCompiler compiler;
+		compiler.setDiskCache(directory);
+		first = compiler.compile(jobs, commonDefinitions);
+		ok = checkCounts(compiler, 0, 0, 3, "first run") && ok;
+	}
+	if (diskCacheFiles(directory).size() != 2)
+	{
+		std::cerr << "expected 2 files in the disk cache, got " << diskCacheFiles(directory).size() << std::endl;
+		ok = false;
+	}
+
+	// a later run reads them back
+	{
+		BatchCompiler compiler;
+		compiler.setDiskCache(directory);
+		const BatchCompiler::CompiledProgramsVector second(compiler.compile(jobs, commonDefinitions));
+		ok = checkCounts(compiler, 0, 2, 1, "second run") && ok;
+		ok = checkProgram(second[0], first[0], "program read from disk") && ok;
+		ok = checkProgram(second[1], first[1], "program read from disk") && ok;
+	}
+
+	// but not for another target or other common definitions
+	{
+		BatchCompiler compiler;
+		compiler.setDiskCache(directory);
+		compiler.compile(BatchCompiler::JobsVector(1, BatchCompiler::Job(otherTarget, jobs[0].source)), commonDefinitions);
+		ok = checkCounts(compiler, 0, 0, 1, "other target") && ok;
+		CommonDefinitions otherCommonDefinitions(commonDefinitions);
+		otherCommonDefinitions.events[0].value = 2;
+		compiler.compile(BatchCompiler::JobsVector(1, jobs[0]), otherCommonDefinitions);
+		ok = checkCounts(compiler, 0, 0, 2, "other common definitions") && ok;
+	}
+
+	// corrupt the files: the key of one, the end of the other
+	const QFileInfoList files(diskCacheFiles(directory));
+	for (int i = 0; i < files.size(); ++i)
+	{
+		QFile file(files[i].filePath());
+		if (!file.open(QFile::ReadWrite))
+		{
+			std::cerr << "cannot open " << file.fileName().toLocal8Bit().constData() << std::endl;
+			return false;
+		}
+		QByteArray content(file.readAll());
+		if (i == 0)
+			content[8] = char(~content[8]);
+		else
+			content.resize(content.size() - 6);
+		file.resize(0);
+		file.write(content);
+		file.close();
+	}
+
+	// corrupted files are not used, and are written again
+	{
+		BatchCompiler compiler;
+		compiler.setDiskCache(directory);
+		const BatchCompiler::CompiledProgramsVector third(compiler.compile(jobs, commonDefinitions));
+		ok = checkCounts(compiler, 0, 0, 3, "corrupted files") && ok;
+		ok = checkProgram(third[0], first[0], "program with a corrupted file") && ok;
+		ok = checkProgram(third[1], first[1], "program with a corrupted file") && ok;
+	}
+	{
+		BatchCompiler compiler;
+		compiler.setDiskCache(directory);
+		compiler.compile(jobs, commonDefinitions);
+		ok = checkCounts(compiler, 0, 2, 1, "rewritten files") && ok;
+	}
+	return ok;
+}
+
+//! Check the eviction of files from the disk cache in directory, return whether it behaves as expected
+static bool checkDiskCacheEviction(const TargetDescription* target, const QString& directory)
+{
+	bool ok(true);
+	const CommonDefinitions commonDefinitions;
+	const unsigned programsCount(20);
+	const unsigned maxFilesCount(4);
+
+	// the programs have the same length, so their files have the same size
+	std::vector<std::wstring> sources;
+	for (unsigned i = 0; i < programsCount; ++i)
+		sources.push_back(L"var a = " + QString::number(10 + i).toStdWString() + L"\n");
+
+	// measure the size of a file
+	qint64 fileSize(0);
+	{
+		BatchCompiler compiler;
+		compiler.setDiskCache(directory);
+		compiler.compile(BatchCompiler::JobsVector(1, BatchCompiler::Job(target, sources[0])), commonDefinitions);
+		const QFileInfoList files(diskCacheFiles(directory));
+		if (files.size() != 1)
+		{
+			std::cerr << "expected 1 file in the disk cache, got " << files.size() << std::endl;
+			return false;
+		}
+		fileSize = files[0].size();
+		QFile::remove(files[0].filePath());
+	}
+
+	// compile the programs one after the other, the directory must never grow beyond its maximum size
+	const qint64 maxSize(maxFilesCount * fileSize);
+	BatchCompiler compiler;
+	compiler.setDiskCache(directory, maxSize);
+	for (unsigned i = 0; i < programsCount; ++i)
+	{
+		compiler.compile(BatchCompiler::JobsVector(1, BatchCompiler::Job(target, sources[i])), commonDefinitions);
+		const QFileInfoList files(diskCacheFiles(directory));
+		qint64 size(0);
+		for (int j = 0; j < files.size(); ++j)
+			size += files[j].size();
+		if (size > maxSize || files.isEmpty())
+		{
+			std::cerr << "after " << i + 1 << " programs, the disk cache holds " << files.size() << " files of " << size << " bytes, for a maximum of " << maxSize << std::endl;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	QCoreApplication app(argc, argv);
+
+	const TargetDescription target(targetDescription(256));
+	const TargetDescription otherTarget(targetDescription(128));
+	const QString directory(QDir::temp().filePath(QString("aseba-test-batch-compiler-%0").arg(QCoreApplication::applicationPid())));
+	removeDirectory(directory);
+
+	bool ok(true);
+	ok = checkMemoryCache(&target) && ok;
+	ok = checkDiskCache(&target, &otherTarget, directory) && ok;
+	removeDirectory(directory);
+	ok = checkDiskCacheEviction(&target, directory) && ok;
+	removeDirectory(directory);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
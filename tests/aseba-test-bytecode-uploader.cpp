@@ -0,0 +1,172 @@
+// Aseba
+#include "../common/msg/msg.h"
+#include "../common/msg/bytecode-uploader.h"
+#include "../common/consts.h"
+using namespace Aseba;
+
+// C++
+#include <vector>
+#include <iostream>
+
+// C
+#include <stdlib.h>		// exit(), rand()
+
+/*
+	Check that the differential uploads of BytecodeUploader leave the same bytecode
+	in a node as full uploads, while sending fewer words. Programs are uploaded to
+	a simulated node, which applies the SetBytecode messages it receives. Each
+	program is then edited in various ways and uploaded again.
+*/
+
+//! A node that only keeps its bytecode
+struct SimulatedNode
+{
+	std::vector<uint16> bytecode;
+	unsigned receivedWords;
+	unsigned receivedMessages;
+	unsigned resetsCount;
+
+	SimulatedNode() : bytecode(1024, 0), receivedWords(0), receivedMessages(0), resetsCount(0) { }
+
+	//! Apply and delete messages
+	void receive(std::vector<Message*>& messages)
+	{
+		for (size_t i = 0; i < messages.size(); ++i)
+		{
+			const SetBytecode* setBytecode(dynamic_cast<const SetBytecode*>(messages[i]));
+			if (setBytecode)
+			{
+				std::copy(setBytecode->bytecode.begin(), setBytecode->bytecode.end(), bytecode.begin() + setBytecode->start);
+				receivedWords += setBytecode->bytecode.size();
+				++resetsCount;
+			}
+			else if (dynamic_cast<const Reset*>(messages[i]))
+				++resetsCount;
+			++receivedMessages;
+			delete messages[i];
+		}
+		messages.clear();
+	}
+};
+
+//! Return a random program of size words
+static std::vector<uint16> randomProgram(unsigned size)
+{
+	std::vector<uint16> program(size);
+	for (size_t i = 0; i < program.size(); ++i)
+		program[i] = rand();
+	return program;
+}
+
+//! Upload program with uploader to node, and check that node ends up with it
+static bool upload(BytecodeUploader& uploader, SimulatedNode& node, const std::vector<uint16>& program, const char* what)
+{
+	std::vector<Message*> messages;
+	uploader.sendBytecode(messages, 1, program);
+	const unsigned resetsCount(node.resetsCount);
+	node.receive(messages);
+	if (!std::equal(program.begin(), program.end(), node.bytecode.begin()))
+	{
+		std::cerr << what << ": bytecode differs" << std::endl;
+		return false;
+	}
+	if (node.resetsCount == resetsCount)
+	{
+		std::cerr << what << ": node not reset" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+int main()
+{
+	bool ok(true);
+	srand(0);
+
+	BytecodeUploader uploader;
+	SimulatedNode node;
+
+	// first upload sends everything
+	std::vector<uint16> program(randomProgram(700));
+	ok = upload(uploader, node, program, "initial") && ok;
+	if (node.receivedWords != program.size())
+	{
+		std::cerr << "initial: sent " << node.receivedWords << " words instead of " << program.size() << std::endl;
+		ok = false;
+	}
+
+	// same program only resets
+	node.receivedWords = 0;
+	ok = upload(uploader, node, program, "unchanged") && ok;
+	if (node.receivedWords != 0)
+	{
+		std::cerr << "unchanged: sent " << node.receivedWords << " words" << std::endl;
+		ok = false;
+	}
+
+	// a few scattered changes, some close to each other
+	node.receivedWords = 0;
+	program[3] ^= 1;
+	program[5] ^= 1;
+	program[300] ^= 1;
+	program[699] ^= 1;
+	ok = upload(uploader, node, program, "scattered") && ok;
+	if (node.receivedWords > 10)
+	{
+		std::cerr << "scattered: sent " << node.receivedWords << " words" << std::endl;
+		ok = false;
+	}
+
+	// a long change, larger than a message
+	for (size_t i = 100; i < 500; ++i)
+		program[i] ^= 2;
+	ok = upload(uploader, node, program, "long") && ok;
+
+	// growing and shrinking
+	const std::vector<uint16> tail(randomProgram(200));
+	program.insert(program.end(), tail.begin(), tail.end());
+	ok = upload(uploader, node, program, "grown") && ok;
+	program.resize(400);
+	program[10] ^= 4;
+	ok = upload(uploader, node, program, "shrunk") && ok;
+
+	// a description from the node makes the next upload a full one
+	Description description;
+	description.source = 1;
+	uploader.processMessage(&description);
+	node.receivedWords = 0;
+	ok = upload(uploader, node, program, "described") && ok;
+	if (node.receivedWords != program.size())
+	{
+		std::cerr << "described: sent " << node.receivedWords << " words instead of " << program.size() << std::endl;
+		ok = false;
+	}
+
+	// a node that reboots loses its bytecode and only announces itself with the hash of its description
+	program[20] ^= 8;
+	ok = upload(uploader, node, program, "before reboot") && ok;
+	node = SimulatedNode();
+	DescriptionHash descriptionHash;
+	descriptionHash.source = 1;
+	uploader.processMessage(&descriptionHash);
+	program[30] ^= 8;
+	ok = upload(uploader, node, program, "rebooted") && ok;
+	if (node.receivedWords != program.size())
+	{
+		std::cerr << "rebooted: sent " << node.receivedWords << " words instead of " << program.size() << std::endl;
+		ok = false;
+	}
+
+	// bytecode sent to the node by someone else as well
+	SetBytecode setBytecode(1, 0);
+	uploader.processMessage(&setBytecode);
+	node.receivedWords = 0;
+	ok = upload(uploader, node, program, "changed by others") && ok;
+	if (node.receivedWords != program.size())
+	{
+		std::cerr << "changed by others: sent " << node.receivedWords << " words instead of " << program.size() << std::endl;
+		ok = false;
+	}
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,230 @@
+// Aseba
+#include "../transport/can/can-net.h"
+
+// C++
+#include <vector>
+#include <deque>
+#include <iostream>
+
+// C
+#include <stdlib.h>		// rand()
+#include <string.h>		// memcmp()
+
+/*
+	Check the reassembly of packets by the CAN transport layer when many nodes
+	send packets at the same time. The frames of the packets of all sources are
+	cut by the sending side of the layer, then interleaved randomly and given
+	to the reception side, which must deliver every packet intact and in order
+	for each source, or report it as dropped.
+*/
+
+typedef std::vector<uint8> Packet;
+
+static std::vector<CanFrame> sentFrames;
+static unsigned droppedCount(0);
+static int filteredSource(-1);
+
+// glue of the layer
+
+static void sendFrame(const CanFrame *frame)
+{
+	sentFrames.push_back(*frame);
+}
+
+static int isFrameRoom()
+{
+	return 1;
+}
+
+static void receivedPacketDropped()
+{
+	++droppedCount;
+}
+
+static void sentPacketDropped()
+{
+	std::cerr << "sent packet dropped" << std::endl;
+	exit(EXIT_FAILURE);
+}
+
+extern "C" void AsebaIdle(void)
+{
+}
+
+extern "C" uint16 AsebaShouldDropPacket(uint16 source, const uint8* data)
+{
+	return int(source) == filteredSource;
+}
+
+//! A source sending packets over the bus
+struct Source
+{
+	uint16 id;
+	std::deque<Packet> packets; //!< packets not received yet, in order
+	std::deque<CanFrame> frames; //!< frames not put on the bus yet
+};
+
+//! Create sources each sending a number of random packets, and cut these packets into frames
+static std::vector<Source> createSources(unsigned sourcesCount, unsigned packetsCount, size_t maxSize)
+{
+	static std::vector<CanFrame> sendQueue(64);
+	static std::vector<CanFrame> recvQueue(1);
+	std::vector<Source> sources(sourcesCount);
+
+	AsebaCanInit(0, sendFrame, isFrameRoom, receivedPacketDropped, sentPacketDropped, &sendQueue[0], sendQueue.size(), &recvQueue[0], recvQueue.size());
+	for (unsigned s = 0; s < sourcesCount; ++s)
+	{
+		sources[s].id = s + 1;
+		for (unsigned p = 0; p < packetsCount; ++p)
+		{
+			Packet packet(1 + rand() % maxSize);
+			for (size_t i = 0; i < packet.size(); ++i)
+				packet[i] = rand();
+			sentFrames.clear();
+			AsebaCanSendSpecificSource(&packet[0], packet.size(), sources[s].id);
+			sources[s].packets.push_back(packet);
+			sources[s].frames.insert(sources[s].frames.end(), sentFrames.begin(), sentFrames.end());
+		}
+	}
+	return sources;
+}
+
+//! Read one packet from the layer and check it against those sent; return false if there was no packet
+static bool receivePacket(std::vector<Source>& sources, unsigned& receivedCount)
+{
+	uint8 data[512];
+	uint16 source;
+	const uint16 length(AsebaCanRecv(data, sizeof(data), &source));
+	if (length == 0)
+		return false;
+
+	if (source < 1 || source > sources.size())
+	{
+		std::cerr << "received packet from unknown source " << source << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// skip the packets of this source that were dropped, the received one must be among the following ones
+	std::deque<Packet>& packets(sources[source - 1].packets);
+	while (!packets.empty() && (packets.front().size() != length || memcmp(&packets.front()[0], data, length) != 0))
+		packets.pop_front();
+	if (packets.empty())
+	{
+		std::cerr << "received a packet of " << length << " bytes from source " << source << " that was not sent" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	packets.pop_front();
+	++receivedCount;
+	return true;
+}
+
+//! Put the frames of all sources randomly interleaved on the bus, reading a packet every readPeriod frames, and return the number of packets received
+static unsigned transmit(std::vector<Source>& sources, size_t recvQueueSize, unsigned readPeriod)
+{
+	static std::vector<CanFrame> sendQueue(64);
+	std::vector<CanFrame> recvQueue(recvQueueSize);
+	unsigned receivedCount(0);
+	unsigned frameCount(0);
+
+	AsebaCanInit(0, sendFrame, isFrameRoom, receivedPacketDropped, sentPacketDropped, &sendQueue[0], sendQueue.size(), &recvQueue[0], recvQueue.size());
+	droppedCount = 0;
+
+	while (true)
+	{
+		std::vector<Source*> sending;
+		for (size_t s = 0; s < sources.size(); ++s)
+			if (!sources[s].frames.empty())
+				sending.push_back(&sources[s]);
+		if (sending.empty())
+			break;
+
+		Source* source(sending[rand() % sending.size()]);
+		AsebaCanFrameReceived(&source->frames.front());
+		source->frames.pop_front();
+
+		if (++frameCount % readPeriod == 0)
+			receivePacket(sources, receivedCount);
+	}
+	while (receivePacket(sources, receivedCount));
+
+	if (!AsebaCanRecvBufferEmpty())
+	{
+		std::cerr << "reception queue is not empty once all packets have been read" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	return receivedCount;
+}
+
+static unsigned sentCount(const std::vector<Source>& sources)
+{
+	unsigned count(0);
+	for (size_t s = 0; s < sources.size(); ++s)
+		count += sources[s].packets.size();
+	return count;
+}
+
+int main()
+{
+	const unsigned sourcesCount(24);
+	const unsigned packetsCount(50);
+	const size_t maxSize(300);
+
+	// with a large enough queue, every packet must be received
+	{
+		std::vector<Source> sources(createSources(sourcesCount, packetsCount, maxSize));
+		const unsigned sent(sentCount(sources));
+		const unsigned received(transmit(sources, 2048, 2));
+		std::cout << "large queue: received " << received << " of " << sent << " packets" << std::endl;
+		if (received != sent || droppedCount != 0)
+		{
+			std::cerr << "packets were lost with a large queue, " << droppedCount << " reported dropped" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// with a small queue read slowly, packets are dropped, but each is either received intact or reported
+	{
+		std::vector<Source> sources(createSources(sourcesCount, packetsCount, maxSize));
+		const unsigned sent(sentCount(sources));
+		const unsigned received(transmit(sources, 128, 16));
+		std::cout << "small queue: received " << received << " of " << sent << " packets, " << droppedCount << " dropped" << std::endl;
+		if (droppedCount == 0 || received + droppedCount != sent)
+		{
+			std::cerr << "received and dropped packets do not add up to sent packets" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// packets filtered by the glue are neither received nor reported dropped
+	{
+		std::vector<Source> sources(createSources(sourcesCount, packetsCount, maxSize));
+		const unsigned sent(sentCount(sources));
+		const unsigned filtered(sources[6].packets.size());
+		filteredSource = sources[6].id;
+		const unsigned received(transmit(sources, 2048, 2));
+		filteredSource = -1;
+		if (received != sent - filtered || droppedCount != 0 || sources[6].packets.size() != filtered)
+		{
+			std::cerr << "filtering: received " << received << " of " << sent - filtered << " packets, " << droppedCount << " reported dropped" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// a packet whose stop was lost is dropped when the next packet of the same source starts
+	{
+		std::vector<Source> sources(createSources(1, 2, maxSize));
+		while (sources[0].packets.front().size() <= 8 || sources[0].packets.back().size() <= 8)
+			sources = createSources(1, 2, maxSize);
+		std::deque<CanFrame>& frames(sources[0].frames);
+		const size_t firstPacketFrames((sources[0].packets.front().size() + 7) / 8);
+		frames.erase(frames.begin() + firstPacketFrames - 1);
+		const unsigned received(transmit(sources, 2048, 1));
+		if (received != 1 || droppedCount != 1)
+		{
+			std::cerr << "lost stop: received " << received << " packets instead of 1, " << droppedCount << " reported dropped instead of 1" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
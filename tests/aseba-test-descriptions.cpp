@@ -0,0 +1,524 @@
+// Aseba
+#include "../common/msg/msg.h"
+#include "../common/msg/descriptions-manager.h"
+#include "../common/consts.h"
+#include "../common/utils/utils.h"
+#include "../compiler/compiler.h"
+#include "../vm/vm.h"
+#include "../vm/natives.h"
+#include "../transport/buffer/vm-buffer.h"
+using namespace Aseba;
+
+// Dashel
+#include <dashel/dashel.h>
+
+// C++
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+// C
+#include <stdlib.h>		// exit(), malloc()
+#include <string.h>		// memcpy()
+#include <stdio.h>		// remove()
+
+/*
+	Check the discovery of nodes: nodes announce themselves with a hash of their
+	description, a client requests the full description once per distinct hash,
+	and the packed description it receives is identical to the one of the node.
+	Three nodes are simulated, two of them with the same description, and the
+	messages they send through vm-buffer are received by a simulated client.
+	Descriptions stored on disk must spare later clients the full transfer,
+	unless they are corrupted.
+*/
+
+//! A stream that keeps what is written, to read it back
+class MemoryStream: public Dashel::Stream
+{
+public:
+	std::vector<uint8> data;
+	size_t readPos;
+
+public:
+	MemoryStream() : Stream("memory"), readPos(0) { }
+
+	virtual void write(const void *data, const size_t size)
+	{
+		const uint8 *ptr(reinterpret_cast<const uint8 *>(data));
+		this->data.insert(this->data.end(), ptr, ptr + size);
+	}
+
+	virtual void flush() { }
+
+	virtual void read(void *data, size_t size)
+	{
+		if (readPos + size > this->data.size())
+		{
+			std::cerr << "MemoryStream::read() : fatal error: reading past the end of stream" << std::endl;
+			abort();
+		}
+		memcpy(data, &this->data[readPos], size);
+		readPos += size;
+	}
+
+	bool atEnd() const { return readPos == data.size(); }
+};
+
+static MemoryStream sentMessages;
+
+//! A simulated node, with the storage of its VM
+struct SimulatedNode
+{
+	AsebaVMState vm;
+	std::vector<uint16> bytecode;
+	std::vector<sint16> variables;
+	std::vector<sint16> stack;
+	AsebaVMDescription* description;
+
+	SimulatedNode(uint16 nodeId, AsebaVMDescription* description) :
+		bytecode(256),
+		variables(400),
+		stack(32),
+		description(description)
+	{
+		vm.nodeId = nodeId;
+		vm.bytecode = &bytecode[0];
+		vm.bytecodeSize = bytecode.size();
+		vm.predecoded = 0;
+		vm.eventIndex = 0;
+		vm.eventIndexSize = 0;
+		vm.stack = &stack[0];
+		vm.stackSize = stack.size();
+		vm.variables = &variables[0];
+		vm.variablesSize = variables.size();
+		vm.variablesShadow = 0;
+		AsebaVMInit(&vm);
+	}
+};
+
+static std::vector<SimulatedNode*> nodes;
+
+static const AsebaLocalEventDescription localEvents[] = {
+	{ "button.forward", "forward button status changed" },
+	{ "button.backward", "backward button status changed" },
+	{ "prox", "proximity sensors updated" },
+	{ "tap", "shock detected" },
+	{ NULL, NULL }
+};
+
+static const AsebaNativeFunctionDescription* nativeFunctionsDescriptions[] = {
+	ASEBA_NATIVES_STD_DESCRIPTIONS,
+	0
+};
+
+//! Create the description of a node with the given name and number of named variables
+static AsebaVMDescription* createDescription(const char* name, unsigned variablesCount)
+{
+	static std::vector<std::string> variablesNames;
+	if (variablesNames.size() < variablesCount)
+	{
+		variablesNames.reserve(variablesCount);
+		for (unsigned i = variablesNames.size(); i < variablesCount; ++i)
+		{
+			std::ostringstream oss;
+			oss << "sensors.variable" << i;
+			variablesNames.push_back(oss.str());
+		}
+	}
+
+	AsebaVMDescription* description(static_cast<AsebaVMDescription*>(malloc(sizeof(AsebaVMDescription) + (variablesCount + 1) * sizeof(AsebaVariableDescription))));
+	description->name = name;
+	for (unsigned i = 0; i < variablesCount; ++i)
+	{
+		description->variables[i].size = 1 + i % 4;
+		description->variables[i].name = variablesNames[i].c_str();
+	}
+	description->variables[variablesCount].size = 0;
+	description->variables[variablesCount].name = NULL;
+	return description;
+}
+
+// glue of the nodes
+
+extern "C" void AsebaSendBuffer(AsebaVMState *vm, const uint8* data, uint16 length)
+{
+	if (length > ASEBA_MAX_INNER_PACKET_SIZE)
+	{
+		std::cerr << "node " << vm->nodeId << " sent a message of " << length << " bytes, larger than the maximum of " << ASEBA_MAX_INNER_PACKET_SIZE << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	uint16 temp;
+	temp = bswap16(length - 2);
+	sentMessages.write(&temp, 2);
+	temp = bswap16(vm->nodeId);
+	sentMessages.write(&temp, 2);
+	sentMessages.write(data, length);
+}
+
+extern "C" uint16 AsebaGetBuffer(AsebaVMState *vm, uint8* data, uint16 maxLength, uint16* source)
+{
+	return 0;
+}
+
+extern "C" const AsebaVMDescription* AsebaGetVMDescription(AsebaVMState *vm)
+{
+	for (size_t i = 0; i < nodes.size(); ++i)
+		if (&nodes[i]->vm == vm)
+			return nodes[i]->description;
+	return 0;
+}
+
+extern "C" const AsebaLocalEventDescription * AsebaGetLocalEventsDescriptions(AsebaVMState *vm)
+{
+	return localEvents;
+}
+
+extern "C" const AsebaNativeFunctionDescription * const * AsebaGetNativeFunctionsDescriptions(AsebaVMState *vm)
+{
+	return nativeFunctionsDescriptions;
+}
+
+extern "C" void AsebaNativeFunction(AsebaVMState *vm, uint16 id)
+{
+}
+
+extern "C" void AsebaWriteBytecode(AsebaVMState *vm)
+{
+}
+
+extern "C" void AsebaResetIntoBootloader(AsebaVMState *vm)
+{
+}
+
+extern "C" void AsebaPutVmToSleep(AsebaVMState *vm)
+{
+}
+
+extern "C" void AsebaAssert(AsebaVMState *vm, AsebaAssertReason reason)
+{
+	std::cerr << "Internal VM exception " << reason << " at pc = " << vm->pc << ", sp = " << vm->sp << std::endl;
+	exit(EXIT_FAILURE);
+}
+
+//! Broadcast a GetDescription message to all nodes
+static void broadcastPresence()
+{
+	uint16 data[] = { bswap16(ASEBA_PROTOCOL_VERSION) };
+	for (size_t i = 0; i < nodes.size(); ++i)
+		AsebaVMDebugMessage(&nodes[i]->vm, ASEBA_MESSAGE_GET_DESCRIPTION, data, 1);
+}
+
+//! A client that builds the descriptions of the nodes, and records what it requests and receives
+struct SimulatedClient: public DescriptionsManager
+{
+	std::vector<unsigned> pendingRequests;
+	std::vector<unsigned> requestedNodes;
+	std::vector<unsigned> receivedNodes;
+	std::map<unsigned, uint16> announcedCrcs;
+	unsigned descriptionMessagesCount;
+	unsigned descriptionEntriesCount;
+
+	SimulatedClient() : descriptionMessagesCount(0), descriptionEntriesCount(0) { }
+
+	//! Process the messages sent by the nodes since last time
+	void receive()
+	{
+		while (!sentMessages.atEnd())
+		{
+			Message* message(Message::receive(&sentMessages));
+			const DescriptionHash* hash(dynamic_cast<const DescriptionHash*>(message));
+			if (hash)
+				announcedCrcs[hash->source] = hash->crc;
+			const PackedDescription* packed(dynamic_cast<const PackedDescription*>(message));
+			if (packed)
+			{
+				++descriptionMessagesCount;
+				descriptionEntriesCount += packed->namedVariables.size() + packed->localEvents.size() + packed->nativeFunctions.size();
+			}
+			processMessage(message);
+			delete message;
+		}
+		sentMessages.data.clear();
+		sentMessages.readPos = 0;
+	}
+
+	//! Send the requested GetNodeDescription messages to the nodes, and process their answers, until there are no more requests
+	void serve()
+	{
+		receive();
+		while (!pendingRequests.empty())
+		{
+			const uint16 nodeId(pendingRequests.front());
+			pendingRequests.erase(pendingRequests.begin());
+			uint16 data[] = { bswap16(nodeId) };
+			for (size_t i = 0; i < nodes.size(); ++i)
+				AsebaVMDebugMessage(&nodes[i]->vm, ASEBA_MESSAGE_GET_NODE_DESCRIPTION, data, 1);
+			receive();
+		}
+	}
+
+	virtual void requestNodeDescription(unsigned nodeId)
+	{
+		pendingRequests.push_back(nodeId);
+		requestedNodes.push_back(nodeId);
+	}
+
+	virtual void nodeDescriptionReceived(unsigned nodeId)
+	{
+		receivedNodes.push_back(nodeId);
+	}
+
+	//! Return the name of the file of the disk cache for the description announced by a node
+	std::string diskCacheFileName(unsigned nodeId) const
+	{
+		const TargetDescription* description(getDescription(nodeId));
+		return DescriptionsManager::diskCacheFileName(DescriptionKey(description->name, announcedCrcs.find(nodeId)->second));
+	}
+};
+
+//! Return whether the client has the description of a node, as the node describes itself
+static bool checkDescription(const SimulatedClient& client, const SimulatedNode& node)
+{
+	const TargetDescription* description(client.getDescription(node.vm.nodeId));
+	if (!description)
+	{
+		std::cerr << "no description for node " << node.vm.nodeId << std::endl;
+		return false;
+	}
+
+	bool ok(true);
+	ok = ok && description->name == UTF8ToWString(node.description->name);
+	ok = ok && description->protocolVersion == ASEBA_PROTOCOL_VERSION;
+	ok = ok && description->bytecodeSize == node.vm.bytecodeSize;
+	ok = ok && description->variablesSize == node.vm.variablesSize;
+	ok = ok && description->stackSize == node.vm.stackSize;
+
+	size_t i;
+	for (i = 0; ok && node.description->variables[i].size; ++i)
+	{
+		ok = ok && i < description->namedVariables.size();
+		ok = ok && description->namedVariables[i].size == node.description->variables[i].size;
+		ok = ok && description->namedVariables[i].name == UTF8ToWString(node.description->variables[i].name);
+	}
+	ok = ok && i == description->namedVariables.size();
+
+	for (i = 0; ok && localEvents[i].name; ++i)
+	{
+		ok = ok && i < description->localEvents.size();
+		ok = ok && description->localEvents[i].name == UTF8ToWString(localEvents[i].name);
+		ok = ok && description->localEvents[i].description == UTF8ToWString(localEvents[i].doc);
+	}
+	ok = ok && i == description->localEvents.size();
+
+	for (i = 0; ok && nativeFunctionsDescriptions[i]; ++i)
+	{
+		const AsebaNativeFunctionDescription* function(nativeFunctionsDescriptions[i]);
+		ok = ok && i < description->nativeFunctions.size();
+		ok = ok && description->nativeFunctions[i].name == UTF8ToWString(function->name);
+		ok = ok && description->nativeFunctions[i].description == UTF8ToWString(function->doc);
+		size_t j;
+		for (j = 0; ok && function->arguments[j].size; ++j)
+		{
+			ok = ok && j < description->nativeFunctions[i].parameters.size();
+			ok = ok && description->nativeFunctions[i].parameters[j].size == function->arguments[j].size;
+			ok = ok && description->nativeFunctions[i].parameters[j].name == UTF8ToWString(function->arguments[j].name);
+		}
+		ok = ok && j == description->nativeFunctions[i].parameters.size();
+	}
+	ok = ok && i == description->nativeFunctions.size();
+
+	if (!ok)
+	{
+		std::cerr << "the description of node " << node.vm.nodeId << " differs from the one of the node" << std::endl;
+		return false;
+	}
+
+	// the hash the node computes must be the one clients compute
+	std::map<unsigned, uint16>::const_iterator crc(client.announcedCrcs.find(node.vm.nodeId));
+	if (crc == client.announcedCrcs.end() || crc->second != description->crc())
+	{
+		std::cerr << "node " << node.vm.nodeId << " did not announce the CRC of its description " << description->crc() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+//! Return whether the list of nodes is the expected one, in any order
+static bool checkNodes(std::vector<unsigned> nodesIds, std::vector<unsigned> expectedIds, const char* context)
+{
+	std::sort(nodesIds.begin(), nodesIds.end());
+	std::sort(expectedIds.begin(), expectedIds.end());
+	if (nodesIds != expectedIds)
+	{
+		std::cerr << context << ": got nodes";
+		for (size_t i = 0; i < nodesIds.size(); ++i)
+			std::cerr << " " << nodesIds[i];
+		std::cerr << " instead of";
+		for (size_t i = 0; i < expectedIds.size(); ++i)
+			std::cerr << " " << expectedIds[i];
+		std::cerr << std::endl;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	// nodes 1 and 2 share their description, node 3 has another one
+	AsebaVMDescription* commonDescription(createDescription("test-node", 80));
+	AsebaVMDescription* otherDescription(createDescription("other-node", 5));
+	nodes.push_back(new SimulatedNode(1, commonDescription));
+	nodes.push_back(new SimulatedNode(2, commonDescription));
+	nodes.push_back(new SimulatedNode(3, otherDescription));
+	std::vector<unsigned> allIds;
+	allIds.push_back(1);
+	allIds.push_back(2);
+	allIds.push_back(3);
+	std::vector<unsigned> distinctIds;
+	distinctIds.push_back(1);
+	distinctIds.push_back(3);
+
+	// a new client only requests one full description per distinct description
+	{
+		SimulatedClient client;
+		broadcastPresence();
+		client.serve();
+		if (!checkNodes(client.requestedNodes, distinctIds, "first discovery, requested"))
+			return EXIT_FAILURE;
+		if (!checkNodes(client.receivedNodes, allIds, "first discovery, received"))
+			return EXIT_FAILURE;
+		for (size_t i = 0; i < nodes.size(); ++i)
+			if (!checkDescription(client, *nodes[i]))
+				return EXIT_FAILURE;
+
+		std::cout << "received " << client.descriptionEntriesCount << " description entries in " << client.descriptionMessagesCount << " messages" << std::endl;
+		if (client.descriptionMessagesCount >= client.descriptionEntriesCount)
+		{
+			std::cerr << "the description entries are not packed" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		// after a reconnection, the descriptions are known and none is requested
+		client.reset();
+		client.requestedNodes.clear();
+		client.receivedNodes.clear();
+		broadcastPresence();
+		client.serve();
+		if (!checkNodes(client.requestedNodes, std::vector<unsigned>(), "rediscovery, requested"))
+			return EXIT_FAILURE;
+		if (!checkNodes(client.receivedNodes, allIds, "rediscovery, received"))
+			return EXIT_FAILURE;
+		for (size_t i = 0; i < nodes.size(); ++i)
+			if (!checkDescription(client, *nodes[i]))
+				return EXIT_FAILURE;
+	}
+
+	// if the node sending a shared description disconnects, it is requested from another one
+	{
+		SimulatedClient client;
+		broadcastPresence();
+		client.receive();
+		if (!checkNodes(client.requestedNodes, distinctIds, "disconnection, requested"))
+			return EXIT_FAILURE;
+
+		// node 1 disconnects before answering
+		client.pendingRequests.erase(std::find(client.pendingRequests.begin(), client.pendingRequests.end(), 1u));
+		Disconnected disconnected;
+		disconnected.source = 1;
+		client.processMessage(&disconnected);
+		client.serve();
+
+		std::vector<unsigned> expectedRequestedIds(distinctIds);
+		expectedRequestedIds.push_back(2);
+		if (!checkNodes(client.requestedNodes, expectedRequestedIds, "disconnection, requested after"))
+			return EXIT_FAILURE;
+		std::vector<unsigned> expectedReceivedIds;
+		expectedReceivedIds.push_back(2);
+		expectedReceivedIds.push_back(3);
+		if (!checkNodes(client.receivedNodes, expectedReceivedIds, "disconnection, received"))
+			return EXIT_FAILURE;
+		if (!checkDescription(client, *nodes[1]) || !checkDescription(client, *nodes[2]))
+			return EXIT_FAILURE;
+	}
+
+	// descriptions stored on disk are reused by a later client, and a corrupted file is replaced
+	{
+		std::vector<std::string> fileNames;
+		{
+			SimulatedClient client;
+			client.setDiskCache(".");
+			broadcastPresence();
+			client.serve();
+			if (!checkNodes(client.requestedNodes, distinctIds, "disk cache, first run, requested"))
+				return EXIT_FAILURE;
+			fileNames.push_back(client.diskCacheFileName(1));
+			fileNames.push_back(client.diskCacheFileName(3));
+		}
+		{
+			SimulatedClient client;
+			client.setDiskCache(".");
+			broadcastPresence();
+			client.serve();
+			if (!checkNodes(client.requestedNodes, std::vector<unsigned>(), "disk cache, second run, requested"))
+				return EXIT_FAILURE;
+			if (!checkNodes(client.receivedNodes, allIds, "disk cache, second run, received"))
+				return EXIT_FAILURE;
+			for (size_t i = 0; i < nodes.size(); ++i)
+				if (!checkDescription(client, *nodes[i]))
+					return EXIT_FAILURE;
+		}
+		{
+			// truncate the file of node 3
+			{
+				std::ofstream file(fileNames[1].c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+				file << "bad";
+			}
+			SimulatedClient client;
+			client.setDiskCache(".");
+			broadcastPresence();
+			client.serve();
+			if (!checkNodes(client.requestedNodes, std::vector<unsigned>(1, 3), "disk cache, corrupted file, requested"))
+				return EXIT_FAILURE;
+			for (size_t i = 0; i < nodes.size(); ++i)
+				if (!checkDescription(client, *nodes[i]))
+					return EXIT_FAILURE;
+		}
+		{
+			SimulatedClient client;
+			client.setDiskCache(".");
+			broadcastPresence();
+			client.serve();
+			if (!checkNodes(client.requestedNodes, std::vector<unsigned>(), "disk cache, replaced file, requested"))
+				return EXIT_FAILURE;
+		}
+		{
+			// change the bytecode size in the file of node 1, the file is well-formed but does not match its CRC
+			{
+				std::fstream file(fileNames[0].c_str(), std::ios::in | std::ios::out | std::ios::binary);
+				file.seekp(8 + strlen(nodes[0]->description->name));
+				file.put(char(0xff));
+			}
+			SimulatedClient client;
+			client.setDiskCache(".");
+			broadcastPresence();
+			client.serve();
+			if (!checkNodes(client.requestedNodes, std::vector<unsigned>(1, 1), "disk cache, wrong CRC, requested"))
+				return EXIT_FAILURE;
+			for (size_t i = 0; i < nodes.size(); ++i)
+				if (!checkDescription(client, *nodes[i]))
+					return EXIT_FAILURE;
+		}
+		for (size_t i = 0; i < fileNames.size(); ++i)
+			remove(fileNames[i].c_str());
+	}
+
+	for (size_t i = 0; i < nodes.size(); ++i)
+		delete nodes[i];
+	free(commonDescription);
+	free(otherDescription);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,219 @@
+// Aseba
+#include "../clients/multiflash/FlashOrchestrator.h"
+#include "../common/msg/msg.h"
+#include "../common/utils/utils.h"
+#include "../common/utils/FormatableString.h"
+using namespace Aseba;
+
+// Dashel
+#include <dashel/dashel.h>
+using namespace Dashel;
+
+// C++
+#include <vector>
+#include <map>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <iostream>
+
+// C
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+	Check that FlashOrchestrator restarts or gives up on nodes that stop
+	answering with the simple protocol, for which each session reads its
+	connection itself. A fake bootloader listens on a local TCP port, and
+	behaves on each new connection as told: it stays silent, it stalls in
+	the middle of a page it sends back, or it answers like a real bootloader.
+	The hex file to write is given as argument.
+*/
+
+//! How the fake bootloader behaves on a connection
+enum Behaviour
+{
+	SILENT,
+	STALLING,
+	ANSWERING
+};
+
+//! A bootloader of the simple protocol, running in its own thread
+class FakeBootloader: public Hub
+{
+public:
+	FakeBootloader(unsigned port, const std::vector<Behaviour>& behaviours) :
+		behaviours(behaviours),
+		connectionsCount(0),
+		pagesWritten(0),
+		stopRequested(false),
+		running(false)
+	{
+		connect(FormatableString("tcpin:port=%0").arg(port));
+		pthread_mutex_init(&mutex, NULL);
+		pthread_create(&thread, NULL, threadMain, this);
+		running = true;
+	}
+
+	virtual ~FakeBootloader()
+	{
+		stop();
+		pthread_mutex_destroy(&mutex);
+	}
+
+	//! Stop the thread, after which the counts can be read
+	void stop()
+	{
+		if (!running)
+			return;
+		pthread_mutex_lock(&mutex);
+		stopRequested = true;
+		pthread_mutex_unlock(&mutex);
+		pthread_join(thread, NULL);
+		running = false;
+	}
+
+	//! Behaviour on each new connection, the last one being kept for the following connections
+	const std::vector<Behaviour> behaviours;
+	unsigned connectionsCount;
+	unsigned pagesWritten;
+
+protected:
+	virtual void connectionCreated(Stream *stream)
+	{
+		streamBehaviours[stream] = behaviours[std::min<size_t>(connectionsCount, behaviours.size() - 1)];
+		++connectionsCount;
+	}
+
+	virtual void incomingData(Stream *stream)
+	{
+		std::auto_ptr<Message> message(Message::receive(stream));
+		const Behaviour behaviour(streamBehaviours[stream]);
+
+		// the data of a page follows its write command
+		BootloaderWritePage* writePage(dynamic_cast<BootloaderWritePage*>(message.get()));
+		if (writePage)
+		{
+			std::vector<uint8> page(2048);
+			stream->read(&page[0], page.size());
+			if (behaviour == ANSWERING)
+			{
+				++pagesWritten;
+				BootloaderAck ack;
+				ack.source = writePage->dest;
+				ack.errorCode = BootloaderAck::SUCCESS;
+				ack.errorAddress = 0;
+				ack.serialize(stream);
+				stream->flush();
+			}
+		}
+
+		// a stalling bootloader sends back only the beginning of the page
+		BootloaderReadPage* readPage(dynamic_cast<BootloaderReadPage*>(message.get()));
+		if (readPage && behaviour != SILENT)
+		{
+			const std::vector<uint8> page(behaviour == ANSWERING ? 2048 : 100, 0);
+			stream->write(&page[0], page.size());
+			stream->flush();
+		}
+	}
+
+	static void* threadMain(void* bootloader)
+	{
+		FakeBootloader* that(static_cast<FakeBootloader*>(bootloader));
+		while (true)
+		{
+			pthread_mutex_lock(&that->mutex);
+			const bool stop(that->stopRequested);
+			pthread_mutex_unlock(&that->mutex);
+			if (stop)
+				break;
+			that->step(10);
+		}
+		return NULL;
+	}
+
+protected:
+	std::map<Stream*, Behaviour> streamBehaviours;
+	pthread_mutex_t mutex; //!< protects stopRequested
+	bool stopRequested;
+	bool running;
+	pthread_t thread;
+};
+
+//! Flash node 1 through a fake bootloader behaving as told on each connection, check the outcome and return whether it is as expected
+static bool checkFlash(const std::string& hexFileName, unsigned port, const std::vector<Behaviour>& behaviours, bool skipUnchangedPages, bool expectedSuccess, unsigned expectedAttempts)
+{
+	const unsigned timeout(200);
+	const unsigned attempts(3);
+
+	FakeBootloader bootloader(port, behaviours);
+	FlashOrchestrator orchestrator;
+	orchestrator.setAttempts(attempts);
+	orchestrator.setTimeout(timeout);
+	orchestrator.setSkipUnchangedPages(skipUnchangedPages);
+	orchestrator.addNode(FormatableString("tcp:host=localhost;port=%0").arg(port), 1);
+
+	const UnifiedTime start;
+	const bool success(orchestrator.run(hexFileName, true, true));
+	const UnifiedTime::Value duration((UnifiedTime() - start).value);
+	const FlashOrchestrator::NodeStatus status(orchestrator.getStatuses()[0]);
+	bootloader.stop();
+
+	std::cout << "port " << port << ": " << (success ? "flashed" : "failed") << " after " << status.attempts << " attempts in " << duration << " ms";
+	if (!status.error.empty())
+		std::cout << ", last error: " << status.error;
+	std::cout << std::endl;
+
+	bool ok(true);
+	if (success != expectedSuccess || status.attempts != expectedAttempts)
+	{
+		std::cerr << "expected to " << (expectedSuccess ? "flash" : "fail") << " after " << expectedAttempts << " attempts" << std::endl;
+		ok = false;
+	}
+	// every attempt on a silent node must end after about the timeout
+	if (duration > attempts * (timeout + 500))
+	{
+		std::cerr << "the sessions did not time out" << std::endl;
+		ok = false;
+	}
+	if (expectedSuccess && (bootloader.pagesWritten != 2 || status.pagesWritten != 2))
+	{
+		std::cerr << "expected 2 pages written, the bootloader got " << bootloader.pagesWritten << " and the orchestrator reports " << status.pagesWritten << std::endl;
+		ok = false;
+	}
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		std::cerr << "usage: " << argv[0] << " hexfile" << std::endl;
+		return EXIT_FAILURE;
+	}
+	const std::string hexFileName(argv[1]);
+
+	bool ok(true);
+	try
+	{
+		// a node that never answers is given up after all attempts
+		std::vector<Behaviour> behaviours(1, SILENT);
+		ok = checkFlash(hexFileName, 33341, behaviours, false, false, 3) && ok;
+
+		// a node that answers again is flashed by the next attempt
+		behaviours.push_back(ANSWERING);
+		ok = checkFlash(hexFileName, 33342, behaviours, false, true, 2) && ok;
+
+		// so is a node stalling in the middle of a page it sends back
+		behaviours[0] = STALLING;
+		ok = checkFlash(hexFileName, 33343, behaviours, true, true, 2) && ok;
+	}
+	catch (const DashelException& e)
+	{
+		std::cerr << "cannot set up the fake bootloader: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,153 @@
+// Aseba
+#include "../common/types.h"
+#include "../transport/dashel_plugins/dashel-plugins.h"
+
+// Dashel
+#include <dashel/dashel.h>
+using namespace Dashel;
+
+// C++
+#include <vector>
+#include <deque>
+#include <string>
+#include <iostream>
+
+// C
+#include <stdlib.h>		// atof()
+#include <sys/time.h>	// gettimeofday()
+
+/*
+	Check the socketcan Dashel plugin on a virtual CAN interface, given as
+	argument (default: vcan0), which must exist and be up:
+		ip link add dev vcan0 type vcan
+		ip link set up vcan0
+	Bursts of packets of various sizes and sources are written to one stream
+	and must be read back intact and in order from another one, with kernel
+	timestamps that do not go backwards and no frame dropped by the kernel.
+	If the interface is not available, the test is skipped.
+*/
+
+//! A packet as written to and read from Dashel streams
+struct Packet
+{
+	uint16 source;
+	uint16 type;
+	std::vector<uint8> payload;
+};
+
+//! Current time in seconds since the epoch
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+//! A hub checking the packets it receives against those written
+class Receiver: public Hub
+{
+public:
+	std::deque<Packet> expected;
+	unsigned receivedCount;
+	double lastTimestamp;
+	bool failed;
+
+	Receiver() : receivedCount(0), lastTimestamp(0), failed(false) {}
+
+protected:
+	virtual void incomingData(Stream *stream)
+	{
+		uint16 header[3];
+		stream->read(header, sizeof(header));
+		std::vector<uint8> payload(header[0]);
+		if (!payload.empty())
+			stream->read(&payload[0], payload.size());
+
+		if (expected.empty())
+		{
+			std::cerr << "received an unexpected packet from " << header[1] << std::endl;
+			failed = true;
+			return;
+		}
+		const Packet& packet(expected.front());
+		if (header[1] != packet.source || header[2] != packet.type || payload != packet.payload)
+		{
+			std::cerr << "packet " << receivedCount << " differs from the one written" << std::endl;
+			failed = true;
+		}
+		expected.pop_front();
+		++receivedCount;
+
+		const double timestamp(atof(stream->getTargetParameter("timestamp").c_str()));
+		if (timestamp < lastTimestamp || timestamp > now() || timestamp < now() - 10)
+		{
+			std::cerr << "packet " << receivedCount << " has timestamp " << timestamp << " after " << lastTimestamp << std::endl;
+			failed = true;
+		}
+		lastTimestamp = timestamp;
+	}
+};
+
+//! Write a packet to a stream, remembering it as expected by the receiver
+static void writePacket(Stream* stream, Receiver& receiver, uint16 source, uint16 type, size_t size)
+{
+	Packet packet;
+	packet.source = source;
+	packet.type = type;
+	for (size_t i = 0; i < size; ++i)
+		packet.payload.push_back(uint8(source + type + i));
+	receiver.expected.push_back(packet);
+
+	const uint16 header[3] = { uint16(size), source, type };
+	stream->write(header, sizeof(header));
+	if (size)
+		stream->write(&packet.payload[0], size);
+	stream->flush();
+}
+
+int main(int argc, char** argv)
+{
+	const std::string interfaceName(argc > 1 ? argv[1] : "vcan0");
+	const unsigned burstsCount(100);
+	const unsigned burstSize(20);
+
+	initPlugins();
+	Receiver receiver;
+	Stream* sender;
+	Stream* reader;
+	try
+	{
+		sender = receiver.connect("can:if=" + interfaceName);
+		reader = receiver.connect("can:if=" + interfaceName);
+	}
+	catch (const DashelException& e)
+	{
+		std::cout << "cannot open CAN interface " << interfaceName << ", skipping test: " << e.what() << std::endl;
+		return EXIT_SUCCESS;
+	}
+
+	// bursts of packets from many sources, from small ones to ones spanning many frames
+	for (unsigned burst = 0; burst < burstsCount && !receiver.failed; ++burst)
+	{
+		for (unsigned i = 0; i < burstSize; ++i)
+			writePacket(sender, receiver, 1 + (burst + i) % 20, burst * burstSize + i, (burst * 7 + i * 13) % 200);
+
+		const double deadline(now() + 2);
+		while (!receiver.expected.empty() && !receiver.failed && now() < deadline)
+			receiver.step(10);
+		if (!receiver.expected.empty())
+		{
+			std::cerr << "burst " << burst << ": " << receiver.expected.size() << " packets not received" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	if (receiver.failed)
+		return EXIT_FAILURE;
+
+	const std::string dropped(reader->getTargetParameter("dropped"));
+	std::cout << "received " << receiver.receivedCount << " packets, " << dropped << " frames dropped by the kernel" << std::endl;
+	if (dropped != "0")
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
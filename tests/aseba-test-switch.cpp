@@ -0,0 +1,573 @@
+// Aseba
+#include "../switches/switch/switch.h"
+#include "../common/msg/msg.h"
+#include "../common/consts.h"
+#include "../common/utils/utils.h"
+#include "../common/utils/FormatableString.h"
+using namespace Aseba;
+
+// Dashel
+#include <dashel/dashel.h>
+using namespace Dashel;
+
+// C++
+#include <vector>
+#include <memory>
+#include <string>
+#include <iostream>
+#include <algorithm>
+
+// C
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/*
+	Check that a slow or stalled peer of the switch does not hold back the others.
+
+	First, the writers of two connections are fed the same messages while the
+	stream of one of them is stalled. The other stream receives every message
+	as it comes. The stalled writer drops the user messages beyond the capacity
+	of its queue as its policy says, keeps all bootloader and command messages,
+	counts the drops in its statistics, and writes the messages queued meanwhile
+	in one batch, followed by a single flush, once its stream moves again.
+
+	Then a switch runs on a local TCP port with writer threads. A peer that
+	does not read does not prevent another one from receiving every message,
+	and once it reads again, it gets all command and bootloader messages and
+	the most recent user messages. Last, without writer threads, messages
+	written during a step of the switch must be flushed at its end.
+*/
+
+//! A stream that keeps what is written, to read it back
+class MemoryStream: public Stream
+{
+public:
+	std::vector<uint8> data;
+	size_t readPos;
+
+public:
+	MemoryStream() : Stream("memory"), readPos(0) { }
+
+	virtual void write(const void *data, const size_t size)
+	{
+		const uint8 *ptr(reinterpret_cast<const uint8 *>(data));
+		this->data.insert(this->data.end(), ptr, ptr + size);
+	}
+
+	virtual void flush() { }
+
+	virtual void read(void *data, size_t size)
+	{
+		if (readPos + size > this->data.size())
+		{
+			std::cerr << "MemoryStream::read() : fatal error: reading past the end of stream" << std::endl;
+			abort();
+		}
+		memcpy(data, &this->data[readPos], size);
+		readPos += size;
+	}
+
+	bool atEnd() const { return readPos == data.size(); }
+};
+
+//! A stream that keeps what is written and counts flushes, and whose writes can be stalled, as if its peer stopped reading
+class StallableStream: public Stream
+{
+public:
+	StallableStream() :
+		Stream("stallable"),
+		stalled(false),
+		blocked(false),
+		flushCount(0)
+	{
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&condition, NULL);
+	}
+
+	virtual ~StallableStream()
+	{
+		pthread_cond_destroy(&condition);
+		pthread_mutex_destroy(&mutex);
+	}
+
+	virtual void write(const void *data, const size_t size)
+	{
+		pthread_mutex_lock(&mutex);
+		while (stalled)
+		{
+			blocked = true;
+			pthread_cond_broadcast(&condition);
+			pthread_cond_wait(&condition, &mutex);
+		}
+		blocked = false;
+		const uint8 *ptr(reinterpret_cast<const uint8 *>(data));
+		written.insert(written.end(), ptr, ptr + size);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	virtual void flush()
+	{
+		pthread_mutex_lock(&mutex);
+		++flushCount;
+		pthread_cond_broadcast(&condition);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	virtual void read(void *data, size_t size)
+	{
+		std::cerr << "StallableStream::read() : fatal error: this stream cannot be read" << std::endl;
+		abort();
+	}
+
+	//! Block writes from now on
+	void stall()
+	{
+		pthread_mutex_lock(&mutex);
+		stalled = true;
+		pthread_mutex_unlock(&mutex);
+	}
+
+	//! Let writes proceed again
+	void release()
+	{
+		pthread_mutex_lock(&mutex);
+		stalled = false;
+		pthread_cond_broadcast(&condition);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	//! Wait until a write is blocked, or until timeout ms have elapsed, return whether it is
+	bool waitBlocked(unsigned timeout)
+	{
+		return wait(timeout, true, 0);
+	}
+
+	//! Wait until count flushes have been done, or until timeout ms have elapsed, return whether they have
+	bool waitFlushes(unsigned count, unsigned timeout)
+	{
+		return wait(timeout, false, count);
+	}
+
+	//! Return the number of flushes done so far
+	unsigned getFlushCount()
+	{
+		pthread_mutex_lock(&mutex);
+		const unsigned count(flushCount);
+		pthread_mutex_unlock(&mutex);
+		return count;
+	}
+
+	//! Return a copy of the data written so far
+	std::vector<uint8> getWritten()
+	{
+		pthread_mutex_lock(&mutex);
+		const std::vector<uint8> data(written);
+		pthread_mutex_unlock(&mutex);
+		return data;
+	}
+
+protected:
+	bool wait(unsigned timeout, bool untilBlocked, unsigned flushes)
+	{
+		const UnifiedTime deadline(UnifiedTime() + UnifiedTime(timeout));
+		pthread_mutex_lock(&mutex);
+		while (untilBlocked ? !blocked : flushCount < flushes)
+		{
+			if (UnifiedTime().value >= deadline.value)
+				break;
+			pthread_mutex_unlock(&mutex);
+			usleep(1000);
+			pthread_mutex_lock(&mutex);
+		}
+		const bool reached(untilBlocked ? blocked : flushCount >= flushes);
+		pthread_mutex_unlock(&mutex);
+		return reached;
+	}
+
+protected:
+	pthread_mutex_t mutex; //!< protects the members below
+	pthread_cond_t condition; //!< signaled when stalled, blocked or flushCount change
+	bool stalled; //!< whether writes must block
+	bool blocked; //!< whether a write is blocked
+	unsigned flushCount; //!< number of flushes
+	std::vector<uint8> written; //!< data written
+};
+
+//! Kind of the index-th message sent by the tests, so that each kind is spread over the whole sequence
+enum Kind
+{
+	USER,
+	COMMAND,
+	BOOTLOADER
+};
+
+static Kind kindOf(unsigned index)
+{
+	if (index % 10 == 0)
+		return COMMAND;
+	else if (index % 10 == 5)
+		return BOOTLOADER;
+	else
+		return USER;
+}
+
+//! Return the index-th message sent by the tests, which carries index, with payloadWords words of data if it is a user message
+static Message* createMessage(unsigned index, size_t payloadWords)
+{
+	switch (kindOf(index))
+	{
+		case COMMAND:
+		return new GetVariables(1, index, 1);
+
+		case BOOTLOADER:
+		{
+			BootloaderReadPage* readPage(new BootloaderReadPage(1));
+			readPage->pageNumber = index;
+			return readPage;
+		}
+
+		default:
+		{
+			UserMessage::DataVector data(payloadWords, 0);
+			data[0] = index;
+			return new UserMessage(1, data);
+		}
+	}
+}
+
+//! Return the index carried by message, or -1 if it is not one of the messages sent by the tests
+static int indexOf(const Message* message)
+{
+	const UserMessage* userMessage(dynamic_cast<const UserMessage*>(message));
+	if (userMessage && !userMessage->data.empty())
+		return uint16(userMessage->data[0]);
+	const GetVariables* getVariables(dynamic_cast<const GetVariables*>(message));
+	if (getVariables)
+		return getVariables->start;
+	const BootloaderReadPage* readPage(dynamic_cast<const BootloaderReadPage*>(message));
+	if (readPage)
+		return readPage->pageNumber;
+	return -1;
+}
+
+//! Return the indexes carried by the messages in data
+static std::vector<int> indexesOf(const std::vector<uint8>& data)
+{
+	MemoryStream stream;
+	stream.data = data;
+	std::vector<int> indexes;
+	while (!stream.atEnd())
+	{
+		std::auto_ptr<Message> message(Message::receive(&stream));
+		indexes.push_back(indexOf(message.get()));
+	}
+	return indexes;
+}
+
+//! Return whether indexes are the expected ones, print both otherwise
+static bool checkIndexes(const std::vector<int>& indexes, const std::vector<int>& expected, const std::string& context)
+{
+	if (indexes == expected)
+		return true;
+	std::cerr << context << ": received messages";
+	for (size_t i = 0; i < indexes.size(); ++i)
+		std::cerr << " " << indexes[i];
+	std::cerr << " instead of";
+	for (size_t i = 0; i < expected.size(); ++i)
+		std::cerr << " " << expected[i];
+	std::cerr << std::endl;
+	return false;
+}
+
+//! Feed the writers of a stalled stream and of a moving one, check their outcome and return whether it is as expected
+static bool checkWriters(ConnectionWriter::DropPolicy dropPolicy)
+{
+	const std::string context(dropPolicy == ConnectionWriter::DROP_OLDEST ? "drop oldest" : "drop newest");
+	const size_t capacity(8);
+	const unsigned messagesCount(40);
+	const unsigned timeout(2000);
+
+	StallableStream stalledStream, movingStream;
+	stalledStream.stall();
+	std::auto_ptr<ConnectionWriter> stalledWriter(new ConnectionWriter(&stalledStream, capacity, dropPolicy));
+	std::auto_ptr<ConnectionWriter> movingWriter(new ConnectionWriter(&movingStream, capacity, dropPolicy));
+
+	// the first message blocks the writer of the stalled stream, the moving stream gets every message as it comes
+	std::vector<int> userIndexes, expectedStalled;
+	for (unsigned i = 0; i < messagesCount; ++i)
+	{
+		std::auto_ptr<Message> message(createMessage(i, 4));
+		MemoryStream stream;
+		message->serialize(&stream);
+		RawMessage rawMessage;
+		rawMessage.receive(&stream);
+
+		stalledWriter->push(rawMessage);
+		movingWriter->push(rawMessage);
+		if (i == 0 && !stalledStream.waitBlocked(timeout))
+		{
+			std::cerr << context << ": the writer of the stalled stream did not write the first message" << std::endl;
+			stalledStream.release();
+			return false;
+		}
+		if (!movingStream.waitFlushes(i + 1, timeout))
+		{
+			std::cerr << context << ": message " << i << " was not flushed to the moving stream while the other one is stalled" << std::endl;
+			stalledStream.release();
+			return false;
+		}
+
+		if (i > 0 && kindOf(i) == USER)
+			userIndexes.push_back(i);
+		else
+			expectedStalled.push_back(i);
+	}
+
+	// the stalled writer dropped the user messages beyond its capacity
+	bool ok(true);
+	const unsigned expectedDropped(userIndexes.size() - capacity);
+	const size_t expectedDepth(messagesCount - 1 - expectedDropped);
+	const ConnectionWriter::Stats stats(stalledWriter->getStats());
+	if (stats.droppedCount != expectedDropped || stats.depth != expectedDepth || stats.maxDepth != expectedDepth || stats.failed)
+	{
+		std::cerr << context << ": got stats depth " << stats.depth << ", max depth " << stats.maxDepth << ", dropped " << stats.droppedCount << (stats.failed ? ", failed" : "");
+		std::cerr << " instead of depth " << expectedDepth << ", max depth " << expectedDepth << ", dropped " << expectedDropped << std::endl;
+		ok = false;
+	}
+	if (movingWriter->getStats().droppedCount != 0)
+	{
+		std::cerr << context << ": the writer of the moving stream dropped messages" << std::endl;
+		ok = false;
+	}
+
+	// once it moves again, the queued messages are written in one batch
+	stalledStream.release();
+	if (!stalledStream.waitFlushes(2, timeout) || stalledStream.getFlushCount() != 2)
+	{
+		std::cerr << context << ": expected the stalled stream to be flushed twice, it was flushed " << stalledStream.getFlushCount() << " times" << std::endl;
+		ok = false;
+	}
+	stalledWriter.reset();
+	movingWriter.reset();
+
+	// it kept the user messages the policy says, and all the others
+	if (dropPolicy == ConnectionWriter::DROP_OLDEST)
+		expectedStalled.insert(expectedStalled.end(), userIndexes.end() - capacity, userIndexes.end());
+	else
+		expectedStalled.insert(expectedStalled.end(), userIndexes.begin(), userIndexes.begin() + capacity);
+	std::sort(expectedStalled.begin(), expectedStalled.end());
+	ok = checkIndexes(indexesOf(stalledStream.getWritten()), expectedStalled, context + ", stalled stream") && ok;
+
+	std::vector<int> expectedMoving;
+	for (unsigned i = 0; i < messagesCount; ++i)
+		expectedMoving.push_back(i);
+	ok = checkIndexes(indexesOf(movingStream.getWritten()), expectedMoving, context + ", moving stream") && ok;
+	if (movingStream.getFlushCount() != messagesCount)
+	{
+		std::cerr << context << ": expected the moving stream to be flushed " << messagesCount << " times, it was flushed " << movingStream.getFlushCount() << " times" << std::endl;
+		ok = false;
+	}
+
+	return ok;
+}
+
+//! A peer of the switch, recording the indexes of the messages it receives
+class Peer: public Hub
+{
+public:
+	Peer(unsigned port)
+	{
+		stream = connect(FormatableString("tcp:host=localhost;port=%0").arg(port));
+	}
+
+	//! Send message to the switch, without flushing
+	void send(Message& message)
+	{
+		message.serialize(stream);
+	}
+
+	void flush()
+	{
+		stream->flush();
+	}
+
+	//! Receive messages until count have been received, or until timeout ms have elapsed, return whether they have
+	bool waitMessages(size_t count, unsigned timeout)
+	{
+		const UnifiedTime deadline(UnifiedTime() + UnifiedTime(timeout));
+		while (indexes.size() < count && UnifiedTime().value < deadline.value)
+			step(10);
+		return indexes.size() >= count;
+	}
+
+	//! Receive messages until the one carrying index has been received last, or until timeout ms have elapsed, return whether it has
+	bool waitIndex(int index, unsigned timeout)
+	{
+		const UnifiedTime deadline(UnifiedTime() + UnifiedTime(timeout));
+		while ((indexes.empty() || indexes.back() != index) && UnifiedTime().value < deadline.value)
+			step(10);
+		return !indexes.empty() && indexes.back() == index;
+	}
+
+	std::vector<int> indexes; //!< indexes of the messages received
+
+protected:
+	virtual void incomingData(Stream *stream)
+	{
+		std::auto_ptr<Message> message(Message::receive(stream));
+		indexes.push_back(indexOf(message.get()));
+	}
+
+protected:
+	Stream* stream; //!< connection to the switch
+};
+
+//! Run aswitch until it is stopped
+static void* runSwitch(void* aswitch)
+{
+	static_cast<Switch*>(aswitch)->run();
+	return NULL;
+}
+
+//! Connect peers to a switch with writer threads, one of which does not read for a while, check what they receive and return whether it is as expected
+static bool checkStalledPeer(unsigned port)
+{
+	const size_t capacity(64);
+	const size_t burstSize(50);
+	// far more than the buffers of the TCP connection of the stalled peer can hold
+	const unsigned messagesCount(32000);
+	const size_t payloadWords(250);
+	const unsigned timeout(5000);
+
+	Switch aswitch(port, false, false, true, false);
+	aswitch.enableWriterThreads(capacity, ConnectionWriter::DROP_OLDEST);
+	pthread_t thread;
+	pthread_create(&thread, NULL, runSwitch, &aswitch);
+
+	bool ok(true);
+	{
+		// the switch accepts connections in order, so it knows the peers once it reads from the sender
+		Peer stalledPeer(port);
+		Peer movingPeer(port);
+		Peer sender(port);
+
+		// the sender sends bursts of messages, each received by the moving peer before the next one, so that its queue never overflows
+		std::vector<int> userIndexes, expectedStalled, expectedMoving;
+		for (unsigned i = 0; i < messagesCount && ok; i += burstSize)
+		{
+			for (unsigned j = i; j < std::min<unsigned>(i + burstSize, messagesCount); ++j)
+			{
+				std::auto_ptr<Message> message(createMessage(j, payloadWords));
+				sender.send(*message);
+				expectedMoving.push_back(j);
+				if (kindOf(j) == USER)
+					userIndexes.push_back(j);
+				else
+					expectedStalled.push_back(j);
+			}
+			sender.flush();
+			if (!movingPeer.waitMessages(expectedMoving.size(), timeout))
+			{
+				std::cerr << "stalled peer: the moving peer received " << movingPeer.indexes.size() << " messages instead of " << expectedMoving.size() << std::endl;
+				ok = false;
+			}
+		}
+		ok = checkIndexes(movingPeer.indexes, expectedMoving, "stalled peer, moving peer") && ok;
+
+		// the stalled peer reads again, until the last message, which the policy keeps
+		if (!stalledPeer.waitIndex(messagesCount - 1, timeout))
+		{
+			std::cerr << "stalled peer: the last message was not received" << std::endl;
+			ok = false;
+		}
+
+		// it got all the command and bootloader messages, and the most recent user messages
+		std::vector<int> stalledOthers, stalledUsers;
+		for (size_t i = 0; i < stalledPeer.indexes.size(); ++i)
+		{
+			const int index(stalledPeer.indexes[i]);
+			if (index >= 0 && kindOf(index) == USER)
+				stalledUsers.push_back(index);
+			else
+				stalledOthers.push_back(index);
+		}
+		ok = checkIndexes(stalledOthers, expectedStalled, "stalled peer, command and bootloader messages") && ok;
+		if (stalledUsers.size() >= userIndexes.size())
+		{
+			std::cerr << "stalled peer: no user message was dropped, the peer was not stalled long enough" << std::endl;
+			ok = false;
+		}
+		if (stalledUsers.size() < capacity || !std::equal(userIndexes.end() - capacity, userIndexes.end(), stalledUsers.end() - capacity))
+		{
+			std::cerr << "stalled peer: the " << capacity << " most recent user messages were not all received" << std::endl;
+			ok = false;
+		}
+		for (size_t i = 1; i < stalledUsers.size(); ++i)
+		{
+			if (stalledUsers[i] <= stalledUsers[i - 1])
+			{
+				std::cerr << "stalled peer: user message " << stalledUsers[i] << " was received after " << stalledUsers[i - 1] << std::endl;
+				ok = false;
+				break;
+			}
+		}
+		std::cout << "stalled peer: received " << stalledUsers.size() << " of " << userIndexes.size() << " user messages" << std::endl;
+	}
+
+	aswitch.stop();
+	pthread_join(thread, NULL);
+	return ok;
+}
+
+//! Connect peers to a switch without writer threads, check that the messages routed during a step are flushed at its end, return whether they are
+static bool checkStepFlush(unsigned port)
+{
+	const unsigned messagesCount(20);
+	const unsigned timeout(2000);
+
+	Switch aswitch(port, false, false, true, false);
+	pthread_t thread;
+	pthread_create(&thread, NULL, runSwitch, &aswitch);
+
+	bool ok(true);
+	{
+		Peer receiver(port);
+		Peer sender(port);
+
+		// a single burst, routed during as few steps of the switch as possible
+		std::vector<int> expected;
+		for (unsigned i = 0; i < messagesCount; ++i)
+		{
+			std::auto_ptr<Message> message(createMessage(i, 4));
+			sender.send(*message);
+			expected.push_back(i);
+		}
+		sender.flush();
+		receiver.waitMessages(messagesCount, timeout);
+		ok = checkIndexes(receiver.indexes, expected, "step flush") && ok;
+	}
+
+	aswitch.stop();
+	pthread_join(thread, NULL);
+	return ok;
+}
+
+int main()
+{
+	bool ok(true);
+	ok = checkWriters(ConnectionWriter::DROP_OLDEST) && ok;
+	ok = checkWriters(ConnectionWriter::DROP_NEWEST) && ok;
+	try
+	{
+		ok = checkStalledPeer(33351) && ok;
+		ok = checkStepFlush(33352) && ok;
+	}
+	catch (const DashelException& e)
+	{
+		std::cerr << "cannot connect to the switch: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,419 @@
+// Aseba
+#include "../common/msg/msg.h"
+#include "../common/consts.h"
+#include "../vm/vm.h"
+#include "../transport/buffer/vm-buffer.h"
+using namespace Aseba;
+
+// Dashel
+#include <dashel/dashel.h>
+
+// C++
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+// C
+#include <stdlib.h>		// exit(), rand()
+#include <string.h>		// memcpy()
+
+/*
+	Check that a client applying the variables deltas sent by the VM for a
+	subscription ends up with the same variables as the node, while receiving
+	fewer words than with full sends. The node variables are modified in various
+	ways between sends, and the messages the node sends through vm-buffer are
+	received by a simulated client. Also check that the node tells clients when
+	it drops a subscription, and why.
+*/
+
+//! A stream that keeps what is written, to read it back
+class MemoryStream: public Dashel::Stream
+{
+public:
+	std::vector<uint8> data;
+	size_t readPos;
+
+public:
+	MemoryStream() : Stream("memory"), readPos(0) { }
+
+	virtual void write(const void *data, const size_t size)
+	{
+		const uint8 *ptr(reinterpret_cast<const uint8 *>(data));
+		this->data.insert(this->data.end(), ptr, ptr + size);
+	}
+
+	virtual void flush() { }
+
+	virtual void read(void *data, size_t size)
+	{
+		if (readPos + size > this->data.size())
+		{
+			std::cerr << "MemoryStream::read() : fatal error: reading past the end of stream" << std::endl;
+			abort();
+		}
+		memcpy(data, &this->data[readPos], size);
+		readPos += size;
+	}
+
+	bool atEnd() const { return readPos == data.size(); }
+};
+
+static MemoryStream sentMessages;
+static AsebaVMState vm;
+static std::vector<sint16> variables(600);
+static std::vector<sint16> variablesShadow(variables.size() + 16); //!< followed by guard words, to detect writes past the shadow
+static std::vector<uint16> bytecode(64);
+static std::vector<sint16> stack(32);
+
+// glue of the node
+
+extern "C" void AsebaSendBuffer(AsebaVMState *vm, const uint8* data, uint16 length)
+{
+	uint16 temp;
+	temp = bswap16(length - 2);
+	sentMessages.write(&temp, 2);
+	temp = bswap16(vm->nodeId);
+	sentMessages.write(&temp, 2);
+	sentMessages.write(data, length);
+}
+
+extern "C" uint16 AsebaGetBuffer(AsebaVMState *vm, uint8* data, uint16 maxLength, uint16* source)
+{
+	return 0;
+}
+
+extern "C" const AsebaVMDescription* AsebaGetVMDescription(AsebaVMState *vm)
+{
+	return 0;
+}
+
+extern "C" const AsebaLocalEventDescription * AsebaGetLocalEventsDescriptions(AsebaVMState *vm)
+{
+	return 0;
+}
+
+extern "C" const AsebaNativeFunctionDescription * const * AsebaGetNativeFunctionsDescriptions(AsebaVMState *vm)
+{
+	return 0;
+}
+
+extern "C" void AsebaNativeFunction(AsebaVMState *vm, uint16 id)
+{
+}
+
+extern "C" void AsebaWriteBytecode(AsebaVMState *vm)
+{
+}
+
+extern "C" void AsebaResetIntoBootloader(AsebaVMState *vm)
+{
+}
+
+extern "C" void AsebaPutVmToSleep(AsebaVMState *vm)
+{
+}
+
+//! Whether an out of variables bounds assert is expected, as it is when checking that a malformed request is ignored
+static bool expectOutOfBounds(false);
+
+extern "C" void AsebaAssert(AsebaVMState *vm, AsebaAssertReason reason)
+{
+	// release firmware is built without asserts, so the VM must handle the request safely after this returns
+	if (expectOutOfBounds && reason == ASEBA_ASSERT_OUT_OF_VARIABLES_BOUNDS)
+		return;
+	std::cerr << "Internal VM exception " << reason << " at pc = " << vm->pc << ", sp = " << vm->sp << std::endl;
+	exit(EXIT_FAILURE);
+}
+
+//! A subscription the node stopped, and why
+struct Unsubscription
+{
+	uint16 start;
+	uint16 length;
+	uint16 reason;
+};
+
+//! A client that keeps a copy of the variables of the node
+struct SimulatedClient
+{
+	std::vector<sint16> variables;
+	unsigned receivedWords;
+	std::vector<Unsubscription> unsubscriptions; //!< subscriptions the node stopped, in the order it told
+
+	SimulatedClient() : variables(::variables.size(), 0), receivedWords(0) { }
+
+	//! Apply the messages sent by the node since last time
+	void receive()
+	{
+		while (!sentMessages.atEnd())
+		{
+			Message* message(Message::receive(&sentMessages));
+			const Variables* full(dynamic_cast<const Variables*>(message));
+			const VariablesDelta* delta(dynamic_cast<const VariablesDelta*>(message));
+			const VariablesUnsubscribed* unsubscribed(dynamic_cast<const VariablesUnsubscribed*>(message));
+			if (full)
+			{
+				std::copy(full->variables.begin(), full->variables.end(), variables.begin() + full->start);
+				receivedWords += 1 + full->variables.size();
+			}
+			else if (delta)
+			{
+				delta->apply(0, variables);
+				receivedWords += 2;
+				for (size_t i = 0; i < delta->runs.size(); ++i)
+					receivedWords += 2 + delta->runs[i].variables.size();
+			}
+			else if (unsubscribed)
+			{
+				const Unsubscription unsubscription = { unsubscribed->start, unsubscribed->length, unsubscribed->reason };
+				unsubscriptions.push_back(unsubscription);
+			}
+			delete message;
+		}
+		sentMessages.data.clear();
+		sentMessages.readPos = 0;
+	}
+};
+
+//! Send a subscription or unsubscription message to the node
+static void sendToNode(uint16 type, uint16 start, uint16 length, uint16 period, uint16 onChange)
+{
+	uint16 data[] = { bswap16(vm.nodeId), bswap16(start), bswap16(length), bswap16(period), bswap16(onChange) };
+	AsebaVMDebugMessage(&vm, type, data, type == ASEBA_MESSAGE_SUBSCRIBE_VARIABLES ? 5 : 3);
+}
+
+//! Modify the variables of the node in one of several ways
+static void modifyVariables(unsigned round, unsigned start, unsigned length)
+{
+	switch (round % 5)
+	{
+		case 0: // a single variable
+			variables[start + rand() % length] = rand();
+			break;
+		case 1: // a few scattered variables
+			for (unsigned i = 0; i < 8; ++i)
+				variables[start + rand() % length] = rand();
+			break;
+		case 2: // a block
+		{
+			const unsigned blockStart(start + rand() % (length - 32));
+			for (unsigned i = blockStart; i < blockStart + 32; ++i)
+				variables[i] = rand();
+		}
+		break;
+		case 3: // nothing
+			break;
+		case 4: // everything
+			for (unsigned i = start; i < start + length; ++i)
+				variables[i] = rand();
+			break;
+	}
+}
+
+//! Return whether the client has the same variables as the node in the given range
+static bool checkRange(const SimulatedClient& client, unsigned start, unsigned length, const char* context)
+{
+	for (unsigned i = start; i < start + length; ++i)
+	{
+		if (client.variables[i] != variables[i])
+		{
+			std::cerr << context << ": variable " << i << " is " << client.variables[i] << " in client instead of " << variables[i] << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+//! Return whether the client was told, and only told, that the node stopped the given subscription for the given reason
+static bool checkUnsubscribed(SimulatedClient& client, unsigned start, unsigned length, unsigned reason, const char* context)
+{
+	client.receive();
+	const bool told(client.unsubscriptions.size() == 1 &&
+		client.unsubscriptions[0].start == start &&
+		client.unsubscriptions[0].length == length &&
+		client.unsubscriptions[0].reason == reason);
+	if (!told)
+		std::cerr << context << ": received " << client.unsubscriptions.size() << " unsubscriptions instead of the one of " << start << " " << length << " for reason " << reason << std::endl;
+	client.unsubscriptions.clear();
+	return told;
+}
+
+int main(int argc, char** argv)
+{
+	vm.nodeId = 1;
+	vm.bytecode = &bytecode[0];
+	vm.bytecodeSize = bytecode.size();
+	vm.predecoded = 0;
+	vm.eventIndex = 0;
+	vm.eventIndexSize = 0;
+	vm.stack = &stack[0];
+	vm.stackSize = stack.size();
+	vm.variables = &variables[0];
+	vm.variablesSize = variables.size();
+	vm.variablesShadow = &variablesShadow[0];
+	AsebaVMInit(&vm);
+
+	for (size_t i = 0; i < variables.size(); ++i)
+		variables[i] = rand();
+
+	// a range larger than a message and an overlapping one, sent periodically
+	const unsigned start(10), length(500);
+	const unsigned overlapStart(100), overlapLength(50);
+	const unsigned period(10);
+	SimulatedClient client;
+	sendToNode(ASEBA_MESSAGE_SUBSCRIBE_VARIABLES, start, length, period, 0);
+	sendToNode(ASEBA_MESSAGE_SUBSCRIBE_VARIABLES, overlapStart, overlapLength, 2 * period, 0);
+	client.receive();
+	if (!checkRange(client, start, length, "subscription"))
+		return EXIT_FAILURE;
+
+	const unsigned roundsCount(100);
+	unsigned fullWords(0);
+	for (unsigned round = 0; round < roundsCount; ++round)
+	{
+		modifyVariables(round, start, length);
+		AsebaVMSendSubscribedVariables(&vm, period);
+		client.receive();
+		fullWords += 2 + length;
+		if (round % 2 == 1)
+			fullWords += 1 + overlapLength;
+		if (!checkRange(client, start, length, "delta"))
+			return EXIT_FAILURE;
+	}
+	const unsigned deltaWords(client.receivedWords);
+
+	std::cout << "received " << deltaWords << " words, instead of " << fullWords << " with full sends" << std::endl;
+	if (deltaWords >= fullWords)
+	{
+		std::cerr << "deltas are not smaller than full sends" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// without shadow, the node always sends all variables
+	sendToNode(ASEBA_MESSAGE_UNSUBSCRIBE_VARIABLES, overlapStart, overlapLength, 0, 0);
+	vm.variablesShadow = 0;
+	modifyVariables(1, start, length);
+	client.receivedWords = 0;
+	AsebaVMSendSubscribedVariables(&vm, period);
+	client.receive();
+	if (!checkRange(client, start, length, "no shadow"))
+		return EXIT_FAILURE;
+	if (client.receivedWords != 2 + length)
+	{
+		std::cerr << "without shadow, received " << client.receivedWords << " words instead of " << 2 + length << std::endl;
+		return EXIT_FAILURE;
+	}
+	
+	// on change, the node sends the variables whenever clients do not have them, and only then
+	sendToNode(ASEBA_MESSAGE_UNSUBSCRIBE_VARIABLES, start, length, 0, 0);
+	client.receive();
+	client.unsubscriptions.clear();
+	vm.variablesShadow = &variablesShadow[0];
+	const unsigned onChangeStart(550), onChangeLength(2);
+	variables[onChangeStart] = 1;
+	variables[onChangeStart + 1] = 0;
+	sendToNode(ASEBA_MESSAGE_SUBSCRIBE_VARIABLES, onChangeStart, onChangeLength, period, 1);
+	client.receive();
+	client.receivedWords = 0;
+	AsebaVMSendSubscribedVariables(&vm, period);
+	client.receive();
+	if (client.receivedWords != 0)
+	{
+		std::cerr << "on change, received " << client.receivedWords << " words while nothing changed" << std::endl;
+		return EXIT_FAILURE;
+	}
+	// a change that leaves a rotate-xor checksum of the range the same
+	variables[onChangeStart] = 0;
+	variables[onChangeStart + 1] = 2;
+	AsebaVMSendSubscribedVariables(&vm, period);
+	client.receive();
+	if (!checkRange(client, onChangeStart, onChangeLength, "on change"))
+		return EXIT_FAILURE;
+	
+	// without shadow, changes cannot be detected, so the node sends at every period
+	vm.variablesShadow = 0;
+	client.receivedWords = 0;
+	AsebaVMSendSubscribedVariables(&vm, period);
+	client.receive();
+	if (client.receivedWords != 1 + onChangeLength)
+	{
+		std::cerr << "on change without shadow, received " << client.receivedWords << " words instead of " << 1 + onChangeLength << std::endl;
+		return EXIT_FAILURE;
+	}
+	
+	// requests for a range past the variables are ignored, they must neither be sent nor write past the shadow
+	vm.variablesShadow = &variablesShadow[0];
+	std::fill(variablesShadow.begin() + variables.size(), variablesShadow.end(), 0x5a5a);
+	const uint16 subscriptionsCount(vm.subscriptionsCount);
+	expectOutOfBounds = true;
+	uint16 getData[] = { bswap16(vm.nodeId), bswap16(uint16(variables.size() - 4)), bswap16(16) };
+	AsebaVMDebugMessage(&vm, ASEBA_MESSAGE_GET_VARIABLES, getData, 3);
+	sendToNode(ASEBA_MESSAGE_SUBSCRIBE_VARIABLES, variables.size() - 4, 16, period, 0);
+	expectOutOfBounds = false;
+	if (!sentMessages.data.empty())
+	{
+		std::cerr << "out of bounds: variables were sent" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (vm.subscriptionsCount != subscriptionsCount)
+	{
+		std::cerr << "out of bounds: subscription was stored" << std::endl;
+		return EXIT_FAILURE;
+	}
+	for (size_t i = variables.size(); i < variablesShadow.size(); ++i)
+	{
+		if (variablesShadow[i] != 0x5a5a)
+		{
+			std::cerr << "out of bounds: shadow overwritten at " << i << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	
+	// the node tells clients when it drops a subscription: when one unsubscribes
+	sendToNode(ASEBA_MESSAGE_UNSUBSCRIBE_VARIABLES, onChangeStart, onChangeLength, 0, 0);
+	if (!checkUnsubscribed(client, onChangeStart, onChangeLength, ASEBA_UNSUBSCRIBED_BY_CLIENT, "unsubscribe"))
+		return EXIT_FAILURE;
+	
+	// when a newer subscription takes the place of the oldest
+	for (unsigned i = 0; i < ASEBA_MAX_SUBSCRIPTIONS; ++i)
+		sendToNode(ASEBA_MESSAGE_SUBSCRIBE_VARIABLES, 4 * i, 2, period, 0);
+	client.receive();
+	if (!client.unsubscriptions.empty())
+	{
+		std::cerr << "no room: a subscription was dropped while there was room" << std::endl;
+		return EXIT_FAILURE;
+	}
+	sendToNode(ASEBA_MESSAGE_SUBSCRIBE_VARIABLES, 4 * ASEBA_MAX_SUBSCRIPTIONS, 2, period, 0);
+	if (!checkUnsubscribed(client, 0, 2, ASEBA_UNSUBSCRIBED_NO_ROOM, "no room"))
+		return EXIT_FAILURE;
+	
+	// and when no client renewed it in time, as clients may be gone; subscribing again renews it
+	const unsigned step(1000);
+	for (unsigned elapsed = 0; elapsed < ASEBA_SUBSCRIPTION_LEASE / 2; elapsed += step)
+		AsebaVMSendSubscribedVariables(&vm, step);
+	const unsigned renewedStart(4 * ASEBA_MAX_SUBSCRIPTIONS);
+	sendToNode(ASEBA_MESSAGE_SUBSCRIBE_VARIABLES, renewedStart, 2, period, 0);
+	for (unsigned elapsed = ASEBA_SUBSCRIPTION_LEASE / 2; elapsed < ASEBA_SUBSCRIPTION_LEASE; elapsed += step)
+		AsebaVMSendSubscribedVariables(&vm, step);
+	client.receive();
+	if (client.unsubscriptions.size() != ASEBA_MAX_SUBSCRIPTIONS - 1 || vm.subscriptionsCount != 1 || vm.subscriptions[0].start != renewedStart)
+	{
+		std::cerr << "lease: " << client.unsubscriptions.size() << " subscriptions expired and " << vm.subscriptionsCount << " are left" << std::endl;
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < client.unsubscriptions.size(); ++i)
+	{
+		if (client.unsubscriptions[i].reason != ASEBA_UNSUBSCRIBED_EXPIRED || client.unsubscriptions[i].start == renewedStart)
+		{
+			std::cerr << "lease: subscription " << client.unsubscriptions[i].start << " dropped for reason " << client.unsubscriptions[i].reason << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	client.unsubscriptions.clear();
+	for (unsigned elapsed = 0; elapsed < ASEBA_SUBSCRIPTION_LEASE / 2; elapsed += step)
+		AsebaVMSendSubscribedVariables(&vm, step);
+	if (!checkUnsubscribed(client, renewedStart, 2, ASEBA_UNSUBSCRIBED_EXPIRED, "renewed lease"))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,427 @@
+// Aseba
+#include "../compiler/compiler.h"
+#include "../vm/vm.h"
+#include "../vm/natives.h"
+#include "../common/consts.h"
+#include "../common/utils/utils.h"
+using namespace Aseba;
+
+// C++
+#include <string>
+#include <iostream>
+#include <locale>
+#include <fstream>
+#include <sstream>
+#include <valarray>
+#include <vector>
+
+// C
+#include <getopt.h>		// getopt_long()
+#include <stdlib.h>		// exit()
+
+// defines
+#define DEFAULT_RUNS	100
+
+/*
+	Compare the direct-threaded run loop of the VM (ASEBA_VM_THREADED_DISPATCH),
+	without and with the pre-decoded bytecode cache, to the switch-based one:
+	all must produce exactly the same VM state (variables, bytecode, pc, sp,
+	flags and emitted messages), and we report the time each one takes to run
+	all the event handlers of the programs given as argument.
+	The switch-based loop looks events up in the event vector table, the
+	others in the event dispatch index, which is also checked for all events.
+*/
+
+// the two run loops, implemented in vm.c
+extern "C" void AsebaDebugBareRun(AsebaVMState *vm, uint16 stepsLimit);
+extern "C" void AsebaDebugThreadedRun(AsebaVMState *vm, uint16 stepsLimit);
+
+static const char short_options [] = "r:i:";
+static const struct option long_options[] = {
+	{ "runs",		required_argument,	NULL,	'r'},
+	{ "steps",		required_argument,	NULL,	'i'},
+	{ 0, 0, 0, 0 }
+};
+
+static void usage (int argc, char** argv)
+{
+	std::cerr 	<< "Usage: " << argv[0] << " [options] source..." << std::endl << std::endl
+			<< "Options:" << std::endl
+			<< "    -r | --runs         Number of times all event handlers are executed (default: " << DEFAULT_RUNS << ")" << std::endl
+			<< "    -i | --steps        Steps limit given to each run, 0 for none (default: 0)" << std::endl;
+}
+
+// checksum of messages sent by the VM, to make sure both loops emit the same
+static uint16 messagesCrc(0);
+static unsigned messagesCount(0);
+
+extern "C" void AsebaSendMessage(AsebaVMState *vm, uint16 type, const void *data, uint16 size)
+{
+	messagesCrc = crcXModem(messagesCrc, type);
+	for (uint16 i = 0; i < size; ++i)
+		messagesCrc = crcXModem(messagesCrc, uint16(reinterpret_cast<const uint8*>(data)[i]));
+	++messagesCount;
+}
+
+#ifdef __BIG_ENDIAN__
+extern "C" void AsebaSendMessageWords(AsebaVMState *vm, uint16 type, const uint16* data, uint16 count)
+{
+	AsebaSendMessage(vm, type, data, count*2);
+}
+#endif
+
+extern "C" void AsebaSendVariables(AsebaVMState *vm, uint16 start, uint16 length)
+{
+}
+
+extern "C" void AsebaSendVariablesDelta(AsebaVMState *vm, uint16 start, uint16 length)
+{
+}
+
+extern "C" void AsebaSendDescriptionHash(AsebaVMState *vm)
+{
+}
+
+extern "C" void AsebaSendDescription(AsebaVMState *vm)
+{
+}
+
+extern "C" void AsebaPutVmToSleep(AsebaVMState *vm)
+{
+}
+
+static AsebaNativeFunctionPointer nativeFunctions[] =
+{
+	ASEBA_NATIVES_STD_FUNCTIONS,
+};
+
+static const AsebaNativeFunctionDescription* nativeFunctionsDescriptions[] =
+{
+	ASEBA_NATIVES_STD_DESCRIPTIONS,
+	0
+};
+
+extern "C" const AsebaNativeFunctionDescription * const * AsebaGetNativeFunctionsDescriptions(AsebaVMState *vm)
+{
+	return nativeFunctionsDescriptions;
+}
+
+extern "C" void AsebaNativeFunction(AsebaVMState *vm, uint16 id)
+{
+	nativeFunctions[id](vm);
+}
+
+extern "C" void AsebaWriteBytecode(AsebaVMState *vm)
+{
+}
+
+extern "C" void AsebaResetIntoBootloader(AsebaVMState *vm)
+{
+}
+
+extern "C" void AsebaAssert(AsebaVMState *vm, AsebaAssertReason reason)
+{
+	std::cerr << "Internal VM exception " << reason << " at pc = " << vm->pc << ", sp = " << vm->sp << std::endl;
+	exit(EXIT_FAILURE);
+}
+
+struct AsebaNode
+{
+	AsebaVMState vm;
+	std::valarray<unsigned short> bytecode;
+	std::valarray<signed short> stack;
+	std::valarray<AsebaVMPredecodedBytecode> predecoded;
+	std::valarray<unsigned short> eventIndex;
+	TargetDescription d;
+
+	struct Variables
+	{
+		sint16 user[1024];
+	} variables;
+
+	AsebaNode()
+	{
+		// create VM
+		vm.nodeId = 0;
+		bytecode.resize(1024);
+		vm.bytecode = &bytecode[0];
+		vm.bytecodeSize = bytecode.size();
+		predecoded.resize(bytecode.size());
+		vm.predecoded = 0;
+		eventIndex.resize(ASEBA_VM_EVENT_INDEX_SIZE);
+		vm.eventIndex = 0;
+		vm.eventIndexSize = 0;
+
+		stack.resize(64);
+		vm.stack = &stack[0];
+		vm.stackSize = stack.size();
+
+		vm.variables = reinterpret_cast<sint16 *>(&variables);
+		vm.variablesSize = sizeof(variables) / sizeof(sint16);
+		vm.variablesShadow = 0;
+
+		AsebaVMInit(&vm);
+
+		// fill description accordingly
+		d.name = L"benchmarkvm";
+		d.protocolVersion = ASEBA_PROTOCOL_VERSION;
+
+		d.bytecodeSize = vm.bytecodeSize;
+		d.variablesSize = vm.variablesSize;
+		d.stackSize = vm.stackSize;
+
+		const AsebaNativeFunctionDescription** nativeDescs(nativeFunctionsDescriptions);
+		while (*nativeDescs)
+		{
+			const AsebaNativeFunctionDescription* nativeDesc(*nativeDescs);
+			std::string name(nativeDesc->name);
+			std::string doc(nativeDesc->doc);
+
+			TargetDescription::NativeFunction native(
+				std::wstring(name.begin(), name.end()),
+				std::wstring(doc.begin(), doc.end())
+			);
+
+			const AsebaNativeFunctionArgumentDescription* params(nativeDesc->arguments);
+			while (params->size)
+			{
+				AsebaNativeFunctionArgumentDescription param(*params);
+				name = param.name;
+				native.parameters.push_back(
+					TargetDescription::NativeFunctionParameter(std::wstring(name.begin(), name.end()), param.size)
+				);
+				++params;
+			}
+
+			d.nativeFunctions.push_back(native);
+
+			++nativeDescs;
+		}
+	}
+
+	void loadBytecode(const BytecodeVector& program, bool usePredecoded, bool useEventIndex)
+	{
+		vm.predecoded = usePredecoded ? &predecoded[0] : 0;
+		vm.eventIndex = useEventIndex ? &eventIndex[0] : 0;
+		vm.eventIndexSize = useEventIndex ? eventIndex.size() : 0;
+		AsebaVMInit(&vm);
+		size_t i = 0;
+		for (BytecodeVector::const_iterator it(program.begin()); it != program.end(); ++it)
+			vm.bytecode[i++] = it->bytecode;
+		AsebaVMBytecodeChanged(&vm);
+	}
+};
+
+//! Final state of a benchmarked VM
+struct RunResult
+{
+	std::valarray<sint16> variables;
+	std::valarray<unsigned short> bytecode;
+	uint16 pc;
+	sint16 sp;
+	uint16 flags;
+	uint16 messagesCrc;
+	unsigned messagesCount;
+	UnifiedTime duration;
+
+	bool operator ==(const RunResult& that) const
+	{
+		if (pc != that.pc || sp != that.sp || flags != that.flags)
+			return false;
+		if (messagesCrc != that.messagesCrc || messagesCount != that.messagesCount)
+			return false;
+		for (size_t i = 0; i < variables.size(); ++i)
+			if (variables[i] != that.variables[i])
+				return false;
+		for (size_t i = 0; i < bytecode.size(); ++i)
+			if (bytecode[i] != that.bytecode[i])
+				return false;
+		return true;
+	}
+};
+
+//! A way of running the VM
+struct Engine
+{
+	const char* name;
+	void (*runLoop)(AsebaVMState *vm, uint16 stepsLimit);
+	bool usePredecoded;
+	bool useEventIndex;
+};
+
+static const Engine engines[] =
+{
+	{ "switch", AsebaDebugBareRun, false, false },
+	{ "threaded", AsebaDebugThreadedRun, false, true },
+	{ "predecoded", AsebaDebugThreadedRun, true, true }
+};
+
+static const size_t enginesCount(sizeof(engines) / sizeof(Engine));
+
+//! Load program and execute all its event handlers, in the order of the event vector table, runs times
+static RunResult benchmark(AsebaNode& node, const BytecodeVector& program, const Engine& engine, unsigned runs, uint16 stepsLimit)
+{
+	AsebaVMState& vm(node.vm);
+	node.loadBytecode(program, engine.usePredecoded, engine.useEventIndex);
+	messagesCrc = 0;
+	messagesCount = 0;
+
+	const UnifiedTime startTime;
+	for (unsigned run = 0; run < runs; ++run)
+	{
+		const uint16 eventVectorSize(vm.bytecode[0]);
+		for (uint16 i = 1; i < eventVectorSize; i += 2)
+		{
+			vm.flags = 0;
+			AsebaVMSetupEvent(&vm, vm.bytecode[i]);
+			engine.runLoop(&vm, stepsLimit);
+		}
+	}
+
+	RunResult result;
+	result.duration = UnifiedTime() - startTime;
+	result.variables.resize(vm.variablesSize);
+	for (size_t i = 0; i < vm.variablesSize; ++i)
+		result.variables[i] = vm.variables[i];
+	result.bytecode.resize(vm.bytecodeSize);
+	for (size_t i = 0; i < vm.bytecodeSize; ++i)
+		result.bytecode[i] = vm.bytecode[i];
+	result.pc = vm.pc;
+	result.sp = vm.sp;
+	result.flags = vm.flags;
+	result.messagesCrc = messagesCrc;
+	result.messagesCount = messagesCount;
+	return result;
+}
+
+//! Return whether the event dispatch index gives the same address as the event vector table for all events
+static bool checkEventIndex(AsebaNode& node, const BytecodeVector& program)
+{
+	AsebaVMState& vm(node.vm);
+	node.loadBytecode(program, false, true);
+	if (vm.eventIndexSlots == 0)
+		return false;
+	for (unsigned event = 0; event <= 0xffff; ++event)
+	{
+		const uint16 indexSlots(vm.eventIndexSlots);
+		const uint16 indexedAddress(AsebaVMGetEventAddress(&vm, event));
+		vm.eventIndexSlots = 0;
+		const uint16 scannedAddress(AsebaVMGetEventAddress(&vm, event));
+		vm.eventIndexSlots = indexSlots;
+		if (indexedAddress != scannedAddress)
+			return false;
+	}
+	return true;
+}
+
+// read source code to a string
+static std::wstring read_source(const std::string& filename)
+{
+	std::ifstream ifs;
+	ifs.open(filename.c_str(), std::ifstream::binary);
+	if (!ifs.is_open())
+	{
+		std::cerr << "Error opening source file " << filename << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::ostringstream oss;
+	oss << ifs.rdbuf();
+	return UTF8ToWString(oss.str());
+}
+
+int main(int argc, char** argv)
+{
+	unsigned runs = DEFAULT_RUNS;
+	uint16 stepsLimit = 0;
+
+	std::locale::global(std::locale(""));
+
+	// parse the arguments
+	for(;;)
+	{
+		int index;
+		int c = getopt_long(argc, argv, short_options, long_options, &index);
+		if (c==-1)
+			break;
+
+		switch(c)
+		{
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			case 'i':
+				stepsLimit = atoi(optarg);
+				break;
+			default:
+				usage(argc, argv);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind == argc)
+	{
+		usage(argc, argv);
+		exit(EXIT_FAILURE);
+	}
+
+	AsebaNode node;
+	CommonDefinitions definitions;
+	definitions.events.push_back(NamedValue(L"event1", 0));
+	definitions.events.push_back(NamedValue(L"event2", 3));
+	definitions.constants.push_back(NamedValue(L"FOO", 2));
+
+	bool mismatch(false);
+	std::vector<UnifiedTime> totals(enginesCount, UnifiedTime(0));
+	for (int arg = optind; arg < argc; ++arg)
+	{
+		const std::string filename(argv[arg]);
+		std::wistringstream ifs(read_source(filename));
+
+		Compiler compiler;
+		compiler.setTargetDescription(&node.d);
+		compiler.setCommonDefinitions(&definitions);
+
+		BytecodeVector program;
+		unsigned varCount;
+		Error outError;
+		if (!compiler.compile(ifs, program, varCount, outError, NULL))
+		{
+			std::cerr << filename << ": compilation failed, skipping: " << WStringToUTF8(outError.toWString()) << std::endl;
+			continue;
+		}
+
+		// the first engine is the reference
+		std::cout << filename << ":";
+		if (!checkEventIndex(node, program))
+		{
+			std::cout << " (EVENT INDEX DIFFERS)";
+			mismatch = true;
+		}
+		const RunResult reference(benchmark(node, program, engines[0], runs, stepsLimit));
+		std::cout << " " << engines[0].name << " " << reference.duration.value << " ms";
+		totals[0] += reference.duration;
+		for (size_t e = 1; e < enginesCount; ++e)
+		{
+			const RunResult result(benchmark(node, program, engines[e], runs, stepsLimit));
+			std::cout << ", " << engines[e].name << " " << result.duration.value << " ms";
+			totals[e] += result.duration;
+			if (!(result == reference))
+			{
+				std::cout << " (RESULTS DIFFER)";
+				mismatch = true;
+			}
+		}
+		std::cout << std::endl;
+	}
+
+	std::cout << "total:";
+	for (size_t e = 0; e < enginesCount; ++e)
+	{
+		std::cout << (e ? ", " : " ") << engines[e].name << " " << totals[e].value << " ms";
+		if (e && totals[e].value)
+			std::cout << " (speedup " << double(totals[0].value) / double(totals[e].value) << ")";
+	}
+	std::cout << std::endl;
+
+	return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
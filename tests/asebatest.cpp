@@ -26,7 +26,7 @@ using namespace Aseba;
 std::wstring read_source(const std::string& filename);
 void dump_source(const std::wstring& source);
 
-static const char short_options [] = "fcepnsdmi:";
+static const char short_options [] = "fcepnsdmi:v:o";
 static const struct option long_options[] = { 
 	{ "fail",	no_argument,			NULL,	'f'},
 	{ "comp_fail",	no_argument,		NULL,	'c'},
@@ -38,6 +38,8 @@ static const struct option long_options[] = {
 	{ "memdump",	no_argument,		NULL,	'u'},
 	{ "memcmp", 	required_argument,	NULL,	'm'},
 	{ "steps", 		required_argument,	NULL,	'i'},
+	{ "vector-natives",	required_argument,	NULL,	'v'},
+	{ "optimization-report",	no_argument,	NULL,	'o'},
 	{ 0, 0, 0, 0 } 
 };
 
@@ -54,7 +56,9 @@ static void usage (int argc, char** argv)
 			<< "    -d | --dump         Dump the compilation result (tokens, tree, bytecode)" << std::endl
 			<< "    -u | --memdump      Dump the memory content at the end of the execution" << std::endl
 			<< "    -m | --memcmp file  Compare result of the VM execution with file" << std::endl
-			<< "    -i | --steps        Number of VM execution steps (default: " << DEFAULT_STEPS << ")" << std::endl;
+			<< "    -i | --steps        Number of VM execution steps (default: " << DEFAULT_STEPS << ")" << std::endl
+			<< "    -v | --vector-natives size  Compile vector assignments of at least size elements to native calls, 0 to unroll them" << std::endl
+			<< "    -o | --optimization-report  Report bytecode size and executed steps without and with dataflow and bytecode optimizations" << std::endl;
 }
 
 static bool executionError(false);
@@ -91,6 +95,16 @@ extern "C" void AsebaSendVariables(AsebaVMState *vm, uint16 start, uint16 length
 	std::cerr << "AsebaSendVariables at pos " << start << ", length " << length << std::endl;
 }
 
+extern "C" void AsebaSendVariablesDelta(AsebaVMState *vm, uint16 start, uint16 length)
+{
+	std::cerr << "AsebaSendVariablesDelta at pos " << start << ", length " << length << std::endl;
+}
+
+extern "C" void AsebaSendDescriptionHash(AsebaVMState *vm)
+{
+	std::cerr << "AsebaSendDescriptionHash" << std::endl;
+}
+
 extern "C" void AsebaSendDescription(AsebaVMState *vm)
 {
 	std::cerr << "AsebaSendDescription" << std::endl;
@@ -175,6 +189,9 @@ struct AsebaNode
 		bytecode.resize(512);
 		vm.bytecode = &bytecode[0];
 		vm.bytecodeSize = bytecode.size();
+		vm.predecoded = 0;
+		vm.eventIndex = 0;
+		vm.eventIndexSize = 0;
 		
 		stack.resize(64);
 		vm.stack = &stack[0];
@@ -182,6 +199,7 @@ struct AsebaNode
 		
 		vm.variables = reinterpret_cast<sint16 *>(&variables);
 		vm.variablesSize = sizeof(variables) / sizeof(sint16);
+		vm.variablesShadow = 0;
 		
 		AsebaVMInit(&vm);
 		
@@ -245,11 +263,14 @@ struct AsebaNode
 		return true;
 	}
 	
-	void run(int stepCount)
+	unsigned run(int stepCount)
 	{
-		// run VM
+		// run VM one step at a time, to count them
 		AsebaVMSetupEvent(&vm, ASEBA_EVENT_INIT);
-		AsebaVMRun(&vm, stepCount);
+		int steps = 0;
+		while (steps < stepCount && AsebaVMRun(&vm, 1))
+			++steps;
+		return steps;
 	}
 };
 
@@ -292,6 +313,8 @@ int main(int argc, char** argv)
 	bool memDump = false;
 	bool memCmp = false;
 	int stepCount = DEFAULT_STEPS;
+	int vectorNativesThreshold = -1;
+	bool optimizationReport = false;
 	std::string memCmpFileName;
 	
 	std::locale::global(std::locale(""));
@@ -345,6 +368,12 @@ int main(int argc, char** argv)
 			case 'i':
 				stepCount = atoi(optarg);
 				break;
+			case 'v':
+				vectorNativesThreshold = atoi(optarg);
+				break;
+			case 'o':
+				optimizationReport = true;
+				break;
 			default:
 				usage(argc, argv);
 				exit(EXIT_FAILURE);
@@ -392,6 +421,8 @@ int main(int argc, char** argv)
 	// compile
 	compiler.setTargetDescription(node.getTargetDescription());
 	compiler.setCommonDefinitions(&definitions);
+	if (vectorNativesThreshold >= 0)
+		compiler.setVectorNativesThreshold(vectorNativesThreshold);
 	if (dump)
 		compiler.compile(ifs, bytecode, varCount, outError, &(std::wcout));
 	else
@@ -401,13 +432,53 @@ int main(int argc, char** argv)
 	
 	checkForError("Compilation", should_compilation_fail, (outError.message != L"not defined"), outError.toWString());
 	
+	// compile and run without dataflow and bytecode optimizations, for comparison
+	AsebaNode unoptimizedNode;
+	BytecodeVector unoptimizedBytecode;
+	unsigned unoptimizedSteps(0);
+	if (optimizationReport)
+	{
+		std::wistringstream unoptimizedIfs(wSource);
+		Compiler unoptimizedCompiler;
+		unsigned int unoptimizedVarCount;
+		Error unoptimizedError;
+		unoptimizedCompiler.setTargetDescription(unoptimizedNode.getTargetDescription());
+		unoptimizedCompiler.setCommonDefinitions(&definitions);
+		if (vectorNativesThreshold >= 0)
+			unoptimizedCompiler.setVectorNativesThreshold(vectorNativesThreshold);
+		unoptimizedCompiler.setDataflowOptimization(false);
+		unoptimizedCompiler.setBytecodeOptimization(false);
+		if (!unoptimizedCompiler.compile(unoptimizedIfs, unoptimizedBytecode, unoptimizedVarCount, unoptimizedError, NULL) ||
+			!unoptimizedNode.loadBytecode(unoptimizedBytecode))
+		{
+			std::wcerr << L"Compilation without optimizations failed: " << unoptimizedError.toWString() << std::endl;
+			return EXIT_FAILURE;
+		}
+		unoptimizedSteps = unoptimizedNode.run(stepCount);
+		executionError = false;
+	}
+	
 	// run
 	if (!node.loadBytecode(bytecode))
 	{
 		std::cerr << "Load bytecode failure" << std::endl;
 		return EXIT_FAILURE;
 	}
-	node.run(stepCount);
+	const unsigned steps(node.run(stepCount));
+	
+	if (optimizationReport)
+	{
+		std::cout << "Bytecode size: " << unoptimizedBytecode.size() << " words without optimization, " << bytecode.size() << " with" << std::endl;
+		std::cout << "Executed steps: " << unoptimizedSteps << " without optimization, " << steps << " with" << std::endl;
+		for (size_t i = 0; i < varCount; ++i)
+		{
+			if (node.vm.variables[i] != unoptimizedNode.vm.variables[i])
+			{
+				std::cerr << "VM variable value at pos " << i << " differs without optimizations; expected: " << unoptimizedNode.vm.variables[i] << ", found: " << node.vm.variables[i] << std::endl;
+				return EXIT_FAILURE;
+			}
+		}
+	}
 	
 	checkForError("Execution", should_execution_fail, executionError);
 	
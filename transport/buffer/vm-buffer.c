@@ -24,8 +24,19 @@
 #include <string.h>
 #include <assert.h>
 
-static unsigned char buffer[ASEBA_MAX_INNER_PACKET_SIZE];
-static unsigned buffer_pos;
+/* the buffer is per thread when several VMs might run in parallel, as in the headless playground */
+#ifdef ASEBA_VM_BUFFER_THREAD_LOCAL
+	#ifdef _MSC_VER
+		#define ASEBA_VM_BUFFER_STORAGE static __declspec(thread)
+	#else
+		#define ASEBA_VM_BUFFER_STORAGE static __thread
+	#endif
+#else
+	#define ASEBA_VM_BUFFER_STORAGE static
+#endif
+
+ASEBA_VM_BUFFER_STORAGE unsigned char buffer[ASEBA_MAX_INNER_PACKET_SIZE];
+ASEBA_VM_BUFFER_STORAGE unsigned buffer_pos;
 
 static void buffer_add(const uint8* data, const uint16 len)
 {
@@ -106,6 +117,168 @@ void AsebaSendVariables(AsebaVMState *vm, uint16 start, uint16 length)
 		buffer_add_uint16(vm->variables[i]);
 
 	AsebaSendBuffer(vm, buffer, buffer_pos);
+	
+	// clients now have these values
+	if (vm->variablesShadow)
+		memcpy(vm->variablesShadow + start, vm->variables + start, length * sizeof(sint16));
+}
+
+/* Return the length of the next run of changed variables in [*pos, end), 0 if none, and set *pos to its start.
+   Runs separated by a single unchanged variable are merged, as a run header is two words. */
+static uint16 next_changed_run(AsebaVMState *vm, uint16 *pos, uint16 end)
+{
+	uint16 i = *pos;
+	uint16 runEnd;
+	
+	while (i < end && vm->variables[i] == vm->variablesShadow[i])
+		i++;
+	*pos = i;
+	if (i == end)
+		return 0;
+	
+	runEnd = i + 1;
+	for (i = runEnd; i < end && i - runEnd < 2; i++)
+		if (vm->variables[i] != vm->variablesShadow[i])
+			runEnd = i + 1;
+	return runEnd - *pos;
+}
+
+void AsebaSendVariablesDelta(AsebaVMState *vm, uint16 start, uint16 length)
+{
+	const uint16 end = start + length;
+	uint16 pos, runLength, size, i;
+	
+	if (!vm->variablesShadow)
+	{
+		AsebaSendVariables(vm, start, length);
+		return;
+	}
+	
+	// compute the size of the delta, in words, and send everything if it is not smaller
+	size = 2;
+	for (pos = start; (runLength = next_changed_run(vm, &pos, end)) != 0; pos += runLength)
+		size += 2 + runLength;
+	if (size >= length + 1)
+	{
+		AsebaSendVariables(vm, start, length);
+		return;
+	}
+	
+	// send the runs of changed variables, with their addresses
+	buffer_pos = 0;
+	buffer_add_uint16(ASEBA_MESSAGE_VARIABLES_DELTA);
+	buffer_add_uint16(start);
+	buffer_add_uint16(length);
+	for (pos = start; (runLength = next_changed_run(vm, &pos, end)) != 0; pos += runLength)
+	{
+		buffer_add_uint16(pos);
+		buffer_add_uint16(runLength);
+		for (i = pos; i < pos + runLength; i++)
+		{
+			buffer_add_uint16(vm->variables[i]);
+			vm->variablesShadow[i] = vm->variables[i];
+		}
+	}
+	
+	AsebaSendBuffer(vm, buffer, buffer_pos);
+}
+
+/* CRC of the description, must be the same as TargetDescription::crc() computes on clients */
+
+static uint16 crc_xmodem_update(uint16 crc, const uint8* data, uint16 len)
+{
+	uint16 i, j;
+	for (i = 0; i < len; i++)
+	{
+		crc = crc ^ ((uint16)data[i] << 8);
+		for (j = 0; j < 8; j++)
+		{
+			if (crc & 0x8000)
+				crc = (crc << 1) ^ 0x1021;
+			else
+				crc <<= 1;
+		}
+	}
+	return crc;
+}
+
+static uint16 crc_xmodem_uint16(uint16 crc, const uint16 value)
+{
+	return crc_xmodem_update(crc, (const uint8*) &value, 2);
+}
+
+static uint16 crc_xmodem_string(uint16 crc, const char* s)
+{
+	// strings are hashed with their terminating zero when it makes their length even
+	uint16 len = strlen(s);
+	if (len & 0x1)
+		++len;
+	return crc_xmodem_update(crc, (const uint8*) s, len);
+}
+
+static uint16 description_crc(AsebaVMState *vm)
+{
+	const AsebaVMDescription *vmDescription = AsebaGetVMDescription(vm);
+	const AsebaVariableDescription* namedVariables = vmDescription->variables;
+	const AsebaNativeFunctionDescription* const * nativeFunctionsDescription = AsebaGetNativeFunctionsDescriptions(vm);
+	const AsebaLocalEventDescription* localEvents = AsebaGetLocalEventsDescriptions(vm);
+	
+	uint16 crc = 0;
+	uint16 i, j;
+	crc = crc_xmodem_uint16(crc, vm->bytecodeSize);
+	crc = crc_xmodem_uint16(crc, vm->variablesSize);
+	crc = crc_xmodem_uint16(crc, vm->stackSize);
+	for (i = 0; namedVariables[i].name; i++)
+	{
+		crc = crc_xmodem_uint16(crc, namedVariables[i].size);
+		crc = crc_xmodem_string(crc, namedVariables[i].name);
+	}
+	for (i = 0; localEvents[i].name; i++)
+		crc = crc_xmodem_string(crc, localEvents[i].name);
+	for (i = 0; nativeFunctionsDescription[i]; i++)
+	{
+		crc = crc_xmodem_string(crc, nativeFunctionsDescription[i]->name);
+		for (j = 0; nativeFunctionsDescription[i]->arguments[j].size; j++)
+		{
+			crc = crc_xmodem_uint16(crc, (uint16)nativeFunctionsDescription[i]->arguments[j].size);
+			crc = crc_xmodem_string(crc, nativeFunctionsDescription[i]->arguments[j].name);
+		}
+	}
+	return crc;
+}
+
+void AsebaSendDescriptionHash(AsebaVMState *vm)
+{
+	const AsebaVMDescription *vmDescription = AsebaGetVMDescription(vm);
+	
+	buffer_pos = 0;
+	
+	buffer_add_uint16(ASEBA_MESSAGE_DESCRIPTION_HASH);
+	
+	buffer_add_string(vmDescription->name);
+	buffer_add_uint16(ASEBA_PROTOCOL_VERSION);
+	buffer_add_uint16(description_crc(vm));
+	
+	// send buffer
+	AsebaSendBuffer(vm, buffer, buffer_pos);
+}
+
+/* start an entry of the given type and size in bytes in a packed description, sending the current one first if the entry does not fit */
+static void buffer_add_packed_entry_header(AsebaVMState *vm, uint16 type, uint16 size)
+{
+	if (buffer_pos + 2 + size > ASEBA_MAX_INNER_PACKET_SIZE)
+	{
+		AsebaSendBuffer(vm, buffer, buffer_pos);
+		buffer_pos = 0;
+	}
+	if (buffer_pos == 0)
+		buffer_add_uint16(ASEBA_MESSAGE_PACKED_DESCRIPTION);
+	buffer_add_uint16(type);
+}
+
+static uint16 string_size(const char* s)
+{
+	return 1 + strlen(s);
 }
 
 void AsebaSendDescription(AsebaVMState *vm)
@@ -146,58 +319,51 @@ void AsebaSendDescription(AsebaVMState *vm)
 	// send buffer
 	AsebaSendBuffer(vm, buffer, buffer_pos);
 	
-	// send named variables description
+	// the named variables, local events and native functions are sent packed, as many per message as fit
+	buffer_pos = 0;
+	
+	// named variables description
 	for (i = 0; namedVariables[i].name; i++)
 	{
-		buffer_pos = 0;
-		
-		buffer_add_uint16(ASEBA_MESSAGE_NAMED_VARIABLE_DESCRIPTION);
+		buffer_add_packed_entry_header(vm, ASEBA_MESSAGE_NAMED_VARIABLE_DESCRIPTION, 2 + string_size(namedVariables[i].name));
 		
 		buffer_add_uint16(namedVariables[i].size);
 		buffer_add_string(namedVariables[i].name);
-		
-		// send buffer
-		AsebaSendBuffer(vm, buffer, buffer_pos);
 	}
 	
-	// send local events description
+	// local events description
 	for (i = 0; localEvents[i].name; i++)
 	{
-		buffer_pos = 0;
-		
-		buffer_add_uint16(ASEBA_MESSAGE_LOCAL_EVENT_DESCRIPTION);
+		buffer_add_packed_entry_header(vm, ASEBA_MESSAGE_LOCAL_EVENT_DESCRIPTION, string_size(localEvents[i].name) + string_size(localEvents[i].doc));
 		
 		buffer_add_string(localEvents[i].name);
 		buffer_add_string(localEvents[i].doc);
-		
-		// send buffer
-		AsebaSendBuffer(vm, buffer, buffer_pos);
 	}
 	
-	// send native functions description
+	// native functions description
 	for (i = 0; nativeFunctionsDescription[i]; i++)
 	{
+		const AsebaNativeFunctionDescription* function = nativeFunctionsDescription[i];
 		uint16 j;
-
-		buffer_pos = 0;
-		
-		buffer_add_uint16(ASEBA_MESSAGE_NATIVE_FUNCTION_DESCRIPTION);
+		uint16 size = string_size(function->name) + string_size(function->doc) + 2;
+		for (j = 0; function->arguments[j].size; j++)
+			size += 2 + string_size(function->arguments[j].name);
 		
+		buffer_add_packed_entry_header(vm, ASEBA_MESSAGE_NATIVE_FUNCTION_DESCRIPTION, size);
 		
-		buffer_add_string(nativeFunctionsDescription[i]->name);
-		buffer_add_string(nativeFunctionsDescription[i]->doc);
-		for (j = 0; nativeFunctionsDescription[i]->arguments[j].size; j++)
-			;
+		buffer_add_string(function->name);
+		buffer_add_string(function->doc);
 		buffer_add_uint16(j);
-		for (j = 0; nativeFunctionsDescription[i]->arguments[j].size; j++)
+		for (j = 0; function->arguments[j].size; j++)
 		{
-			buffer_add_sint16(nativeFunctionsDescription[i]->arguments[j].size);
-			buffer_add_string(nativeFunctionsDescription[i]->arguments[j].name);
+			buffer_add_sint16(function->arguments[j].size);
+			buffer_add_string(function->arguments[j].name);
 		}
-		
-		// send buffer
-		AsebaSendBuffer(vm, buffer, buffer_pos);
 	}
+	
+	// send the last packed description, if any
+	if (buffer_pos)
+		AsebaSendBuffer(vm, buffer, buffer_pos);
 }
 
 void AsebaProcessIncomingEvents(AsebaVMState *vm)
@@ -35,6 +35,8 @@ extern "C" {
 	This helper provides to the VM:
 	* AsebaSendMessage()
 	* AsebaSendVariables()
+	* AsebaSendVariablesDelta()
+	* AsebaSendDescriptionHash()
 	* AsebaSendDescription()
 	
 	This helper provides to the glue code:
@@ -33,9 +33,29 @@
 
 #define ASEBA_MIN(a, b) (((a) < (b)) ? (a) : (b))
 
+/*! Maximum number of multi-frames packets that can be reassembled at the same time, one per source */
+#ifndef ASEBA_CAN_MAX_PENDING_PACKETS
+#define ASEBA_CAN_MAX_PENDING_PACKETS 32
+#endif
+
+/*! Maximum number of complete packets waiting to be read by AsebaCanRecv() */
+#ifndef ASEBA_CAN_COMPLETED_QUEUE_SIZE
+#define ASEBA_CAN_COMPLETED_QUEUE_SIZE 64
+#endif
+
+#define NO_FRAME 0xffff
+#define NO_SOURCE 0xffff
+
+/*!	A multi-frames packet being received from a source */
+typedef struct
+{
+	uint16 source; /*!< identifier of the source, NO_SOURCE if this entry is free */
+	uint16 first; /*!< position of the first frame of the packet in the reception queue, NO_FRAME if the rest of the packet is dropped */
+	uint16 last; /*!< position of the last received frame of the packet in the reception queue */
+} AsebaCanPendingPacket;
 
 /*!	This contains the state of the CAN implementation of Aseba network */
-static struct AsebaCan
+struct AsebaCan
 {
 	// data
 	uint16 id; /*!< identifier of this node on CAN */
@@ -57,10 +77,27 @@ static struct AsebaCan
 	size_t recvQueueSize;
 	uint16 recvQueueInsertPos;
 	uint16 recvQueueConsumePos;
+	
+	// packets being reassembled, only accessed by AsebaCanFrameReceived()
+	AsebaCanPendingPacket pendingPackets[ASEBA_CAN_MAX_PENDING_PACKETS];
+	
+	// positions of the first frames of complete packets, in order of completion
+	uint16 completedQueue[ASEBA_CAN_COMPLETED_QUEUE_SIZE];
+	uint16 volatile completedQueueInsertPos;
+	uint16 volatile completedQueueConsumePos;
 
 	uint16 volatile sendQueueLock;
 	
-} asebaCan;
+};
+
+/* on hosts, several instances might live in the same process, for instance to simulate a bus */
+#ifdef ASEBA_CAN_INSTANCES
+static struct AsebaCan asebaCanDefaultInstance;
+static struct AsebaCan* asebaCanInstance = &asebaCanDefaultInstance;
+#define asebaCan (*asebaCanInstance)
+#else
+static struct AsebaCan asebaCan;
+#endif
 
 /** \addtogroup can */
 /*@{*/
@@ -167,22 +204,74 @@ static void AsebaCanRecvQueueGarbageCollect()
 	}
 }
 
-/*! Free frames associated with an id in the reception queue */
-static void AsebaCanRecvQueueFreeFrames(uint16 id)
+/*! Free the frames of a packet in the reception queue, following the links from its first frame */
+static void AsebaCanRecvQueueFreePacket(uint16 first)
 {
-	uint16 i;
+	uint16 i = first;
+	while (i != NO_FRAME)
+	{
+		asebaCan.recvQueue[i].used = 0;
+		i = asebaCan.recvQueue[i].next;
+	}
+}
+
+/*! Insert a frame in the reception queue and return its position, do not check for overwrite */
+static uint16 AsebaCanRecvQueueInsert(const CanFrame *frame)
+{
+	uint16 pos = asebaCan.recvQueueInsertPos;
+	uint16 temp;
+	
+	// copy members one by one, as the data layer might pass a structure with only the same leading members
+	memcpy(asebaCan.recvQueue[pos].data, frame->data, sizeof(frame->data));
+	asebaCan.recvQueue[pos].id = frame->id;
+	asebaCan.recvQueue[pos].len = frame->len;
+	asebaCan.recvQueue[pos].used = 1;
+	asebaCan.recvQueue[pos].next = NO_FRAME;
+	
+	temp = pos + 1;
+	if (temp >= asebaCan.recvQueueSize)
+		temp = 0;
+	asebaCan.recvQueueInsertPos = temp;
+	
+	return pos;
+}
+
+/*! Make a complete packet available to AsebaCanRecv(), drop it if too many packets are waiting */
+static void AsebaCanCompletedQueuePush(uint16 first)
+{
+	uint16 temp = asebaCan.completedQueueInsertPos + 1;
+	if (temp >= ASEBA_CAN_COMPLETED_QUEUE_SIZE)
+		temp = 0;
 	
-	// for all used frames...
-	for (i = asebaCan.recvQueueConsumePos; i != asebaCan.recvQueueInsertPos;)
+	if (temp == asebaCan.completedQueueConsumePos)
 	{
-		// if frame is of a specific id, mark frame as unused
-		if (CANID_TO_ID(asebaCan.recvQueue[i].id) == id)
-			asebaCan.recvQueue[i].used = 0;
-		
-		i++;
-		if (i >= asebaCan.recvQueueSize)
-			i = 0;
+		AsebaCanRecvQueueFreePacket(first);
+		asebaCan.receivedPacketDroppedFP();
+		return;
 	}
+	
+	asebaCan.completedQueue[asebaCan.completedQueueInsertPos] = first;
+	asebaCan.completedQueueInsertPos = temp;
+}
+
+/*! Return the packet being reassembled for a source, or 0 if there is none; use NO_SOURCE to get a free entry */
+static AsebaCanPendingPacket* AsebaCanFindPendingPacket(uint16 source)
+{
+	uint16 i;
+	for (i = 0; i < ASEBA_CAN_MAX_PENDING_PACKETS; i++)
+		if (asebaCan.pendingPackets[i].source == source)
+			return &asebaCan.pendingPackets[i];
+	return 0;
+}
+
+/*! Forget all packets being reassembled and all complete packets */
+static void AsebaCanResetPackets()
+{
+	uint16 i;
+	for (i = 0; i < ASEBA_CAN_MAX_PENDING_PACKETS; i++)
+		asebaCan.pendingPackets[i].source = NO_SOURCE;
+	asebaCan.completedQueueInsertPos = 0;
+	asebaCan.completedQueueConsumePos = 0;
 }
 
 
@@ -204,6 +293,7 @@ void AsebaCanInit(uint16 id, AsebaCanSendFrameFP sendFrameFP, AsebaCanIntVoidFP
 	asebaCan.recvQueueSize = recvQueueSize;
 	asebaCan.recvQueueInsertPos = 0;
 	asebaCan.recvQueueConsumePos = 0;
+	AsebaCanResetPackets();
 	
 	asebaCan.sendQueueLock = 0;
 }
@@ -271,143 +361,133 @@ void AsebaCanFlushQueue(void)
 
 uint16 AsebaCanRecv(uint8 *data, size_t size, uint16 *source)
 {
-	int stopPos = -1;
-	uint16 stopId;
 	uint16 pos = 0;
-	uint16 i;
+	uint16 i, temp;
 	
-	// first scan for "short packets" and "stops"
-	for (i = asebaCan.recvQueueConsumePos; i != asebaCan.recvQueueInsertPos; )
-	{
-		if(asebaCan.recvQueue[i].used) {
-			
-			if (CANID_TO_TYPE(asebaCan.recvQueue[i].id) == TYPE_SMALL_PACKET)
-			{
-				// copy data
-				uint16 len = ASEBA_MIN(size, asebaCan.recvQueue[i].len);
-				memcpy(data, asebaCan.recvQueue[i].data, len);
-				*source = CANID_TO_ID(asebaCan.recvQueue[i].id);
-				asebaCan.recvQueue[i].used = 0;
-				
-				// garbage collect
-				AsebaCanRecvQueueGarbageCollect();
-				
-				return len;
-			}
-			// stop found, we thus must have seen start before
-			else if (CANID_TO_TYPE(asebaCan.recvQueue[i].id) == TYPE_PACKET_STOP)
-			{
-				stopPos = i;
-				stopId = CANID_TO_ID(asebaCan.recvQueue[i].id);
-				break;
-			}
-		}
-		i++;
-		if (i >= asebaCan.recvQueueSize)
-			i = 0;
-	}
+	// reclaim frames freed by the reception of dropped packets
+	AsebaCanRecvQueueGarbageCollect();
 	
-	// if we haven't found anything
-	if (stopPos < 0)
+	// if no packet is complete
+	if (asebaCan.completedQueueConsumePos == asebaCan.completedQueueInsertPos)
 		return 0;
 	
-	// collect data
-	*source = CANID_TO_ID(stopId);
-	i = asebaCan.recvQueueConsumePos;
-	while (1)
+	// collect data of the oldest complete packet, following the links between its frames
+	i = asebaCan.completedQueue[asebaCan.completedQueueConsumePos];
+	*source = CANID_TO_ID(asebaCan.recvQueue[i].id);
+	while (i != NO_FRAME)
 	{
-		if(asebaCan.recvQueue[i].used) {
-
-			if (CANID_TO_ID(asebaCan.recvQueue[i].id) == stopId)
-			{
-			if (pos < size)
-					{
-					uint16 amount = ASEBA_MIN(asebaCan.recvQueue[i].len, size - pos);
-					memcpy(data + pos, asebaCan.recvQueue[i].data, amount);
-					pos += amount;
-				}
-				asebaCan.recvQueue[i].used = 0;
-			}
-			
-			if (i == stopPos)
-				break;
-	
+		if (pos < size)
+		{
+			uint16 amount = ASEBA_MIN(asebaCan.recvQueue[i].len, size - pos);
+			memcpy(data + pos, asebaCan.recvQueue[i].data, amount);
+			pos += amount;
 		}
-		i++;
-		if (i >= asebaCan.recvQueueSize)
-			i = 0;
+		asebaCan.recvQueue[i].used = 0;
+		i = asebaCan.recvQueue[i].next;
 	}
-
+	
+	temp = asebaCan.completedQueueConsumePos + 1;
+	if (temp >= ASEBA_CAN_COMPLETED_QUEUE_SIZE)
+		temp = 0;
+	asebaCan.completedQueueConsumePos = temp;
+	
 	// garbage collect
 	AsebaCanRecvQueueGarbageCollect();
 	
 	return pos;
 }
 
-#define MAX_DROPPING_SOURCE 20
-static uint16 dropping[MAX_DROPPING_SOURCE];
-
 void AsebaCanFrameReceived(const CanFrame *frame)
 {
-	
+	uint16 type = CANID_TO_TYPE(frame->id);
 	uint16 source = CANID_TO_ID(frame->id);
+	AsebaCanPendingPacket* packet;
+	uint16 pos;
 	
-	// check whether this packet should be filtered or not
-	if (CANID_TO_TYPE(frame->id) == TYPE_SMALL_PACKET)
+	if (type == TYPE_SMALL_PACKET)
 	{
+		// check whether this packet should be filtered or not
 		if (AsebaShouldDropPacket(source, frame->data))
 			return;
+		
+		if (AsebaCanRecvQueueGetMinFreeFrames() <= 1)
+			asebaCan.receivedPacketDroppedFP();
+		else
+			AsebaCanCompletedQueuePush(AsebaCanRecvQueueInsert(frame));
 	}
-	else if (CANID_TO_TYPE(frame->id) == TYPE_PACKET_START)
+	else if (type == TYPE_PACKET_START)
 	{
-		if (AsebaShouldDropPacket(source, frame->data))
+		uint16 drop = AsebaShouldDropPacket(source, frame->data);
+		
+		// a start replaces the packet of this source whose stop was lost
+		packet = AsebaCanFindPendingPacket(source);
+		if (packet)
 		{
-			uint16 i;
-			for (i = 0; i < MAX_DROPPING_SOURCE; i++)
+			if (packet->first != NO_FRAME)
 			{
-				if (dropping[i] == 0)
-				{
-					dropping[i] = source + 1;
-					return;
-				}
+				AsebaCanRecvQueueFreePacket(packet->first);
+				asebaCan.receivedPacketDroppedFP();
 			}
 		}
-	}
-	else
-	{
-		uint16 i;
-		for (i = 0; i < MAX_DROPPING_SOURCE; i++)
+		else
 		{
-			if (dropping[i] == source + 1)
+			// if too many sources are sending at the same time, the rest of this packet will be ignored
+			packet = AsebaCanFindPendingPacket(NO_SOURCE);
+			if (!packet)
 			{
-				if (CANID_TO_TYPE(frame->id) == TYPE_PACKET_STOP)
-					dropping[i] = 0;
+				if (!drop)
+					asebaCan.receivedPacketDroppedFP();
 				return;
 			}
-		}
-	}
-	
-	if (AsebaCanRecvQueueGetMinFreeFrames() <= 1)
-	{
-		// if packet is stop, free associated frames, otherwise this could lead to everlasting used frames
-		if (CANID_TO_TYPE(frame->id) == TYPE_PACKET_STOP) {
-			AsebaCanRecvQueueFreeFrames(source);
-			AsebaCanRecvQueueGarbageCollect();
+			packet->source = source;
 		}
 		
-		// notify user
-		asebaCan.receivedPacketDroppedFP();
+		if (drop)
+		{
+			packet->first = NO_FRAME;
+		}
+		else if (AsebaCanRecvQueueGetMinFreeFrames() <= 1)
+		{
+			packet->first = NO_FRAME;
+			asebaCan.receivedPacketDroppedFP();
+		}
+		else
+		{
+			pos = AsebaCanRecvQueueInsert(frame);
+			packet->first = pos;
+			packet->last = pos;
+		}
 	}
 	else
 	{
-		uint16 temp;
-		// store and increment pos
-		memcpy(&asebaCan.recvQueue[asebaCan.recvQueueInsertPos], frame, sizeof(*frame));
-		asebaCan.recvQueue[asebaCan.recvQueueInsertPos].used = 1;
-		temp = asebaCan.recvQueueInsertPos + 1;
-		if (temp >= asebaCan.recvQueueSize)
-			temp = 0;
-		asebaCan.recvQueueInsertPos = temp;
+		// ignore frames of packets whose start was not received
+		packet = AsebaCanFindPendingPacket(source);
+		if (!packet)
+			return;
+		
+		if (packet->first != NO_FRAME)
+		{
+			if (AsebaCanRecvQueueGetMinFreeFrames() <= 1)
+			{
+				// free frames already received, and ignore the rest of this packet
+				AsebaCanRecvQueueFreePacket(packet->first);
+				packet->first = NO_FRAME;
+				asebaCan.receivedPacketDroppedFP();
+			}
+			else
+			{
+				pos = AsebaCanRecvQueueInsert(frame);
+				asebaCan.recvQueue[packet->last].next = pos;
+				packet->last = pos;
+			}
+		}
+		
+		if (type == TYPE_PACKET_STOP)
+		{
+			if (packet->first != NO_FRAME)
+				AsebaCanCompletedQueuePush(packet->first);
+			packet->source = NO_SOURCE;
+		}
 	}
 }
 
@@ -419,8 +499,28 @@ void AsebaCanRecvFreeQueue(void)
 	asebaCan.recvQueueInsertPos = 0;
 	asebaCan.recvQueueConsumePos = 0;
 	
-	for(i = 0; i < MAX_DROPPING_SOURCE; i++) 
-		dropping[i] = 0;
+	AsebaCanResetPackets();
+}
+
+#ifdef ASEBA_CAN_INSTANCES
+
+AsebaCanInstance* AsebaCanNewInstance(void)
+{
+	return (AsebaCanInstance*)calloc(1, sizeof(struct AsebaCan));
+}
+
+void AsebaCanDeleteInstance(AsebaCanInstance* instance)
+{
+	if (instance == asebaCanInstance)
+		asebaCanInstance = &asebaCanDefaultInstance;
+	free(instance);
+}
+
+void AsebaCanSelectInstance(AsebaCanInstance* instance)
+{
+	asebaCanInstance = instance ? instance : &asebaCanDefaultInstance;
 }
 
+#endif // ASEBA_CAN_INSTANCES
+
 /*@}*/
@@ -41,6 +41,11 @@ extern "C" {
 	
 	This transport layer only works on little-endian systems for now,
 	as it does not perform endian correction.
+	
+	On reception, the frames of the packets of each source are linked
+	together as they arrive, so that the frames of packets sent at
+	the same time by different nodes can be interleaved on the bus
+	without having to search for them in the reception queue.
 */
 /*@{*/
 
@@ -53,6 +58,7 @@ typedef struct
 	unsigned id:11; /*!< CAN identifier */
 	unsigned len:4; /*!< amount of bytes used in data */
 	unsigned used:1; /*!< when frame is in a circular buffer, tell if it frame is used */
+	uint16 next; /*!< when frame is in the reception queue, position of the next frame of the same packet */
 } CanFrame;
 
 /*! Pointer to a void function */
@@ -128,6 +134,26 @@ void AsebaCanFrameSent();
 /*! Return true if the recv buffer is empty, false otherwise */
 uint16 AsebaCanRecvBufferEmpty(void);
 
+// to simulate several nodes in the same process, only on hosts
+
+#ifdef ASEBA_CAN_INSTANCES
+
+/*! State of an instance of the layer, opaque */
+typedef struct AsebaCan AsebaCanInstance;
+
+/*! Create a new instance of the layer, it must be selected and then initialized with AsebaCanInit() */
+AsebaCanInstance* AsebaCanNewInstance(void);
+
+/*! Delete an instance of the layer created with AsebaCanNewInstance() */
+void AsebaCanDeleteInstance(AsebaCanInstance* instance);
+
+/*! Select the instance of the layer all other functions, including those called on interrupts, operate on.
+	@param instance instance to select, 0 to select the default one
+*/
+void AsebaCanSelectInstance(AsebaCanInstance* instance);
+
+#endif // ASEBA_CAN_INSTANCES
+
 /*@}*/
 
 #ifdef __cplusplus
@@ -24,6 +24,7 @@
 #include <poll.h>
 
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
 
@@ -62,6 +63,11 @@ using namespace std;
  * This stream (named "can") accept only one parameter:
  * 	if : The CAN interface to use
  *
+ * It updates the following parameters, that can be read with getTargetParameter():
+ * 	dropped : The number of frames the kernel dropped because the socket buffer was full
+ * 	txdropped : The number of packets not sent because the queue of the interface stayed full
+ * 	timestamp : When the kernel received the last frame of the packet being read, in seconds since the epoch
+ *
  * The interface must already be configured & upped by your distribution script.
  *
  * Usage example:
@@ -87,19 +93,37 @@ class CanStream: public SelectableStream
 		unsigned int rx_len;
 		unsigned int rx_p;
 
-		struct iovec iov;
-		struct msghdr msg;
 		struct sockaddr_can addr;
-		char ctrlmsg[CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(__u32))];
-		struct can_frame rframe;
 
 #define RX_CAN_SIZE 1000
 		struct {
 			struct can_frame f;
+			struct timeval t;
 			int used;
 		} rx_fifo[RX_CAN_SIZE];
 		int rx_insert;
 		int rx_consume;
+		struct timeval rx_timestamp;
+		__u32 rx_dropped;
+
+		// Frames received with a single system call
+#define RX_BATCH_SIZE 64
+		struct can_frame rx_batch[RX_BATCH_SIZE];
+		struct iovec rx_iov[RX_BATCH_SIZE];
+		struct mmsghdr rx_msgs[RX_BATCH_SIZE];
+		char rx_ctrlmsg[RX_BATCH_SIZE][CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(__u32))];
+
+		// Frames of a packet, sent with a single system call
+#define TX_BATCH_SIZE (ASEBA_MAX_OUTER_PACKET_SIZE / 8 + 2)
+		struct can_frame tx_batch[TX_BATCH_SIZE];
+		struct iovec tx_iov[TX_BATCH_SIZE];
+		struct mmsghdr tx_msgs[TX_BATCH_SIZE];
+		unsigned int tx_dropped;
+		// Whether the last packet was dropped because the queue of the interface stayed full
+		bool tx_stalled;
+
+		// How many times to wait for room in the queue of the interface before dropping a packet
+#define TX_RETRIES 100
 	public:
 		CanStream(const string &targetName) :
 			Stream("can"),
@@ -137,6 +161,11 @@ class CanStream: public SelectableStream
 			if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &options, sizeof(options)))
 				perror("socketcan: cannot set monitoring for dropped packets");
 
+			// Enable timestamping of received frames
+			options = 1;
+			if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &options, sizeof(options)))
+				perror("socketcan: cannot set timestamping");
+
 			addr.can_ifindex = ifr.ifr_ifindex;
 			if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
 				throw DashelException(DashelException::ConnectionFailed, 0, "Unable to bind", this);
@@ -146,16 +175,42 @@ class CanStream: public SelectableStream
 			rx_len = 0;
 			rx_p = 0;
 			memset(rx_fifo, 0, sizeof(rx_fifo));
-			iov.iov_base = &rframe;
-			msg.msg_iov = &iov;
-			msg.msg_name = &addr;
-			msg.msg_namelen = sizeof(addr);
-			msg.msg_iovlen = 1;
-			msg.msg_control = ctrlmsg;
-			msg.msg_controllen = sizeof(ctrlmsg);
-			msg.msg_flags = 0;
+			memset(&rx_timestamp, 0, sizeof(rx_timestamp));
+			rx_dropped = 0;
+			tx_dropped = 0;
+			tx_stalled = false;
+			target.addParam("dropped", "0");
+			target.addParam("txdropped", "0");
+			target.addParam("timestamp", "0.000000");
+
+			memset(rx_msgs, 0, sizeof(rx_msgs));
+			for(int i = 0; i < RX_BATCH_SIZE; i++)
+			{
+				rx_iov[i].iov_base = &rx_batch[i];
+				rx_iov[i].iov_len = sizeof(rx_batch[i]);
+				rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+				rx_msgs[i].msg_hdr.msg_iovlen = 1;
+				rx_msgs[i].msg_hdr.msg_control = rx_ctrlmsg[i];
+			}
+			memset(tx_msgs, 0, sizeof(tx_msgs));
+			for(int i = 0; i < TX_BATCH_SIZE; i++)
+			{
+				tx_iov[i].iov_base = &tx_batch[i];
+				tx_iov[i].iov_len = sizeof(tx_batch[i]);
+				tx_msgs[i].msg_hdr.msg_iov = &tx_iov[i];
+				tx_msgs[i].msg_hdr.msg_iovlen = 1;
+			}
 		}
 	private:
+		// Update the value of a parameter registered in the constructor;
+		// unlike addParam(), add() does not append it to the target name again
+		void updateParam(const char *param, const char *value)
+		{
+			char line[64];
+			snprintf(line, sizeof(line), "can:%s=%s", param, value);
+			target.add(line);
+		}
+
 		int is_packet_tx(void)
 		{
 			int packet_len;
@@ -167,32 +222,48 @@ class CanStream: public SelectableStream
 			return 0;
 		}
 
-		void can_write_frame(struct can_frame * f)
+		// Send frames from tx_batch, with as few system calls as possible
+		void can_write_frames(unsigned int count)
 		{
-			ssize_t ret;
+			unsigned int sent = 0;
+			// While the interface is stalled, do not wait for each packet before dropping it
+			int retries = tx_stalled ? TX_RETRIES : 0;
 
-			do {
-				ret = ::write(fd, f, sizeof(*f));
-
-				if(ret == -1 && errno == ENOBUFS)
+			while(sent < count)
+			{
+				int ret = sendmmsg(fd, &tx_msgs[sent], count - sent, 0);
+				if(ret > 0)
 				{
-					struct pollfd pf;
-					pf.fd = fd;
-					pf.events = POLLOUT | POLLHUP;
-					pf.revents = 0;
-					if (poll(&pf, 1, 0) == -1)
-						perror("socketcan: can_write_frame: error while polling the socket");
+					sent += ret;
+					retries = 0;
+					tx_stalled = false;
+				}
+				else if(ret == -1 && errno == EINTR)
 					continue;
+				else if(ret == -1 && errno == ENOBUFS)
+				{
+					// The queue of the interface is full, and poll() does not tell when it has room again,
+					// so wait a bit; if it stays full, for instance when no other node acknowledges frames,
+					// drop the packet, preferably before its first frame. Receivers discard the frames
+					// of a packet truncated after its first frame when the next packet starts.
+					if(retries++ >= TX_RETRIES)
+					{
+						tx_stalled = true;
+						char value[16];
+						snprintf(value, sizeof(value), "%u", ++tx_dropped);
+						updateParam("txdropped", value);
+						return;
+					}
+					usleep(1000);
 				}
-
-				if(ret != sizeof(*f))
+				else
 					throw DashelException(DashelException::IOError, 0, "Write error", this);
-			} while(0);
+			}
 		}
 
 		void send_aseba_packet()
 		{
-			struct can_frame frame;
+			struct can_frame * frame = tx_batch;
 			unsigned int packet_len = tx_buffer[0] | (tx_buffer[1] << 8); // Little endian;
 			unsigned int nodeId = tx_buffer[2] | (tx_buffer[3] << 8);
 			unsigned int msgId = tx_buffer[4] | (tx_buffer[5] << 8);
@@ -200,39 +271,40 @@ class CanStream: public SelectableStream
 			if(packet_len  <= 6) 
 			{
 				// Small packet
-				frame.can_id = TO_CANID(TYPE_SMALL_PACKET, nodeId);
-				frame.can_dlc = packet_len + 2;
-				frame.data[0] = msgId;
-				frame.data[1] = msgId >> 8;
-				memcpy(&frame.data[2], &tx_buffer[6], packet_len);
-				can_write_frame(&frame);
+				frame->can_id = TO_CANID(TYPE_SMALL_PACKET, nodeId);
+				frame->can_dlc = packet_len + 2;
+				frame->data[0] = msgId;
+				frame->data[1] = msgId >> 8;
+				memcpy(&frame->data[2], &tx_buffer[6], packet_len);
+				frame++;
 			} 
 			else 
 			{
 				unsigned char * p = &tx_buffer[6];
-				frame.can_id = TO_CANID(TYPE_PACKET_START, nodeId);
-				frame.can_dlc = 8;
-				frame.data[0] = msgId;
-				frame.data[1] = msgId >> 8;
-				memcpy(&frame.data[2], p, 6);
+				frame->can_id = TO_CANID(TYPE_PACKET_START, nodeId);
+				frame->can_dlc = 8;
+				frame->data[0] = msgId;
+				frame->data[1] = msgId >> 8;
+				memcpy(&frame->data[2], p, 6);
 				p += 6;
 				packet_len -= 6;
-				can_write_frame(&frame);
+				frame++;
 
 				while(packet_len > 8)
 				{
-					frame.can_id = TO_CANID(TYPE_PACKET_NORMAL, nodeId);
-					frame.can_dlc = 8;
-					memcpy(frame.data, p, 8);
+					frame->can_id = TO_CANID(TYPE_PACKET_NORMAL, nodeId);
+					frame->can_dlc = 8;
+					memcpy(frame->data, p, 8);
 					p+=8;
 					packet_len -= 8;
-					can_write_frame(&frame);
+					frame++;
 				}
-				frame.can_id = TO_CANID(TYPE_PACKET_STOP, nodeId);
-				frame.can_dlc = packet_len;
-				memcpy(frame.data, p, packet_len);
-				can_write_frame(&frame);
+				frame->can_id = TO_CANID(TYPE_PACKET_STOP, nodeId);
+				frame->can_dlc = packet_len;
+				memcpy(frame->data, p, packet_len);
+				frame++;
 			}
+			can_write_frames(frame - tx_batch);
 			tx_len = 0;
 		}
 	public:
@@ -286,6 +358,7 @@ class CanStream: public SelectableStream
 						memcpy(&rx_buffer[4], rx_fifo[i].f.data, rx_fifo[i].f.can_dlc);
 						rx_p = 0;
 						rx_len = rx_fifo[i].f.can_dlc + 4;
+						rx_timestamp = rx_fifo[i].t;
 						 
 						rx_fifo[i].used = 0; // Free the frame (pack_fifo())
 						return 1;
@@ -313,6 +386,12 @@ class CanStream: public SelectableStream
 			{
 				if(rx_fifo[i].used && CANID_TO_ID(rx_fifo[i].f.can_id) == stopId)
 				{
+					if(rx_len > 4 && CANID_TO_TYPE(rx_fifo[i].f.can_id) == TYPE_PACKET_START)
+					{
+						// The sender dropped the end of the previous packet, restart with this one
+						rx_len = 4;
+						ignore = 0;
+					}
 					if(rx_len == 4 && CANID_TO_TYPE(rx_fifo[i].f.can_id) != TYPE_PACKET_START)
 						// We got a stop, but not a start, let's ignore this packet
 						ignore = 1;
@@ -341,54 +420,88 @@ class CanStream: public SelectableStream
 				rx_buffer[0] = rx_len - 6;
 				rx_buffer[1] = (rx_len - 6) >> 8;
 				rx_p = 0;
+				rx_timestamp = rx_fifo[stopPos].t;
 				return 1;
 			}
 		}
-		int fifo_full() 
+		int fifo_room() 
 		{
-			int i = rx_insert + 1;
-			if(i == RX_CAN_SIZE)
-				i = 0;
-			return i == rx_consume;
+			int room = rx_consume - rx_insert - 1;
+			if(room < 0)
+				room += RX_CAN_SIZE;
+			return room;
 		}
 
-		void read_iface(void)
+		// Receive all available frames, up to the room in the fifo, waiting for at least one
+		void receive_frames(void)
 		{
-			int def;
-			while(1)
-			{
-				while((def = defragment()) == -1);
-				if(def == 1)
-					break;
+			int count = fifo_room();
+			if(count == 0)
+				throw DashelException(DashelException::IOError, 0, "Fifo full", this);
+			if(count > RX_BATCH_SIZE)
+				count = RX_BATCH_SIZE;
 
+			for(int i = 0; i < count; i++)
+			{
+				rx_msgs[i].msg_hdr.msg_controllen = sizeof(rx_ctrlmsg[i]);
+				rx_msgs[i].msg_hdr.msg_flags = 0;
+			}
+			do
+				count = recvmmsg(fd, rx_msgs, count, MSG_WAITFORONE, NULL);
+			while(count == -1 && errno == EINTR);
+			if(count <= 0)
+				throw DashelException(DashelException::IOError, 0, "Read error", this);
+
+			const __u32 dropped = rx_dropped;
+			for(int i = 0; i < count; i++)
+			{
+				struct msghdr * msg = &rx_msgs[i].msg_hdr;
 				struct cmsghdr *cmsg;
-				iov.iov_len = sizeof(rframe);
-				msg.msg_flags = 0;
-				if(recvmsg(fd, &msg, 0) < (int) sizeof(rframe))
+				if(rx_msgs[i].msg_len < sizeof(struct can_frame))
 					throw DashelException(DashelException::IOError, 0, "Read error", this);
 
-				for(cmsg = CMSG_FIRSTHDR(&msg); 
+				// push to fifo ...
+				memcpy(&rx_fifo[rx_insert].f, &rx_batch[i], sizeof(struct can_frame));
+				memset(&rx_fifo[rx_insert].t, 0, sizeof(struct timeval));
+				for(cmsg = CMSG_FIRSTHDR(msg); 
 					cmsg && (cmsg->cmsg_level == SOL_SOCKET);
-					cmsg = CMSG_NXTHDR(&msg,cmsg))
+					cmsg = CMSG_NXTHDR(msg,cmsg))
 				{
-					if(cmsg->cmsg_type == SO_RXQ_OVFL)
-					{
-						__u32 * dropcnt = (__u32 *) CMSG_DATA(cmsg);
-						if(*dropcnt)
-							throw DashelException(DashelException::IOError, 0, "Packet dropped", this);
-					}
+					if(cmsg->cmsg_type == SO_TIMESTAMP)
+						memcpy(&rx_fifo[rx_insert].t, CMSG_DATA(cmsg), sizeof(struct timeval));
+					else if(cmsg->cmsg_type == SO_RXQ_OVFL)
+						memcpy(&rx_dropped, CMSG_DATA(cmsg), sizeof(rx_dropped));
 				}
-			
-				if(fifo_full())
-					throw DashelException(DashelException::IOError, 0, "Fifo full", this);
-
-				// push to fifo ...
-				memcpy(&rx_fifo[rx_insert].f,&rframe,sizeof(rframe));
 				rx_fifo[rx_insert++].used = 1;
 				if(rx_insert == RX_CAN_SIZE)
 					rx_insert = 0;
 			}
+
+			// The kernel counts dropped frames since the creation of the socket
+			if(rx_dropped != dropped)
+			{
+				char value[16];
+				snprintf(value, sizeof(value), "%u", rx_dropped);
+				updateParam("dropped", value);
+			}
+		}
+
+		void read_iface(void)
+		{
+			int def;
+			while(1)
+			{
+				while((def = defragment()) == -1);
+				if(def == 1)
+					break;
+
+				receive_frames();
+			}
 			pack_fifo();
+
+			char value[32];
+			snprintf(value, sizeof(value), "%ld.%06ld", (long)rx_timestamp.tv_sec, (long)rx_timestamp.tv_usec);
+			updateParam("timestamp", value);
 		}
 	public:
 		virtual void read(void *data, size_t size) 
@@ -46,16 +46,36 @@ void AsebaVMInit(AsebaVMState *vm)
 	vm->pc = 0;
 	vm->flags = 0;
 	vm->breakpointsCount = 0;
+	vm->subscriptionsCount = 0;
+	vm->predecodedValid = 0;
+	vm->eventIndexSlots = 0;
 	
 	// fill with no event
 	vm->bytecode[0] = 0;
 	memset(vm->variables, 0, vm->variablesSize*sizeof(sint16));
 }
 
+//! Slot of event in the event dispatch index, before probing; local events count down from 0xffff, so fold the high byte in
+#define EVENT_INDEX_HASH(event, mask) (((event) ^ ((event) >> 8)) & (mask))
+
 uint16 AsebaVMGetEventAddress(AsebaVMState *vm, uint16 event)
 {
 	uint16 eventVectorSize = vm->bytecode[0];
 	uint16 i;
+	
+	// if there is an index, look into it, an empty slot (address 0) ends the probing
+	if (vm->eventIndexSlots)
+	{
+		const uint16 mask = vm->eventIndexSlots - 1;
+		uint16 slot = EVENT_INDEX_HASH(event, mask);
+		while (vm->eventIndex[2 * slot + 1])
+		{
+			if (vm->eventIndex[2 * slot] == event)
+				return vm->eventIndex[2 * slot + 1];
+			slot = (slot + 1) & mask;
+		}
+		return 0;
+	}
 
 	// look into event vectors and if event match execute corresponding bytecode
 	for (i = 1; i < eventVectorSize; i += 2)
@@ -577,6 +597,632 @@ void AsebaDebugBareRun(AsebaVMState *vm, uint16 stepsLimit)
 	AsebaMaskClear(vm->flags, ASEBA_VM_EVENT_RUNNING_MASK);
 }
 
+#ifdef ASEBA_VM_THREADED_DISPATCH
+
+#ifndef __GNUC__
+	#error "ASEBA_VM_THREADED_DISPATCH requires the labels-as-values extension of GCC"
+#endif
+
+/*! Superinstructions of the pre-decoded cache, numbered after the bytecodes */
+enum
+{
+	ASEBA_VM_SUPER_LOAD_LOAD_BINARY_STORE = 16,
+	ASEBA_VM_SUPER_LOAD_IMMEDIATE_BINARY_STORE,
+	ASEBA_VM_SUPER_IMMEDIATE_CONDITIONAL_BRANCH,
+	ASEBA_VM_SUPER_LOAD_IMMEDIATE_CONDITIONAL_BRANCH,
+	ASEBA_VM_SUPERINSTRUCTIONS_END
+};
+
+//! Return true if bytecode b has identifier id
+#define IS_BYTECODE(b, id) (((b) >> 12) == (id))
+
+/*! Return true if the binary operator of bytecode b can be executed in a superinstruction,
+	that is, it cannot raise an execution error */
+static uint16 AsebaVMIsSafeBinaryOperator(uint16 b)
+{
+	const uint16 op = b & ASEBA_BINARY_OPERATOR_MASK;
+	return op <= ASEBA_OP_AND && op != ASEBA_OP_DIV && op != ASEBA_OP_MOD;
+}
+
+/*! Return true if the conditional branch at address pc has both destinations inside the bytecode */
+static uint16 AsebaVMIsSafeConditionalBranch(AsebaVMState *vm, uint16 pc)
+{
+	const sint16 falseDisp = (sint16)vm->bytecode[pc + 1];
+	return (pc + 2 < vm->bytecodeSize) && (pc + falseDisp >= 0) && (pc + falseDisp < vm->bytecodeSize);
+}
+
+/*! Fill vm->predecoded from vm->bytecode.
+	Every address holds the identifier of its bytecode, or of a superinstruction if
+	a fusable sequence starts there. As addresses are kept, jumps, breakpoints and
+	messages use the original pc and entering the middle of a sequence is fine. */
+static void AsebaVMPredecode(AsebaVMState *vm)
+{
+	const uint16 * const b = vm->bytecode;
+	uint16 pc;
+	for (pc = 0; pc < vm->bytecodeSize; pc++)
+	{
+		AsebaVMPredecodedBytecode* d = &vm->predecoded[pc];
+		const uint16 left = vm->bytecodeSize - pc;
+		d->op = b[pc] >> 12;
+		
+		if (left >= 4 && IS_BYTECODE(b[pc], ASEBA_BYTECODE_LOAD) &&
+			IS_BYTECODE(b[pc+2], ASEBA_BYTECODE_BINARY_ARITHMETIC) && AsebaVMIsSafeBinaryOperator(b[pc+2]) &&
+			IS_BYTECODE(b[pc+3], ASEBA_BYTECODE_STORE) &&
+			(b[pc] & 0x0fff) < vm->variablesSize && (b[pc+3] & 0x0fff) < vm->variablesSize
+		)
+		{
+			d->args[0] = b[pc] & 0x0fff;
+			d->args[2] = b[pc+2] & ASEBA_BINARY_OPERATOR_MASK;
+			d->args[3] = b[pc+3] & 0x0fff;
+			if (IS_BYTECODE(b[pc+1], ASEBA_BYTECODE_LOAD) && (b[pc+1] & 0x0fff) < vm->variablesSize)
+			{
+				d->op = ASEBA_VM_SUPER_LOAD_LOAD_BINARY_STORE;
+				d->args[1] = b[pc+1] & 0x0fff;
+			}
+			else if (IS_BYTECODE(b[pc+1], ASEBA_BYTECODE_SMALL_IMMEDIATE))
+			{
+				d->op = ASEBA_VM_SUPER_LOAD_IMMEDIATE_BINARY_STORE;
+				d->args[1] = ((sint16)(b[pc+1] << 4)) >> 4;
+			}
+		}
+		else if (left >= 4 && IS_BYTECODE(b[pc], ASEBA_BYTECODE_LOAD) && (b[pc] & 0x0fff) < vm->variablesSize &&
+			IS_BYTECODE(b[pc+1], ASEBA_BYTECODE_SMALL_IMMEDIATE) &&
+			IS_BYTECODE(b[pc+2], ASEBA_BYTECODE_CONDITIONAL_BRANCH) && AsebaVMIsSafeBinaryOperator(b[pc+2]) &&
+			AsebaVMIsSafeConditionalBranch(vm, pc + 2)
+		)
+		{
+			d->op = ASEBA_VM_SUPER_LOAD_IMMEDIATE_CONDITIONAL_BRANCH;
+			d->args[0] = b[pc] & 0x0fff;
+			d->args[1] = ((sint16)(b[pc+1] << 4)) >> 4;
+			d->args[2] = b[pc+2] & ASEBA_BINARY_OPERATOR_MASK;
+		}
+		else if (left >= 3 && IS_BYTECODE(b[pc], ASEBA_BYTECODE_SMALL_IMMEDIATE) &&
+			IS_BYTECODE(b[pc+1], ASEBA_BYTECODE_CONDITIONAL_BRANCH) && AsebaVMIsSafeBinaryOperator(b[pc+1]) &&
+			AsebaVMIsSafeConditionalBranch(vm, pc + 1)
+		)
+		{
+			d->op = ASEBA_VM_SUPER_IMMEDIATE_CONDITIONAL_BRANCH;
+			d->args[1] = ((sint16)(b[pc] << 4)) >> 4;
+			d->args[2] = b[pc+1] & ASEBA_BINARY_OPERATOR_MASK;
+		}
+	}
+}
+
+//! Write back the cached program counter and stack pointer to the VM
+#define THREADED_SAVE_STATE() { vm->pc = pc; vm->sp = sp; }
+//! Reload the program counter and stack pointer from the VM, as a callee might have changed them
+#define THREADED_LOAD_STATE() { pc = vm->pc; sp = vm->sp; predecoded = vm->predecodedValid ? vm->predecoded : 0; }
+
+//! Fetch the bytecode at pc and jump to its handler, or to the one of its superinstruction if there is a pre-decoded cache
+#define THREADED_FETCH() \
+	{ \
+		bytecode = vmBytecode[pc]; \
+		if (predecoded) \
+		{ \
+			decoded = &predecoded[pc]; \
+			goto *dispatchTable[decoded->op]; \
+		} \
+		goto *dispatchTable[bytecode >> 12]; \
+	}
+
+//! Go to the next bytecode, leaving the loop if the steps limit is reached
+#define THREADED_NEXT() \
+	{ \
+		if (--stepsLeft == 0) \
+		{ \
+			if (stepsLimit) \
+				goto leave; \
+			stepsLeft = 0xffffffff; \
+		} \
+		THREADED_FETCH(); \
+	}
+
+//! Go to the next bytecode after an instruction that might have changed the flags
+#define THREADED_CHECK_NEXT() \
+	{ \
+		if (--stepsLeft == 0) \
+		{ \
+			if (stepsLimit) \
+				goto leave; \
+			stepsLeft = 0xffffffff; \
+		} \
+		goto check; \
+	}
+
+#ifdef ASEBA_ASSERT
+	//! Report an assertion through AsebaAssert with the VM state in sync, and force a flags check
+	#define THREADED_ASSERT(cond, reason) \
+		if (cond) \
+		{ \
+			THREADED_SAVE_STATE(); \
+			AsebaAssert(vm, reason); \
+			THREADED_LOAD_STATE(); \
+			assertRaised = 1; \
+		}
+	//! Go to the next bytecode, checking the flags if an assertion was raised
+	#define THREADED_DISPATCH() \
+		{ \
+			if (assertRaised) \
+			{ \
+				assertRaised = 0; \
+				THREADED_CHECK_NEXT(); \
+			} \
+			THREADED_NEXT(); \
+		}
+#else // ASEBA_ASSERT
+	#define THREADED_ASSERT(cond, reason)
+	#define THREADED_DISPATCH() THREADED_NEXT()
+#endif // ASEBA_ASSERT
+
+/*! Run without support of breakpoints using direct-threaded dispatch.
+	The program counter and stack pointer are kept in locals and are only written
+	back when leaving the loop or calling code outside the VM.
+	The flags are only checked after bytecodes that can change them (stop, emit,
+	native call, execution errors), so unlike AsebaDebugBareRun, an interrupt
+	clearing ASEBA_VM_EVENT_RUNNING_MASK is not seen before the next such bytecode.
+	This is why this engine is meant for host targets only.
+	Otherwise, the result is identical to AsebaDebugBareRun. */
+void AsebaDebugThreadedRun(AsebaVMState *vm, uint16 stepsLimit)
+{
+	// order must match AsebaBytecodeId
+	static const void* const dispatchTable[ASEBA_VM_SUPERINSTRUCTIONS_END] = {
+		&&op_stop,
+		&&op_small_immediate,
+		&&op_large_immediate,
+		&&op_load,
+		&&op_store,
+		&&op_load_indirect,
+		&&op_store_indirect,
+		&&op_unary_arithmetic,
+		&&op_binary_arithmetic,
+		&&op_jump,
+		&&op_conditional_branch,
+		&&op_emit,
+		&&op_native_call,
+		&&op_sub_call,
+		&&op_sub_ret,
+		&&op_unknown,
+		&&super_load_load_binary_store,
+		&&super_load_immediate_binary_store,
+		&&super_immediate_conditional_branch,
+		&&super_load_immediate_conditional_branch
+	};
+
+	uint16 * const vmBytecode = vm->bytecode;
+	sint16 * const variables = vm->variables;
+	sint16 * const stack = vm->stack;
+	const AsebaVMPredecodedBytecode* predecoded = vm->predecodedValid ? vm->predecoded : 0;
+	const AsebaVMPredecodedBytecode* decoded = 0;
+	uint16 pc = vm->pc;
+	sint16 sp = vm->sp;
+	uint16 bytecode;
+	// as 0 means no limit, in that case wrap around when reaching 0
+	uint32 stepsLeft = stepsLimit ? stepsLimit : 0xffffffff;
+	#ifdef ASEBA_ASSERT
+	uint16 assertRaised = 0;
+	#endif
+
+	AsebaMaskSet(vm->flags, ASEBA_VM_EVENT_RUNNING_MASK);
+
+	check:
+	if (AsebaMaskIsClear(vm->flags, ASEBA_VM_EVENT_ACTIVE_MASK) ||
+		AsebaMaskIsClear(vm->flags, ASEBA_VM_EVENT_RUNNING_MASK)
+	)
+		goto leave;
+	THREADED_FETCH();
+
+	// Bytecode: Stop
+	op_stop:
+	{
+		AsebaMaskClear(vm->flags, ASEBA_VM_EVENT_ACTIVE_MASK);
+		THREADED_CHECK_NEXT();
+	}
+
+	// Bytecode: Small Immediate
+	op_small_immediate:
+	{
+		THREADED_ASSERT(sp + 1 >= vm->stackSize, ASEBA_ASSERT_STACK_OVERFLOW);
+		stack[++sp] = ((sint16)(bytecode << 4)) >> 4;
+		pc++;
+		THREADED_DISPATCH();
+	}
+
+	// Bytecode: Large Immediate
+	op_large_immediate:
+	{
+		THREADED_ASSERT(sp + 1 >= vm->stackSize, ASEBA_ASSERT_STACK_OVERFLOW);
+		stack[++sp] = vmBytecode[pc + 1];
+		pc += 2;
+		THREADED_DISPATCH();
+	}
+
+	// Bytecode: Load
+	op_load:
+	{
+		const uint16 variableIndex = bytecode & 0x0fff;
+		THREADED_ASSERT(sp + 1 >= vm->stackSize, ASEBA_ASSERT_STACK_OVERFLOW);
+		THREADED_ASSERT(variableIndex >= vm->variablesSize, ASEBA_ASSERT_OUT_OF_VARIABLES_BOUNDS);
+		stack[++sp] = variables[variableIndex];
+		pc++;
+		THREADED_DISPATCH();
+	}
+
+	// Bytecode: Store
+	op_store:
+	{
+		const uint16 variableIndex = bytecode & 0x0fff;
+		THREADED_ASSERT(sp < 0, ASEBA_ASSERT_STACK_UNDERFLOW);
+		THREADED_ASSERT(variableIndex >= vm->variablesSize, ASEBA_ASSERT_OUT_OF_VARIABLES_BOUNDS);
+		variables[variableIndex] = stack[sp--];
+		pc++;
+		THREADED_DISPATCH();
+	}
+
+	// Bytecode: Load Indirect
+	op_load_indirect:
+	{
+		const uint16 arrayIndex = bytecode & 0x0fff;
+		uint16 arraySize;
+		uint16 variableIndex;
+
+		THREADED_ASSERT(sp < 0, ASEBA_ASSERT_STACK_UNDERFLOW);
+		arraySize = vmBytecode[pc + 1];
+		variableIndex = stack[sp];
+		if (variableIndex >= arraySize)
+		{
+			uint16 buffer[3];
+			buffer[0] = pc;
+			buffer[1] = arraySize;
+			buffer[2] = variableIndex;
+			THREADED_SAVE_STATE();
+			vm->flags = ASEBA_VM_STEP_BY_STEP_MASK;
+			AsebaSendMessageWords(vm, ASEBA_MESSAGE_ARRAY_ACCESS_OUT_OF_BOUNDS, buffer, 3);
+			if(AsebaVMErrorCB)
+				AsebaVMErrorCB(vm,NULL);
+			THREADED_LOAD_STATE();
+			THREADED_CHECK_NEXT();
+		}
+		stack[sp] = variables[arrayIndex + variableIndex];
+		pc += 2;
+		THREADED_DISPATCH();
+	}
+
+	// Bytecode: Store Indirect
+	op_store_indirect:
+	{
+		const uint16 arrayIndex = bytecode & 0x0fff;
+		uint16 arraySize;
+		uint16 variableIndex;
+
+		THREADED_ASSERT(sp < 1, ASEBA_ASSERT_STACK_UNDERFLOW);
+		arraySize = vmBytecode[pc + 1];
+		variableIndex = (uint16)stack[sp];
+		if (variableIndex >= arraySize)
+		{
+			uint16 buffer[3];
+			buffer[0] = pc;
+			buffer[1] = arraySize;
+			buffer[2] = variableIndex;
+			THREADED_SAVE_STATE();
+			vm->flags = ASEBA_VM_STEP_BY_STEP_MASK;
+			AsebaSendMessageWords(vm, ASEBA_MESSAGE_ARRAY_ACCESS_OUT_OF_BOUNDS, buffer, 3);
+			if(AsebaVMErrorCB)
+				AsebaVMErrorCB(vm,NULL);
+			THREADED_LOAD_STATE();
+			THREADED_CHECK_NEXT();
+		}
+		variables[arrayIndex + variableIndex] = stack[sp - 1];
+		sp -= 2;
+		pc += 2;
+		THREADED_DISPATCH();
+	}
+
+	// Bytecode: Unary Arithmetic
+	op_unary_arithmetic:
+	{
+		THREADED_ASSERT(sp < 0, ASEBA_ASSERT_STACK_UNDERFLOW);
+		switch (bytecode & ASEBA_UNARY_OPERATOR_MASK)
+		{
+			case ASEBA_UNARY_OP_SUB: stack[sp] = -stack[sp]; break;
+			case ASEBA_UNARY_OP_ABS: stack[sp] = stack[sp] >= 0 ? stack[sp] : -stack[sp]; break;
+			case ASEBA_UNARY_OP_BIT_NOT: stack[sp] = ~stack[sp]; break;
+			default:
+			{
+				sint16 opResult;
+				THREADED_SAVE_STATE();
+				opResult = AsebaVMDoUnaryOperation(vm, stack[sp], bytecode & ASEBA_UNARY_OPERATOR_MASK);
+				THREADED_LOAD_STATE();
+				stack[sp] = opResult;
+				pc++;
+				THREADED_CHECK_NEXT();
+			}
+		}
+		pc++;
+		THREADED_DISPATCH();
+	}
+
+	// Bytecode: Binary Arithmetic
+	op_binary_arithmetic:
+	{
+		const uint16 op = bytecode & ASEBA_BINARY_OPERATOR_MASK;
+		sint16 valueOne, valueTwo, opResult;
+
+		THREADED_ASSERT(sp < 1, ASEBA_ASSERT_STACK_UNDERFLOW);
+		valueOne = stack[sp - 1];
+		valueTwo = stack[sp];
+		// division by zero and unknown operators access the VM
+		if ((op == ASEBA_OP_DIV && valueTwo == 0) || op > ASEBA_OP_AND)
+		{
+			THREADED_SAVE_STATE();
+			opResult = AsebaVMDoBinaryOperation(vm, valueOne, valueTwo, op);
+			THREADED_LOAD_STATE();
+			sp--;
+			stack[sp] = opResult;
+			pc++;
+			THREADED_CHECK_NEXT();
+		}
+		sp--;
+		stack[sp] = AsebaVMDoBinaryOperation(vm, valueOne, valueTwo, op);
+		pc++;
+		THREADED_DISPATCH();
+	}
+
+	// Bytecode: Jump
+	op_jump:
+	{
+		const sint16 disp = ((sint16)(bytecode << 4)) >> 4;
+		THREADED_ASSERT((pc + disp < 0) || (pc + disp >= vm->bytecodeSize), ASEBA_ASSERT_OUT_OF_BYTECODE_BOUNDS);
+		pc += disp;
+		THREADED_DISPATCH();
+	}
+
+	// Bytecode: Conditional Branch
+	op_conditional_branch:
+	{
+		const uint16 op = bytecode & ASEBA_BINARY_OPERATOR_MASK;
+		sint16 valueOne, valueTwo, conditionResult;
+		sint16 disp;
+		uint16 flagsMightChange = 0;
+
+		THREADED_ASSERT(sp < 1, ASEBA_ASSERT_STACK_OVERFLOW);
+		valueOne = stack[sp - 1];
+		valueTwo = stack[sp];
+		// division by zero and unknown operators access the VM
+		if ((op == ASEBA_OP_DIV && valueTwo == 0) || op > ASEBA_OP_AND)
+		{
+			THREADED_SAVE_STATE();
+			conditionResult = AsebaVMDoBinaryOperation(vm, valueOne, valueTwo, op);
+			THREADED_LOAD_STATE();
+			flagsMightChange = 1;
+		}
+		else
+			conditionResult = AsebaVMDoBinaryOperation(vm, valueOne, valueTwo, op);
+		sp -= 2;
+
+		// is the condition really true ?
+		if (conditionResult && !(GET_BIT(bytecode, ASEBA_IF_IS_WHEN_BIT) && GET_BIT(bytecode, ASEBA_IF_WAS_TRUE_BIT)))
+			disp = 2;
+		else
+			disp = (sint16)vmBytecode[pc + 1];
+
+		// write back condition result
+		if (conditionResult)
+			BIT_SET(vmBytecode[pc], ASEBA_IF_WAS_TRUE_BIT);
+		else
+			BIT_CLR(vmBytecode[pc], ASEBA_IF_WAS_TRUE_BIT);
+
+		THREADED_ASSERT((pc + disp < 0) || (pc + disp >= vm->bytecodeSize), ASEBA_ASSERT_OUT_OF_BYTECODE_BOUNDS);
+		pc += disp;
+		if (flagsMightChange)
+			THREADED_CHECK_NEXT();
+		THREADED_DISPATCH();
+	}
+
+	// Bytecode: Emit
+	op_emit:
+	{
+		const uint16 start = vmBytecode[pc + 1];
+		const uint16 length = vmBytecode[pc + 2];
+
+		THREADED_ASSERT(length > ASEBA_MAX_EVENT_ARG_SIZE, ASEBA_ASSERT_EMIT_BUFFER_TOO_LONG);
+		THREADED_SAVE_STATE();
+		AsebaSendMessageWords(vm, bytecode & 0x0fff, variables + start, length);
+		THREADED_LOAD_STATE();
+		pc += 3;
+		THREADED_CHECK_NEXT();
+	}
+
+	// Bytecode: Call
+	op_native_call:
+	{
+		THREADED_SAVE_STATE();
+		AsebaNativeFunction(vm, bytecode & 0x0fff);
+		THREADED_LOAD_STATE();
+		pc++;
+		THREADED_CHECK_NEXT();
+	}
+
+	// Bytecode: Subroutine call
+	op_sub_call:
+	{
+		stack[++sp] = pc + 1;
+		pc = bytecode & 0x0fff;
+		THREADED_DISPATCH();
+	}
+
+	// Bytecode: Subroutine return
+	op_sub_ret:
+	{
+		pc = stack[sp--];
+		THREADED_DISPATCH();
+	}
+
+	op_unknown:
+	{
+		THREADED_ASSERT(1, ASEBA_ASSERT_UNKNOWN_BYTECODE);
+		THREADED_DISPATCH();
+	}
+
+	// Superinstructions from the pre-decoded cache.
+	// Their operands were checked by AsebaVMPredecode, but if the remaining steps or
+	// the stack are not sufficient, they fall back to executing their first bytecode alone,
+	// so that limits and errors are handled exactly as without them.
+
+	// Superinstruction: Load, Load, Binary Arithmetic, Store
+	super_load_load_binary_store:
+	{
+		sint16 valueTwo, opResult;
+		if (stepsLeft < 4 || sp + 2 >= vm->stackSize)
+			goto fallback;
+		valueTwo = variables[decoded->args[1]];
+		opResult = AsebaVMDoBinaryOperation(vm, variables[decoded->args[0]], valueTwo, decoded->args[2]);
+		stack[sp + 1] = opResult;
+		stack[sp + 2] = valueTwo;
+		variables[decoded->args[3]] = opResult;
+		pc += 4;
+		stepsLeft -= 3;
+		THREADED_NEXT();
+	}
+
+	// Superinstruction: Load, Small Immediate, Binary Arithmetic, Store
+	super_load_immediate_binary_store:
+	{
+		sint16 opResult;
+		if (stepsLeft < 4 || sp + 2 >= vm->stackSize)
+			goto fallback;
+		opResult = AsebaVMDoBinaryOperation(vm, variables[decoded->args[0]], (sint16)decoded->args[1], decoded->args[2]);
+		stack[sp + 1] = opResult;
+		stack[sp + 2] = (sint16)decoded->args[1];
+		variables[decoded->args[3]] = opResult;
+		pc += 4;
+		stepsLeft -= 3;
+		THREADED_NEXT();
+	}
+
+	// Superinstruction: Small Immediate, Conditional Branch
+	super_immediate_conditional_branch:
+	{
+		if (stepsLeft < 2 || sp < 0 || sp + 1 >= vm->stackSize)
+			goto fallback;
+		stack[sp + 1] = (sint16)decoded->args[1];
+		sp -= 1;
+		pc += 1;
+		stepsLeft -= 1;
+		goto super_conditional_branch;
+	}
+
+	// Superinstruction: Load, Small Immediate, Conditional Branch
+	super_load_immediate_conditional_branch:
+	{
+		if (stepsLeft < 3 || sp + 2 >= vm->stackSize)
+			goto fallback;
+		stack[sp + 1] = variables[decoded->args[0]];
+		stack[sp + 2] = (sint16)decoded->args[1];
+		pc += 2;
+		stepsLeft -= 2;
+		goto super_conditional_branch;
+	}
+
+	// common tail of the conditional branch superinstructions, pc is the address of the branch
+	super_conditional_branch:
+	{
+		const uint16 branchBytecode = vmBytecode[pc];
+		const sint16 conditionResult = AsebaVMDoBinaryOperation(vm, stack[sp + 1], (sint16)decoded->args[1], decoded->args[2]);
+		sint16 disp;
+
+		// is the condition really true ?
+		if (conditionResult && !(GET_BIT(branchBytecode, ASEBA_IF_IS_WHEN_BIT) && GET_BIT(branchBytecode, ASEBA_IF_WAS_TRUE_BIT)))
+			disp = 2;
+		else
+			disp = (sint16)vmBytecode[pc + 1];
+
+		// write back condition result
+		if (conditionResult)
+			BIT_SET(vmBytecode[pc], ASEBA_IF_WAS_TRUE_BIT);
+		else
+			BIT_CLR(vmBytecode[pc], ASEBA_IF_WAS_TRUE_BIT);
+
+		pc += disp;
+		THREADED_NEXT();
+	}
+
+	fallback:
+	goto *dispatchTable[bytecode >> 12];
+
+	leave:
+	THREADED_SAVE_STATE();
+	AsebaMaskClear(vm->flags, ASEBA_VM_EVENT_RUNNING_MASK);
+}
+
+#endif // ASEBA_VM_THREADED_DISPATCH
+
+/*! Rebuild the event dispatch index from the event vector table.
+	The index is an open-addressing hash table of (event, address) pairs, with a power of two
+	number of slots, at most half of them used; if eventIndex is too small, the index is
+	disabled and AsebaVMGetEventAddress scans the event vector table. */
+static void AsebaVMBuildEventIndex(AsebaVMState *vm)
+{
+	uint16 eventVectorSize = vm->bytecode[0];
+	uint16 eventCount;
+	uint16 slots, mask;
+	uint16 i;
+	
+	vm->eventIndexSlots = 0;
+	if (!vm->eventIndex || eventVectorSize > vm->bytecodeSize)
+		return;
+	
+	// find the largest power of two number of slots fitting in the memory
+	eventCount = eventVectorSize / 2;
+	slots = 1;
+	while (slots <= vm->eventIndexSize / 4)
+		slots *= 2;
+	if (slots < 2 * eventCount || slots * 2 > vm->eventIndexSize)
+		return;
+	mask = slots - 1;
+	
+	for (i = 0; i < slots; i++)
+		vm->eventIndex[2 * i + 1] = 0;
+	for (i = 1; i + 1 < eventVectorSize; i += 2)
+	{
+		const uint16 event = vm->bytecode[i];
+		const uint16 address = vm->bytecode[i + 1];
+		uint16 slot = EVENT_INDEX_HASH(event, mask);
+		
+		// an event without address is not handled, and only the first vector of an event is used
+		if (address == 0)
+			continue;
+		while (vm->eventIndex[2 * slot + 1] && vm->eventIndex[2 * slot] != event)
+			slot = (slot + 1) & mask;
+		if (vm->eventIndex[2 * slot + 1])
+			continue;
+		vm->eventIndex[2 * slot] = event;
+		vm->eventIndex[2 * slot + 1] = address;
+	}
+	vm->eventIndexSlots = slots;
+}
+
+void AsebaVMBytecodeChanged(AsebaVMState *vm)
+{
+	AsebaVMBuildEventIndex(vm);
+	
+	#ifdef ASEBA_VM_THREADED_DISPATCH
+	if (vm->predecoded)
+	{
+		AsebaVMPredecode(vm);
+		vm->predecodedValid = 1;
+	}
+	#endif // ASEBA_VM_THREADED_DISPATCH
+}
+
+uint16 AsebaVMPredecodedSize(uint16 bytecodeSize)
+{
+	#ifdef ASEBA_VM_THREADED_DISPATCH
+	return bytecodeSize;
+	#else // ASEBA_VM_THREADED_DISPATCH
+	return 0;
+	#endif // ASEBA_VM_THREADED_DISPATCH
+}
+
 /*! Run with support of breakpoints.
 	Also check ASEBA_VM_EVENT_RUNNING_MASK to exit on interrupts. */
 void AsebaDebugBreakpointRun(AsebaVMState *vm, uint16 stepsLimit)
@@ -636,7 +1282,11 @@ uint16 AsebaVMRun(AsebaVMState *vm, uint16 stepsLimit)
 	if (vm->breakpointsCount)
 		AsebaDebugBreakpointRun(vm, stepsLimit);
 	else
+	#ifdef ASEBA_VM_THREADED_DISPATCH
+		AsebaDebugThreadedRun(vm, stepsLimit);
+	#else
 		AsebaDebugBareRun(vm, stepsLimit);
+	#endif
 	
 	return 1;
 }
@@ -684,6 +1334,130 @@ void AsebaVMClearBreakpoints(AsebaVMState *vm)
 	vm->breakpointsCount = 0;
 }
 
+/*! Return whether the variables of subscription differ from what clients have; without variablesShadow, this is unknown, so return true. */
+static uint16 AsebaVMSubscriptionChanged(AsebaVMState *vm, const AsebaVMSubscription *subscription)
+{
+	uint16 i;
+	if (!vm->variablesShadow)
+		return 1;
+	for (i = subscription->start; i < subscription->start + subscription->length; i++)
+		if (vm->variables[i] != vm->variablesShadow[i])
+			return 1;
+	return 0;
+}
+
+/*! Send the variables of subscription, in as many messages as needed; if delta, only send what changed since they were last sent. */
+static void AsebaVMSendSubscription(AsebaVMState *vm, AsebaVMSubscription *subscription, uint16 delta)
+{
+	const uint16 maxLength = ASEBA_MAX_EVENT_ARG_COUNT - 1;
+	uint16 start = subscription->start;
+	uint16 length = subscription->length;
+	while (length > maxLength)
+	{
+		if (delta)
+			AsebaSendVariablesDelta(vm, start, maxLength);
+		else
+			AsebaSendVariables(vm, start, maxLength);
+		start += maxLength;
+		length -= maxLength;
+	}
+	if (delta)
+		AsebaSendVariablesDelta(vm, start, length);
+	else
+		AsebaSendVariables(vm, start, length);
+	subscription->elapsed = 0;
+}
+
+/*! Remove the subscription at index i, and tell clients why, so that they can poll these variables or subscribe again. */
+static void AsebaVMRemoveSubscription(AsebaVMState *vm, uint16 i, uint16 reason)
+{
+	uint16 notice[3];
+	notice[0] = vm->subscriptions[i].start;
+	notice[1] = vm->subscriptions[i].length;
+	notice[2] = reason;
+	// displace
+	vm->subscriptionsCount--;
+	for (; i < vm->subscriptionsCount; i++)
+		vm->subscriptions[i] = vm->subscriptions[i+1];
+	AsebaSendMessageWords(vm, ASEBA_MESSAGE_VARIABLES_UNSUBSCRIBED, notice, 3);
+}
+
+/*! Subscribe to a range of variables, replacing and renewing any subscription to the same range; if there are too many, forget the oldest. */
+static void AsebaVMSubscribe(AsebaVMState *vm, uint16 start, uint16 length, uint16 period, uint16 onChange)
+{
+	AsebaVMSubscription *subscription;
+	uint16 i;
+	
+	#ifdef ASEBA_ASSERT
+	if (start + length > vm->variablesSize)
+		AsebaAssert(vm, ASEBA_ASSERT_OUT_OF_VARIABLES_BOUNDS);
+	#endif
+	// never keep a range that would make us read past the variables and write past their shadow
+	if (start + length > vm->variablesSize)
+		return;
+	
+	for (i = 0; i < vm->subscriptionsCount; i++)
+		if (vm->subscriptions[i].start == start && vm->subscriptions[i].length == length)
+			break;
+	if (i == ASEBA_MAX_SUBSCRIPTIONS)
+	{
+		AsebaVMRemoveSubscription(vm, 0, ASEBA_UNSUBSCRIBED_NO_ROOM);
+		i = vm->subscriptionsCount;
+	}
+	if (i == vm->subscriptionsCount)
+		vm->subscriptionsCount++;
+	
+	subscription = &vm->subscriptions[i];
+	subscription->start = start;
+	subscription->length = length;
+	subscription->period = period;
+	subscription->onChange = onChange;
+	subscription->age = 0;
+	
+	// send the current values right away, the subscriber has none yet
+	AsebaVMSendSubscription(vm, subscription, 0);
+}
+
+/*! Remove the subscription to a range of variables, if any. */
+static void AsebaVMUnsubscribe(AsebaVMState *vm, uint16 start, uint16 length)
+{
+	uint16 i;
+	for (i = 0; i < vm->subscriptionsCount; i++)
+	{
+		if (vm->subscriptions[i].start == start && vm->subscriptions[i].length == length)
+		{
+			AsebaVMRemoveSubscription(vm, i, ASEBA_UNSUBSCRIBED_BY_CLIENT);
+			return;
+		}
+	}
+}
+
+void AsebaVMSendSubscribedVariables(AsebaVMState *vm, uint16 elapsedTime)
+{
+	uint16 i;
+	for (i = 0; i < vm->subscriptionsCount; i++)
+	{
+		AsebaVMSubscription *subscription = &vm->subscriptions[i];
+		if (subscription->age + (uint32)elapsedTime >= ASEBA_SUBSCRIPTION_LEASE)
+		{
+			AsebaVMRemoveSubscription(vm, i, ASEBA_UNSUBSCRIBED_EXPIRED);
+			i--;
+			continue;
+		}
+		subscription->age += elapsedTime;
+		if ((uint16)(subscription->elapsed + elapsedTime) < subscription->elapsed)
+			subscription->elapsed = 0xffff;
+		else
+			subscription->elapsed += elapsedTime;
+		if (subscription->elapsed < subscription->period)
+			continue;
+		if (subscription->onChange && !AsebaVMSubscriptionChanged(vm, subscription))
+			subscription->elapsed = subscription->period;
+		else
+			AsebaVMSendSubscription(vm, subscription, 1);
+	}
+}
+
 /*! Send an execution state changed message */
 void AsebaVMSendExecutionStateChanged(AsebaVMState *vm)
 {
@@ -696,10 +1470,10 @@ void AsebaVMSendExecutionStateChanged(AsebaVMState *vm)
 void AsebaVMDebugMessage(AsebaVMState *vm, uint16 id, uint16 *data, uint16 dataLength)
 {
 	
-	// react to global presence
+	// react to global presence, the full description is only sent on request
 	if (id == ASEBA_MESSAGE_GET_DESCRIPTION)
 	{
-		AsebaSendDescription(vm);
+		AsebaSendDescriptionHash(vm);
 		return;
 	}
 	
@@ -723,6 +1497,7 @@ void AsebaVMDebugMessage(AsebaVMState *vm, uint16 id, uint16 *data, uint16 dataL
 			#endif
 			for (i = 0; i < length; i++)
 				vm->bytecode[start+i] = bswap16(data[i+1]);
+			AsebaVMBytecodeChanged(vm);
 		}
 		// There is no break here because we want to do a reset after a set bytecode
 		
@@ -787,7 +1562,9 @@ void AsebaVMDebugMessage(AsebaVMState *vm, uint16 id, uint16 *data, uint16 dataL
 			if (start + length > vm->variablesSize)
 				AsebaAssert(vm, ASEBA_ASSERT_OUT_OF_VARIABLES_BOUNDS);
 			#endif
-			AsebaSendVariables(vm, start, length);
+			// sending also copies the variables to their shadow, so an invalid range must be ignored even without asserts
+			if (start + length <= vm->variablesSize)
+				AsebaSendVariables(vm, start, length);
 		}
 		break;
 		
@@ -817,6 +1594,18 @@ void AsebaVMDebugMessage(AsebaVMState *vm, uint16 id, uint16 *data, uint16 dataL
 		AsebaPutVmToSleep(vm);
 		break;
 		
+		case ASEBA_MESSAGE_SUBSCRIBE_VARIABLES:
+		AsebaVMSubscribe(vm, bswap16(data[0]), bswap16(data[1]), bswap16(data[2]), bswap16(data[3]));
+		break;
+		
+		case ASEBA_MESSAGE_UNSUBSCRIBE_VARIABLES:
+		AsebaVMUnsubscribe(vm, bswap16(data[0]), bswap16(data[1]));
+		break;
+		
+		case ASEBA_MESSAGE_GET_NODE_DESCRIPTION:
+		AsebaSendDescription(vm);
+		break;
+		
 		default:
 		break;
 	}
@@ -53,9 +53,33 @@ else
 
 enum
 {
-	ASEBA_MAX_BREAKPOINTS = 16		//!< maximum number of simultaneous breakpoints the target supports
+	ASEBA_MAX_BREAKPOINTS = 16,		//!< maximum number of simultaneous breakpoints the target supports
+	ASEBA_MAX_SUBSCRIPTIONS = 8,		//!< maximum number of simultaneous subscriptions to variables the target supports
+	ASEBA_SUBSCRIPTION_LEASE = 30000	//!< time in ms after which a subscription that was not renewed is dropped
 };
 
+/*! A range of variables that the VM sends by itself, see AsebaVMSendSubscribedVariables */
+typedef struct
+{
+	uint16 start; /*!< address of the first variable */
+	uint16 length; /*!< number of variables */
+	uint16 period; /*!< minimum time between two sends, in ms */
+	uint16 onChange; /*!< if non-zero, only send when the variables differ from variablesShadow, or at every period if there is no shadow */
+	uint16 elapsed; /*!< time since the last send, in ms */
+	uint16 age; /*!< time since the subscription was made or last renewed, in ms */
+} AsebaVMSubscription;
+
+/*! Size in words of the event dispatch index used by the targets, enough for 32 handled events */
+#define ASEBA_VM_EVENT_INDEX_SIZE 256
+
+/*! A bytecode in the pre-decoded cache, used by the direct-threaded run loop.
+	It is either a simple bytecode, or a superinstruction fusing a frequent sequence of bytecodes. */
+typedef struct
+{
+	uint16 op; /*!< identifier of the bytecode or of the superinstruction */
+	uint16 args[4]; /*!< for superinstructions, their decoded operands */
+} AsebaVMPredecodedBytecode;
+
 /*! This structure contains the state of the Aseba VM.
 	This is the required and the sufficient data for the VM to run.
 	This is not sufficient for the compiler to build bytecode, as there is
@@ -91,6 +115,25 @@ typedef struct
 	// breakpoint
 	uint16 breakpoints[ASEBA_MAX_BREAKPOINTS];
 	uint16 breakpointsCount;
+	
+	// subscriptions to variables, requested by clients instead of polling them
+	AsebaVMSubscription subscriptions[ASEBA_MAX_SUBSCRIPTIONS];
+	uint16 subscriptionsCount;
+	
+	// pre-decoded bytecode, only used if compiled with ASEBA_VM_THREADED_DISPATCH
+	AsebaVMPredecodedBytecode * predecoded; /*!< pre-decoded bytecode space of size bytecodeSize, or 0 if unused */
+	uint16 predecodedValid; /*!< whether predecoded is up to date with bytecode, set by AsebaVMBytecodeChanged */
+	
+	// event dispatch index, optional
+	uint16 * eventIndex; /*!< memory for the event dispatch index, of size eventIndexSize, or 0 to scan the event vector table */
+	uint16 eventIndexSize; /*!< size of eventIndex in words, eight per handled event are always enough */
+	uint16 eventIndexSlots; /*!< number of slots of the index, 0 if not built, set by AsebaVMBytecodeChanged */
+	
+	// copy of variables, optional
+	sint16 * variablesShadow; /*!< variables as last sent to clients, of size variablesSize, or 0 to always send all requested variables */
+	
+	// target-specific data, optional
+	void * userData; /*!< for use by the glue code of the target, for instance to find in constant time the object owning this VM; never used by the VM */
 } AsebaVMState;
 
 // Macros to work with masks
@@ -126,13 +169,29 @@ uint16 AsebaVMSetupEvent(AsebaVMState *vm, uint16 event);
 /*! Run the VM depending on the current execution mode.
 	Either run or step, depending of the current mode.
 	If stepsLimit > 0, execute at maximim stepsLimit
+	If compiled with ASEBA_VM_THREADED_DISPATCH (host targets only), runs without
+	breakpoints use a faster direct-threaded loop, see AsebaDebugThreadedRun in vm.c.
 	Return 1 if anything was executed, 0 otherwise. */
 uint16 AsebaVMRun(AsebaVMState *vm, uint16 stepsLimit);
 
+/*! Rebuild what the VM derives from its bytecode (the event dispatch index and the pre-decoded cache).
+	This is done by AsebaVMDebugMessage when receiving bytecode, but must be called
+	by the glue code if it writes to the bytecode directly. */
+void AsebaVMBytecodeChanged(AsebaVMState *vm);
+
+/*! Return the number of entries the pre-decoded cache needs for a bytecode of bytecodeSize words.
+	This is 0 if the VM is compiled without ASEBA_VM_THREADED_DISPATCH, in which case vm->predecoded must be 0. */
+uint16 AsebaVMPredecodedSize(uint16 bytecodeSize);
+
 /*! Execute a debug action from a debug message. 
 	dataLength is given in number of uint16. */
 void AsebaVMDebugMessage(AsebaVMState *vm, uint16 id, uint16 *data, uint16 dataLength);
 
+/*! Send the variables that clients subscribed to and that are due, using AsebaSendVariables.
+	Drop the subscriptions that were not renewed for ASEBA_SUBSCRIPTION_LEASE ms, as their clients may be gone.
+	Must be called periodically by the glue code, with the time elapsed since the last call, in ms. */
+void AsebaVMSendSubscribedVariables(AsebaVMState *vm, uint16 elapsedTime);
+
 /*! Can be called by glue code (including native functions), to stop vm and emit a node specific error */
 void AsebaVMEmitNodeSpecificError(AsebaVMState *vm, const char* message);
 
@@ -156,6 +215,14 @@ void AsebaSendMessageWords(AsebaVMState *vm, uint16 type, const uint16* data, ui
 /*! Called by AsebaVMDebugMessage when some variables must be sent efficiently */
 void AsebaSendVariables(AsebaVMState *vm, uint16 start, uint16 length);
 
+/*! Called by AsebaVMSendSubscribedVariables when some variables, already sent once, must be sent again;
+	only what changed since they were last sent needs to be. */
+void AsebaSendVariablesDelta(AsebaVMState *vm, uint16 start, uint16 length);
+
+/*! Called by AsebaVMDebugMessage when VM must announce itself on the network, by sending its name and
+	a hash of its description; clients that do not already know this description then request it. */
+void AsebaSendDescriptionHash(AsebaVMState *vm);
+
 /*! Called by AsebaVMDebugMessage when VM must send its description on the network. */
 void AsebaSendDescription(AsebaVMState *vm);
 